@@ -39,6 +39,11 @@ type queryResult struct {
 	WallTime uint64      `json:"walltime"`
 	Gen      int         `json:"gen"`
 	Parent   int         `json:"parent"`
+	Durable  *int        `json:"durable,omitempty"`
+	Alloc    interface{} `json:"alloc,omitempty"`
+	Phases   interface{} `json:"phases,omitempty"`
+
+	LastSerialize interface{} `json:"last_serialize,omitempty"`
 }
 
 type transac struct {
@@ -61,6 +66,7 @@ var evalers = []*evaler{}
 var elock = sync.RWMutex{}
 
 var userDBsPath string
+var durability string
 
 func newEvaler(db string) (*evaler, error) {
 	evalerName, err := dbEvaler(db)
@@ -68,7 +74,12 @@ func newEvaler(db string) (*evaler, error) {
 		return nil, err
 	}
 
-	cmd := exec.Command("./"+evalerName, "-d", path.Join(userDBsPath, db), "-s")
+	cmd := exec.Command(
+		"./"+evalerName,
+		"-d", path.Join(userDBsPath, db),
+		"-s",
+		"--durability="+durability,
+	)
 	cmd.Stderr = os.Stderr
 
 	stdin, err := cmd.StdinPipe()
@@ -171,6 +182,28 @@ func parseQuery(w http.ResponseWriter, r *http.Request) (*query, bool) {
 	return nil, false
 }
 
+// memgraphStats serves memgraph's aggregate statistics for a db, which stay
+// cheap to produce long after the full graph is too big to lay out.
+func memgraphStats(w http.ResponseWriter, r *http.Request) {
+	db := r.URL.Query().Get("db")
+
+	if db == "" {
+		return
+	}
+
+	out, err := exec.Command(
+		"./memgraph", "-j", "-d", path.Join(userDBsPath, db),
+	).Output()
+	if err != nil {
+		log.WithField("db", db).WithError(err).Println("cant run grapher")
+		w.WriteHeader(500)
+		return
+	}
+
+	w.Header().Set("content-type", "application/json")
+	w.Write(out)
+}
+
 func memgraph(w http.ResponseWriter, r *http.Request) {
 	var renderer *exec.Cmd
 	if r.URL.Query().Get("render") == "neato" {
@@ -195,6 +228,10 @@ func memgraph(w http.ResponseWriter, r *http.Request) {
 		grapher.Args = append(grapher.Args, "-s")
 	}
 
+	if r.URL.Query().Get("summary") != "" {
+		grapher.Args = append(grapher.Args, "-u")
+	}
+
 	renderer.Stdin, _ = grapher.StdoutPipe()
 	renderer.Stdout = w
 
@@ -581,6 +618,12 @@ func webReqHandle(w http.ResponseWriter, r *http.Request) {
 func main() {
 	dp := flag.String("path", "./db/", "path to the root folder")
 	port := flag.String("port", "5000", "port to listen on")
+	flag.StringVar(
+		&durability,
+		"durability",
+		"none",
+		"when evalers flush commits to disk: none, sync, group or wal",
+	)
 
 	flag.Parse()
 
@@ -591,6 +634,7 @@ func main() {
 	dbMux.HandleFunc("/create", create)
 	dbMux.HandleFunc("/link", link)
 	dbMux.HandleFunc("/memgraph.svg", memgraph)
+	dbMux.HandleFunc("/memgraph.json", memgraphStats)
 	dbMux.HandleFunc("/eval/", eval)
 	dbMux.HandleFunc("/tail/", tail)
 	dbMux.HandleFunc("/query/", queryPage)
@@ -6,6 +6,7 @@
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <linux/magic.h>
 #include <sched.h>
 #include <signal.h>
 #include <stdint.h>
@@ -14,11 +15,25 @@
 #include <string.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/sysmacros.h>
 #include <sys/types.h>
+#include <sys/vfs.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "alloc.h"
 #include "config.h"
+#include "lz.h"
+#include "probes.h"
+#include "trace.h"
+#include "wal.h"
+#include "ws.h"
+
+// older headers don't know about it, older kernels ignore it which open_db
+// catches.
+#ifndef MAP_FIXED_NOREPLACE
+#define MAP_FIXED_NOREPLACE 0x100000
+#endif
 
 // lol namespaces
 #define page snap_page
@@ -32,16 +47,13 @@
 #define FULL_VERIFY
 #endif
 
-#ifdef DEBUG_LOGGING
-#define SNAP_EVENT_LOG_PRECOMMITED
-#define SNAP_EVENT_LOG_FILE "/dev/stderr"
-#endif
-
-#ifdef SNAP_EVENT_LOG_FILE
-FILE *event_log;
-#endif
+// every allocator call is recorded here once snap_trace has been called, or
+// from the start when SNAP_EVENT_LOG_FILE names a trace to open.
+static struct trace *tracer = NULL;
 
 void full_verify(int committed);
+void sample_verify(struct heap_header *heap);
+int cmp_map_start(const void *a, const void *b);
 
 struct map {
   char w;
@@ -54,18 +66,146 @@ struct table {
   struct map m[MAX_MAPS];
 };
 
+// why a page was copied on write.
+enum copy_reason {
+  COPY_FAULT,        // it was written to
+  COPY_FAULT_AROUND, // a page before it was written to
+  COPY_PRECOW,       // it's been written to by most recent transactions
+  COPY_GRANULE,      // it shares a cow granule with a page written to
+};
+
+// a page the working generation copied, and its copy.
+struct copied_page {
+  snap_off live;
+  snap_off copy;
+  char reason;
+};
+
+// a committed page there was no room to copy for a write, replaced for the
+// rest of the transaction by anonymous memory that started out as saved.
+struct stand_in {
+  void *at;
+  size_t len;
+  char *saved;
+};
+
+// a page written recently. history has a bit for each of the last 8
+// transactions, lowest for the newest, set when it wrote to the page.
+struct hot_page {
+  snap_off page;
+  uint8_t history;
+  char written;
+};
+
+// everything we know about an open heap that doesn't belong in the file.
 struct runtime_state {
   char *db_path;
   int db_fd;
   struct heap_header *heap;
-  void *handling_segv;
 
   struct table active_map;
+
+  enum snap_durability durability;
+  int group_commits;
+  long group_latency_us;
+
+  // commits made since the last flush, whether anything else moved the
+  // committed generation since then, and when the first of them happened.
+  int pending_commits;
+  char pending_moved;
+  struct timespec pending_since;
+
+  int durable_gen;
+
+  // ranges written since the last flush. If we ever run out of room the whole
+  // heap gets flushed instead.
+  struct table dirty;
+  char dirty_overflow;
+
+  // in SNAP_DURABILITY_WAL the heap is mapped privately and commits go to the
+  // log, these are the ranges logged since the heap file was last brought up
+  // to date.
+  struct wal *wal;
+  struct table logged;
+  char logged_overflow;
+
+  // pages in use get sampled every so often so the next open can prefetch
+  // them, commits tells us when.
+  struct ws *ws;
+  long ws_commits;
+
+  // fault-around copies up to fault_around pages past a fault once writes
+  // look sequential. last_fault_end is where the last batch ended and
+  // fault_window how many pages it copied ahead, both reset every
+  // transaction.
+  int fault_around;
+  char *last_fault_end;
+  int fault_window;
+
+  // snap_begin_mut copies up to precow of the pages in hot that most
+  // transactions have been writing to.
+  int precow;
+  struct hot_page hot[HOT_PAGES];
+
+  // whether commits turn the copies they leave behind into deltas
+  char deltas;
+
+  // in huge page mode the heap only grows to whole huge pages and asks to be
+  // backed by them. A write fault copies every page starting in the same
+  // aligned block of cow_granule pages as the one hit.
+  char hugepages;
+  int cow_granule;
+
+  // every page copied this transaction, so commit can check which of them
+  // actually changed.
+  struct copied_page *copies;
+  size_t copies_len;
+  size_t copies_cap;
+
+  // once a write finds no room to copy its page, the page gets a stand-in
+  // outside the file and the transaction can only be rolled back. Nothing
+  // more gets copied, commit puts the heap's own pages back.
+  struct stand_in *stand_ins;
+  size_t stand_ins_len;
+  size_t stand_ins_cap;
+  char out_of_room;
+
+  // allocations are refused once they'd take a transaction past handing out
+  // quota_txn_bytes or adding quota_txn_pages pages to the heap, or the heap
+  // file past quota_db_bytes, 0 leaves a limit off. txn_bytes and txn_pages
+  // count up from snap_begin_mut. Copies only count towards the file's quota,
+  // which they can go over by QUOTA_RESERVE since a write can't be refused.
+  // Once one allocation has been refused the transaction gets QUOTA_RESERVE
+  // more to fail in, half of it for the file's quota.
+  size_t quota_txn_bytes;
+  size_t quota_txn_pages;
+  size_t quota_db_bytes;
+  size_t txn_bytes;
+  size_t txn_pages;
+  char over_quota;
+
+  // every commit checks verify_samples of the nodes it committed and as many
+  // entries of active_map, picked with verify_rand. 0 leaves it off.
+  int verify_samples;
+  uint64_t verify_rand;
+
+  // opened by snap_open_readonly, nothing is allowed to change it.
+  char readonly;
+
+  struct snap_stats stats;
+
+  struct runtime_state *next;
 };
 
-static struct runtime_state rstate = {0};
+// every open heap, and the one currently being worked on. Each entry point
+// switches rs to the heap it was handed so everything below it only has to
+// care about one heap at a time.
+static struct runtime_state *open_heaps = NULL;
+static struct runtime_state *rs = NULL;
 
-#define H (rstate.heap)
+static void *handling_segv = NULL;
+
+#define H (rs->heap)
 
 #ifdef DEBUG_LOGGING
 #define LOG(...) fprintf(stderr, __VA_ARGS__)
@@ -83,6 +223,72 @@ uintptr_t round_page_up(uintptr_t addr) {
   return addr;
 }
 
+long elapsed_us(struct timespec since) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  return (now.tv_sec - since.tv_sec) * 1000000 +
+         (now.tv_nsec - since.tv_nsec) / 1000;
+}
+
+long elapsed_ns(struct timespec since) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  return (now.tv_sec - since.tv_sec) * 1000000000 +
+         (now.tv_nsec - since.tv_nsec);
+}
+
+// add_range records [start, start + len) rounded out to whole pages in d,
+// setting overflow instead once d is full.
+void add_range(struct table *d, char *overflow, void *start, size_t len) {
+  if (*overflow) {
+    return;
+  }
+
+  char *s = (char *)round_page_down((uintptr_t)start);
+  char *e = (char *)round_page_up((uintptr_t)start + len);
+
+  // most writes land right next to the previous one
+  if (d->len) {
+    struct map *last = &d->m[d->len - 1];
+    char *ls = last->start;
+    char *le = ls + last->len;
+
+    if (s >= ls && e <= le) {
+      return;
+    } else if (s <= le && e >= ls) {
+      if (s < ls) {
+        ls = s;
+      }
+      if (e > le) {
+        le = e;
+      }
+
+      last->start = ls;
+      last->len = le - ls;
+      return;
+    }
+  }
+
+  if (d->len == MAX_MAPS) {
+    *overflow = 1;
+    return;
+  }
+
+  d->m[d->len++] = (struct map){.start = s, .len = e - s};
+}
+
+// mark_dirty records that [start, start + len) was written to and has to hit
+// the disk before the current generation can be considered durable.
+void mark_dirty(void *start, size_t len) {
+  if (rs->durability == SNAP_DURABILITY_NONE) {
+    return;
+  }
+
+  add_range(&rs->dirty, &rs->dirty_overflow, start, len);
+}
+
 void print_map(struct map m) {
   LOG("\t%p-%p r", m.start, (void *)((char *)m.start + m.len));
   if (m.w) {
@@ -191,6 +397,13 @@ int w_to_prot(char w) {
   return PROT_READ;
 }
 
+// protect changes the protection of part of the heap.
+int protect(void *start, size_t len, int prot) {
+  rs->stats.mprotect_calls++;
+
+  return mprotect(start, len, prot);
+}
+
 // taken from linux mmap.c:
 //
 // The following mprotect cases have to be considered, where AAAA is
@@ -216,7 +429,7 @@ void merge_in_map(struct map newmap) {
 #endif
 
   struct table hits = {0};
-  overlaps(newmap, &rstate.active_map, &hits);
+  overlaps(newmap, &rs->active_map, &hits);
   assert(hits.len != 0);
 
 #ifdef LOG_MAP_MODS
@@ -225,17 +438,22 @@ void merge_in_map(struct map newmap) {
   LOG("\t");
 #endif
 
+  // maps folded in here may have had the other protection, if so the range
+  // still needs changing even when what's left already matches.
+  int folded_mixed = 0;
+
   while (hits.len > 2 || (hits.len == 2 && hits.m[0].w == hits.m[1].w)) {
     struct map sec = hits.m[1];
+    folded_mixed |= sec.w != newmap.w;
 
-    struct map *abefore = find_map_before(&rstate.active_map, sec);
+    struct map *abefore = find_map_before(&rs->active_map, sec);
     assert(abefore);
 
     struct map *hbefore = find_map_before(&hits, sec);
     assert(hbefore);
 
     remove_map(&hits, map_index(&hits, sec));
-    remove_map(&rstate.active_map, map_index(&rstate.active_map, sec));
+    remove_map(&rs->active_map, map_index(&rs->active_map, sec));
 
     abefore->len += sec.len;
     hbefore->len += sec.len;
@@ -244,7 +462,17 @@ void merge_in_map(struct map newmap) {
   if (hits.len == 1) {
     struct map hit = hits.m[0];
 
-    if (hit.w == newmap.w) {
+    if (hit.w == newmap.w && folded_mixed) {
+#ifdef LOG_MAP_MODS
+      LOG("equal after folding, reprotect\n");
+#endif
+
+      int err = protect(newmap.start, newmap.len, w_to_prot(newmap.w));
+      if (err != 0) {
+        fprintf(stderr, "failed to mark write pages %s\n", strerror(errno));
+        exit(3);
+      }
+    } else if (hit.w == newmap.w) {
 #ifdef LOG_MAP_MODS
       LOG("skip because equal\n");
 #endif
@@ -253,8 +481,8 @@ void merge_in_map(struct map newmap) {
       LOG("exact match\n");
 #endif
 
-      struct map *mbefore = find_map_before(&rstate.active_map, hit);
-      struct map *mafter = find_map_after(&rstate.active_map, hit);
+      struct map *mbefore = find_map_before(&rs->active_map, hit);
+      struct map *mafter = find_map_after(&rs->active_map, hit);
       assert(mbefore || mafter);
 
       if (mbefore && mafter) {
@@ -272,12 +500,12 @@ void merge_in_map(struct map newmap) {
 
         assert(mbefore->w == mafter->w && "should be alternating");
 
-        remove_map(&rstate.active_map, map_index(&rstate.active_map, hit));
-        remove_map(&rstate.active_map, map_index(&rstate.active_map, mafterv));
+        remove_map(&rs->active_map, map_index(&rs->active_map, hit));
+        remove_map(&rs->active_map, map_index(&rs->active_map, mafterv));
 
         mbefore->len += mafterv.len + hit.len;
 
-        int err = mprotect(newmap.start, newmap.len, w_to_prot(newmap.w));
+        int err = protect(newmap.start, newmap.len, w_to_prot(newmap.w));
         if (err != 0) {
           fprintf(stderr, "failed to mark write pages %s\n", strerror(errno));
           exit(3);
@@ -303,10 +531,10 @@ void merge_in_map(struct map newmap) {
       //
       // shrink the map being hit and extend the map before
 
-      struct map *mbefore = find_map_before(&rstate.active_map, hit);
+      struct map *mbefore = find_map_before(&rs->active_map, hit);
       assert(mbefore && "unimplemented: hitting left most map");
 
-      struct map *hitptr = find_map(&rstate.active_map, hit);
+      struct map *hitptr = find_map(&rs->active_map, hit);
       assert(hitptr);
 
       hitptr->len -= newmap.len;
@@ -314,7 +542,7 @@ void merge_in_map(struct map newmap) {
 
       hitptr->start = (char *)newmap.start + newmap.len;
 
-      int err = mprotect(newmap.start, newmap.len, w_to_prot(newmap.w));
+      int err = protect(newmap.start, newmap.len, w_to_prot(newmap.w));
       if (err != 0) {
         fprintf(stderr, "failed to mark write pages %s\n", strerror(errno));
         exit(3);
@@ -331,23 +559,23 @@ void merge_in_map(struct map newmap) {
       // becomes
       // LLRRRRRRRRRR
 
-      struct map *mafter = find_map_after(&rstate.active_map, hit);
+      struct map *mafter = find_map_after(&rs->active_map, hit);
 
       if (!mafter) {
-        struct map *hitptr = find_map(&rstate.active_map, hit);
+        struct map *hitptr = find_map(&rs->active_map, hit);
         assert(hitptr);
 
-        insert_after(&rstate.active_map, newmap, hit);
+        insert_after(&rs->active_map, newmap, hit);
 
         hitptr->len -= newmap.len;
 
-        int err = mprotect(newmap.start, newmap.len, w_to_prot(newmap.w));
+        int err = protect(newmap.start, newmap.len, w_to_prot(newmap.w));
         if (err != 0) {
           fprintf(stderr, "failed to mark write pages %s\n", strerror(errno));
           exit(3);
         }
       } else {
-        struct map *hitptr = find_map(&rstate.active_map, hit);
+        struct map *hitptr = find_map(&rs->active_map, hit);
         assert(hitptr);
 
         mafter->len += newmap.len;
@@ -355,7 +583,7 @@ void merge_in_map(struct map newmap) {
 
         hitptr->len -= newmap.len;
 
-        int err = mprotect(newmap.start, newmap.len, w_to_prot(newmap.w));
+        int err = protect(newmap.start, newmap.len, w_to_prot(newmap.w));
         if (err != 0) {
           fprintf(stderr, "failed to mark write pages %s\n", strerror(errno));
           exit(3);
@@ -366,21 +594,21 @@ void merge_in_map(struct map newmap) {
       LOG("inside\n");
 #endif
 
-      struct map *hitptr = find_map(&rstate.active_map, hit);
+      struct map *hitptr = find_map(&rs->active_map, hit);
       assert(hitptr);
 
       hitptr->len = (char *)newmap.start - (char *)hitptr->start;
 
-      insert_after(&rstate.active_map, newmap, *hitptr);
+      insert_after(&rs->active_map, newmap, *hitptr);
 
       struct map m2 = {
           .start = (char *)newmap.start + newmap.len,
           .len = hit.len - hitptr->len - newmap.len,
           .w = hitptr->w,
       };
-      insert_after(&rstate.active_map, m2, newmap);
+      insert_after(&rs->active_map, m2, newmap);
 
-      int err = mprotect(newmap.start, newmap.len, w_to_prot(newmap.w));
+      int err = protect(newmap.start, newmap.len, w_to_prot(newmap.w));
       if (err != 0) {
         fprintf(stderr, "failed to mark write pages %s\n", strerror(errno));
         exit(3);
@@ -390,10 +618,10 @@ void merge_in_map(struct map newmap) {
     struct map hl = hits.m[0];
     struct map hr = hits.m[1];
 
-    struct map *lptr = find_map(&rstate.active_map, hl);
+    struct map *lptr = find_map(&rs->active_map, hl);
     assert(lptr);
 
-    struct map *rptr = find_map(&rstate.active_map, hr);
+    struct map *rptr = find_map(&rs->active_map, hr);
     assert(rptr);
 
     if (newmap.w == hl.w) {
@@ -410,12 +638,12 @@ void merge_in_map(struct map newmap) {
         // the map probably aligned with the right side, we'll end up killing
         // two maps
 
-        size_t emptyi = map_index(&rstate.active_map, *rptr);
-        remove_map(&rstate.active_map, emptyi);
+        size_t emptyi = map_index(&rs->active_map, *rptr);
+        remove_map(&rs->active_map, emptyi);
 
-        lptr->len += rstate.active_map.m[emptyi].len;
+        lptr->len += rs->active_map.m[emptyi].len;
 
-        remove_map(&rstate.active_map, emptyi);
+        remove_map(&rs->active_map, emptyi);
       }
     } else if (newmap.w == hr.w) {
       LOG("expanding right\n");
@@ -424,13 +652,24 @@ void merge_in_map(struct map newmap) {
 
       lptr->len -= rdiff;
 
-      assert(lptr->len != 0);
-
       rptr->start = (char *)rptr->start - rdiff;
       rptr->len += rdiff;
+
+      if (lptr->len == 0) {
+        // the map aligned with the left side, the one before it is the same
+        // kind as the right one so they come together
+
+        size_t emptyi = map_index(&rs->active_map, *lptr);
+        remove_map(&rs->active_map, emptyi);
+
+        if (emptyi > 0) {
+          rs->active_map.m[emptyi - 1].len += rs->active_map.m[emptyi].len;
+          remove_map(&rs->active_map, emptyi);
+        }
+      }
     }
 
-    int err = mprotect(newmap.start, newmap.len, w_to_prot(newmap.w));
+    int err = protect(newmap.start, newmap.len, w_to_prot(newmap.w));
     if (err != 0) {
       fprintf(stderr, "failed to mark write pages %s\n", strerror(errno));
       exit(3);
@@ -441,7 +680,7 @@ void merge_in_map(struct map newmap) {
 
 #ifdef LOG_MAP_MODS
   LOG("resulting map:\n");
-  print_table(&rstate.active_map);
+  print_table(&rs->active_map);
   LOG("\n");
 #endif
 
@@ -453,15 +692,15 @@ void merge_in_table(struct table newmaps) {
   assert(newmaps.len > 0);
 
   // lowest map can't start before the existing lowest map
-  assert(newmaps.m[0].start >= rstate.active_map.m[0].start);
+  assert(newmaps.m[0].start >= rs->active_map.m[0].start);
 
   // highest map can't go beyond the existing highest map
   assert(
       (char *)newmaps.m[newmaps.len - 1].start +
           newmaps.m[newmaps.len - 1].len <=
 
-      (char *)rstate.active_map.m[rstate.active_map.len - 1].start +
-          rstate.active_map.m[rstate.active_map.len - 1].len);
+      (char *)rs->active_map.m[rs->active_map.len - 1].start +
+          rs->active_map.m[rs->active_map.len - 1].len);
 
   struct table merged = {
       .len = 1,
@@ -489,7 +728,10 @@ void merge_in_table(struct table newmaps) {
 
   for (size_t i = 0; i < merged.len; i++) {
     struct map newmap = merged.m[i];
+
+    PROBE2(map_start, newmap.start, newmap.len);
     merge_in_map(newmap);
+    PROBE0(map_done);
   }
 
 #ifdef LOG_MAP_MODS
@@ -504,6 +746,8 @@ enum walk_action {
 };
 
 int walk_nodes(struct node *n, int (*cb)(struct node *, void *), void *d) {
+  rs->stats.nodes_walked++;
+
   int action = cb(n, d);
   if (action) {
     return action;
@@ -517,11 +761,13 @@ int walk_nodes(struct node *n, int (*cb)(struct node *, void *), void *d) {
         continue;
       }
 
-      if (walk_nodes(g->c[i], cb, d) == WALK_EXIT) {
+      if (walk_nodes(snap_at(H, g->c[i]), cb, d) == WALK_EXIT) {
         return WALK_EXIT;
       }
     }
-  } else if (n->type == SNAP_NODE_PAGE) {
+  } else if (
+      n->type == SNAP_NODE_PAGE || n->type == SNAP_NODE_DELTA ||
+      n->type == SNAP_NODE_PACKED) {
     // eh
   } else {
     assert(0 && "invalid node type while walking, probably walked off the end");
@@ -545,7 +791,7 @@ int find_page(struct node *n, void *d) {
       phit->p = p;
 
       for (int i = 0; i < p->len; i++) {
-        struct segment *s = p->c[i];
+        struct segment *s = snap_segment_at(p, i);
         if (phit->hit >= (void *)((char *)s) &&
             phit->hit <
                 (void *)((char *)s + sizeof(struct segment) + s->size)) {
@@ -577,69 +823,78 @@ int open_db(const char *path, struct runtime_state *state) {
     return -1;
   }
 
-  int fd = open(path, O_RDWR, 0660);
+  int fd = open(path, state->readonly ? O_RDONLY : O_RDWR, 0660);
   if (fd == -1) {
     fprintf(stderr, "couldn't open db %s\n", strerror(errno));
     return -1;
   }
 
-  rstate.db_fd = fd;
-
-  LOG("mapping initial heap from %p-%p\n",
-      MAP_START_ADDR,
-      (void *)((char *)MAP_START_ADDR + PAGE_SIZE));
+  rs->db_fd = fd;
 
-  // we'll initially map the first page to grab db header info
-  void *mem = mmap(
-      MAP_START_ADDR,
-      PAGE_SIZE,
-      PROT_READ | PROT_WRITE,
-      MAP_FIXED | MAP_SHARED,
-      fd,
-      0);
-  if (mem == MAP_FAILED) {
+  // the header can be read from wherever, it tells us where the rest goes
+  struct heap_header *header =
+      mmap(NULL, PAGE_SIZE, PROT_READ, MAP_SHARED, fd, 0);
+  if (header == MAP_FAILED) {
     fprintf(stderr, "db map failed  %s\n", strerror(errno));
     return -1;
   }
 
-  struct heap_header *heap = (struct heap_header *)mem;
-
-  if (heap->v != HEAP_VERSION) {
+  if (header->v != HEAP_VERSION) {
     fprintf(
         stderr,
         "got a bad snapshot, invalid magic seq 0x%x (expected) != 0x%x "
         "(actual)\n",
         HEAP_VERSION,
-        heap->v);
+        header->v);
+    munmap(header, PAGE_SIZE);
     return -1;
   }
 
-  if (heap->map_start != MAP_START_ADDR) {
-    assert(0 && "cannot handle alternate map_start");
-  }
-
-  state->heap = mem;
+  void *map_start = header->map_start;
+  size_t size = header->size;
+  munmap(header, PAGE_SIZE);
 
   LOG("mapping in entire heap %p-%p\n",
-      MAP_START_ADDR,
-      (void *)((char *)MAP_START_ADDR + heap->size));
+      map_start,
+      (void *)((char *)map_start + size));
 
-  void *new_addr = mremap(MAP_START_ADDR, PAGE_SIZE, heap->size, 0);
-  if (new_addr == (void *)-1) {
-    fprintf(stderr, "db remap failed at open: %s\n", strerror(errno));
+  // The allocator would be fine anywhere but the user's pointers only make
+  // sense where they were made. Don't take the address from under someone
+  // else if it's already in use. A read-only heap is mapped privately so not
+  // even a stray write can reach the file.
+  void *mem = mmap(
+      map_start,
+      size,
+      state->readonly ? PROT_READ : PROT_READ | PROT_WRITE,
+      MAP_FIXED_NOREPLACE | (state->readonly ? MAP_PRIVATE : MAP_SHARED),
+      fd,
+      0);
+  if (mem == MAP_FAILED) {
+    fprintf(
+        stderr,
+        "db map at %p failed %s\n",
+        map_start,
+        strerror(errno));
+    return -1;
+  }
+
+  if (mem != map_start) {
+    // kernels before MAP_FIXED_NOREPLACE treat it as a hint
+    fprintf(stderr, "db could not be mapped at %p\n", map_start);
+    munmap(mem, size);
     return -1;
   }
-  assert(new_addr == heap->map_start);
-  assert(new_addr == MAP_START_ADDR);
+
+  state->heap = mem;
 
   state->active_map = (struct table){
       .len = 1,
       .m =
           {
               {
-                  .start = MAP_START_ADDR,
-                  .len = heap->size,
-                  .w = 1,
+                  .start = mem,
+                  .len = size,
+                  .w = !state->readonly,
               },
           },
   };
@@ -647,6 +902,51 @@ int open_db(const char *path, struct runtime_state *state) {
   return 0;
 }
 
+// slot_taken checks if a heap placed at start could collide with one that's
+// already open or anything else mapped into its range.
+int slot_taken(char *start) {
+  for (struct runtime_state *s = open_heaps; s; s = s->next) {
+    if (s->heap && (char *)s->heap->map_start < start + HEAP_SPAN &&
+        (char *)s->heap->map_start + HEAP_SPAN > start) {
+      return 1;
+    }
+  }
+
+  void *probe = mmap(
+      start,
+      HEAP_SPAN,
+      PROT_NONE,
+      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED_NOREPLACE,
+      -1,
+      0);
+  if (probe == MAP_FAILED) {
+    return 1;
+  }
+
+  munmap(probe, HEAP_SPAN);
+
+  return probe != start;
+}
+
+// pick_map_start finds a range for a new heap. The search starts from a slot
+// picked by the db's path so heaps made by different processes are unlikely
+// to land on the same range and can still be opened together later.
+void *pick_map_start(const char *path) {
+  uint64_t h = 0xcbf29ce484222325;
+  for (const char *c = path; *c; c++) {
+    h = (h ^ (unsigned char)*c) * 0x100000001b3;
+  }
+
+  for (size_t i = 0; i < HEAP_SLOTS; i++) {
+    char *start = (char *)MAP_START_ADDR + ((h + i) % HEAP_SLOTS) * HEAP_SPAN;
+    if (!slot_taken(start)) {
+      return start;
+    }
+  }
+
+  return NULL;
+}
+
 int new_db(const char *path) {
   LOG("creating db at %s\n", path);
 
@@ -657,7 +957,6 @@ int new_db(const char *path) {
   }
 
   size_t initial_size = INITIAL_PAGES * PAGE_SIZE;
-  void *map_start = MAP_START_ADDR;
 
   int err = ftruncate(fd, initial_size);
   if (err) {
@@ -665,13 +964,10 @@ int new_db(const char *path) {
     return -1;
   }
 
-  void *mem = mmap(
-      map_start,
-      initial_size,
-      PROT_READ | PROT_WRITE,
-      MAP_FIXED | MAP_SHARED,
-      fd,
-      0);
+  // nothing in here points anywhere yet so it can be set up from wherever,
+  // opening it is what places it at map_start.
+  void *mem =
+      mmap(NULL, initial_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
   if (mem == MAP_FAILED) {
     fprintf(stderr, "db map failed  %s\n", strerror(errno));
     return -1;
@@ -683,32 +979,38 @@ int new_db(const char *path) {
   heap->size = initial_size;
   heap->last_gen_index = 0;
   heap->page_size = PAGE_SIZE;
-  heap->map_start = map_start;
+  heap->map_start = pick_map_start(path);
+  if (!heap->map_start) {
+    fprintf(stderr, "no address range left for another heap\n");
+    munmap(mem, initial_size);
+    close(fd);
+    return -1;
+  }
 
-  struct page *initial_page = heap->last_page =
-      (struct page *)((char *)(mem) + (PAGE_SIZE * 2));
+  heap->last_page = PAGE_SIZE * 2;
+  struct page *initial_page = snap_at(heap, heap->last_page);
 
   *initial_page = (struct page){
       .i = {.type = SNAP_NODE_PAGE, .committed = 1},
       .pages = 1,
       .len = 0,
-      .real_addr = initial_page,
+      .real_addr = heap->last_page,
   };
 
-  struct generation *initial_gen = heap->last_gen =
-      (struct generation *)((char *)(mem) + (PAGE_SIZE));
+  heap->last_gen = PAGE_SIZE;
+  struct generation *initial_gen = snap_at(heap, heap->last_gen);
 
   *initial_gen = (struct generation){
       .i = {.type = SNAP_NODE_GENERATION, .committed = 1},
       .gen = heap->last_gen_index,
-      .c = {(struct node *)initial_page},
+      .c = {heap->last_page},
   };
 
-  heap->committed = NULL;
-  heap->working = initial_gen;
-  heap->root = initial_gen;
+  heap->committed = 0;
+  heap->working = heap->last_gen;
+  heap->root = heap->last_gen;
 
-  munmap(heap->map_start, initial_size);
+  munmap(mem, initial_size);
   close(fd);
 
   return 0;
@@ -724,7 +1026,7 @@ int find_parent(struct node *n, void *d) {
     struct generation *g = (struct generation *)n;
     struct node_rel *l = d;
     for (int i = 0; i < GENERATION_CHILDREN; i++) {
-      if (l->child == g->c[i]) {
+      if (snap_offset(H, l->child) == g->c[i]) {
         l->parent = n;
         l->index = i;
         return WALK_EXIT;
@@ -738,12 +1040,21 @@ int find_parent(struct node *n, void *d) {
 struct tree_slot {
   int index;
   struct generation *target;
+  struct generation *in; // where the walk started, filled in by the walk
 };
 int first_free_slot(struct node *n, void *d) {
   if (n->type == SNAP_NODE_GENERATION) {
     struct generation *g = (struct generation *)n;
     struct tree_slot *slot = d;
 
+    // the generations under a committed one are its children, only the
+    // nodes new_gen_between split it into have room that's still its own
+    if (!slot->in) {
+      slot->in = g;
+    } else if (g->gen != slot->in->gen) {
+      return WALK_SKIP;
+    }
+
     for (int i = 0; i < GENERATION_CHILDREN; i++) {
       if (!g->c[i]) {
         slot->target = g;
@@ -763,7 +1074,7 @@ int pages_in_gen(struct node *n, void *d) {
 
   struct page *p = (struct page *)n;
 
-  if (p->real_addr != p) {
+  if (p->real_addr != snap_offset(H, p)) {
     return WALK_CONTINUE;
   }
 
@@ -781,19 +1092,141 @@ int pages_in_gen(struct node *n, void *d) {
   return WALK_CONTINUE;
 }
 
-void expand_heap_space(struct heap_header *heap, size_t min_expand) {
+// heap_size_for rounds a size the heap is growing to up to a whole page, or
+// a whole huge page in huge page mode.
+size_t heap_size_for(size_t size) {
+  if (rs->hugepages) {
+    return (size + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+  }
+
+  return round_page_up(size);
+}
+
+// tmpfs_hugepages says whether the kernel will put the tmpfs file fd in huge
+// pages, going by the huge= option it's mounted with unless shmem_enabled
+// forces them on or off for every tmpfs mount.
+int tmpfs_hugepages(int fd) {
+  char shmem[128] = {0};
+  FILE *f = fopen("/sys/kernel/mm/transparent_hugepage/shmem_enabled", "r");
+  if (f) {
+    if (!fgets(shmem, sizeof(shmem), f)) {
+      shmem[0] = '\0';
+    }
+    fclose(f);
+  }
+
+  if (strstr(shmem, "[deny]")) {
+    return 0;
+  } else if (strstr(shmem, "[force]")) {
+    return 1;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st)) {
+    return 0;
+  }
+
+  f = fopen("/proc/self/mountinfo", "r");
+  if (!f) {
+    return 0;
+  }
+
+  // mount id, parent id, major:minor, root and mount point, optional fields
+  // up to a " - " and then fs type, source and super block options
+  int huge = 0;
+  char line[4096];
+  while (fgets(line, sizeof(line), f)) {
+    unsigned int maj, min;
+    if (sscanf(line, "%*d %*d %u:%u", &maj, &min) != 2 ||
+        maj != major(st.st_dev) || min != minor(st.st_dev)) {
+      continue;
+    }
+
+    char *opts = strstr(line, " - ");
+    huge = opts && (strstr(opts, "huge=always") ||
+                    strstr(opts, "huge=within_size") ||
+                    strstr(opts, "huge=advise"));
+    break;
+  }
+
+  fclose(f);
+
+  return huge;
+}
+
+// advise_hugepages asks for the whole heap to be backed by transparent huge
+// pages. The heap's range and offset in the file are both aligned to them.
+// The kernel only does that for a shared file mapping when the file is on
+// tmpfs, on any other filesystem the heap stays in 4KB pages however it's
+// advised, so that's turned down here rather than left to silently do
+// nothing.
+int advise_hugepages(struct heap_header *heap) {
+  struct statfs fs;
+  if (fstatfs(rs->db_fd, &fs)) {
+    fprintf(stderr, "couldn't check db filesystem %s\n", strerror(errno));
+    return -1;
+  }
+
+  if (fs.f_type != TMPFS_MAGIC) {
+    fprintf(stderr, "huge pages need the db on tmpfs\n");
+    return -1;
+  }
+
+  if (!tmpfs_hugepages(rs->db_fd)) {
+    fprintf(stderr, "huge pages need the db's tmpfs mounted with huge=\n");
+    return -1;
+  }
+
+  if (madvise(heap, heap->size, MADV_HUGEPAGE)) {
+    fprintf(stderr, "couldn't ask for huge pages %s\n", strerror(errno));
+    return -1;
+  }
+
+  return 0;
+}
+
+// expand_heap_space grows the heap file and its map by at least min_expand
+// bytes. Returns -1 if it can't, leaving the heap as it was.
+int expand_heap_space(struct heap_header *heap, size_t min_expand) {
   size_t new_size = heap->size * 2;
 
   if (new_size - heap->size < min_expand * 2) {
-    new_size = round_page_up(min_expand * 2);
+    new_size = heap->size + min_expand * 2;
+  }
+
+  new_size = heap_size_for(new_size);
+
+  // maybe_grow_heap wants the address it was given inside the heap, not
+  // just up to it
+  size_t needed = heap_size_for(heap->size + min_expand + 1);
+
+  // doubling shouldn't be what takes the file over its quota
+  if (rs->quota_db_bytes && new_size > rs->quota_db_bytes + QUOTA_RESERVE) {
+    new_size = heap_size_for(rs->quota_db_bytes + QUOTA_RESERVE);
+
+    if (new_size < needed) {
+      new_size = needed;
+    }
+  }
+
+  if (new_size > HEAP_SPAN) {
+    // running into the next range over would break whichever heap lives
+    // there, settle for what we actually need.
+    new_size = needed;
+
+    if (new_size > HEAP_SPAN) {
+      fprintf(
+          stderr, "heap can't grow past %lu bytes\n", (unsigned long)HEAP_SPAN);
+      return -1;
+    }
   }
 
-  LOG("expanding db size %d, %lu", rstate.db_fd, new_size);
+  LOG("expanding db size %d, %lu", rs->db_fd, new_size);
 
-  int err = ftruncate(rstate.db_fd, new_size);
+  int err = ftruncate(rs->db_fd, new_size);
   if (err) {
     fprintf(stderr, "could not increase db file size %s\n", strerror(errno));
-    exit(1);
+    return -1;
   }
 
   size_t expand_by = new_size - heap->size;
@@ -804,7 +1237,7 @@ void expand_heap_space(struct heap_header *heap, size_t min_expand) {
       (unsigned long)expand_by,
       (unsigned long)min_expand);
 
-  struct map lastmap = rstate.active_map.m[rstate.active_map.len - 1];
+  struct map lastmap = rs->active_map.m[rs->active_map.len - 1];
 
   LOG("resizing map:");
   print_map(lastmap);
@@ -813,52 +1246,156 @@ void expand_heap_space(struct heap_header *heap, size_t min_expand) {
       mremap(lastmap.start, lastmap.len, lastmap.len + expand_by, 0);
   if (new_addr == (void *)-1) {
     fprintf(stderr, "db remap failed at expand: %s\n", strerror(errno));
-    exit(3);
+
+    // the file can go back to what the map still covers
+    if (ftruncate(rs->db_fd, heap->size)) {
+      fprintf(stderr, "could not shrink db file %s\n", strerror(errno));
+    }
+
+    return -1;
   }
 
-  rstate.active_map.m[rstate.active_map.len - 1].len += expand_by;
+  rs->active_map.m[rs->active_map.len - 1].len += expand_by;
 
   LOG("layout is now:\n");
-  print_table(&rstate.active_map);
+  print_table(&rs->active_map);
 
   heap->size = new_size;
+
+  if (rs->hugepages) {
+    advise_hugepages(heap);
+  }
+
+  return 0;
 }
 
 // maybe_grow_heap takes an address we'd like to be inside the heap
 // and (if necessary) increases the heap size to include that address.
-void maybe_grow_heap(struct heap_header *h, void *addr) {
+// Returns -1 if the heap couldn't grow.
+int maybe_grow_heap(struct heap_header *h, void *addr) {
   char *end = (char *)h->map_start + h->size;
   if ((char *)addr < end) {
-    return;
+    return 0;
+  }
+
+  if (expand_heap_space(h, (char *)addr - end)) {
+    return -1;
   }
 
-  expand_heap_space(h, (char *)addr - end);
   assert((char *)addr < (char *)h->map_start + h->size);
+
+  return 0;
 }
 
-struct page *new_page(struct heap_header *h, size_t pages) {
-  struct page *next = NULL;
+// free_page puts a page nothing refers to anymore on the heap's free list.
+// Only copies and the pages of a discarded generation ever get freed and
+// neither are write protected, so new_page can hand them straight back out.
+void free_page(struct heap_header *h, struct page *p) {
+  *p = (struct page){
+      .i = {.type = 0, .committed = 0},
+      .pages = p->pages,
+      .len = 0,
+      .real_addr = h->free_pages,
+  };
+  h->free_pages = snap_offset(h, p);
 
-  if ((char *)h->last_page > (char *)h->last_gen) {
-    next = h->last_page =
-        (struct page
-             *)((char *)h->last_page + (h->last_page->pages * PAGE_SIZE));
-    LOG("expanding page by growing %p\n", (void *)next);
-  } else {
-    next = h->last_page = (struct page *)round_page_up(
-        (uintptr_t)h->last_gen + sizeof(struct generation));
-    LOG("expanding page by jumping %p\n", (void *)next);
+  mark_dirty(p, sizeof(struct page));
+  mark_dirty(h, sizeof(struct heap_header));
+}
+
+// free_page_link finds the link in the free list to a page of exactly the
+// right size, or NULL if there isn't one.
+snap_off *free_page_link(struct heap_header *h, size_t pages) {
+  for (snap_off *link = &h->free_pages; *link;) {
+    struct page *p = snap_at(h, *link);
+
+    if ((size_t)p->pages == pages) {
+      return link;
+    }
+
+    link = &p->real_addr;
+  }
+
+  return NULL;
+}
+
+// reuse_page takes a page of exactly the right size off the free list.
+struct page *reuse_page(struct heap_header *h, size_t pages) {
+  snap_off *link = free_page_link(h, pages);
+  if (!link) {
+    return NULL;
   }
 
-  maybe_grow_heap(h, (char *)next + (pages * PAGE_SIZE));
+  struct page *p = snap_at(h, *link);
+  *link = p->real_addr;
+  mark_dirty(h, sizeof(struct heap_header));
+
+  return p;
+}
+
+// bump_start is where bump_page would put the next page.
+struct page *bump_start(struct heap_header *h) {
+  struct page *last_page = snap_at(h, h->last_page);
+  struct generation *last_gen = snap_at(h, h->last_gen);
+
+  if ((char *)last_page > (char *)last_gen) {
+    return (struct page *)((char *)last_page +
+                           (last_page->pages * PAGE_SIZE));
+  }
+
+  return (struct page *)round_page_up(
+      (uintptr_t)last_gen + sizeof(struct generation));
+}
+
+// bump_page finds room for a page past everything else in the heap, or
+// returns NULL if the heap can't grow to fit it.
+struct page *bump_page(struct heap_header *h, size_t pages) {
+  struct page *next = bump_start(h);
+
+  LOG("expanding page at %p\n", (void *)next);
+
+  if (maybe_grow_heap(h, (char *)next + (pages * PAGE_SIZE))) {
+    return NULL;
+  }
+
+  h->last_page = snap_offset(h, next);
+
+  return next;
+}
+
+// db_has_room checks whether a page of pages pages fits without taking the
+// heap file past limit bytes.
+int db_has_room(struct heap_header *h, size_t pages, size_t limit) {
+  // a free page doesn't make the file any bigger
+  if (free_page_link(h, pages)) {
+    return 1;
+  }
+
+  char *end = (char *)bump_start(h) + pages * PAGE_SIZE;
+
+  return (size_t)(end - (char *)h) <= limit;
+}
+
+struct page *new_page(struct heap_header *h, size_t pages) {
+  struct page *next = reuse_page(h, pages);
+  if (next) {
+    LOG("reusing free page %p\n", (void *)next);
+  } else {
+    next = bump_page(h, pages);
+    if (!next) {
+      return NULL;
+    }
+  }
 
   *next = (struct page){
       .i = {.type = SNAP_NODE_PAGE, .committed = 0},
       .pages = pages,
       .len = 0,
-      .real_addr = next,
+      .real_addr = snap_offset(h, next),
   };
 
+  mark_dirty(next, pages * PAGE_SIZE);
+
   return next;
 }
 
@@ -866,21 +1403,19 @@ int set_committed(struct node *n, void *d) {
   int *flagged = (int *)d;
   (*flagged)++;
   n->committed = 1;
+  mark_dirty(n, sizeof(struct node));
 
   return WALK_CONTINUE;
 }
 
 struct page *page_copy(struct heap_header *h, struct page *p) {
   struct page *new = new_page(h, p->pages);
-  memcpy(new, p, p->pages * PAGE_SIZE);
-
-  // offset all the segment pointers so they're still correct when the
-  // page is moved. Useful for analyzing the situation without remapping.
-  for (int i = 0; i < p->len; i++) {
-    new->c[i] =
-        (struct segment *)((char *)new->c[i] + ((char *)new - (char *)p));
+  if (!new) {
+    return NULL;
   }
 
+  memcpy(new, p, p->pages * PAGE_SIZE);
+
   return new;
 }
 
@@ -891,13 +1426,17 @@ void page_swap(struct heap_header *heap, struct page *p1, struct page *p2) {
   assert(p1->pages > 0);
   assert(p1->pages == p2->pages);
   assert(p1->real_addr == p2->real_addr);
-  assert(p1->real_addr == p1 || p2->real_addr == p2);
+  assert(
+      p1->real_addr == snap_offset(heap, p1) ||
+      p2->real_addr == snap_offset(heap, p2));
 
   int pages = p1->pages;
   size_t chlen = pages * PAGE_SIZE;
 
   LOG("swapping pages %p <-> %p\n", (void *)p1, (void *)p2);
 
+  PROBE2(swap_start, p1->real_addr, pages);
+
   struct table rw = {
       .len = 2,
       .m =
@@ -922,52 +1461,55 @@ void page_swap(struct heap_header *heap, struct page *p1, struct page *p2) {
   memcpy(p1, p2, chlen);
   memcpy(p2, tmp, chlen);
 
-  size_t dist = (char *)p1 - (char *)p2;
+  mark_dirty(p1, chlen);
+  mark_dirty(p2, chlen);
 
-  for (int i = 0; i < p1->len; i++) {
-    p1->c[i] = (struct segment *)((char *)p1->c[i] + dist);
-  }
-
-  for (int i = 0; i < p2->len; i++) {
-    p2->c[i] = (struct segment *)((char *)p2->c[i] - dist);
-  }
+  PROBE0(swap_done);
 
   full_verify(1);
 }
 
 struct generation *new_gen(struct heap_header *h, int index) {
-  uintptr_t last_page = round_page_down((uintptr_t)(h->last_gen));
-  uintptr_t next_page = round_page_down((uintptr_t)(h->last_gen + 2));
+  struct generation *last_gen = snap_at(h, h->last_gen);
+  struct page *last_page = snap_at(h, h->last_page);
+
+  uintptr_t last_p = round_page_down((uintptr_t)(last_gen));
+  uintptr_t next_p = round_page_down((uintptr_t)(last_gen + 2));
 
-  LOG("last p:%p next p:%p\n", (void *)last_page, (void *)next_page);
+  LOG("last p:%p next p:%p\n", (void *)last_p, (void *)next_p);
 
   struct generation *next = NULL;
 
   // the idea is once we have an object in any part of a page we own the entire
   // page. When crossing page boundaries we need to check/alloc another page.
-  if (last_page == next_page) {
-    next = ++h->last_gen;
+  if (last_p == next_p) {
+    next = last_gen + 1;
     LOG("gen in same page, all good %p\n", (void *)next);
-  } else if ((char *)h->last_gen > (char *)h->last_page) {
+  } else if ((char *)last_gen > (char *)last_page) {
     // we were the last object grown, it's fine to just grow again.
     // just gotta make sure the heap is big enough.
 
-    next = ++h->last_gen;
+    next = last_gen + 1;
     LOG("expanding gen by growing %p\n", (void *)next);
   } else {
     // we're crossing pages and the next page is owned by someone else!
 
-    char *nextp = (char *)h->last_page + (h->last_page->pages * PAGE_SIZE);
+    char *nextp = (char *)last_page + (last_page->pages * PAGE_SIZE);
 
     // sanity check page placement. They should always start at a physical
     // page and extend to the end of all pages they occupy.
     assert((uintptr_t)nextp == round_page_up((uintptr_t)nextp));
 
-    next = h->last_gen = (struct generation *)nextp;
+    next = (struct generation *)nextp;
     LOG("expanding gen by jumping %p\n", (void *)next);
   }
 
-  maybe_grow_heap(h, (char *)(next) + sizeof(struct generation));
+  // the tree has no way to go on without it
+  if (maybe_grow_heap(h, (char *)(next) + sizeof(struct generation))) {
+    exit(1);
+  }
+
+  h->last_gen = snap_offset(h, next);
 
   *next = (struct generation){
       .i = {.type = SNAP_NODE_GENERATION, .committed = 0},
@@ -975,6 +1517,8 @@ struct generation *new_gen(struct heap_header *h, int index) {
       .c = {0},
   };
 
+  mark_dirty(next, sizeof(struct generation));
+
   return next;
 }
 
@@ -987,40 +1531,272 @@ new_gen_between(struct heap_header *heap, struct generation *parent) {
 
   for (int i = 0; i < GENERATION_CHILDREN; i++) {
     child->c[i] = parent->c[i];
-    parent->c[i] = NULL;
+    parent->c[i] = 0;
   }
 
-  parent->c[0] = (struct node *)child;
+  parent->c[0] = snap_offset(heap, child);
+  mark_dirty(parent, sizeof(struct generation));
 
   return child;
 }
 
-void handle_segv(int signum, siginfo_t *i, void *d) {
-  void *addr = i->si_addr;
+// heap_at finds the open heap addr falls inside of.
+struct runtime_state *heap_at(void *addr) {
+  for (struct runtime_state *s = open_heaps; s; s = s->next) {
+    char *start = s->heap->map_start;
+    if ((char *)addr >= start && (char *)addr < start + s->heap->size) {
+      return s;
+    }
+  }
 
-  if (rstate.handling_segv) {
-    fprintf(
-        stderr,
-        "SEGFAULT at %p while already handling SEGV for %p\n",
-        addr,
-        rstate.handling_segv);
-    exit(2);
+  return NULL;
+}
+
+// use_heap switches rs over to the state for heap. Most of the time it's the
+// same heap as last time.
+void use_heap(struct heap_header *heap) {
+  if (rs && rs->heap == heap) {
+    return;
   }
 
-  rstate.handling_segv = addr;
+  for (struct runtime_state *s = open_heaps; s; s = s->next) {
+    if (s->heap == heap) {
+      rs = s;
+      return;
+    }
+  }
 
-  if (addr < H->map_start || (char *)addr >= (char *)H->map_start + H->size) {
-    LOG("legal zone: %p-%p\n",
-        H->map_start,
-        (void *)((char *)H->map_start + H->size));
+  fprintf(stderr, "%p is not an open heap\n", (void *)heap);
+  exit(1);
+}
 
-    LOG("in transaction: %s\n", H->committed == H->working ? "false" : "true");
+// use_writable_heap is use_heap for everything that would change the heap,
+// which a heap from snap_open_readonly can't have done to it.
+void use_writable_heap(struct heap_header *heap) {
+  use_heap(heap);
 
-    fprintf(stderr, "SEGFAULT trying to read %p\n", addr);
-    exit(2);
+  if (rs->readonly) {
+    fprintf(stderr, "%s was opened read-only\n", rs->db_path);
+    exit(1);
   }
+}
 
-  if (H->committed == H->working) {
+struct page *cow_page(struct page *hit_page, enum copy_reason reason);
+
+struct pages_ahead {
+  char *from;
+  char *to;
+  struct page *skip;
+  struct page *p[COW_GRANULE_MAX + FAULT_AROUND_MAX];
+  int len;
+};
+// find_pages_ahead collects the protected pages other than skip that start
+// inside the window.
+int find_pages_ahead(struct node *n, void *d) {
+  if (n->type != SNAP_NODE_PAGE || !n->committed) {
+    return WALK_CONTINUE;
+  }
+
+  struct page *p = (struct page *)n;
+  struct pages_ahead *a = d;
+
+  int max = sizeof(a->p) / sizeof(*a->p);
+
+  if (p != a->skip && p->real_addr == snap_offset(H, p) &&
+      (char *)p >= a->from && (char *)p < a->to && a->len < max) {
+    a->p[a->len++] = p;
+  }
+
+  return WALK_CONTINUE;
+}
+
+// note_copied remembers a page the working generation copied so the commit
+// can tell whether it changed. One we can't remember just never gets checked.
+void note_copied(struct page *p, struct page *copy, enum copy_reason reason) {
+  if (rs->copies_len == rs->copies_cap) {
+    size_t cap = rs->copies_cap ? rs->copies_cap * 2 : 64;
+    struct copied_page *c = realloc(rs->copies, cap * sizeof(*c));
+    if (!c) {
+      return;
+    }
+
+    rs->copies = c;
+    rs->copies_cap = cap;
+  }
+
+  rs->copies[rs->copies_len++] = (struct copied_page){
+      .live = snap_offset(H, p),
+      .copy = snap_offset(H, copy),
+      .reason = reason,
+  };
+}
+
+// note_written records that the working generation wrote to p. A page we
+// aren't tracking yet takes the place of the one written least lately.
+void note_written(struct page *p) {
+  snap_off off = snap_offset(H, p);
+  struct hot_page *coldest = NULL;
+
+  for (int i = 0; i < HOT_PAGES; i++) {
+    struct hot_page *h = &rs->hot[i];
+    if (h->page == off) {
+      h->written = 1;
+      return;
+    }
+
+    if (!h->written && (!coldest || h->history < coldest->history)) {
+      coldest = h;
+    }
+  }
+
+  if (coldest) {
+    *coldest = (struct hot_page){.page = off, .history = 0, .written = 1};
+  }
+}
+
+// is_hot guesses a page will be written again when at least 3 of the last 4
+// transactions wrote to it.
+int is_hot(struct hot_page *h) {
+  int n = 0;
+  for (int i = 0; i < 4; i++) {
+    n += (h->history >> i) & 1;
+  }
+
+  return h->page && n >= 3;
+}
+
+// page_changed compares a page to the copy taken of it, leaving out the node
+// header since the committed bits always differ.
+int page_changed(struct page *p, struct page *copy) {
+  size_t skip = offsetof(struct page, real_addr);
+  return memcmp(
+      (char *)p + skip, (char *)copy + skip, p->pages * PAGE_SIZE - skip);
+}
+
+// stand_in swaps a committed page out of the file for anonymous memory
+// holding the same bytes, so a write there can go ahead without touching what
+// was committed. The transaction it's in gets marked out of room.
+int stand_in(void *at, size_t len) {
+  rs->out_of_room = 1;
+
+  for (size_t i = 0; i < rs->stand_ins_len; i++) {
+    if (rs->stand_ins[i].at == at) {
+      return 0;
+    }
+  }
+
+  if (rs->stand_ins_len == rs->stand_ins_cap) {
+    size_t cap = rs->stand_ins_cap ? rs->stand_ins_cap * 2 : 16;
+    struct stand_in *s = realloc(rs->stand_ins, cap * sizeof(*s));
+    if (!s) {
+      return -1;
+    }
+
+    rs->stand_ins = s;
+    rs->stand_ins_cap = cap;
+  }
+
+  char *saved = malloc(len);
+  if (!saved) {
+    return -1;
+  }
+
+  memcpy(saved, at, len);
+
+  void *mem = mmap(
+      at,
+      len,
+      PROT_READ | PROT_WRITE,
+      MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED,
+      -1,
+      0);
+  if (mem == MAP_FAILED) {
+    free(saved);
+    return -1;
+  }
+
+  memcpy(at, saved, len);
+
+  rs->stand_ins[rs->stand_ins_len++] = (struct stand_in){
+      .at = at,
+      .len = len,
+      .saved = saved,
+  };
+
+  return 0;
+}
+
+// drop_stand_ins maps the heap's own pages back where stand-ins were put,
+// throwing away whatever was written to them.
+void drop_stand_ins(struct heap_header *heap) {
+  for (size_t i = 0; i < rs->stand_ins_len; i++) {
+    struct stand_in *s = &rs->stand_ins[i];
+
+    int type = rs->wal ? MAP_PRIVATE | MAP_NORESERVE : MAP_SHARED;
+    void *mem = mmap(
+        s->at,
+        s->len,
+        PROT_READ | PROT_WRITE,
+        MAP_FIXED | type,
+        rs->db_fd,
+        (char *)s->at - (char *)heap->map_start);
+    if (mem == MAP_FAILED) {
+      fprintf(stderr, "db remap failed %s\n", strerror(errno));
+      exit(3);
+    }
+
+    // a private mapping only sees what's been checkpointed to the file
+    if (rs->wal) {
+      memcpy(s->at, s->saved, s->len);
+    }
+
+    free(s->saved);
+  }
+
+  rs->stand_ins_len = 0;
+}
+
+void handle_segv(int signum, siginfo_t *i, void *d) {
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  void *addr = i->si_addr;
+
+  PROBE1(segv_start, addr);
+
+  if (handling_segv) {
+    fprintf(
+        stderr,
+        "SEGFAULT at %p while already handling SEGV for %p\n",
+        addr,
+        handling_segv);
+    exit(2);
+  }
+
+  handling_segv = addr;
+
+  // the fault could belong to any of the open heaps, not just the one we
+  // were last asked to work on.
+  struct runtime_state *interrupted = rs;
+
+  rs = heap_at(addr);
+  if (!rs) {
+    LOG("in transaction: %s\n",
+        interrupted && interrupted->heap->committed !=
+                           interrupted->heap->working
+            ? "true"
+            : "false");
+
+    fprintf(stderr, "SEGFAULT trying to read %p\n", addr);
+    exit(2);
+  }
+
+  if (rs->readonly) {
+    fprintf(stderr, "SEGFAULT write to read-only heap %p\n", addr);
+    exit(2);
+  }
+
+  if (H->committed == H->working) {
     fprintf(stderr, "SEGFAULT write outside of mutation %p\n", addr);
     exit(2);
   }
@@ -1030,7 +1806,7 @@ void handle_segv(int signum, siginfo_t *i, void *d) {
   assert(H->working != H->committed);
 
   struct page_from_hit phit = {.hit = addr, .p = NULL, .index = -1};
-  walk_nodes((struct node *)H->root, find_page, (void *)&phit);
+  walk_nodes(snap_at(H, H->root), find_page, (void *)&phit);
 
   LOG("! turns out the page is %p\n", (void *)phit.p);
 
@@ -1042,293 +1818,2080 @@ void handle_segv(int signum, siginfo_t *i, void *d) {
   assert(hit_page->i.type == SNAP_NODE_PAGE);
   assert(hit_page->i.committed);
 
-  struct table pm = {
-      .len = 1,
-      .m =
-          {
-              {
-                  .w = 1,
-                  .start = hit_page,
-                  .len = hit_page->pages * PAGE_SIZE,
-              },
-          },
+  rs->stats.faults++;
+
+  // Writes tend to move forward through the heap. When this fault lands
+  // just past the last batch we copied, copy a few of the pages after it
+  // too, doubling how many each time the pattern holds.
+  int window = 0;
+  char *hit_start = (char *)hit_page;
+  if (rs->fault_around && rs->last_fault_end &&
+      hit_start >= rs->last_fault_end &&
+      hit_start < rs->last_fault_end + rs->fault_around * PAGE_SIZE) {
+    window = rs->fault_window ? rs->fault_window * 2 : 1;
+    if (window > rs->fault_around) {
+      window = rs->fault_around;
+    }
+  }
+  rs->fault_window = window;
+
+  char *hit_end = hit_start + hit_page->pages * PAGE_SIZE;
+  char *window_end = hit_end + window * PAGE_SIZE;
+
+  struct pages_ahead ahead = {
+      .from = hit_end,
+      .to = window_end,
+      .skip = hit_page,
+      .len = 0,
+  };
+
+  // the rest of the aligned block the hit page starts in comes along too, so
+  // protection only ever changes a whole block at a time
+  if (rs->cow_granule > 1) {
+    size_t block = rs->cow_granule * PAGE_SIZE;
+    char *block_start = (char *)((uintptr_t)hit_start & ~(block - 1));
+
+    ahead.from = block_start;
+    if (block_start + block > ahead.to) {
+      ahead.to = block_start + block;
+    }
+  }
+
+  if (ahead.to > ahead.from) {
+    walk_nodes(snap_at(H, H->root), find_pages_ahead, &ahead);
+  }
+
+  // every page in the batch gets unprotected in one go
+  struct table pm = {.len = 0};
+  pm.m[pm.len++] = (struct map){
+      .w = 1,
+      .start = hit_page,
+      .len = hit_page->pages * PAGE_SIZE,
   };
+  for (int j = 0; j < ahead.len; j++) {
+    pm.m[pm.len++] = (struct map){
+        .w = 1,
+        .start = ahead.p[j],
+        .len = ahead.p[j]->pages * PAGE_SIZE,
+    };
+  }
+  qsort(pm.m, pm.len, sizeof(struct map), cmp_map_start);
   merge_in_table(pm);
 
+  // There's no failing a write, so without room to keep what's been
+  // committed the page gets written somewhere else and the transaction can't
+  // be committed anymore.
+  int copied_hit = 0;
+  if (cow_page(hit_page, COPY_FAULT)) {
+    copied_hit = 1;
+    note_written(hit_page);
+    rs->last_fault_end = hit_start + hit_page->pages * PAGE_SIZE;
+  } else if (stand_in(hit_page, hit_page->pages * PAGE_SIZE)) {
+    fprintf(stderr, "no room to copy %p for a write\n", addr);
+    exit(1);
+  }
+
+  int around = 0;
+  int copied = 0;
+
+  // pages there wasn't room to copy ahead get locked back up, they can
+  // fault on their own if they're written to
+  struct table *ro = &pm;
+  ro->len = 0;
+
+  for (int j = 0; j < ahead.len; j++) {
+    char *start = (char *)ahead.p[j];
+    int is_around = start >= hit_end && start < window_end;
+    size_t len = ahead.p[j]->pages * PAGE_SIZE;
+
+    if (!cow_page(
+            ahead.p[j], is_around ? COPY_FAULT_AROUND : COPY_GRANULE)) {
+      ro->m[ro->len++] = (struct map){.w = 0, .start = ahead.p[j], .len = len};
+      continue;
+    }
+
+    around += is_around;
+    copied++;
+
+    if (start + len > rs->last_fault_end) {
+      rs->last_fault_end = start + len;
+    }
+  }
+
+  if (ro->len) {
+    qsort(ro->m, ro->len, sizeof(struct map), cmp_map_start);
+    merge_in_table(*ro);
+  }
+
+  rs->stats.pages_copied += copied_hit + copied;
+  rs->stats.fault_around_pages += around;
+  rs->stats.granule_pages += copied - around;
+  rs->stats.segv_ns += elapsed_ns(start);
+
+  PROBE2(segv_done, addr, 1 + copied);
+
+  rs = interrupted;
+  handling_segv = NULL;
+}
+
+// cow_page moves a committed page the working generation is about to write
+// to into the working generation, leaving a copy of it behind for the
+// generations that still need the old contents. The page must already be
+// writable. Returns the copy, or NULL with nothing changed if there's no room
+// for one: copies can take the heap file past its quota by at most
+// QUOTA_RESERVE.
+struct page *cow_page(struct page *hit_page, enum copy_reason reason) {
+  // a stand-in copied now would keep what the transaction wrote as history
+  if (rs->out_of_room) {
+    return NULL;
+  }
+
+  if (rs->quota_db_bytes &&
+      !db_has_room(H, hit_page->pages, rs->quota_db_bytes + QUOTA_RESERVE)) {
+    rs->stats.quota_failures++;
+    return NULL;
+  }
+
   struct node_rel rel = {
       .parent = NULL,
       .index = -1,
       .child = (struct node *)hit_page,
   };
-  walk_nodes((struct node *)H->root, find_parent, &rel);
+  walk_nodes(snap_at(H, H->root), find_parent, &rel);
   assert(rel.parent != NULL);
   assert(rel.index != -1);
   assert(rel.parent->type == SNAP_NODE_GENERATION);
 
   struct page *fresh_page = page_copy(H, hit_page);
+  if (!fresh_page) {
+    return NULL;
+  }
 
   struct tree_slot slot = {.index = -1, .target = NULL};
-  walk_nodes((struct node *)H->working, first_free_slot, &slot);
+  walk_nodes(snap_at(H, H->working), first_free_slot, &slot);
 
   if (slot.target == NULL) {
     LOG("did one of those fancy moves\n");
 
-    new_gen_between(H, H->working);
+    new_gen_between(H, snap_at(H, H->working));
 
     slot = (struct tree_slot){.index = -1, .target = NULL};
-    walk_nodes((struct node *)H->working, first_free_slot, &slot);
+    walk_nodes(snap_at(H, H->working), first_free_slot, &slot);
   }
 
   assert(slot.target != NULL);
   assert(slot.index != -1);
 
   fresh_page->i.committed = 1;
-  ((struct generation *)rel.parent)->c[rel.index] = (struct node *)fresh_page;
+  ((struct generation *)rel.parent)->c[rel.index] = snap_offset(H, fresh_page);
 
   hit_page->i.committed = 0;
-  slot.target->c[slot.index] = (struct node *)hit_page;
+  slot.target->c[slot.index] = snap_offset(H, hit_page);
+
+  mark_dirty(rel.parent, sizeof(struct generation));
+  mark_dirty(slot.target, sizeof(struct generation));
+  mark_dirty(hit_page, hit_page->pages * PAGE_SIZE);
+
+  note_copied(hit_page, fresh_page, reason);
 
   LOG("! duplicated %p-%p to %p\n",
       (void *)hit_page,
       (void *)((char *)hit_page + PAGE_SIZE - 1),
       (void *)fresh_page);
 
-  rstate.handling_segv = NULL;
+  return fresh_page;
 }
 
-struct heap_header *snap_init(char *db_path) {
-#ifdef SNAP_EVENT_LOG_FILE
-  int logfd = open(SNAP_EVENT_LOG_FILE, O_CREAT | O_RDWR, 0600);
-  if (logfd == -1) {
-    fprintf(stderr, "couldn't open event log %s\n", strerror(errno));
-    return NULL;
+// release_pages tells the kernel nothing is going to read len bytes at start
+// for a while. The shared mapping can drop them outright since the file keeps
+// them. In WAL mode the private mapping may hold the only up to date copy so
+// they can only be pushed out to swap.
+void release_pages(void *start, size_t len) {
+  int advice = rs->wal ? MADV_PAGEOUT : MADV_DONTNEED;
+
+  // it's only ever a hint, older kernels without MADV_PAGEOUT just keep them
+  if (!madvise(start, len, advice)) {
+    rs->stats.pages_released += len / PAGE_SIZE;
   }
+}
 
-  event_log = fdopen(logfd, "a");
-#endif
+// elide_copy undoes cow_page for a page the working generation didn't end up
+// changing, putting it back under the generation it came from and freeing
+// its copy.
+void elide_copy(struct page *p, struct page *copy) {
+  struct node_rel mine = {
+      .parent = NULL,
+      .index = -1,
+      .child = (struct node *)p,
+  };
+  walk_nodes(snap_at(H, H->working), find_parent, &mine);
+  assert(mine.parent != NULL);
 
-  rstate.db_path = db_path;
+  struct node_rel theirs = {
+      .parent = NULL,
+      .index = -1,
+      .child = (struct node *)copy,
+  };
+  walk_nodes(snap_at(H, H->root), find_parent, &theirs);
+  assert(theirs.parent != NULL);
 
-  struct stat stat_info;
+  p->i.committed = 1;
+  ((struct generation *)theirs.parent)->c[theirs.index] = snap_offset(H, p);
 
-  int created = 0;
+  // checkout relies on a generation's children only ever being added at the
+  // end so the ones after this slot shuffle down rather than leave a hole.
+  struct generation *g = (struct generation *)mine.parent;
+  memmove(
+      &g->c[mine.index],
+      &g->c[mine.index + 1],
+      (GENERATION_CHILDREN - mine.index - 1) * sizeof(snap_off));
+  g->c[GENERATION_CHILDREN - 1] = 0;
 
-  int err = stat(db_path, &stat_info);
-  if (err && errno == ENOENT) {
-    if (new_db(db_path)) {
-      fprintf(stderr, "couldn't creat initial db\n");
-      return NULL;
+  mark_dirty(mine.parent, sizeof(struct generation));
+  mark_dirty(theirs.parent, sizeof(struct generation));
+  mark_dirty(p, sizeof(struct node));
+
+  free_page(H, copy);
+
+  LOG("! elided %p, freed its copy %p\n", (void *)p, (void *)copy);
+}
+
+// where a delta starts covering a page, the node header is left out since the
+// committed bit is the only thing in it and that changes under us.
+#define DELTA_FROM offsetof(struct page, real_addr)
+
+// equal bytes a run carries on through rather than starting a new one
+#define DELTA_RUN_GAP 8
+
+// delta_encode writes out the runs where a and b differ, xored together.
+// Returns how many bytes that took, or -1 once it'd take more than max.
+long delta_encode(
+    const unsigned char *a,
+    const unsigned char *b,
+    size_t len,
+    unsigned char *out,
+    size_t max) {
+  size_t used = 0;
+  size_t last = 0;
+  size_t i = 0;
+
+  while (i < len) {
+    // most of a page is usually unchanged, skip it a word at a time
+    uint64_t wa, wb;
+    if (i + sizeof(uint64_t) <= len) {
+      memcpy(&wa, a + i, sizeof(wa));
+      memcpy(&wb, b + i, sizeof(wb));
+      if (wa == wb) {
+        i += sizeof(uint64_t);
+        continue;
+      }
     }
 
-    created = 1;
-  }
+    if (a[i] == b[i]) {
+      i++;
+      continue;
+    }
 
-  int notok = open_db(db_path, &rstate);
-  if (notok) {
-    return NULL;
-  }
+    size_t end = i + 1;
+    for (size_t j = end; j < len && j - end < DELTA_RUN_GAP; j++) {
+      if (a[j] != b[j]) {
+        end = j + 1;
+      }
+    }
 
-  if (created) {
-    full_verify(0);
-  } else {
-    // if we're loading an existing heap lets handle some invariant and try to
-    // correct for them.
+    struct snap_delta_run run = {.skip = i - last, .len = end - i};
+    if (used + sizeof(run) + run.len > max) {
+      return -1;
+    }
 
-    // TODO(turbio): cleanup some of the other state!
-    if (H->committed != H->working) {
-      fprintf(stderr, "WARNING: heap is uncommitted, rolling back...\n");
-      H->working = H->committed;
+    memcpy(out + used, &run, sizeof(run));
+    used += sizeof(run);
+
+    for (size_t j = i; j < end; j++) {
+      out[used++] = a[j] ^ b[j];
     }
 
-    full_verify(1);
+    last = i = end;
   }
 
-  static struct sigaction segv_action;
+  return used;
+}
 
-  segv_action.sa_flags = SA_SIGINFO | SA_NODEFER;
-  segv_action.sa_sigaction = handle_segv;
-  sigaction(SIGSEGV, &segv_action, NULL);
+// delta_apply xors the runs of a delta into out.
+void delta_apply(unsigned char *out, const unsigned char *runs, size_t len) {
+  size_t at = 0;
 
-  LOG("snap allocator initialized\n");
+  for (size_t i = 0; i < len;) {
+    struct snap_delta_run run;
+    memcpy(&run, runs + i, sizeof(run));
+    i += sizeof(run);
+    at += run.skip;
 
-  return rstate.heap;
+    for (uint32_t j = 0; j < run.len; j++) {
+      out[at++] ^= runs[i++];
+    }
+  }
 }
 
-int snap_commit(struct heap_header *heap) {
-#ifdef SNAP_EVENT_LOG_FILE
-  fprintf(event_log, "snap_commit\n");
-  fflush(event_log);
-#endif
+// deltas and compressed pages get packed into pages of their own. These start
+// out the same as a page so new_page can still tell where one ends when it's
+// the last thing in the heap, but they're never part of the tree.
+struct delta_arena {
+  struct node i;
+  snap_off real_addr;
+  int pages;
+
+  snap_off next;
+  size_t used;
+  unsigned char data[];
+};
 
-  full_verify(0);
+#define DELTA_ARENA_SIZE                                                       \
+  (DELTA_ARENA_PAGES * PAGE_SIZE - sizeof(struct delta_arena))
 
-  LOG("BEGINNING COMMIT\n");
+// arena_alloc finds room for size bytes in the current arena, starting a new
+// one when it's full. Returns NULL if there's no room for one.
+void *arena_alloc(struct heap_header *h, size_t size) {
+  size = (size + sizeof(snap_off) - 1) & ~(sizeof(snap_off) - 1);
 
-  LOG("update commit bit\n");
+  if (size > (size_t)DELTA_ARENA_SIZE) {
+    return NULL;
+  }
 
-  int flagged = 0;
-  walk_nodes((struct node *)heap->working, set_committed, &flagged);
+  struct delta_arena *a = snap_at(h, h->deltas);
 
-  LOG("committed %d nodes\n", flagged);
+  if (!a || a->used + size > (size_t)DELTA_ARENA_SIZE) {
+    snap_off prev = h->deltas;
 
-  heap->committed = heap->working;
+    a = (struct delta_arena *)new_page(h, DELTA_ARENA_PAGES);
+    if (!a) {
+      return NULL;
+    }
 
-  full_verify(1);
+    *a = (struct delta_arena){
+        .i = {.type = 0, .committed = 1},
+        .real_addr = snap_offset(h, a),
+        .pages = DELTA_ARENA_PAGES,
+        .next = prev,
+        .used = 0,
+    };
+    h->deltas = snap_offset(h, a);
 
-  LOG("COMMIT COMPLETE\n");
+    mark_dirty(h, sizeof(struct heap_header));
+  }
 
-  return heap->committed->gen;
-}
+  void *at = a->data + a->used;
+  a->used += size;
 
-struct up_to_gen_state {
-  int max_gen;
-  struct page **p;
-  int count;
-};
-int pages_up_to_gen(struct node *n, void *d) {
-  struct up_to_gen_state *s = (struct up_to_gen_state *)d;
+  mark_dirty(a, sizeof(struct delta_arena));
 
-  if (n->type == SNAP_NODE_GENERATION) {
-    struct generation *g = (struct generation *)n;
+  return at;
+}
 
-    if (g->gen > s->max_gen) {
-      return WALK_SKIP;
-    }
+// encode_copy replaces the copy of an old version of a page with a delta
+// against p, the version in base_gen that replaced it, when that's small
+// enough to be worth it.
+int encode_copy(struct page *copy, struct page *p, int base_gen) {
+  size_t size = copy->pages * PAGE_SIZE;
+  size_t max = size / DELTA_MAX_RATIO;
 
-    return WALK_CONTINUE;
+  unsigned char *runs = malloc(max);
+  if (!runs) {
+    return 0;
   }
 
-  struct page *page = (struct page *)n;
+  long len = delta_encode(
+      (unsigned char *)copy + DELTA_FROM,
+      (unsigned char *)p + DELTA_FROM,
+      size - DELTA_FROM,
+      runs,
+      max);
+
+  struct snap_delta *d =
+      len < 0 ? NULL : arena_alloc(H, sizeof(struct snap_delta) + len);
+  if (!d) {
+    free(runs);
+    return 0;
+  }
 
-  if (s->p) {
-    for (int i = 0; i < s->count; i++) {
-      if (s->p[i]->real_addr == page->real_addr) {
-        s->p[i] = page;
-        goto exit;
-      }
-    }
+  *d = (struct snap_delta){
+      .i = {.type = SNAP_NODE_DELTA, .committed = 1},
+      .real_addr = copy->real_addr,
+      .pages = copy->pages,
+      .base_gen = base_gen,
+      .len = len,
+  };
+  memcpy(d->runs, runs, len);
+  free(runs);
 
-    s->p[s->count] = page;
-  }
+  mark_dirty(d, sizeof(struct snap_delta) + len);
 
-  s->count++;
+  struct node_rel rel = {
+      .parent = NULL,
+      .index = -1,
+      .child = (struct node *)copy,
+  };
+  walk_nodes(snap_at(H, H->root), find_parent, &rel);
+  assert(rel.parent != NULL);
 
-exit:
-  return WALK_CONTINUE;
+  ((struct generation *)rel.parent)->c[rel.index] = snap_offset(H, d);
+  mark_dirty(rel.parent, sizeof(struct generation));
+
+  free_page(H, copy);
+
+  rs->stats.deltas_encoded++;
+  rs->stats.delta_bytes += len;
+
+  return 1;
 }
 
-struct gen_from_id {
-  int id;
-  struct generation *g;
-};
-int first_gen_for_id(struct node *n, void *d) {
-  if (n->type == SNAP_NODE_GENERATION) {
-    struct generation *g = (struct generation *)n;
-    struct gen_from_id *f = (struct gen_from_id *)d;
+// find_version finds the node holding home's version as of generation gen.
+// Generations only ever get higher going down the tree so anything newer can
+// be skipped.
+struct node *find_version(struct generation *g, snap_off home, int gen) {
+  for (int i = 0; i < GENERATION_CHILDREN; i++) {
+    struct node *n = snap_at(H, g->c[i]);
+    if (!n) {
+      continue;
+    }
 
-    if (g->gen == f->id) {
-      f->g = g;
-      return WALK_EXIT;
+    if (n->type == SNAP_NODE_GENERATION) {
+      if (((struct generation *)n)->gen > gen) {
+        continue;
+      }
+
+      struct node *found = find_version((struct generation *)n, home, gen);
+      if (found) {
+        return found;
+      }
+    } else if (g->gen == gen && ((struct page *)n)->real_addr == home) {
+      return n;
+    }
+  }
+
+  return NULL;
+}
+
+// unpack decompresses a packed page version into the size bytes at out.
+void unpack(struct snap_packed *packed, unsigned char *out, size_t size) {
+  long len = lz_decompress(packed->data, packed->len, out, size);
+  if (len != (long)size) {
+    fprintf(
+        stderr, "compressed page at %p is corrupt\n", (void *)packed);
+    exit(1);
+  }
+}
+
+// materialize turns a delta or a compressed version back into a full page in
+// its place. The deltas between it and the nearest full version newer than it
+// are all xors so they can be applied in whatever order they're found.
+struct page *materialize(struct node *n) {
+  struct page *v = (struct page *)n;
+  size_t size = v->pages * PAGE_SIZE;
+
+  struct node_rel rel = {
+      .parent = NULL,
+      .index = -1,
+      .child = n,
+  };
+  walk_nodes(snap_at(H, H->root), find_parent, &rel);
+  assert(rel.parent != NULL);
+
+  // a checkout can't be left half done
+  struct page *p = new_page(H, v->pages);
+  if (!p) {
+    exit(1);
+  }
+
+  unsigned char *to = (unsigned char *)p + DELTA_FROM;
+  memset(to, 0, size - DELTA_FROM);
+
+  if (n->type == SNAP_NODE_PACKED) {
+    unpack((struct snap_packed *)n, to, size - DELTA_FROM);
+    rs->stats.pages_unpacked++;
+    goto done;
+  }
+
+  while (n->type == SNAP_NODE_DELTA) {
+    struct snap_delta *step = (struct snap_delta *)n;
+    delta_apply(to, step->runs, step->len);
+
+    n = find_version(snap_at(H, H->root), step->real_addr, step->base_gen);
+    assert(n && "delta base went missing");
+  }
+
+  unsigned char *from = (unsigned char *)n + DELTA_FROM;
+  unsigned char *unpacked = NULL;
+
+  if (n->type == SNAP_NODE_PACKED) {
+    unpacked = malloc(size - DELTA_FROM);
+    if (!unpacked) {
+      fprintf(stderr, "no memory to decompress a page\n");
+      exit(1);
+    }
+
+    unpack((struct snap_packed *)n, unpacked, size - DELTA_FROM);
+    from = unpacked;
+  }
+
+  for (size_t i = 0; i < size - DELTA_FROM; i++) {
+    to[i] ^= from[i];
+  }
+
+  free(unpacked);
+
+  rs->stats.pages_materialized++;
+
+done:
+  p->i = (struct node){.type = SNAP_NODE_PAGE, .committed = 1};
+
+  ((struct generation *)rel.parent)->c[rel.index] = snap_offset(H, p);
+  mark_dirty(rel.parent, sizeof(struct generation));
+  mark_dirty(p, size);
+
+  return p;
+}
+
+// pack_copy compresses the old page version in slot i of g into an arena,
+// when that makes it enough smaller, and frees the page it was in.
+int pack_copy(struct generation *g, int i, unsigned char *buf) {
+  struct page *p = snap_at(H, g->c[i]);
+  size_t size = p->pages * PAGE_SIZE - DELTA_FROM;
+  size_t max = size * PACK_MAX_PERCENT / 100;
+
+  if (p->pages >= DELTA_ARENA_PAGES) {
+    return 0;
+  }
+
+  long len = lz_compress((unsigned char *)p + DELTA_FROM, size, buf, max);
+
+  struct snap_packed *packed =
+      len < 0 ? NULL : arena_alloc(H, sizeof(struct snap_packed) + len);
+  if (!packed) {
+    return 0;
+  }
+
+  *packed = (struct snap_packed){
+      .i = {.type = SNAP_NODE_PACKED, .committed = 1},
+      .real_addr = p->real_addr,
+      .pages = p->pages,
+      .len = len,
+  };
+  memcpy(packed->data, buf, len);
+
+  mark_dirty(packed, sizeof(struct snap_packed) + len);
+
+  g->c[i] = snap_offset(H, packed);
+  mark_dirty(g, sizeof(struct generation));
+
+  free_page(H, p);
+
+  rs->stats.pages_packed++;
+  rs->stats.packed_from += size + DELTA_FROM;
+  rs->stats.packed_bytes += len;
+
+  return 1;
+}
+
+// compact_gen packs every old page version under g in generations up to
+// max_gen. Whichever version is checked out sits at its home and is left
+// alone.
+int compact_gen(struct generation *g, int max_gen, unsigned char *buf) {
+  int packed = 0;
+
+  for (int i = 0; i < GENERATION_CHILDREN; i++) {
+    struct node *n = snap_at(H, g->c[i]);
+    if (!n) {
+      continue;
+    }
+
+    if (n->type == SNAP_NODE_GENERATION) {
+      struct generation *child = (struct generation *)n;
+      if (child->gen <= max_gen) {
+        packed += compact_gen(child, max_gen, buf);
+      }
+    } else if (
+        n->type == SNAP_NODE_PAGE &&
+        snap_at(H, ((struct page *)n)->real_addr) != n) {
+      packed += pack_copy(g, i, buf);
+    }
+  }
+
+  return packed;
+}
+
+// drop_heap forgets about the heap rs is pointing at.
+void drop_heap() {
+  struct runtime_state **s = &open_heaps;
+  while (*s != rs) {
+    s = &(*s)->next;
+  }
+
+  *s = rs->next;
+
+  if (rs->ws) {
+    ws_close(rs->ws);
+  }
+
+  free(rs->copies);
+  for (size_t i = 0; i < rs->stand_ins_len; i++) {
+    free(rs->stand_ins[i].saved);
+  }
+  free(rs->stand_ins);
+  free(rs->db_path);
+  free(rs);
+  rs = NULL;
+}
+
+// open_heap does all the work for snap_init with rs already pointing at a
+// fresh state.
+struct heap_header *open_heap(char *db_path) {
+  struct stat stat_info;
+
+  int created = 0;
+
+  int err = stat(db_path, &stat_info);
+  if (err && errno == ENOENT) {
+    // a log left behind by some older db would get replayed over this one
+    wal_discard(db_path);
+    ws_discard(db_path);
+
+    if (new_db(db_path)) {
+      fprintf(stderr, "couldn't creat initial db\n");
+      return NULL;
+    }
+
+    created = 1;
+  } else {
+    int replayed = wal_replay(db_path);
+    if (replayed < 0) {
+      fprintf(stderr, "couldn't replay log\n");
+      return NULL;
+    }
+
+    if (replayed) {
+      LOG("replayed %d commits from the log\n", replayed);
+    }
+  }
+
+  int notok = open_db(db_path, rs);
+  if (notok) {
+    return NULL;
+  }
+
+  if (!created && !H->committed) {
+    // we died before the very first commit so there's nothing to lose
+    fprintf(stderr, "WARNING: heap was never committed, starting over...\n");
+
+    munmap(H->map_start, H->size);
+    close(rs->db_fd);
+    rs->heap = NULL;
+    rs->db_fd = -1;
+
+    ws_discard(db_path);
+
+    if (unlink(db_path) || new_db(db_path) || open_db(db_path, rs)) {
+      fprintf(stderr, "couldn't recreate db\n");
+      return NULL;
+    }
+
+    created = 1;
+  }
+
+  if (!created) {
+    long prefetched = ws_prefetch(db_path, H, H->size);
+    LOG("prefetching %ld pages\n", prefetched);
+    (void)prefetched;
+  }
+
+  rs->ws = ws_open(db_path);
+
+  if (created) {
+    full_verify(0);
+  } else {
+    // if we're loading an existing heap lets handle some invariant and try to
+    // correct for them.
+
+    // The abandoned generation already moved the pages it wrote to and left
+    // copies of the originals behind, the same as a failed query. Roll back
+    // the same way: commit it and checkout its parent so the copies get
+    // swapped back in.
+    if (H->committed != H->working) {
+      fprintf(stderr, "WARNING: heap is uncommitted, rolling back...\n");
+
+      int parent_gen = snap_gen_id(H, H->committed);
+      snap_commit(H);
+      snap_checkout(H, parent_gen);
+    }
+
+    full_verify(1);
+  }
+
+  return rs->heap;
+}
+
+// new_state adds a state for the heap at db_path to the open heaps and
+// switches rs over to it.
+struct runtime_state *new_state(const char *db_path) {
+  struct runtime_state *state = calloc(1, sizeof(struct runtime_state));
+  if (!state) {
+    fprintf(stderr, "couldn't allocate heap state\n");
+    return NULL;
+  }
+
+  state->db_path = strdup(db_path);
+  state->db_fd = -1;
+  state->fault_around = FAULT_AROUND_PAGES;
+  state->precow = PRECOW_PAGES;
+  state->deltas = 1;
+  state->cow_granule = 1;
+  state->next = open_heaps;
+  open_heaps = state;
+
+  rs = state;
+
+  return state;
+}
+
+// abandon_heap undoes new_state and whatever of the open got done, leaving rs
+// as prev.
+void abandon_heap(struct runtime_state *prev) {
+  if (rs->heap) {
+    munmap(rs->heap, rs->heap->size);
+  }
+  if (rs->db_fd != -1) {
+    close(rs->db_fd);
+  }
+
+  drop_heap();
+  rs = prev;
+}
+
+struct heap_header *snap_init(char *db_path) {
+#ifdef SNAP_EVENT_LOG_FILE
+  if (!tracer && snap_trace(SNAP_EVENT_LOG_FILE)) {
+    return NULL;
+  }
+#endif
+
+  struct runtime_state *prev = rs;
+
+  struct runtime_state *state = new_state(db_path);
+  if (!state) {
+    return NULL;
+  }
+
+  struct heap_header *heap = open_heap(state->db_path);
+  if (!heap) {
+    abandon_heap(prev);
+    return NULL;
+  }
+
+  static struct sigaction segv_action;
+
+  segv_action.sa_flags = SA_SIGINFO | SA_NODEFER;
+  segv_action.sa_sigaction = handle_segv;
+  sigaction(SIGSEGV, &segv_action, NULL);
+
+  LOG("snap allocator initialized\n");
+
+  return heap;
+}
+
+// snap_open_readonly maps the heap at db_path without being able to change
+// it, for looking at a database an evaler might have open at the same time.
+// Nothing gets repaired or rolled back and the log isn't replayed, so it sees
+// the file as it is: in WAL mode only up to the last checkpoint, and a
+// transaction still in progress if there is one. Writes to it are fatal.
+struct heap_header *snap_open_readonly(const char *db_path) {
+  struct runtime_state *prev = rs;
+
+  struct runtime_state *state = new_state(db_path);
+  if (!state) {
+    return NULL;
+  }
+
+  state->readonly = 1;
+
+  if (open_db(state->db_path, state)) {
+    abandon_heap(prev);
+    return NULL;
+  }
+
+  return state->heap;
+}
+
+// trace_call records a call made on heap. Pointers go in as offsets into it
+// and the heap as the slot it's mapped at, so a trace says the same thing
+// wherever the heap gets mapped next time.
+void trace_call(
+    struct heap_header *heap,
+    enum trace_op op,
+    void *ptr,
+    size_t size,
+    void *result) {
+  uint32_t slot =
+      ((char *)heap->map_start - (char *)MAP_START_ADDR) / HEAP_SPAN;
+
+  trace_event(
+      tracer,
+      op,
+      slot,
+      snap_offset(heap, ptr),
+      size,
+      snap_offset(heap, result));
+}
+
+// snap_trace starts recording every allocator call into the trace at path,
+// for snaptrace to turn back into something memtest can replay. It's kept
+// across every heap in the process.
+int snap_trace(const char *path) {
+  struct trace *t = trace_open(path, TRACE_RECORDS);
+  if (!t) {
+    return -1;
+  }
+
+  if (tracer) {
+    trace_close(tracer);
+  }
+
+  tracer = t;
+
+  return 0;
+}
+
+// snap_close flushes whatever the durability mode still owes the disk and
+// unmaps the heap.
+void snap_close(struct heap_header *heap) {
+  use_heap(heap);
+
+  if (!rs->readonly) {
+    snap_set_durability(heap, SNAP_DURABILITY_NONE, 0, 0);
+  }
+
+  if (rs->ws) {
+    ws_sample(rs->ws, heap, heap->size);
+    ws_save(rs->ws);
+  }
+
+  munmap(heap, heap->size);
+  close(rs->db_fd);
+
+  drop_heap();
+}
+
+void msync_range(void *start, size_t len) {
+  if (msync(start, len, MS_SYNC)) {
+    fprintf(stderr, "failed to sync heap %s\n", strerror(errno));
+    exit(3);
+  }
+}
+
+int cmp_map_start(const void *a, const void *b) {
+  const struct map *ma = a;
+  const struct map *mb = b;
+
+  if ((char *)ma->start < (char *)mb->start) {
+    return -1;
+  } else if ((char *)ma->start > (char *)mb->start) {
+    return 1;
+  }
+
+  return 0;
+}
+
+// coalesce sorts the ranges in d and merges any that touch so neighbouring
+// pages get written out together.
+void coalesce(struct table *d) {
+  if (!d->len) {
+    return;
+  }
+
+  qsort(d->m, d->len, sizeof(struct map), cmp_map_start);
+
+  size_t out = 0;
+  for (size_t i = 1; i < d->len; i++) {
+    struct map *last = &d->m[out];
+    char *end = (char *)last->start + last->len;
+
+    if ((char *)d->m[i].start <= end) {
+      char *next_end = (char *)d->m[i].start + d->m[i].len;
+      if (next_end > end) {
+        last->len = next_end - (char *)last->start;
+      }
+    } else {
+      d->m[++out] = d->m[i];
+    }
+  }
+
+  d->len = out + 1;
+}
+
+// sync_dirty writes every range touched since the last flush out to disk. The
+// header is left to sync_header so it can be ordered after the pages it points
+// to.
+void sync_dirty(struct heap_header *heap) {
+  struct table *d = &rs->dirty;
+
+  if (rs->dirty_overflow) {
+    msync_range(heap->map_start, heap->size);
+  } else {
+    coalesce(d);
+
+    for (size_t i = 0; i < d->len; i++) {
+      msync_range(d->m[i].start, d->m[i].len);
+    }
+  }
+
+  d->len = 0;
+  rs->dirty_overflow = 0;
+}
+
+void sync_header(struct heap_header *heap) { msync_range(heap, PAGE_SIZE); }
+
+void sync_generation(struct heap_header *heap) {
+  sync_dirty(heap);
+  sync_header(heap);
+
+  rs->pending_commits = 0;
+  rs->pending_moved = 0;
+  rs->durable_gen = snap_gen_id(heap, heap->committed);
+}
+
+// remap_heap replaces the whole heap mapping with a fresh one of the given
+// type. Only valid while the file holds exactly what's in memory.
+void remap_heap(struct heap_header *heap, int type) {
+  void *start = heap->map_start;
+  size_t size = heap->size;
+
+  // A private mapping gets charged as if every page could be written to,
+  // which big heaps easily blow through. Only the pages we actually write get
+  // copied so don't reserve for the rest.
+  if (type == MAP_PRIVATE) {
+    type |= MAP_NORESERVE;
+  }
+
+  void *mem = mmap(
+      start,
+      size,
+      PROT_READ | PROT_WRITE,
+      MAP_FIXED | type,
+      rs->db_fd,
+      0);
+  if (mem == MAP_FAILED) {
+    fprintf(stderr, "db remap failed %s\n", strerror(errno));
+    exit(3);
+  }
+
+  assert(mem == start);
+
+  rs->active_map = (struct table){
+      .len = 1,
+      .m =
+          {
+              {
+                  .start = start,
+                  .len = size,
+                  .w = 1,
+              },
+          },
+  };
+}
+
+// checkpoint writes everything the log holds back into the heap file so the
+// log can start over. The private mapping then gets replaced by a fresh one,
+// dropping the anonymous copies of every page we've written to.
+void checkpoint(struct heap_header *heap) {
+  struct table *l = &rs->logged;
+
+  if (rs->logged_overflow) {
+    l->len = 1;
+    l->m[0] = (struct map){.start = heap->map_start, .len = heap->size};
+  } else {
+    coalesce(l);
+  }
+
+  for (size_t i = 0; i < l->len; i++) {
+    char *start = l->m[i].start;
+    size_t done = 0;
+
+    while (done < l->m[i].len) {
+      ssize_t n = pwrite(
+          rs->db_fd,
+          start + done,
+          l->m[i].len - done,
+          start + done - (char *)heap->map_start);
+      if (n < 0 && errno != EINTR) {
+        fprintf(stderr, "failed to checkpoint heap %s\n", strerror(errno));
+        exit(3);
+      }
+
+      done += n > 0 ? n : 0;
+    }
+  }
+
+  if (fdatasync(rs->db_fd)) {
+    fprintf(stderr, "failed to sync heap %s\n", strerror(errno));
+    exit(3);
+  }
+
+  if (wal_reset(rs->wal)) {
+    exit(3);
+  }
+
+  l->len = 0;
+  rs->logged_overflow = 0;
+
+  // the remap is about to forget which pages we've been using
+  if (rs->ws) {
+    ws_sample(rs->ws, heap, heap->size);
+  }
+
+  remap_heap(heap, MAP_PRIVATE);
+}
+
+// log_generation appends everything written since the last flush to the log
+// as one record. Once it returns the generation will survive a crash.
+void log_generation(struct heap_header *heap) {
+  static struct wal_range ranges[MAX_MAPS];
+  size_t n = 0;
+
+  struct table *d = &rs->dirty;
+
+  // the header has to go along, it's what points at the new generation
+  add_range(d, &rs->dirty_overflow, heap, PAGE_SIZE);
+
+  if (rs->dirty_overflow) {
+    ranges[n++] = (struct wal_range){.off = 0, .len = heap->size};
+  } else {
+    coalesce(d);
+
+    for (size_t i = 0; i < d->len; i++) {
+      ranges[n++] = (struct wal_range){
+          .off = (char *)d->m[i].start - (char *)heap->map_start,
+          .len = d->m[i].len,
+      };
+    }
+  }
+
+  int gen = snap_gen_id(heap, heap->committed);
+
+  if (wal_append(rs->wal, gen, heap->size, heap->map_start, ranges, n)) {
+    fprintf(stderr, "failed to log generation %d\n", gen);
+    exit(3);
+  }
+
+  for (size_t i = 0; i < n; i++) {
+    add_range(
+        &rs->logged,
+        &rs->logged_overflow,
+        (char *)heap->map_start + ranges[i].off,
+        ranges[i].len);
+  }
+
+  d->len = 0;
+  rs->dirty_overflow = 0;
+
+  rs->pending_commits = 0;
+  rs->pending_moved = 0;
+  rs->durable_gen = gen;
+
+  if (wal_size(rs->wal) > WAL_CHECKPOINT_SIZE) {
+    checkpoint(heap);
+  }
+}
+
+// start_wal moves the heap over to a private mapping with commits going
+// through the log.
+void start_wal(struct heap_header *heap) {
+  // whatever went through the shared mapping so far has to be on disk before
+  // the log takes over.
+  if (fdatasync(rs->db_fd)) {
+    fprintf(stderr, "failed to sync heap %s\n", strerror(errno));
+    exit(3);
+  }
+
+  rs->wal = wal_open(rs->db_path);
+  if (!rs->wal) {
+    exit(3);
+  }
+
+  remap_heap(heap, MAP_PRIVATE);
+
+  rs->dirty.len = 0;
+  rs->dirty_overflow = 0;
+  rs->logged.len = 0;
+  rs->logged_overflow = 0;
+}
+
+void stop_wal(struct heap_header *heap) {
+  if (wal_size(rs->wal)) {
+    checkpoint(heap);
+  }
+
+  remap_heap(heap, MAP_SHARED);
+
+  wal_close(rs->wal);
+  rs->wal = NULL;
+}
+
+// durable_point is reached whenever heap->committed moves. Depending on the
+// durability mode the new generation is flushed now or queued up for a group
+// flush. Only commits count toward a group, anything else moving the
+// committed generation just waits for the next flush.
+void durable_point(struct heap_header *heap, int commit) {
+  switch (rs->durability) {
+  case SNAP_DURABILITY_NONE:
+    break;
+  case SNAP_DURABILITY_SYNC:
+    sync_generation(heap);
+    break;
+  case SNAP_DURABILITY_WAL:
+    log_generation(heap);
+    break;
+  case SNAP_DURABILITY_GROUP:
+    if (!rs->pending_commits && !rs->pending_moved) {
+      clock_gettime(CLOCK_MONOTONIC, &rs->pending_since);
+    }
+
+    if (commit) {
+      rs->pending_commits++;
+    } else {
+      rs->pending_moved = 1;
+    }
+
+    if (rs->pending_commits >= rs->group_commits ||
+        snap_sync_due(heap) == 0) {
+      sync_generation(heap);
+    }
+    break;
+  }
+}
+
+void snap_set_durability(
+    struct heap_header *heap,
+    enum snap_durability mode,
+    int group_commits,
+    long group_latency_us) {
+  use_writable_heap(heap);
+
+  if (rs->durability != SNAP_DURABILITY_NONE) {
+    snap_sync(heap);
+  } else if (mode != SNAP_DURABILITY_NONE) {
+    // we haven't been tracking writes so far, the first flush has to cover
+    // everything.
+    rs->dirty_overflow = 1;
+  }
+
+  if (mode == SNAP_DURABILITY_WAL && rs->durability != mode) {
+    start_wal(heap);
+  } else if (mode != SNAP_DURABILITY_WAL && rs->wal) {
+    stop_wal(heap);
+  }
+
+  rs->durability = mode;
+  rs->group_commits = group_commits > 0 ? group_commits : 1;
+  rs->group_latency_us = group_latency_us > 0 ? group_latency_us : 0;
+  rs->pending_commits = 0;
+  rs->pending_moved = 0;
+  rs->durable_gen = snap_gen_id(heap, heap->committed);
+}
+
+// snap_sync flushes any commits still waiting on a group flush and returns the
+// newest generation known to be on disk.
+int snap_sync(struct heap_header *heap) {
+  use_writable_heap(heap);
+
+  if (rs->durability == SNAP_DURABILITY_NONE) {
+    return -1;
+  }
+
+  if (rs->durability == SNAP_DURABILITY_WAL) {
+    // every commit is already in the log, bring the heap file up to date so
+    // it's complete on its own.
+    if (heap->committed == heap->working && wal_size(rs->wal)) {
+      checkpoint(heap);
+    }
+
+    return rs->durable_gen;
+  }
+
+  if (rs->pending_commits || rs->pending_moved || rs->dirty.len ||
+      rs->dirty_overflow) {
+    sync_generation(heap);
+  }
+
+  return rs->durable_gen;
+}
+
+// snap_sync_due returns how many microseconds are left before pending commits
+// must be flushed, or -1 if nothing is waiting.
+long snap_sync_due(struct heap_header *heap) {
+  use_heap(heap);
+
+  if (rs->durability != SNAP_DURABILITY_GROUP ||
+      (!rs->pending_commits && !rs->pending_moved)) {
+    return -1;
+  }
+
+  long left = rs->group_latency_us - elapsed_us(rs->pending_since);
+  if (left < 0) {
+    return 0;
+  }
+
+  return left;
+}
+
+// snap_set_fault_around sets how many pages a write fault may copy ahead of
+// itself, 0 turns fault-around off.
+void snap_set_fault_around(struct heap_header *heap, int max_pages) {
+  use_heap(heap);
+
+  if (max_pages < 0) {
+    max_pages = 0;
+  } else if (max_pages > FAULT_AROUND_MAX) {
+    max_pages = FAULT_AROUND_MAX;
+  }
+
+  rs->fault_around = max_pages;
+}
+
+void snap_get_stats(struct heap_header *heap, struct snap_stats *stats) {
+  use_heap(heap);
+  *stats = rs->stats;
+}
+
+// snap_set_precow sets how many hot pages snap_begin_mut may copy up front,
+// 0 turns it off.
+void snap_set_precow(struct heap_header *heap, int max_pages) {
+  use_heap(heap);
+
+  if (max_pages < 0) {
+    max_pages = 0;
+  } else if (max_pages > HOT_PAGES) {
+    max_pages = HOT_PAGES;
+  }
+
+  rs->precow = max_pages;
+}
+
+// snap_set_deltas sets whether commits keep the old versions of the pages
+// they changed as deltas rather than whole copies.
+void snap_set_deltas(struct heap_header *heap, int enabled) {
+  use_heap(heap);
+  rs->deltas = enabled;
+}
+
+// snap_set_hugepages turns huge page mode on or off. Turning it on grows the
+// heap out to whole huge pages straight away, off only stops it growing in
+// huge steps. Returns -1 and stays off when the kernel won't do huge pages
+// for the db, which is the case unless it's on a tmpfs that allows them.
+int snap_set_hugepages(struct heap_header *heap, int enabled) {
+  use_writable_heap(heap);
+
+  rs->hugepages = enabled;
+
+  if (!enabled) {
+    return 0;
+  }
+
+  if (advise_hugepages(heap)) {
+    rs->hugepages = 0;
+    return -1;
+  }
+
+  // growing advises the rest of the heap too
+  if (heap->size % HUGE_PAGE_SIZE &&
+      expand_heap_space(heap, heap_size_for(heap->size) - heap->size)) {
+    rs->hugepages = 0;
+    return -1;
+  }
+
+  return 0;
+}
+
+// snap_set_cow_granule sets how many pages a write fault copies at once,
+// rounded down to a power of two. 1 copies just the page written to.
+void snap_set_cow_granule(struct heap_header *heap, int pages) {
+  use_heap(heap);
+
+  if (pages < 1) {
+    pages = 1;
+  } else if (pages > COW_GRANULE_MAX) {
+    pages = COW_GRANULE_MAX;
+  }
+
+  int granule = 1;
+  while (granule * 2 <= pages) {
+    granule *= 2;
+  }
+
+  rs->cow_granule = granule;
+}
+
+// snap_set_verify has every commit check samples of the pages it committed
+// and samples of the protection table's entries, 0 turns it off.
+void snap_set_verify(struct heap_header *heap, int samples) {
+  use_heap(heap);
+
+  if (samples < 0) {
+    samples = 0;
+  } else if (samples > VERIFY_SAMPLES_MAX) {
+    samples = VERIFY_SAMPLES_MAX;
+  }
+
+  rs->verify_samples = samples;
+
+  if (!rs->verify_rand) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    rs->verify_rand = ((uint64_t)now.tv_sec << 32 ^ now.tv_nsec) | 1;
+  }
+}
+
+void snap_set_quota(
+    struct heap_header *heap,
+    size_t txn_bytes,
+    size_t txn_pages,
+    size_t db_bytes) {
+  use_heap(heap);
+
+  rs->quota_txn_bytes = txn_bytes;
+  rs->quota_txn_pages = txn_pages;
+  rs->quota_db_bytes = db_bytes;
+}
+
+// snap_durable_gen returns the newest generation known to have reached the
+// disk, or -1 when durability isn't being tracked.
+int snap_durable_gen(struct heap_header *heap) {
+  use_heap(heap);
+
+  if (rs->durability == SNAP_DURABILITY_NONE) {
+    return -1;
+  }
+
+  return rs->durable_gen;
+}
+
+// snap_out_of_room says whether the current or last transaction wrote to a
+// page there was no room to copy. Those writes are lost at commit so it should
+// be rolled back.
+int snap_out_of_room(struct heap_header *heap) {
+  use_heap(heap);
+  return rs->out_of_room;
+}
+
+int snap_commit(struct heap_header *heap) {
+  use_writable_heap(heap);
+
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  if (tracer) {
+    trace_call(heap, TRACE_COMMIT, NULL, 0, NULL);
+  }
+
+  PROBE1(commit_start, snap_gen_id(heap, heap->working));
+
+  full_verify(0);
+
+  LOG("BEGINNING COMMIT\n");
+
+  drop_stand_ins(heap);
+
+  // A page can be written and still end up the way it started, like a mark
+  // bit set and cleared again by a gc. There's no point keeping a version of
+  // it so it goes back to where it was and the copy gets reused.
+  int elided = 0;
+  for (size_t i = 0; i < rs->copies_len; i++) {
+    struct copied_page *c = &rs->copies[i];
+    struct page *p = snap_at(heap, c->live);
+    struct page *copy = snap_at(heap, c->copy);
+
+    if (page_changed(p, copy)) {
+      note_written(p);
+      rs->stats.pages_committed += p->pages;
+
+      int encoded =
+          rs->deltas && encode_copy(copy, p, snap_gen_id(heap, heap->working));
+
+      // the copy is history now, only a checkout can reach it. Pushing it to
+      // swap would hold up the commit though.
+      if (!encoded && !rs->wal) {
+        release_pages(copy, copy->pages * PAGE_SIZE);
+      }
+
+      if (c->reason == COPY_PRECOW) {
+        rs->stats.precow_hits++;
+      } else if (c->reason == COPY_FAULT_AROUND) {
+        rs->stats.faults_avoided++;
+      }
+    } else {
+      if (c->reason == COPY_PRECOW) {
+        rs->stats.precow_misses++;
+      }
+
+      elide_copy(p, copy);
+      elided++;
+    }
+  }
+  rs->copies_len = 0;
+  rs->stats.pages_elided += elided;
+  rs->stats.pages_committed += rs->txn_pages;
+
+  LOG("elided %d unchanged pages\n", elided);
+
+  LOG("update commit bit\n");
+
+  int flagged = 0;
+  walk_nodes(snap_at(heap, heap->working), set_committed, &flagged);
+
+  LOG("committed %d nodes\n", flagged);
+
+  for (int i = 0; i < HOT_PAGES; i++) {
+    rs->hot[i].history = (rs->hot[i].history << 1) | rs->hot[i].written;
+    rs->hot[i].written = 0;
+  }
+
+  if (rs->durability == SNAP_DURABILITY_SYNC) {
+    // the generation has to be on disk before the header points at it
+    sync_dirty(heap);
+  }
+
+  heap->committed = heap->working;
+
+  durable_point(heap, 1);
+
+  // the first sample catches what it took to get the heap going, which is
+  // exactly what the next cold start wants prefetched.
+  if (rs->ws && rs->ws_commits++ % WS_SAMPLE_COMMITS == 0) {
+    ws_sample(rs->ws, heap, heap->size);
+    ws_save(rs->ws);
+  }
+
+  full_verify(1);
+
+  sample_verify(heap);
+
+  LOG("COMMIT COMPLETE\n");
+
+  rs->stats.commit_ns += elapsed_ns(start);
+
+  PROBE2(commit_done, snap_gen_id(heap, heap->committed), elided);
+
+  return snap_gen_id(heap, heap->committed);
+}
+
+// gen_ancestors sets the bit of every generation between n and target in
+// ancestors, returning whether target is under n at all.
+int gen_ancestors(
+    struct node *n,
+    struct generation *target,
+    unsigned char *ancestors) {
+  rs->stats.nodes_walked++;
+
+  if (n->type != SNAP_NODE_GENERATION) {
+    return 0;
+  }
+
+  struct generation *g = (struct generation *)n;
+
+  int found = g == target;
+  for (int i = 0; i < GENERATION_CHILDREN && !found; i++) {
+    if (g->c[i]) {
+      found = gen_ancestors(snap_at(H, g->c[i]), target, ancestors);
+    }
+  }
+
+  if (found) {
+    ancestors[g->gen / 8] |= 1 << (g->gen % 8);
+  }
+
+  return found;
+}
+
+struct up_to_gen_state {
+  unsigned char *ancestors;
+  struct page **p;
+  int count;
+};
+// add_version puts page in s in place of any older version of it.
+void add_version(struct up_to_gen_state *s, struct page *page) {
+  if (s->p) {
+    for (int i = 0; i < s->count; i++) {
+      if (s->p[i]->real_addr == page->real_addr) {
+        s->p[i] = page;
+        return;
+      }
+    }
+
+    s->p[s->count] = page;
+  }
+
+  s->count++;
+}
+
+// versions_in_gen adds every page version in g, and in the nodes
+// new_gen_between split it into (they all have its number), to s. Returns
+// g's child on the way to the generation being checked out, if any.
+//
+// A generation that was rolled back or checked out away from is older than
+// the ones after it but none of its pages are theirs, and a child can end
+// up in a slot before some of its parent's pages, so the versions are taken
+// a generation at a time down the path rather than in tree order.
+struct generation *versions_in_gen(
+    struct generation *g,
+    int gen,
+    struct up_to_gen_state *s) {
+  rs->stats.nodes_walked++;
+
+  struct generation *next = NULL;
+
+  for (int i = 0; i < GENERATION_CHILDREN; i++) {
+    if (!g->c[i]) {
+      continue;
+    }
+
+    struct node *n = snap_at(H, g->c[i]);
+
+    if (n->type != SNAP_NODE_GENERATION) {
+      rs->stats.nodes_walked++;
+      add_version(s, (struct page *)n);
+      continue;
+    }
+
+    struct generation *child = (struct generation *)n;
+
+    if (child->gen == gen) {
+      struct generation *found = versions_in_gen(child, gen, s);
+      if (found) {
+        next = found;
+      }
+    } else if (s->ancestors[child->gen / 8] & (1 << (child->gen % 8))) {
+      next = child;
+    }
+  }
+
+  return next;
+}
+
+struct gen_from_id {
+  int id;
+  struct generation *g;
+};
+int first_gen_for_id(struct node *n, void *d) {
+  if (n->type == SNAP_NODE_GENERATION) {
+    struct generation *g = (struct generation *)n;
+    struct gen_from_id *f = (struct gen_from_id *)d;
+
+    if (g->gen == f->id) {
+      f->g = g;
+      return WALK_EXIT;
+    }
+  }
+
+  return WALK_CONTINUE;
+}
+
+void snap_checkout(struct heap_header *heap, int genid) {
+  use_writable_heap(heap);
+
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  PROBE2(checkout_start, snap_gen_id(heap, heap->committed), genid);
+
+  LOG("BEGINNING CHECKOUT\n");
+
+  full_verify(1);
+
+  assert(heap->committed == heap->working);
+
+  struct gen_from_id fid = {.id = genid, .g = NULL};
+  walk_nodes(snap_at(heap, heap->root), first_gen_for_id, &fid);
+  assert(fid.g != NULL);
+  assert(fid.g->gen == genid);
+
+  if (snap_gen_id(heap, heap->committed) == genid) {
+    LOG("CHECKOUT DONE\n");
+    rs->stats.checkout_ns += elapsed_ns(start);
+    PROBE2(checkout_done, genid, 0);
+    return;
+  }
+
+  unsigned char ancestors[heap->last_gen_index / 8 + 1];
+  memset(ancestors, 0, sizeof(ancestors));
+  gen_ancestors(snap_at(heap, heap->root), fid.g, ancestors);
+
+  struct up_to_gen_state s = {
+      .ancestors = ancestors,
+      .p = NULL,
+      .count = 0,
+  };
+  for (struct generation *g = snap_at(heap, heap->root); g;) {
+    g = versions_in_gen(g, g->gen, &s);
+  }
+
+  struct page *to_swap[s.count];
+
+  s = (struct up_to_gen_state){
+      .ancestors = ancestors,
+      .p = to_swap,
+      .count = 0,
+  };
+  for (struct generation *g = snap_at(heap, heap->root); g;) {
+    g = versions_in_gen(g, g->gen, &s);
+  }
+
+  // every version being checked out has to be a whole page first
+  for (int i = 0; i < s.count; i++) {
+    if (s.p[i]->i.type != SNAP_NODE_PAGE) {
+      s.p[i] = materialize((struct node *)s.p[i]);
+    }
+  }
+
+  full_verify(1);
+
+  LOG("swapping %d pages\n", s.count);
+
+  for (int i = 0; i < s.count; i++) {
+    struct page *real = snap_at(heap, s.p[i]->real_addr);
+
+    if (s.p[i] != real) {
+      struct node_rel rel1 = {
+          .parent = NULL,
+          .index = -1,
+          .child = (struct node *)s.p[i],
+      };
+      walk_nodes(snap_at(heap, heap->root), find_parent, &rel1);
+      assert(rel1.parent != NULL);
+      assert(rel1.index != -1);
+      assert(rel1.parent->type == SNAP_NODE_GENERATION);
+
+      struct node_rel rel2 = {
+          .parent = NULL,
+          .index = -1,
+          .child = (struct node *)real,
+      };
+      walk_nodes(snap_at(heap, heap->root), find_parent, &rel2);
+      assert(rel2.parent != NULL);
+      assert(rel2.index != -1);
+      assert(rel2.parent->type == SNAP_NODE_GENERATION);
+
+      ((struct generation *)rel1.parent)->c[rel1.index] = s.p[i]->real_addr;
+      ((struct generation *)rel2.parent)->c[rel2.index] =
+          snap_offset(heap, s.p[i]);
+
+      mark_dirty(rel1.parent, sizeof(struct generation));
+      mark_dirty(rel2.parent, sizeof(struct generation));
+
+      page_swap(heap, s.p[i], real);
+
+      // what was checked out before is history again
+      release_pages(s.p[i], s.p[i]->pages * PAGE_SIZE);
+    }
+  }
+
+  heap->committed = snap_offset(heap, fid.g);
+  heap->working = heap->committed;
+
+  durable_point(heap, 0);
+
+  LOG("COMPLETED CHECKOUT\n");
+
+  rs->stats.checkout_ns += elapsed_ns(start);
+
+  PROBE2(checkout_done, genid, s.count);
+}
+
+// discard_pages frees every page g and the same id generations under it hold
+// and leaves them empty. Returns how many pages it freed.
+size_t discard_pages(struct heap_header *heap, struct generation *g) {
+  size_t freed = 0;
+
+  for (int i = 0; i < GENERATION_CHILDREN; i++) {
+    if (!g->c[i]) {
+      continue;
+    }
+
+    struct node *n = snap_at(heap, g->c[i]);
+
+    if (n->type == SNAP_NODE_GENERATION) {
+      assert(
+          ((struct generation *)n)->gen == g->gen &&
+          "only a generation nothing branched off can be discarded");
+      freed += discard_pages(heap, (struct generation *)n);
+    } else if (n->type == SNAP_NODE_PAGE) {
+      freed += ((struct page *)n)->pages;
+      free_page(heap, (struct page *)n);
+    }
+
+    g->c[i] = 0;
+  }
+
+  mark_dirty(g, sizeof(struct generation));
+
+  return freed;
+}
+
+// snap_discard gives the pages generation genid holds back to the free list,
+// for a transaction that was only committed to be rolled back. It has to be
+// the generation just checked out away from, before anything else begins:
+// its new pages and the versions the checkout swapped out of the way haven't
+// been write protected yet. The generation is left empty, checking it out
+// again gets its parent's state.
+void snap_discard(struct heap_header *heap, int genid) {
+  use_writable_heap(heap);
+
+  assert(heap->committed == heap->working);
+  assert(snap_gen_id(heap, heap->committed) != genid);
+
+  struct gen_from_id fid = {.id = genid, .g = NULL};
+  walk_nodes(snap_at(heap, heap->root), first_gen_for_id, &fid);
+  assert(fid.g != NULL);
+
+  size_t freed = discard_pages(heap, fid.g);
+
+  rs->stats.pages_discarded += freed;
+
+  LOG("discarded %lu pages of gen %d\n", (unsigned long)freed, genid);
+}
+
+// snap_hibernate gives as much of the heap back to the kernel as it'll take,
+// for when it's going to sit idle for a while. Everything comes back as it's
+// touched again.
+void snap_hibernate(struct heap_header *heap) {
+  use_heap(heap);
+
+  assert(heap->committed == heap->working);
+
+  // anything still waiting to be flushed goes first so none of it is left
+  // in memory that's about to be let go
+  snap_sync(heap);
+
+  release_pages(heap, heap->size);
+
+  LOG("HIBERNATED\n");
+}
+
+// snap_compact compresses the old page versions in generations at least
+// min_age generations older than the newest one, they're decompressed again
+// whenever a checkout needs them. Returns how many got compressed.
+int snap_compact(struct heap_header *heap, int min_age) {
+  use_writable_heap(heap);
+
+  LOG("BEGINNING COMPACT\n");
+
+  full_verify(1);
+
+  assert(heap->committed == heap->working);
+
+  int max_gen = heap->last_gen_index - min_age;
+  if (max_gen < 0) {
+    return 0;
+  }
+
+  // pages too big to fit in an arena aren't compressed so nothing bigger than
+  // one ever comes out
+  unsigned char *buf = malloc(DELTA_ARENA_PAGES * PAGE_SIZE);
+  if (!buf) {
+    fprintf(stderr, "no memory to compact with\n");
+    return -1;
+  }
+
+  int packed = compact_gen(snap_at(heap, heap->root), max_gen, buf);
+
+  free(buf);
+
+  durable_point(heap, 0);
+
+  LOG("COMPACTED %d PAGES\n", packed);
+
+  return packed;
+}
+
+// find_view_end finds where the last home page ends, which is as far as the
+// checked out view goes.
+int find_view_end(struct node *n, void *d) {
+  char **end = d;
+
+  if (n->type != SNAP_NODE_PAGE) {
+    return WALK_CONTINUE;
+  }
+
+  struct page *p = (struct page *)n;
+  char *p_end = (char *)p + p->pages * PAGE_SIZE;
+
+  if (snap_at(H, p->real_addr) == p && p_end > *end) {
+    *end = p_end;
+  }
+
+  return WALK_CONTINUE;
+}
+
+struct relayout {
+  char *view_end;
+
+  // where each arena that had to move went
+  struct map *arenas;
+  char **arena_to;
+  size_t arenas_len;
+
+  // what was moved out of the view, to be punched out of the file
+  struct map *vacated;
+  size_t vacated_len;
+  size_t vacated_cap;
+
+  int moved;
+};
+
+void vacate(struct relayout *r, void *start, size_t len) {
+  if (r->vacated_len == r->vacated_cap) {
+    r->vacated_cap = r->vacated_cap ? r->vacated_cap * 2 : 64;
+    r->vacated = realloc(r->vacated, r->vacated_cap * sizeof(struct map));
+    if (!r->vacated) {
+      fprintf(stderr, "no memory to relayout with\n");
+      exit(1);
+    }
+  }
+
+  r->vacated[r->vacated_len++] = (struct map){.start = start, .len = len};
+}
+
+// moved_to translates an address inside an arena that's been moved to where
+// it is now.
+char *moved_to(struct relayout *r, char *at) {
+  for (size_t i = 0; i < r->arenas_len; i++) {
+    char *from = r->arenas[i].start;
+
+    if (at >= from && at < from + r->arenas[i].len) {
+      return r->arena_to[i] + (at - from);
+    }
+  }
+
+  return at;
+}
+
+// relayout_gen moves every old page version under g that sits inside the
+// view out past it, and points deltas and compressed versions at wherever
+// their arena went.
+void relayout_gen(struct generation *g, struct relayout *r) {
+  for (int i = 0; i < GENERATION_CHILDREN; i++) {
+    struct node *n = snap_at(H, g->c[i]);
+    if (!n) {
+      continue;
+    }
+
+    if (n->type == SNAP_NODE_GENERATION) {
+      relayout_gen((struct generation *)n, r);
+      continue;
+    }
+
+    char *to = (char *)n;
+
+    if (n->type != SNAP_NODE_PAGE) {
+      to = moved_to(r, to);
+    } else if (
+        snap_at(H, ((struct page *)n)->real_addr) != n &&
+        (char *)n < r->view_end) {
+      size_t size = ((struct page *)n)->pages * PAGE_SIZE;
+
+      to = (char *)bump_page(H, ((struct page *)n)->pages);
+      if (!to) {
+        exit(1);
+      }
+
+      memcpy(to, n, size);
+      mark_dirty(to, size);
+
+      vacate(r, n, size);
+      r->moved += size / PAGE_SIZE;
+    }
+
+    if (to != (char *)n) {
+      g->c[i] = snap_offset(H, to);
+      mark_dirty(g, sizeof(struct generation));
     }
   }
-
-  return WALK_CONTINUE;
 }
 
-void snap_checkout(struct heap_header *heap, int genid) {
-  LOG("BEGINNING CHECKOUT\n");
+// snap_relayout packs the checked out view together at the front of the heap
+// file so reading it back goes in order, which readahead is much better at.
+// Home pages can't move since whatever the user keeps in them points at
+// them, so instead every old page version and delta arena mixed in with them
+// is moved out past the last one. The ranges they leave behind are punched
+// out of the file and never reused. Returns how many pages were moved.
+int snap_relayout(struct heap_header *heap) {
+  use_writable_heap(heap);
+
+  LOG("BEGINNING RELAYOUT\n");
 
   full_verify(1);
 
   assert(heap->committed == heap->working);
 
-  struct gen_from_id fid = {.id = genid, .g = NULL};
-  walk_nodes((struct node *)heap->root, first_gen_for_id, &fid);
-  assert(fid.g != NULL);
-  assert(fid.g->gen == genid);
+  struct relayout r = {.view_end = (char *)heap};
+  walk_nodes(snap_at(heap, heap->root), find_view_end, &r.view_end);
 
-  if (heap->committed->gen == genid) {
-    LOG("CHECKOUT DONE\n");
-    return;
+  // arenas go first so the old versions they hold can be pointed at their
+  // new place while walking the tree
+  size_t arenas = 0;
+  for (struct delta_arena *a = snap_at(heap, heap->deltas); a;
+       a = snap_at(heap, a->next)) {
+    arenas++;
   }
 
-  struct up_to_gen_state s = {
-      .max_gen = genid,
-      .p = NULL,
-      .count = 0,
-  };
-  walk_nodes((struct node *)heap->root, pages_up_to_gen, &s);
+  r.arenas = malloc((arenas + 1) * sizeof(struct map));
+  r.arena_to = malloc((arenas + 1) * sizeof(char *));
+  if (!r.arenas || !r.arena_to) {
+    fprintf(stderr, "no memory to relayout with\n");
+    free(r.arenas);
+    free(r.arena_to);
+    return -1;
+  }
 
-  struct page *to_swap[s.count];
+  for (struct delta_arena *a = snap_at(heap, heap->deltas); a;
+       a = snap_at(heap, a->next)) {
+    if ((char *)a >= r.view_end) {
+      continue;
+    }
 
-  s = (struct up_to_gen_state){
-      .max_gen = genid,
-      .p = to_swap,
-      .count = 0,
-  };
-  walk_nodes((struct node *)heap->root, pages_up_to_gen, &s);
+    size_t size = DELTA_ARENA_PAGES * PAGE_SIZE;
+    struct delta_arena *to =
+        (struct delta_arena *)bump_page(heap, DELTA_ARENA_PAGES);
+    if (!to) {
+      exit(1);
+    }
 
-  full_verify(1);
+    memcpy(to, a, size);
+    to->real_addr = snap_offset(heap, to);
+    mark_dirty(to, size);
 
-  LOG("swapping %d pages\n", s.count);
+    r.arenas[r.arenas_len] = (struct map){.start = a, .len = size};
+    r.arena_to[r.arenas_len++] = (char *)to;
 
-  for (int i = 0; i < s.count; i++) {
-    if (s.p[i] != s.p[i]->real_addr) {
-      struct node_rel rel1 = {
-          .parent = NULL,
-          .index = -1,
-          .child = (struct node *)s.p[i],
-      };
-      walk_nodes((struct node *)heap->root, find_parent, &rel1);
-      assert(rel1.parent != NULL);
-      assert(rel1.index != -1);
-      assert(rel1.parent->type == SNAP_NODE_GENERATION);
+    vacate(&r, a, size);
+    r.moved += DELTA_ARENA_PAGES;
+  }
 
-      struct node_rel rel2 = {
-          .parent = NULL,
-          .index = -1,
-          .child = (struct node *)s.p[i]->real_addr,
-      };
-      walk_nodes((struct node *)heap->root, find_parent, &rel2);
-      assert(rel2.parent != NULL);
-      assert(rel2.index != -1);
-      assert(rel2.parent->type == SNAP_NODE_GENERATION);
+  for (snap_off *link = &heap->deltas; *link;) {
+    *link = snap_offset(heap, moved_to(&r, snap_at(heap, *link)));
+    link = &((struct delta_arena *)snap_at(heap, *link))->next;
+  }
+  mark_dirty(heap, sizeof(struct heap_header));
+
+  relayout_gen(snap_at(heap, heap->root), &r);
+
+  // free pages in the view would only get filled with old versions again
+  for (snap_off *link = &heap->free_pages; *link;) {
+    struct page *p = snap_at(heap, *link);
+
+    if ((char *)p < r.view_end) {
+      *link = p->real_addr;
+      mark_dirty(link, sizeof(*link));
+      vacate(&r, p, p->pages * PAGE_SIZE);
+    } else {
+      link = &p->real_addr;
+    }
+  }
+
+  // the new layout has to be on disk before anything it replaced can be
+  // thrown away, whatever the durability. Without any, nothing kept track of
+  // what was written, but msync only writes back pages that are dirty so the
+  // whole mapping can go through it.
+  durable_point(heap, 0);
+  snap_sync(heap);
+  if (rs->durability == SNAP_DURABILITY_NONE) {
+    msync_range(heap->map_start, heap->size);
+  }
+
+  if (fdatasync(rs->db_fd)) {
+    fprintf(stderr, "failed to sync heap %s\n", strerror(errno));
+    exit(3);
+  }
 
-      ((struct generation *)rel1.parent)->c[rel1.index] =
-          (struct node *)s.p[i]->real_addr;
-      ((struct generation *)rel2.parent)->c[rel2.index] = (struct node *)s.p[i];
+  qsort(r.vacated, r.vacated_len, sizeof(struct map), cmp_map_start);
 
-      page_swap(heap, s.p[i], s.p[i]->real_addr);
+  // copies are mostly made in runs, so most of what was vacated is next to
+  // something else that was and can go in one go
+  size_t ranges = 0;
+  for (size_t i = 0; i < r.vacated_len; i++) {
+    struct map *last = ranges ? &r.vacated[ranges - 1] : NULL;
+
+    if (last && (char *)last->start + last->len == r.vacated[i].start) {
+      last->len += r.vacated[i].len;
+    } else {
+      r.vacated[ranges++] = r.vacated[i];
     }
   }
 
-  heap->committed = fid.g;
-  heap->working = fid.g;
+  for (size_t i = 0; i < ranges; i++) {
+    struct map *v = &r.vacated[i];
 
-  LOG("COMPLETED CHECKOUT\n");
+    if (!fallocate(
+            rs->db_fd,
+            FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+            (char *)v->start - (char *)heap,
+            v->len)) {
+      rs->stats.pages_punched += v->len / PAGE_SIZE;
+    }
+
+    // the shared mapping already sees the hole, a private one has to be told
+    release_pages(v->start, v->len);
+  }
+
+  free(r.arenas);
+  free(r.arena_to);
+  free(r.vacated);
+
+  rs->stats.pages_relocated += r.moved;
+
+  full_verify(1);
+
+  LOG("RELAYOUT MOVED %d PAGES\n", r.moved);
+
+  return r.moved;
 }
 
 int snap_begin_mut(struct heap_header *heap) {
-#ifdef SNAP_EVENT_LOG_FILE
-  fprintf(event_log, "snap_begin_mut\n");
-  fflush(event_log);
-#endif
+  use_writable_heap(heap);
+
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  if (tracer) {
+    trace_call(heap, TRACE_BEGIN_MUT, NULL, 0, NULL);
+  }
+
+  PROBE1(begin_start, snap_gen_id(heap, heap->committed));
 
   LOG("BEGINNING MUT\n");
 
   full_verify(1);
 
+  rs->last_fault_end = NULL;
+  rs->fault_window = 0;
+  rs->copies_len = 0;
+  rs->txn_bytes = 0;
+  rs->txn_pages = 0;
+  rs->over_quota = 0;
+  rs->out_of_room = 0;
+
+  if (snap_sync_due(heap) == 0) {
+    sync_generation(heap);
+  }
+
   LOG("rev: %d, generation at: %p\n",
-      heap->working->gen,
+      snap_gen_id(heap, heap->working),
       (void *)heap->working);
 
   struct tree_slot slot = {.index = -1, .target = NULL};
-  walk_nodes((struct node *)heap->committed, first_free_slot, &slot);
+  walk_nodes(snap_at(heap, heap->committed), first_free_slot, &slot);
 
   if (slot.target == NULL) {
-    new_gen_between(heap, heap->committed);
+    new_gen_between(heap, snap_at(heap, heap->committed));
     slot = (struct tree_slot){.index = -1, .target = NULL};
-    walk_nodes((struct node *)heap->committed, first_free_slot, &slot);
+    walk_nodes(snap_at(heap, heap->committed), first_free_slot, &slot);
   }
 
   assert(slot.target != NULL);
@@ -1336,20 +3899,76 @@ int snap_begin_mut(struct heap_header *heap) {
 
   struct generation *next = new_gen(heap, ++heap->last_gen_index);
 
-  slot.target->c[slot.index] = (struct node *)next;
-  heap->working = next;
+  slot.target->c[slot.index] = snap_offset(heap, next);
+  mark_dirty(slot.target, sizeof(struct generation));
+  heap->working = snap_offset(heap, next);
 
-  LOG("working now: %d\n", heap->working->gen);
+  LOG("working now: %d\n", snap_gen_id(heap, heap->working));
 
   assert(heap->working != heap->committed);
-  assert(heap->committed->gen != heap->working->gen);
+  assert(
+      snap_gen_id(heap, heap->committed) != snap_gen_id(heap, heap->working));
 
   struct table mm = {0};
 
-  walk_nodes((struct node *)heap->root, pages_in_gen, &mm);
+  walk_nodes(snap_at(heap, heap->root), pages_in_gen, &mm);
+  qsort(mm.m, mm.len, sizeof(struct map), cmp_map_start);
+
+  // Pages most transactions write to get copied now rather than on their
+  // first write. They're left writable by the same protection update that
+  // locks up the rest of the committed pages.
+  snap_off hot[HOT_PAGES];
+  int nhot = 0;
+  for (int i = 0; i < HOT_PAGES && nhot < rs->precow; i++) {
+    if (is_hot(&rs->hot[i])) {
+      hot[nhot++] = rs->hot[i].page;
+    }
+  }
+
+  struct page *precow[HOT_PAGES];
+  int nprecow = 0;
+  for (size_t i = 0; i < mm.len && nprecow < nhot; i++) {
+    snap_off off = snap_offset(heap, mm.m[i].start);
+    for (int j = 0; j < nhot; j++) {
+      if (hot[j] == off) {
+        mm.m[i].w = 1;
+        precow[nprecow++] = mm.m[i].start;
+        break;
+      }
+    }
+  }
+
   merge_in_table(mm);
 
-  return heap->working->gen;
+  // ones there's no room to copy wait for a fault like any other page
+  struct table *ro = &mm;
+  ro->len = 0;
+  int copied = 0;
+
+  for (int i = 0; i < nprecow; i++) {
+    if (cow_page(precow[i], COPY_PRECOW)) {
+      copied++;
+      continue;
+    }
+
+    ro->m[ro->len++] = (struct map){
+        .w = 0,
+        .start = precow[i],
+        .len = precow[i]->pages * PAGE_SIZE,
+    };
+  }
+
+  if (ro->len) {
+    merge_in_table(*ro);
+  }
+
+  rs->stats.pages_copied += copied;
+  rs->stats.precow_pages += copied;
+  rs->stats.begin_mut_ns += elapsed_ns(start);
+
+  PROBE2(begin_done, snap_gen_id(heap, heap->working), copied);
+
+  return snap_gen_id(heap, heap->working);
 }
 
 void *page_head_end(struct page *p) {
@@ -1361,7 +3980,7 @@ void *page_data_start(struct page *p) {
     return (char *)p + (PAGE_SIZE * p->pages) - 1;
   }
 
-  return (char *)p->c[p->len - 1] - 1;
+  return (char *)snap_segment_at(p, p->len - 1) - 1;
 }
 
 // can the page fit an additional segment of size n
@@ -1370,6 +3989,15 @@ int page_can_fit(struct page *p, size_t n) {
          (char *)((n + sizeof(void *) + sizeof(struct segment)));
 }
 
+// pages_to_fit is how big a new page has to be for page_can_fit to let a
+// segment of size n into it.
+size_t pages_to_fit(size_t n) {
+  size_t used = sizeof(struct page) + sizeof(size_t) + sizeof(void *) +
+                sizeof(struct segment) + n + 1;
+
+  return used / PAGE_SIZE + 1;
+}
+
 struct segment *page_new_segment(struct page *p, size_t bytes) {
   assert(page_can_fit(p, bytes));
 
@@ -1383,12 +4011,53 @@ struct segment *page_new_segment(struct page *p, size_t bytes) {
       .size = bytes,
   };
 
-  p->c[p->len] = seg;
+  p->c[p->len] = (char *)seg - (char *)p;
   p->len++;
 
   return seg;
 }
 
+int count_usage(struct node *n, void *d) {
+  struct snap_usage *u = d;
+
+  if (n->type == SNAP_NODE_GENERATION) {
+    u->generations++;
+    return WALK_CONTINUE;
+  }
+
+  struct page *p = (struct page *)n;
+  u->versions += p->pages;
+
+  // only the version sitting at home is part of what's checked out
+  if (n->type != SNAP_NODE_PAGE || snap_at(H, p->real_addr) != p) {
+    return WALK_CONTINUE;
+  }
+
+  u->pages += p->pages;
+  u->unused_bytes += (char *)page_data_start(p) + 1 - (char *)page_head_end(p);
+
+  for (int i = 0; i < p->len; i++) {
+    struct segment *seg = snap_segment_at(p, i);
+
+    if (seg->used) {
+      u->live_bytes += seg->size;
+    } else {
+      u->freed_bytes += seg->size;
+    }
+  }
+
+  return WALK_CONTINUE;
+}
+
+// snap_get_usage walks the whole tree to see how full the checked out
+// generation's pages are and how much history is kept around it.
+void snap_get_usage(struct heap_header *heap, struct snap_usage *usage) {
+  use_heap(heap);
+
+  *usage = (struct snap_usage){0};
+  walk_nodes(snap_at(heap, heap->root), count_usage, usage);
+}
+
 struct gen_match_info {
   int target;
   struct generation *mismatch;
@@ -1423,6 +4092,46 @@ int first_page_fit(struct node *n, void *d) {
   return WALK_CONTINUE;
 }
 
+// over_quota checks whether handing out size bytes, in a new page of pages
+// pages if that's what it'll take, would go over any of the heap's quotas.
+int over_quota(struct heap_header *heap, size_t size, size_t pages) {
+  // an interpreter needs some memory to report running out of it, without any
+  // it can end up retrying forever instead
+  size_t reserve = rs->over_quota ? QUOTA_RESERVE : 0;
+
+  if (rs->quota_txn_bytes &&
+      rs->txn_bytes + size > rs->quota_txn_bytes + reserve) {
+    return 1;
+  }
+
+  if (!pages) {
+    return 0;
+  }
+
+  if (rs->quota_txn_pages &&
+      rs->txn_pages + pages > rs->quota_txn_pages + reserve / PAGE_SIZE) {
+    return 1;
+  }
+
+  // half the reserve is kept back for copies, a write can't be refused
+  if (rs->quota_db_bytes &&
+      !db_has_room(heap, pages, rs->quota_db_bytes + reserve / 2)) {
+    return 1;
+  }
+
+  return 0;
+}
+
+// refuse_quota fails an allocation for going over a quota.
+void *refuse_quota(size_t size) {
+  LOG("refusing %lu bytes, over quota\n", (unsigned long)size);
+
+  rs->over_quota = 1;
+  rs->stats.quota_failures++;
+
+  return NULL;
+}
+
 void *_snap_malloc(struct heap_header *heap, size_t size) {
   if (!size) {
     return NULL;
@@ -1432,7 +4141,11 @@ void *_snap_malloc(struct heap_header *heap, size_t size) {
 
   assert(heap->working != heap->committed);
 
-  struct generation *g = heap->working;
+  if (over_quota(heap, size, 0)) {
+    return refuse_quota(size);
+  }
+
+  struct generation *g = snap_at(heap, heap->working);
 
   struct gen_match_info m = {.target = g->gen, .mismatch = NULL};
   walk_nodes((struct node *)g, all_gen_match, &m);
@@ -1442,20 +4155,34 @@ void *_snap_malloc(struct heap_header *heap, size_t size) {
   walk_nodes((struct node *)g, first_page_fit, &fit);
 
   if (fit.p == NULL) {
+    size_t pages = pages_to_fit(size);
+
+    if (over_quota(heap, size, pages)) {
+      return refuse_quota(size);
+    }
+
     struct tree_slot slot = {.index = -1, .target = NULL};
     walk_nodes((struct node *)g, first_free_slot, &slot);
 
     if (slot.target == NULL) {
       new_gen_between(heap, g);
       slot = (struct tree_slot){.index = -1, .target = NULL};
-      walk_nodes((struct node *)heap->working, first_free_slot, &slot);
+      walk_nodes(snap_at(heap, heap->working), first_free_slot, &slot);
     }
 
     assert(slot.target != NULL);
     assert(slot.index != -1);
 
-    slot.target->c[slot.index] =
-        (struct node *)new_page(heap, (size / PAGE_SIZE) + 1);
+    // the file may not have been able to grow even under its quota
+    struct page *p = new_page(heap, pages);
+    if (!p) {
+      return refuse_quota(size);
+    }
+
+    slot.target->c[slot.index] = snap_offset(heap, p);
+    mark_dirty(slot.target, sizeof(struct generation));
+
+    rs->txn_pages += pages;
 
     fit = (struct page_fit){.size = size, .p = NULL};
     walk_nodes((struct node *)g, first_page_fit, &fit);
@@ -1466,6 +4193,9 @@ void *_snap_malloc(struct heap_header *heap, size_t size) {
 
   struct segment *s = page_new_segment(fit.p, size);
 
+  rs->txn_bytes += size;
+  rs->stats.bytes_allocated += size;
+
   full_verify(0);
 
   return (char *)s + sizeof(struct segment);
@@ -1484,50 +4214,55 @@ void _snap_free(struct heap_header *heap, void *ptr) {
   assert(s->used);
 
   struct page_from_hit phit = {.hit = ptr, .p = NULL, .index = -1};
-  walk_nodes((struct node *)heap->root, find_page, (void *)&phit);
+  walk_nodes(snap_at(heap, heap->root), find_page, (void *)&phit);
   assert(phit.p != NULL);
   assert(phit.index != -1);
 
   s->used = 0;
+  rs->stats.bytes_freed += s->size;
 
   full_verify(0);
 }
 
 void *snap_malloc(struct heap_header *heap, size_t size) {
-#ifdef SNAP_EVENT_LOG_PRECOMMITED
-  fprintf(event_log, "snap_malloc %lu\n", (unsigned long)size);
-  fflush(event_log);
-#endif
+  use_writable_heap(heap);
+
+  LOG("snap_malloc %lu\n", (unsigned long)size);
 
   if (size == 0) {
     return NULL;
   }
 
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
   void *result = _snap_malloc(heap, size);
 
-#ifdef SNAP_EVENT_LOG_FILE
-  fprintf(event_log, "snap_malloc %lu -> %p\n", (unsigned long)size, result);
-  fflush(event_log);
-#endif
+  rs->stats.malloc_ns += elapsed_ns(start);
+
+  if (tracer) {
+    trace_call(heap, TRACE_MALLOC, NULL, size, result);
+  }
 
   return result;
 }
 
 void snap_free(struct heap_header *heap, void *ptr) {
-#ifdef SNAP_EVENT_LOG_FILE
-  fprintf(event_log, "snap_free %p\n", ptr);
-  fflush(event_log);
-#endif
+  use_writable_heap(heap);
+
+  if (tracer) {
+    trace_call(heap, TRACE_FREE, ptr, 0, NULL);
+  }
+
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
 
   _snap_free(heap, ptr);
-}
 
-void *snap_realloc(struct heap_header *heap, void *ptr, size_t size) {
-#ifdef SNAP_EVENT_LOG_PRECOMMITED
-  fprintf(event_log, "snap_realloc %p %lu\n", ptr, (unsigned long)size);
-  fflush(event_log);
-#endif
+  rs->stats.malloc_ns += elapsed_ns(start);
+}
 
+void *_snap_realloc(struct heap_header *heap, void *ptr, size_t size) {
   if (!ptr) {
     return _snap_malloc(heap, size);
   }
@@ -1535,7 +4270,7 @@ void *snap_realloc(struct heap_header *heap, void *ptr, size_t size) {
   assert(heap->working != heap->committed);
 
   struct page_from_hit phit = {.hit = ptr, .p = NULL, .index = -1};
-  walk_nodes((struct node *)heap->root, find_page, (void *)&phit);
+  walk_nodes(snap_at(heap, heap->root), find_page, (void *)&phit);
   assert(phit.p != NULL);
   assert(phit.index != -1);
 
@@ -1544,23 +4279,216 @@ void *snap_realloc(struct heap_header *heap, void *ptr, size_t size) {
     return NULL;
   }
 
+  // freed space is never handed out again so moving to a smaller segment
+  // wouldn't save anything, and shrinking must not run into a quota.
+  struct segment *seg =
+      (struct segment *)((char *)ptr - sizeof(struct segment));
+  if (size <= seg->size) {
+    return ptr;
+  }
+
+  // like realloc, a failure leaves the old allocation alone
   void *result = _snap_malloc(heap, size);
-  memcpy(result, ptr, size);
+  if (!result) {
+    return NULL;
+  }
+
+  memcpy(result, ptr, seg->size);
   _snap_free(heap, ptr);
 
-#ifdef SNAP_EVENT_LOG_FILE
-  fprintf(
-      event_log,
-      "snap_realloc %p %lu -> %p\n",
-      ptr,
-      (unsigned long)size,
-      result);
-  fflush(event_log);
-#endif
+  return result;
+}
+
+void *snap_realloc(struct heap_header *heap, void *ptr, size_t size) {
+  use_writable_heap(heap);
+
+  LOG("snap_realloc %p %lu\n", ptr, (unsigned long)size);
+
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  void *result = _snap_realloc(heap, ptr, size);
+
+  rs->stats.malloc_ns += elapsed_ns(start);
+
+  if (tracer) {
+    trace_call(heap, TRACE_REALLOC, ptr, size, result);
+  }
 
   return result;
 }
 
+// verify_rand is a xorshift so picking samples doesn't disturb anyone else's
+// rand().
+uint64_t verify_rand() {
+  uint64_t x = rs->verify_rand;
+  x ^= x << 13;
+  x ^= x >> 7;
+  x ^= x << 17;
+  rs->verify_rand = x;
+
+  return x;
+}
+
+int verify_failed(const char *what, void *at) {
+  fprintf(stderr, "heap verification failed: %s at %p\n", what, at);
+  rs->stats.verify_failures++;
+
+  return 1;
+}
+
+// verify_node checks one node of the committed generation against what every
+// node has to look like. Pages get their segments checked as well, which
+// bounds the cost by the page's size.
+int verify_node(struct node *n, int gen) {
+  char *heap_end = (char *)H + H->size;
+
+  if (!n->committed) {
+    return verify_failed("node not committed", n);
+  }
+
+  if (n->type == SNAP_NODE_GENERATION) {
+    struct generation *g = (struct generation *)n;
+    if (g->gen < gen || g->gen > H->last_gen_index) {
+      return verify_failed("generation id out of order", n);
+    }
+
+    return 0;
+  }
+
+  if (n->type != SNAP_NODE_PAGE && n->type != SNAP_NODE_DELTA &&
+      n->type != SNAP_NODE_PACKED) {
+    return verify_failed("unknown node type", n);
+  }
+
+  // deltas and packed versions start out the same as a page
+  struct page *p = (struct page *)n;
+  if (p->pages < 1 || p->real_addr % PAGE_SIZE ||
+      p->real_addr + p->pages * PAGE_SIZE > H->size) {
+    return verify_failed("page outside the heap", n);
+  }
+
+  if (n->type != SNAP_NODE_PAGE) {
+    return 0;
+  }
+
+  char *end = (char *)p + p->pages * PAGE_SIZE;
+  if ((uintptr_t)p % PAGE_SIZE || end > heap_end || p->len < 0 ||
+      (char *)page_head_end(p) > end) {
+    return verify_failed("bad page header", n);
+  }
+
+  // segments are handed out from the end of the page backwards
+  char *limit = end;
+  for (int i = 0; i < p->len; i++) {
+    struct segment *s = snap_segment_at(p, i);
+
+    if ((char *)s < (char *)page_head_end(p) ||
+        (char *)s + sizeof(struct segment) + s->size > limit ||
+        (s->used != 0 && s->used != 1)) {
+      return verify_failed("bad segment", s);
+    }
+
+    limit = (char *)s;
+  }
+
+  // whatever's at home is part of the view, which the protection table has
+  // to cover
+  if (snap_at(H, p->real_addr) == p && rs->active_map.len &&
+      ((char *)p < (char *)rs->active_map.m[0].start ||
+       end > (char *)rs->active_map.m[rs->active_map.len - 1].start +
+                 rs->active_map.m[rs->active_map.len - 1].len)) {
+    return verify_failed("page outside the protection table", p);
+  }
+
+  return 0;
+}
+
+// verify_map checks entry i of the protection table against its neighbour,
+// the same as full_verify does for all of them.
+int verify_map(size_t i) {
+  struct map *m = &rs->active_map.m[i];
+
+  if (!m->len || (uintptr_t)m->start % PAGE_SIZE || m->len % PAGE_SIZE) {
+    return verify_failed("bad protection table entry", m->start);
+  }
+
+  if (i == 0) {
+    if (m->start != H->map_start) {
+      return verify_failed("protection table doesn't start the heap", m->start);
+    }
+
+    return 0;
+  }
+
+  struct map *prev = m - 1;
+  if (prev->w == m->w || (char *)prev->start + prev->len != m->start) {
+    return verify_failed("protection table entries don't line up", m->start);
+  }
+
+  return 0;
+}
+
+// sample_verify spends a bounded amount of every commit checking a few random
+// nodes of the generation it just committed, found by walking down from the
+// generation picking a child at random, and a few random entries of the
+// protection table. That keeps catching corruption cheap enough to leave on,
+// unlike full_verify.
+void sample_verify(struct heap_header *heap) {
+  if (!rs->verify_samples) {
+    return;
+  }
+
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  struct generation *committed = snap_at(heap, heap->committed);
+  int failed = 0;
+
+  for (int i = 0; i < rs->verify_samples && !failed; i++) {
+    struct node *n = (struct node *)committed;
+
+    // generations only nest as deep as they've been split
+    for (int depth = 0; n->type == SNAP_NODE_GENERATION && depth < 64;
+         depth++) {
+      struct generation *g = (struct generation *)n;
+      if (g != committed && g->gen != committed->gen) {
+        break;
+      }
+
+      int children = 0;
+      for (int c = 0; c < GENERATION_CHILDREN; c++) {
+        children += g->c[c] != 0;
+      }
+
+      if (!children) {
+        break;
+      }
+
+      int pick = verify_rand() % children;
+      for (int c = 0; c < GENERATION_CHILDREN; c++) {
+        if (g->c[c] && !pick--) {
+          n = snap_at(heap, g->c[c]);
+          break;
+        }
+      }
+
+      rs->stats.nodes_walked++;
+    }
+
+    rs->stats.verify_checks++;
+    failed = verify_node(n, committed->gen);
+  }
+
+  for (int i = 0; i < rs->verify_samples && !failed && rs->active_map.len;
+       i++) {
+    rs->stats.verify_checks++;
+    failed = verify_map(verify_rand() % rs->active_map.len);
+  }
+
+  rs->stats.verify_ns += elapsed_ns(start);
+}
+
 #ifdef FULL_VERIFY
 int segments_inside_pages(struct node *n, void *d) {
   if (n->type != SNAP_NODE_PAGE) {
@@ -1570,12 +4498,13 @@ int segments_inside_pages(struct node *n, void *d) {
   struct page *p = (struct page *)n;
 
   for (int i = 0; i < p->len; i++) {
-    if (!((char *)p->c[i] > (char *)p) ||
-        !((char *)p->c[i] < (char *)p + (p->pages * PAGE_SIZE))) {
+    struct segment *s = snap_segment_at(p, i);
+    if (!((char *)s > (char *)p) ||
+        !((char *)s < (char *)p + (p->pages * PAGE_SIZE))) {
       LOG("page verification failed!\n");
       LOG("segment %d is bad, %p should be inside %p-%p\n",
           i,
-          (void *)p->c[i],
+          (void *)s,
           (void *)p,
           (void *)((char *)p + (p->pages * PAGE_SIZE)));
       exit(1);
@@ -1601,39 +4530,39 @@ int verify_all_committed(struct node *n, void *d) {
 void full_verify(int committed) {
   if (committed == 1) {
     assert(H->working == H->committed && "expected to be committed");
-    walk_nodes((struct node *)H->root, verify_all_committed, NULL);
+    walk_nodes(snap_at(H, H->root), verify_all_committed, NULL);
   } else if (committed == 0) {
     assert(H->working != H->committed && "expected to be uncommitted");
   }
 
-  walk_nodes((struct node *)H->root, segments_inside_pages, NULL);
+  walk_nodes(snap_at(H, H->root), segments_inside_pages, NULL);
 
-  for (size_t i = 1; i < rstate.active_map.len; i++) {
+  for (size_t i = 1; i < rs->active_map.len; i++) {
     assert(
-        rstate.active_map.m[i].len > 0 &&
+        rs->active_map.m[i].len > 0 &&
         "shouldn't have any zero length maps");
   }
 
-  for (size_t i = 1; i < rstate.active_map.len; i++) {
+  for (size_t i = 1; i < rs->active_map.len; i++) {
     assert(
-        (rstate.active_map.m[0].start && (PAGE_SIZE - 1)) != 0 &&
+        (rs->active_map.m[0].start && (PAGE_SIZE - 1)) != 0 &&
         "start address should be page aligned");
     assert(
-        (rstate.active_map.m[0].start && (PAGE_SIZE - 1)) != 0 &&
+        (rs->active_map.m[0].start && (PAGE_SIZE - 1)) != 0 &&
         "end address should be page aligned");
   }
 
-  for (size_t i = 1; i < rstate.active_map.len; i++) {
+  for (size_t i = 1; i < rs->active_map.len; i++) {
     assert(
-        rstate.active_map.m[i].w != rstate.active_map.m[i - 1].w &&
+        rs->active_map.m[i].w != rs->active_map.m[i - 1].w &&
         "table entries must be alternating");
   }
 
-  for (size_t i = 1; i < rstate.active_map.len; i++) {
+  for (size_t i = 1; i < rs->active_map.len; i++) {
     assert(
-        (char *)rstate.active_map.m[i].start ==
-            ((char *)rstate.active_map.m[i - 1].start +
-             rstate.active_map.m[i - 1].len) &&
+        (char *)rs->active_map.m[i].start ==
+            ((char *)rs->active_map.m[i - 1].start +
+             rs->active_map.m[i - 1].len) &&
         "table entries must be contiguous");
   }
 
@@ -1646,7 +4575,7 @@ void full_verify(int committed) {
   int found_start = 0;
   int err = 0;
 
-  for (size_t i = 0; i < rstate.active_map.len; i++) {
+  for (size_t i = 0; i < rs->active_map.len; i++) {
     assert(
         fscanf(f, "%lx-%lx %c%c%c%c %*[^\n]", &start, &end, &r, &w, &x, &s) ==
         6);
@@ -1661,10 +4590,10 @@ void full_verify(int committed) {
           6);
     }
 
-    if (rstate.active_map.m[i].start != (void *)start ||
-        (char *)rstate.active_map.m[i].start + rstate.active_map.m[i].len !=
+    if (rs->active_map.m[i].start != (void *)start ||
+        (char *)rs->active_map.m[i].start + rs->active_map.m[i].len !=
             (char *)end ||
-        rstate.active_map.m[i].w != (w == 'w')) {
+        rs->active_map.m[i].w != (w == 'w')) {
       err = 1;
       break;
     }
@@ -1673,7 +4602,7 @@ void full_verify(int committed) {
   if (err) {
     LOG("linux page table mismatch!\n");
     LOG("expected:\n");
-    print_table(&rstate.active_map);
+    print_table(&rs->active_map);
     LOG("but linux says we're actually:\n");
     rewind(f);
 
@@ -14,35 +14,92 @@
 
 #define MAP_START_ADDR ((void *)0x100000000000)
 
+// Heaps are handed out address ranges of HEAP_SPAN bytes starting at
+// MAP_START_ADDR so several can be open at once, and can't grow past them.
+#define HEAP_SPAN ((size_t)32 << 30)
+#define HEAP_SLOTS 3072
+
 #define GENERATION_CHILDREN 16
 
 #define MAX_MAPS 65530
 
-#define HEAP_VERSION 0xffca
+// moves to a value it's never had whenever the heap's layout changes, older
+// layouts have used 0xffc9 through 0xffcb.
+#define HEAP_VERSION 0xffce
+
+// how many pages past a write fault get copied in the same batch once writes
+// look sequential, and the most that can be asked for.
+#define FAULT_AROUND_PAGES 8
+#define FAULT_AROUND_MAX 64
+
+// snap_begin_mut copies up to PRECOW_PAGES pages that most recent
+// transactions wrote to before anything faults on them, picked from the
+// HOT_PAGES most recently written pages.
+#define PRECOW_PAGES 16
+#define HOT_PAGES 64
+
+// older versions of a page are kept as deltas against the version that
+// replaced them when that takes at most 1/DELTA_MAX_RATIO of the page. They're
+// packed into arenas of DELTA_ARENA_PAGES pages.
+#define DELTA_MAX_RATIO 4
+#define DELTA_ARENA_PAGES 16
+
+// in huge page mode the heap grows in steps of HUGE_PAGE_SIZE so the kernel
+// can back it with transparent huge pages.
+#define HUGE_PAGE_SIZE ((size_t)2 << 20)
+
+// a write fault copies every page starting in the same aligned block of
+// cow_granule pages along with the one hit. This is the most that block can
+// be, one huge page.
+#define COW_GRANULE_MAX 512
+
+// snap_compact only keeps a compressed page version when it comes out at most
+// PACK_MAX_PERCENT percent of the original's size.
+#define PACK_MAX_PERCENT 75
+
+// how far past its quotas a transaction can go once an allocation has been
+// refused for going over one, so the interpreter has room to fail in.
+#define QUOTA_RESERVE (64 << 10)
+
+// the most pages and map entries snap_set_verify can have checked per commit.
+#define VERIFY_SAMPLES_MAX 1024
+
+// Every link the allocator keeps inside the heap is an offset from the start
+// of the heap rather than an address, so its own bookkeeping stays valid
+// wherever the file gets mapped. The header always sits at offset 0 which
+// leaves 0 free to mean NULL.
+typedef uint64_t snap_off;
 
 struct heap_header {
   uint16_t v;
 
   size_t page_size; // catastrophic things happen if the page size changes
-  void *map_start;
+  void *map_start;  // where the heap was last mapped. Whatever the user keeps
+                    // in the heap is still made of plain pointers so this is
+                    // where it has to be mapped again.
 
   size_t size; // size includes self
 
   void *user_ptr;
 
-  struct snap_generation *working;
-  struct snap_generation *committed;
+  snap_off working;   // struct snap_generation
+  snap_off committed; // struct snap_generation
 
-  struct snap_generation *root;
+  snap_off root; // struct snap_generation
 
-  struct snap_page *last_page;
-  struct snap_generation *last_gen;
+  snap_off last_page; // struct snap_page
+  snap_off last_gen;  // struct snap_generation
   int last_gen_index;
+
+  snap_off free_pages; // struct snap_page, chained through real_addr
+  snap_off deltas;     // the delta arena being filled
 };
 
 enum snap_node_type {
   SNAP_NODE_GENERATION = 1 << 0,
   SNAP_NODE_PAGE = 1 << 1,
+  SNAP_NODE_DELTA = 1 << 2,
+  SNAP_NODE_PACKED = 1 << 3,
 };
 
 struct snap_node {
@@ -54,21 +111,55 @@ struct snap_generation {
   struct snap_node i;
 
   int gen;
-  struct snap_node *c[GENERATION_CHILDREN];
+  snap_off c[GENERATION_CHILDREN]; // struct snap_node
 };
 
 struct snap_page {
   struct snap_node i;
 
-  void *real_addr; // when a page is relocated (because of a write after commit)
-                   // the real address will refer to the location is originally
-                   // resided at.
+  snap_off real_addr; // when a page is relocated (because of a write after
+                      // commit) the real address will refer to the location
+                      // is originally resided at.
 
   int pages; // the number of physical pages this page covers. This is only
              // greater than 1 when allocing a size greater than one page.
 
   int len;
-  struct snap_segment *c[]; // TODO(turbi): should be relative
+  size_t c[]; // segment offsets from the start of this page, so a page can be
+              // copied or swapped without touching them.
+};
+
+// an old version of a page stored as the bytes that differ from the version
+// that replaced it, xored with them. It starts out the same as a snap_page so
+// either can be asked for its real_addr and pages.
+struct snap_delta {
+  struct snap_node i;
+
+  snap_off real_addr;
+  int pages;
+
+  int base_gen; // the generation holding the version this was taken against
+  uint32_t len; // bytes of runs
+  unsigned char runs[];
+};
+
+// a run of bytes in a delta. skip counts the bytes since the end of the last
+// run that are unchanged, len of them follow.
+struct snap_delta_run {
+  uint32_t skip;
+  uint32_t len;
+};
+
+// an old version of a page that's been compressed whole by snap_compact. Like
+// a delta it starts out the same as a snap_page.
+struct snap_packed {
+  struct snap_node i;
+
+  snap_off real_addr;
+  int pages;
+
+  uint32_t len; // compressed bytes
+  unsigned char data[];
 };
 
 struct snap_segment {
@@ -76,12 +167,122 @@ struct snap_segment {
   size_t size; // size does not include self
 };
 
+static inline void *snap_at(const struct heap_header *heap, snap_off off) {
+  return off ? (char *)heap + off : NULL;
+}
+
+static inline snap_off snap_offset(const struct heap_header *heap, void *ptr) {
+  return ptr ? (snap_off)((char *)ptr - (char *)heap) : 0;
+}
+
+// snap_gen_id returns the id of the generation at off, -1 if there isn't one.
+static inline int snap_gen_id(const struct heap_header *heap, snap_off off) {
+  struct snap_generation *g = snap_at(heap, off);
+  return g ? g->gen : -1;
+}
+
+static inline struct snap_segment *
+snap_segment_at(const struct snap_page *p, int i) {
+  return (struct snap_segment *)((char *)p + p->c[i]);
+}
+
+// how much of a commit has reached the disk by the time snap_commit returns.
+enum snap_durability {
+  SNAP_DURABILITY_NONE = 0,  // leave writeback up to the kernel
+  SNAP_DURABILITY_SYNC = 1,  // msync the generation's dirty pages every commit
+  SNAP_DURABILITY_GROUP = 2, // flush several commits at once, bounded by
+                             // a commit count and a latency
+  SNAP_DURABILITY_WAL = 3,   // append every commit to a write-ahead log and
+                             // only write the heap file back at checkpoints
+};
+
+// counters kept for each open heap since it was opened.
+struct snap_stats {
+  long faults;             // write faults taken on committed pages
+  long pages_copied;       // pages copied on write, including fault-around
+  long fault_around_pages; // pages copied ahead of a fault
+  long granule_pages;      // pages copied for sharing a cow granule with one
+  long faults_avoided;     // of those, ones that were written before commit
+  long precow_pages;       // pages copied by snap_begin_mut
+  long precow_hits;        // of those, ones that were written before commit
+  long precow_misses;      // and ones that weren't
+  long pages_elided;       // copies dropped at commit for being unchanged
+  long deltas_encoded;     // copies turned into deltas
+  long delta_bytes;        // bytes those deltas took
+  long pages_materialized; // deltas turned back into pages by checkout
+  long pages_packed;       // page versions compressed by snap_compact
+  long packed_from;        // bytes those versions took before
+  long packed_bytes;       // and after
+  long pages_unpacked;     // compressed versions decompressed by checkout
+  long pages_released;     // pages handed back to the kernel as unreachable
+  long pages_discarded;    // pages rolled back generations gave back
+  long pages_relocated;    // pages moved out of the view by snap_relayout
+  long pages_punched;      // pages it punched out of the heap file after
+  long quota_failures;     // allocations refused for going over a quota
+  long bytes_allocated;    // bytes handed out by snap_malloc and snap_realloc
+  long bytes_freed;        // bytes given back by snap_free and snap_realloc
+  long pages_committed;    // pages committed generations wrote to or added
+  long mprotect_calls;     // protection changes made to the heap
+  long nodes_walked;       // nodes visited walking the generation tree
+  long segv_ns;            // time spent handling write faults
+  long malloc_ns;          // in snap_malloc, snap_free and snap_realloc
+  long begin_mut_ns;       // in snap_begin_mut
+  long commit_ns;          // in snap_commit
+  long checkout_ns;        // in snap_checkout
+  long verify_checks;      // pages and map entries checked by commits
+  long verify_failures;    // of those, ones that weren't what they should be
+  long verify_ns;          // time spent checking them
+};
+
+// how the checked out generation is laid out, from snap_get_usage. Freed
+// segments are never handed out again so freed_bytes against live_bytes is
+// how fragmented the heap is.
+struct snap_usage {
+  long generations;  // generations in the tree
+  long versions;     // page versions in the tree, in the pages they cover
+  long pages;        // pages the checked out generation is made of
+  long live_bytes;   // in segments still in use
+  long freed_bytes;  // in segments that have been freed
+  long unused_bytes; // left between the segments and headers of those pages
+};
+
 void *snap_malloc(struct heap_header *heap, size_t size);
 void snap_free(struct heap_header *heap, void *ptr);
 void *snap_realloc(struct heap_header *heap, void *ptr, size_t size);
 
 struct heap_header *snap_init(char *db_path);
+struct heap_header *snap_open_readonly(const char *db_path);
+void snap_close(struct heap_header *heap);
 
 int snap_commit(struct heap_header *heap);
 int snap_begin_mut(struct heap_header *heap);
 void snap_checkout(struct heap_header *heap, int genid);
+void snap_discard(struct heap_header *heap, int genid);
+int snap_compact(struct heap_header *heap, int min_age);
+int snap_relayout(struct heap_header *heap);
+void snap_hibernate(struct heap_header *heap);
+
+void snap_set_durability(
+    struct heap_header *heap,
+    enum snap_durability mode,
+    int group_commits,
+    long group_latency_us);
+int snap_sync(struct heap_header *heap);
+long snap_sync_due(struct heap_header *heap);
+int snap_durable_gen(struct heap_header *heap);
+int snap_out_of_room(struct heap_header *heap);
+
+void snap_set_fault_around(struct heap_header *heap, int max_pages);
+void snap_set_precow(struct heap_header *heap, int max_pages);
+void snap_set_deltas(struct heap_header *heap, int enabled);
+int snap_set_hugepages(struct heap_header *heap, int enabled);
+void snap_set_cow_granule(struct heap_header *heap, int pages);
+void snap_set_verify(struct heap_header *heap, int samples);
+void snap_set_quota(
+    struct heap_header *heap,
+    size_t txn_bytes,
+    size_t txn_pages,
+    size_t db_bytes);
+void snap_get_stats(struct heap_header *heap, struct snap_stats *stats);
+void snap_get_usage(struct heap_header *heap, struct snap_usage *usage);
+int snap_trace(const char *path);
@@ -1,3 +1,5 @@
 #undef LOG_MAP_MODS
 #undef DEBUG_LOGGING
 #undef FULL_VERIFY
+#define WAL_IO_URING
+#define SNAP_PROBES
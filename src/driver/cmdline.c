@@ -34,15 +34,32 @@ const char *gengetopt_args_info_versiontext = "";
 const char *gengetopt_args_info_description = "";
 
 const char *gengetopt_args_info_help[] = {
-  "  -h, --help          Print help and exit",
-  "  -V, --version       Print version and exit",
-  "  -l, --list          list all generations  (default=off)",
-  "  -n, --noaslr        indicate we're already running without aslr, no need to\n                        set  (default=off)",
-  "  -c, --checkout=INT  select a specific generation",
-  "  -e, --eval=STRING   evaluate the given program and exit",
-  "  -d, --db=STRING     snapalloc db to use",
-  "  -s, --server        run as a server sending/recieving json on stdio\n                        (default=off)",
-  "  -a, --arg=STRING    argument sent to the interpreter",
+  "  -h, --help               Print help and exit",
+  "  -V, --version            Print version and exit",
+  "  -l, --list               list all generations  (default=off)",
+  "  -n, --noaslr             ignored, the heap no longer needs aslr disabled\n                             (default=off)",
+  "  -c, --checkout=INT       select a specific generation",
+  "  -e, --eval=STRING        evaluate the given program and exit",
+  "  -d, --db=STRING          snapalloc db to use",
+  "  -s, --server             run as a server sending/recieving json on stdio\n                             (default=off)",
+  "  -a, --arg=STRING         argument sent to the interpreter",
+  "      --durability=STRING  how commits reach the disk: none, sync, group or wal",
+  "      --group-commits=INT  commits flushed together in group durability mode",
+  "      --group-latency=INT  milliseconds a commit may wait to be flushed in\n                             group durability mode",
+  "      --fault-around=INT   pages copied ahead of a sequential write fault, 0\n                             disables",
+  "      --precow=INT         hot pages copied up front by every transaction, 0\n                             disables",
+  "      --compact=INT        compress page versions at least this many\n                             generations old and exit",
+  "      --hugepages          grow the heap in huge pages and ask for them to back\n                             it  (default=off)",
+  "      --cow-granule=INT    pages copied together on a write fault, a power of\n                             two up to 512",
+  "      --hibernate=INT      seconds without a query before the server lets go of\n                             its heaps",
+  "      --relayout           move history out of the current view's way in the\n                             heap file and exit  (default=off)",
+  "      --txn-quota=INT      most kilobytes one query can allocate, 0 for no\n                             limit",
+  "      --txn-page-quota=INT  most pages one query can add to the heap, 0 for no\n                             limit",
+  "      --db-quota=INT       most megabytes the heap file can grow to, 0 for no\n                             limit",
+  "      --usage              print how full the current generation's pages are\n                             and exit  (default=off)",
+  "      --trace=STRING       record every allocator call into a binary trace at\n                             this path",
+  "      --verify=INT         check this many random pages and protection table\n                             entries every commit",
+  "      --max-dbs=INT        most databases a server keeps open before closing\n                             the least recently used",
     0
 };
 
@@ -79,6 +96,23 @@ void clear_given (struct gengetopt_args_info *args_info)
   args_info->db_given = 0 ;
   args_info->server_given = 0 ;
   args_info->arg_given = 0 ;
+  args_info->durability_given = 0 ;
+  args_info->group_commits_given = 0 ;
+  args_info->group_latency_given = 0 ;
+  args_info->fault_around_given = 0 ;
+  args_info->precow_given = 0 ;
+  args_info->compact_given = 0 ;
+  args_info->hugepages_given = 0 ;
+  args_info->cow_granule_given = 0 ;
+  args_info->hibernate_given = 0 ;
+  args_info->relayout_given = 0 ;
+  args_info->txn_quota_given = 0 ;
+  args_info->txn_page_quota_given = 0 ;
+  args_info->db_quota_given = 0 ;
+  args_info->usage_given = 0 ;
+  args_info->trace_given = 0 ;
+  args_info->verify_given = 0 ;
+  args_info->max_dbs_given = 0 ;
 }
 
 static
@@ -95,6 +129,25 @@ void clear_args (struct gengetopt_args_info *args_info)
   args_info->server_flag = 0;
   args_info->arg_arg = NULL;
   args_info->arg_orig = NULL;
+  args_info->durability_arg = NULL;
+  args_info->durability_orig = NULL;
+  args_info->group_commits_orig = NULL;
+  args_info->group_latency_orig = NULL;
+  args_info->fault_around_orig = NULL;
+  args_info->precow_orig = NULL;
+  args_info->compact_orig = NULL;
+  args_info->hugepages_flag = 0;
+  args_info->cow_granule_orig = NULL;
+  args_info->hibernate_orig = NULL;
+  args_info->relayout_flag = 0;
+  args_info->txn_quota_orig = NULL;
+  args_info->txn_page_quota_orig = NULL;
+  args_info->db_quota_orig = NULL;
+  args_info->usage_flag = 0;
+  args_info->trace_arg = NULL;
+  args_info->trace_orig = NULL;
+  args_info->verify_orig = NULL;
+  args_info->max_dbs_orig = NULL;
   
 }
 
@@ -114,6 +167,23 @@ void init_args_info(struct gengetopt_args_info *args_info)
   args_info->arg_help = gengetopt_args_info_help[8] ;
   args_info->arg_min = 0;
   args_info->arg_max = 0;
+  args_info->durability_help = gengetopt_args_info_help[9] ;
+  args_info->group_commits_help = gengetopt_args_info_help[10] ;
+  args_info->group_latency_help = gengetopt_args_info_help[11] ;
+  args_info->fault_around_help = gengetopt_args_info_help[12] ;
+  args_info->precow_help = gengetopt_args_info_help[13] ;
+  args_info->compact_help = gengetopt_args_info_help[14] ;
+  args_info->hugepages_help = gengetopt_args_info_help[15] ;
+  args_info->cow_granule_help = gengetopt_args_info_help[16] ;
+  args_info->hibernate_help = gengetopt_args_info_help[17] ;
+  args_info->relayout_help = gengetopt_args_info_help[18] ;
+  args_info->txn_quota_help = gengetopt_args_info_help[19] ;
+  args_info->txn_page_quota_help = gengetopt_args_info_help[20] ;
+  args_info->db_quota_help = gengetopt_args_info_help[21] ;
+  args_info->usage_help = gengetopt_args_info_help[22] ;
+  args_info->trace_help = gengetopt_args_info_help[23] ;
+  args_info->verify_help = gengetopt_args_info_help[24] ;
+  args_info->max_dbs_help = gengetopt_args_info_help[25] ;
   
 }
 
@@ -254,6 +324,22 @@ cmdline_parser_release (struct gengetopt_args_info *args_info)
   free_string_field (&(args_info->db_arg));
   free_string_field (&(args_info->db_orig));
   free_multiple_string_field (args_info->arg_given, &(args_info->arg_arg), &(args_info->arg_orig));
+  free_string_field (&(args_info->durability_arg));
+  free_string_field (&(args_info->durability_orig));
+  free_string_field (&(args_info->group_commits_orig));
+  free_string_field (&(args_info->group_latency_orig));
+  free_string_field (&(args_info->fault_around_orig));
+  free_string_field (&(args_info->precow_orig));
+  free_string_field (&(args_info->compact_orig));
+  free_string_field (&(args_info->cow_granule_orig));
+  free_string_field (&(args_info->hibernate_orig));
+  free_string_field (&(args_info->txn_quota_orig));
+  free_string_field (&(args_info->txn_page_quota_orig));
+  free_string_field (&(args_info->db_quota_orig));
+  free_string_field (&(args_info->trace_arg));
+  free_string_field (&(args_info->trace_orig));
+  free_string_field (&(args_info->verify_orig));
+  free_string_field (&(args_info->max_dbs_orig));
   
   
 
@@ -309,6 +395,40 @@ cmdline_parser_dump(FILE *outfile, struct gengetopt_args_info *args_info)
   if (args_info->server_given)
     write_into_file(outfile, "server", 0, 0 );
   write_multiple_into_file(outfile, args_info->arg_given, "arg", args_info->arg_orig, 0);
+  if (args_info->durability_given)
+    write_into_file(outfile, "durability", args_info->durability_orig, 0);
+  if (args_info->group_commits_given)
+    write_into_file(outfile, "group-commits", args_info->group_commits_orig, 0);
+  if (args_info->group_latency_given)
+    write_into_file(outfile, "group-latency", args_info->group_latency_orig, 0);
+  if (args_info->fault_around_given)
+    write_into_file(outfile, "fault-around", args_info->fault_around_orig, 0);
+  if (args_info->precow_given)
+    write_into_file(outfile, "precow", args_info->precow_orig, 0);
+  if (args_info->compact_given)
+    write_into_file(outfile, "compact", args_info->compact_orig, 0);
+  if (args_info->hugepages_given)
+    write_into_file(outfile, "hugepages", 0, 0 );
+  if (args_info->cow_granule_given)
+    write_into_file(outfile, "cow-granule", args_info->cow_granule_orig, 0);
+  if (args_info->hibernate_given)
+    write_into_file(outfile, "hibernate", args_info->hibernate_orig, 0);
+  if (args_info->relayout_given)
+    write_into_file(outfile, "relayout", 0, 0 );
+  if (args_info->txn_quota_given)
+    write_into_file(outfile, "txn-quota", args_info->txn_quota_orig, 0);
+  if (args_info->txn_page_quota_given)
+    write_into_file(outfile, "txn-page-quota", args_info->txn_page_quota_orig, 0);
+  if (args_info->db_quota_given)
+    write_into_file(outfile, "db-quota", args_info->db_quota_orig, 0);
+  if (args_info->usage_given)
+    write_into_file(outfile, "usage", 0, 0 );
+  if (args_info->trace_given)
+    write_into_file(outfile, "trace", args_info->trace_orig, 0);
+  if (args_info->verify_given)
+    write_into_file(outfile, "verify", args_info->verify_orig, 0);
+  if (args_info->max_dbs_given)
+    write_into_file(outfile, "max-dbs", args_info->max_dbs_orig, 0);
   
 
   i = EXIT_SUCCESS;
@@ -876,6 +996,23 @@ cmdline_parser_internal (
         { "db",	1, NULL, 'd' },
         { "server",	0, NULL, 's' },
         { "arg",	1, NULL, 'a' },
+        { "durability",	1, NULL, 0 },
+        { "group-commits",	1, NULL, 0 },
+        { "group-latency",	1, NULL, 0 },
+        { "fault-around",	1, NULL, 0 },
+        { "precow",	1, NULL, 0 },
+        { "compact",	1, NULL, 0 },
+        { "hugepages",	0, NULL, 0 },
+        { "cow-granule",	1, NULL, 0 },
+        { "hibernate",	1, NULL, 0 },
+        { "relayout",	0, NULL, 0 },
+        { "txn-quota",	1, NULL, 0 },
+        { "txn-page-quota",	1, NULL, 0 },
+        { "db-quota",	1, NULL, 0 },
+        { "usage",	0, NULL, 0 },
+        { "trace",	1, NULL, 0 },
+        { "verify",	1, NULL, 0 },
+        { "max-dbs",	1, NULL, 0 },
         { 0,  0, 0, 0 }
       };
 
@@ -905,7 +1042,7 @@ cmdline_parser_internal (
             goto failure;
         
           break;
-        case 'n':	/* indicate we're already running without aslr, no need to set.  */
+        case 'n':	/* ignored, the heap no longer needs aslr disabled.  */
         
         
           if (update_arg((void *)&(args_info->noaslr_flag), 0, &(args_info->noaslr_given),
@@ -972,6 +1109,240 @@ cmdline_parser_internal (
           break;
 
         case 0:	/* Long option with no short option */
+          /* how commits reach the disk: none, sync, group or wal.  */
+          if (strcmp (long_options[option_index].name, "durability") == 0)
+          {
+          
+          
+            if (update_arg( (void *)&(args_info->durability_arg), 
+                 &(args_info->durability_orig), &(args_info->durability_given),
+                &(local_args_info.durability_given), optarg, 0, 0, ARG_STRING,
+                check_ambiguity, override, 0, 0,
+                "durability", '-',
+                additional_error))
+              goto failure;
+          
+          }
+          /* commits flushed together in group durability mode.  */
+          else if (strcmp (long_options[option_index].name, "group-commits") == 0)
+          {
+          
+          
+            if (update_arg( (void *)&(args_info->group_commits_arg), 
+                 &(args_info->group_commits_orig), &(args_info->group_commits_given),
+                &(local_args_info.group_commits_given), optarg, 0, 0, ARG_INT,
+                check_ambiguity, override, 0, 0,
+                "group-commits", '-',
+                additional_error))
+              goto failure;
+          
+          }
+          /* milliseconds a commit may wait to be flushed in group durability mode.  */
+          else if (strcmp (long_options[option_index].name, "group-latency") == 0)
+          {
+          
+          
+            if (update_arg( (void *)&(args_info->group_latency_arg), 
+                 &(args_info->group_latency_orig), &(args_info->group_latency_given),
+                &(local_args_info.group_latency_given), optarg, 0, 0, ARG_INT,
+                check_ambiguity, override, 0, 0,
+                "group-latency", '-',
+                additional_error))
+              goto failure;
+          
+          }
+          /* pages copied ahead of a sequential write fault, 0 disables.  */
+          else if (strcmp (long_options[option_index].name, "fault-around") == 0)
+          {
+          
+          
+            if (update_arg( (void *)&(args_info->fault_around_arg), 
+                 &(args_info->fault_around_orig), &(args_info->fault_around_given),
+                &(local_args_info.fault_around_given), optarg, 0, 0, ARG_INT,
+                check_ambiguity, override, 0, 0,
+                "fault-around", '-',
+                additional_error))
+              goto failure;
+          
+          }
+          /* hot pages copied up front by every transaction, 0 disables.  */
+          else if (strcmp (long_options[option_index].name, "precow") == 0)
+          {
+          
+          
+            if (update_arg( (void *)&(args_info->precow_arg), 
+                 &(args_info->precow_orig), &(args_info->precow_given),
+                &(local_args_info.precow_given), optarg, 0, 0, ARG_INT,
+                check_ambiguity, override, 0, 0,
+                "precow", '-',
+                additional_error))
+              goto failure;
+          
+          }
+          /* compress page versions at least this many generations old and exit.  */
+          else if (strcmp (long_options[option_index].name, "compact") == 0)
+          {
+          
+          
+            if (update_arg( (void *)&(args_info->compact_arg), 
+                 &(args_info->compact_orig), &(args_info->compact_given),
+                &(local_args_info.compact_given), optarg, 0, 0, ARG_INT,
+                check_ambiguity, override, 0, 0,
+                "compact", '-',
+                additional_error))
+              goto failure;
+          
+          }
+          /* grow the heap in huge pages and ask for them to back it.  */
+          else if (strcmp (long_options[option_index].name, "hugepages") == 0)
+          {
+          
+          
+            if (update_arg((void *)&(args_info->hugepages_flag), 0, &(args_info->hugepages_given),
+                &(local_args_info.hugepages_given), optarg, 0, 0, ARG_FLAG,
+                check_ambiguity, override, 1, 0, "hugepages", '-',
+                additional_error))
+              goto failure;
+          
+          }
+          /* pages copied together on a write fault, a power of two up to 512.  */
+          else if (strcmp (long_options[option_index].name, "cow-granule") == 0)
+          {
+          
+          
+            if (update_arg( (void *)&(args_info->cow_granule_arg), 
+                 &(args_info->cow_granule_orig), &(args_info->cow_granule_given),
+                &(local_args_info.cow_granule_given), optarg, 0, 0, ARG_INT,
+                check_ambiguity, override, 0, 0,
+                "cow-granule", '-',
+                additional_error))
+              goto failure;
+          
+          }
+          /* seconds without a query before the server lets go of its heaps.  */
+          else if (strcmp (long_options[option_index].name, "hibernate") == 0)
+          {
+          
+          
+            if (update_arg( (void *)&(args_info->hibernate_arg), 
+                 &(args_info->hibernate_orig), &(args_info->hibernate_given),
+                &(local_args_info.hibernate_given), optarg, 0, 0, ARG_INT,
+                check_ambiguity, override, 0, 0,
+                "hibernate", '-',
+                additional_error))
+              goto failure;
+          
+          }
+          /* move history out of the current view's way in the heap file and exit.  */
+          else if (strcmp (long_options[option_index].name, "relayout") == 0)
+          {
+          
+          
+            if (update_arg((void *)&(args_info->relayout_flag), 0, &(args_info->relayout_given),
+                &(local_args_info.relayout_given), optarg, 0, 0, ARG_FLAG,
+                check_ambiguity, override, 1, 0, "relayout", '-',
+                additional_error))
+              goto failure;
+          
+          }
+          /* most kilobytes one query can allocate, 0 for no limit.  */
+          else if (strcmp (long_options[option_index].name, "txn-quota") == 0)
+          {
+          
+          
+            if (update_arg( (void *)&(args_info->txn_quota_arg), 
+                 &(args_info->txn_quota_orig), &(args_info->txn_quota_given),
+                &(local_args_info.txn_quota_given), optarg, 0, 0, ARG_INT,
+                check_ambiguity, override, 0, 0,
+                "txn-quota", '-',
+                additional_error))
+              goto failure;
+          
+          }
+          /* most pages one query can add to the heap, 0 for no limit.  */
+          else if (strcmp (long_options[option_index].name, "txn-page-quota") == 0)
+          {
+          
+          
+            if (update_arg( (void *)&(args_info->txn_page_quota_arg), 
+                 &(args_info->txn_page_quota_orig), &(args_info->txn_page_quota_given),
+                &(local_args_info.txn_page_quota_given), optarg, 0, 0, ARG_INT,
+                check_ambiguity, override, 0, 0,
+                "txn-page-quota", '-',
+                additional_error))
+              goto failure;
+          
+          }
+          /* most megabytes the heap file can grow to, 0 for no limit.  */
+          else if (strcmp (long_options[option_index].name, "db-quota") == 0)
+          {
+          
+          
+            if (update_arg( (void *)&(args_info->db_quota_arg), 
+                 &(args_info->db_quota_orig), &(args_info->db_quota_given),
+                &(local_args_info.db_quota_given), optarg, 0, 0, ARG_INT,
+                check_ambiguity, override, 0, 0,
+                "db-quota", '-',
+                additional_error))
+              goto failure;
+          
+          }
+          /* print how full the current generation's pages are and exit.  */
+          else if (strcmp (long_options[option_index].name, "usage") == 0)
+          {
+          
+          
+            if (update_arg((void *)&(args_info->usage_flag), 0, &(args_info->usage_given),
+                &(local_args_info.usage_given), optarg, 0, 0, ARG_FLAG,
+                check_ambiguity, override, 1, 0, "usage", '-',
+                additional_error))
+              goto failure;
+          
+          }
+          /* record every allocator call into a binary trace at this path.  */
+          else if (strcmp (long_options[option_index].name, "trace") == 0)
+          {
+          
+          
+            if (update_arg( (void *)&(args_info->trace_arg), 
+                 &(args_info->trace_orig), &(args_info->trace_given),
+                &(local_args_info.trace_given), optarg, 0, 0, ARG_STRING,
+                check_ambiguity, override, 0, 0,
+                "trace", '-',
+                additional_error))
+              goto failure;
+          
+          }
+          /* check this many random pages and protection table entries every commit.  */
+          else if (strcmp (long_options[option_index].name, "verify") == 0)
+          {
+          
+          
+            if (update_arg( (void *)&(args_info->verify_arg), 
+                 &(args_info->verify_orig), &(args_info->verify_given),
+                &(local_args_info.verify_given), optarg, 0, 0, ARG_INT,
+                check_ambiguity, override, 0, 0,
+                "verify", '-',
+                additional_error))
+              goto failure;
+          
+          }
+          /* most databases a server keeps open before closing the least recently used.  */
+          else if (strcmp (long_options[option_index].name, "max-dbs") == 0)
+          {
+          
+          
+            if (update_arg( (void *)&(args_info->max_dbs_arg), 
+                 &(args_info->max_dbs_orig), &(args_info->max_dbs_given),
+                &(local_args_info.max_dbs_given), optarg, 0, 0, ARG_INT,
+                check_ambiguity, override, 0, 0,
+                "max-dbs", '-',
+                additional_error))
+              goto failure;
+          
+          }
+          
+          break;
         case '?':	/* Invalid option.  */
           /* `getopt_long' already printed an error message.  */
           goto failure;
@@ -41,8 +41,8 @@ struct gengetopt_args_info
   const char *version_help; /**< @brief Print version and exit help description.  */
   int list_flag;	/**< @brief list all generations (default=off).  */
   const char *list_help; /**< @brief list all generations help description.  */
-  int noaslr_flag;	/**< @brief indicate we're already running without aslr, no need to set (default=off).  */
-  const char *noaslr_help; /**< @brief indicate we're already running without aslr, no need to set help description.  */
+  int noaslr_flag;	/**< @brief ignored, the heap no longer needs aslr disabled (default=off).  */
+  const char *noaslr_help; /**< @brief ignored, the heap no longer needs aslr disabled help description.  */
   int checkout_arg;	/**< @brief select a specific generation.  */
   char * checkout_orig;	/**< @brief select a specific generation original value given at command line.  */
   const char *checkout_help; /**< @brief select a specific generation help description.  */
@@ -59,6 +59,54 @@ struct gengetopt_args_info
   unsigned int arg_min; /**< @brief argument sent to the interpreter's minimum occurreces */
   unsigned int arg_max; /**< @brief argument sent to the interpreter's maximum occurreces */
   const char *arg_help; /**< @brief argument sent to the interpreter help description.  */
+  char * durability_arg;	/**< @brief how commits reach the disk: none, sync, group or wal.  */
+  char * durability_orig;	/**< @brief how commits reach the disk: none, sync, group or wal original value given at command line.  */
+  const char *durability_help; /**< @brief how commits reach the disk: none, sync, group or wal help description.  */
+  int group_commits_arg;	/**< @brief commits flushed together in group durability mode.  */
+  char * group_commits_orig;	/**< @brief commits flushed together in group durability mode original value given at command line.  */
+  const char *group_commits_help; /**< @brief commits flushed together in group durability mode help description.  */
+  int group_latency_arg;	/**< @brief milliseconds a commit may wait to be flushed in group durability mode.  */
+  char * group_latency_orig;	/**< @brief milliseconds a commit may wait to be flushed in group durability mode original value given at command line.  */
+  const char *group_latency_help; /**< @brief milliseconds a commit may wait to be flushed in group durability mode help description.  */
+  int fault_around_arg;	/**< @brief pages copied ahead of a sequential write fault, 0 disables.  */
+  char * fault_around_orig;	/**< @brief pages copied ahead of a sequential write fault, 0 disables original value given at command line.  */
+  const char *fault_around_help; /**< @brief pages copied ahead of a sequential write fault, 0 disables help description.  */
+  int precow_arg;	/**< @brief hot pages copied up front by every transaction, 0 disables.  */
+  char * precow_orig;	/**< @brief hot pages copied up front by every transaction, 0 disables original value given at command line.  */
+  const char *precow_help; /**< @brief hot pages copied up front by every transaction, 0 disables help description.  */
+  int compact_arg;	/**< @brief compress page versions at least this many generations old and exit.  */
+  char * compact_orig;	/**< @brief compress page versions at least this many generations old and exit original value given at command line.  */
+  const char *compact_help; /**< @brief compress page versions at least this many generations old and exit help description.  */
+  int hugepages_flag;	/**< @brief grow the heap in huge pages and ask for them to back it (default=off).  */
+  const char *hugepages_help; /**< @brief grow the heap in huge pages and ask for them to back it help description.  */
+  int cow_granule_arg;	/**< @brief pages copied together on a write fault, a power of two up to 512.  */
+  char * cow_granule_orig;	/**< @brief pages copied together on a write fault, a power of two up to 512 original value given at command line.  */
+  const char *cow_granule_help; /**< @brief pages copied together on a write fault, a power of two up to 512 help description.  */
+  int hibernate_arg;	/**< @brief seconds without a query before the server lets go of its heaps.  */
+  char * hibernate_orig;	/**< @brief seconds without a query before the server lets go of its heaps original value given at command line.  */
+  const char *hibernate_help; /**< @brief seconds without a query before the server lets go of its heaps help description.  */
+  int relayout_flag;	/**< @brief move history out of the current view's way in the heap file and exit (default=off).  */
+  const char *relayout_help; /**< @brief move history out of the current view's way in the heap file and exit help description.  */
+  int txn_quota_arg;	/**< @brief most kilobytes one query can allocate, 0 for no limit.  */
+  char * txn_quota_orig;	/**< @brief most kilobytes one query can allocate, 0 for no limit original value given at command line.  */
+  const char *txn_quota_help; /**< @brief most kilobytes one query can allocate, 0 for no limit help description.  */
+  int txn_page_quota_arg;	/**< @brief most pages one query can add to the heap, 0 for no limit.  */
+  char * txn_page_quota_orig;	/**< @brief most pages one query can add to the heap, 0 for no limit original value given at command line.  */
+  const char *txn_page_quota_help; /**< @brief most pages one query can add to the heap, 0 for no limit help description.  */
+  int db_quota_arg;	/**< @brief most megabytes the heap file can grow to, 0 for no limit.  */
+  char * db_quota_orig;	/**< @brief most megabytes the heap file can grow to, 0 for no limit original value given at command line.  */
+  const char *db_quota_help; /**< @brief most megabytes the heap file can grow to, 0 for no limit help description.  */
+  int usage_flag;	/**< @brief print how full the current generation's pages are and exit (default=off).  */
+  const char *usage_help; /**< @brief print how full the current generation's pages are and exit help description.  */
+  char * trace_arg;	/**< @brief record every allocator call into a binary trace at this path.  */
+  char * trace_orig;	/**< @brief record every allocator call into a binary trace at this path original value given at command line.  */
+  const char *trace_help; /**< @brief record every allocator call into a binary trace at this path help description.  */
+  int verify_arg;	/**< @brief check this many random pages and protection table entries every commit.  */
+  char * verify_orig;	/**< @brief check this many random pages and protection table entries every commit original value given at command line.  */
+  const char *verify_help; /**< @brief check this many random pages and protection table entries every commit help description.  */
+  int max_dbs_arg;	/**< @brief most databases a server keeps open before closing the least recently used.  */
+  char * max_dbs_orig;	/**< @brief most databases a server keeps open before closing the least recently used original value given at command line.  */
+  const char *max_dbs_help; /**< @brief most databases a server keeps open before closing the least recently used help description.  */
   
   unsigned int help_given ;	/**< @brief Whether help was given.  */
   unsigned int version_given ;	/**< @brief Whether version was given.  */
@@ -69,6 +117,23 @@ struct gengetopt_args_info
   unsigned int db_given ;	/**< @brief Whether db was given.  */
   unsigned int server_given ;	/**< @brief Whether server was given.  */
   unsigned int arg_given ;	/**< @brief Whether arg was given.  */
+  unsigned int durability_given ;	/**< @brief Whether durability was given.  */
+  unsigned int group_commits_given ;	/**< @brief Whether group-commits was given.  */
+  unsigned int group_latency_given ;	/**< @brief Whether group-latency was given.  */
+  unsigned int fault_around_given ;	/**< @brief Whether fault-around was given.  */
+  unsigned int precow_given ;	/**< @brief Whether precow was given.  */
+  unsigned int compact_given ;	/**< @brief Whether compact was given.  */
+  unsigned int hugepages_given ;	/**< @brief Whether hugepages was given.  */
+  unsigned int cow_granule_given ;	/**< @brief Whether cow-granule was given.  */
+  unsigned int hibernate_given ;	/**< @brief Whether hibernate was given.  */
+  unsigned int relayout_given ;	/**< @brief Whether relayout was given.  */
+  unsigned int txn_quota_given ;	/**< @brief Whether txn-quota was given.  */
+  unsigned int txn_page_quota_given ;	/**< @brief Whether txn-page-quota was given.  */
+  unsigned int db_quota_given ;	/**< @brief Whether db-quota was given.  */
+  unsigned int usage_given ;	/**< @brief Whether usage was given.  */
+  unsigned int trace_given ;	/**< @brief Whether trace was given.  */
+  unsigned int verify_given ;	/**< @brief Whether verify was given.  */
+  unsigned int max_dbs_given ;	/**< @brief Whether max-dbs was given.  */
 
 } ;
 
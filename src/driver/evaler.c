@@ -1,28 +1,249 @@
+// strdup
+#define _XOPEN_SOURCE 600
+
 #include <assert.h>
 #include <errno.h>
 #include <jansson.h>
+#include <poll.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/personality.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
 
+#include "../probes.h"
 #include "cmdline.h"
 #include "evaler.h"
 
-void walk_generations(struct snap_generation *g) {
+// how many databases a single server can keep open at once, past max_dbs the
+// least recently used one is closed to make room
+#define MAX_OPEN_DBS 1024
+
+struct open_db {
+  char *path;
+  struct heap_header *heap;
+  long used;
+};
+
+static struct open_db dbs[MAX_OPEN_DBS];
+static int open_dbs = 0;
+static long db_clock = 0;
+static int max_dbs = MAX_OPEN_DBS;
+
+// applied to every database as it's opened
+static int durability_given = 0;
+static enum snap_durability durability;
+static int group_commits;
+static long group_latency_us;
+static int fault_around = -1;
+static int precow = -1;
+static int hugepages;
+static int cow_granule = -1;
+static int hibernate_after;
+static size_t txn_quota;
+static size_t txn_page_quota;
+static size_t db_quota;
+static int verify_samples;
+
+// what each phase of the current query took. Write faults come from the heap
+// being queried, kernel faults from the whole process.
+static const char *phase_names[PHASE_COUNT] = {
+    "parse",
+    "checkout",
+    "begin",
+    "compile",
+    "execute",
+    "marshal",
+    "gc",
+    "commit",
+    "rollback",
+    "serialize",
+};
+
+static struct heap_header *phase_heap;
+static int phase = -1;
+static struct timespec phase_start;
+static long phase_start_faults;
+static long phase_start_kfaults;
+static int phase_ran[PHASE_COUNT];
+static long phase_ns[PHASE_COUNT];
+static long phase_faults[PHASE_COUNT];
+static long phase_kfaults[PHASE_COUNT];
+
+// serializing and writing out the last response, for the next one to report
+static json_t *last_serialize;
+
+void walk_generations(struct heap_header *heap, struct snap_generation *g) {
   printf("%d\n", g->gen);
 
   for (int i = 0; i < GENERATION_CHILDREN; i++) {
-    if (g->c[i] && g->c[i]->type == SNAP_NODE_GENERATION) {
-      walk_generations((struct snap_generation *)g->c[i]);
+    struct snap_node *n = snap_at(heap, g->c[i]);
+    if (n && n->type == SNAP_NODE_GENERATION) {
+      walk_generations(heap, (struct snap_generation *)n);
     }
   }
 }
 
 void list_generations(struct heap_header *heap) {
-  printf("  working: %d\n", heap->working->gen);
-  printf("committed: %d\n", heap->committed->gen);
-  walk_generations(heap->root);
+  printf("  working: %d\n", snap_gen_id(heap, heap->working));
+  printf("committed: %d\n", snap_gen_id(heap, heap->committed));
+  walk_generations(heap, snap_at(heap, heap->root));
+}
+
+void compact_db(struct heap_header *heap, int min_age) {
+  struct snap_stats before, after;
+  snap_get_stats(heap, &before);
+
+  int packed = snap_compact(heap, min_age);
+
+  if (packed < 0) {
+    fprintf(stderr, "compacting failed\n");
+    return;
+  }
+
+  snap_get_stats(heap, &after);
+
+  long from = after.packed_from - before.packed_from;
+  long to = after.packed_bytes - before.packed_bytes;
+
+  printf("compressed %d pages\n", packed);
+  if (packed) {
+    printf("%ld -> %ld bytes (%.2fx)\n", from, to, (double)from / to);
+  }
+}
+
+void relayout_db(struct heap_header *heap) {
+  struct snap_stats before, after;
+  snap_get_stats(heap, &before);
+
+  int moved = snap_relayout(heap);
+
+  if (moved < 0) {
+    fprintf(stderr, "relayout failed\n");
+    return;
+  }
+
+  snap_get_stats(heap, &after);
+
+  printf("moved %d pages\n", moved);
+  printf("punched %ld pages\n", after.pages_punched - before.pages_punched);
+}
+
+void usage_db(struct heap_header *heap) {
+  struct snap_usage u;
+  snap_get_usage(heap, &u);
+
+  long held = u.live_bytes + u.freed_bytes;
+
+  printf("%ld generations, %ld page versions\n", u.generations, u.versions);
+  printf("%ld pages checked out\n", u.pages);
+  printf("%ld bytes live, %ld freed", u.live_bytes, u.freed_bytes);
+  if (held) {
+    printf(" (%.1f%% fragmented)", 100.0 * u.freed_bytes / held);
+  }
+  printf("\n%ld bytes unused\n", u.unused_bytes);
+}
+
+// alloc_delta is what the allocator did between two snapshots of its stats,
+// so a slow query can be put down to the allocator or the interpreter.
+json_t *alloc_delta(struct snap_stats *before, struct snap_stats *after) {
+  json_t *d = json_object();
+
+#define DELTA(name, field)                                                     \
+  json_object_set_new(d, name, json_integer(after->field - before->field))
+
+  DELTA("bytes_allocated", bytes_allocated);
+  DELTA("bytes_freed", bytes_freed);
+  DELTA("faults", faults);
+  DELTA("pages_copied", pages_copied);
+  DELTA("pages_committed", pages_committed);
+  DELTA("mprotects", mprotect_calls);
+  DELTA("nodes_walked", nodes_walked);
+  DELTA("segv_ns", segv_ns);
+  DELTA("malloc_ns", malloc_ns);
+  DELTA("begin_ns", begin_mut_ns);
+  DELTA("commit_ns", commit_ns);
+  DELTA("checkout_ns", checkout_ns);
+  DELTA("verify_failures", verify_failures);
+
+#undef DELTA
+
+  return d;
+}
+
+long heap_faults() {
+  if (!phase_heap) {
+    return 0;
+  }
+
+  struct snap_stats s;
+  snap_get_stats(phase_heap, &s);
+  return s.faults;
+}
+
+long kernel_faults() {
+  struct rusage ru;
+  getrusage(RUSAGE_SELF, &ru);
+  return ru.ru_minflt + ru.ru_majflt;
+}
+
+void reset_phases(struct heap_header *heap) {
+  phase_heap = heap;
+  phase = -1;
+  memset(phase_ran, 0, sizeof(phase_ran));
+  memset(phase_ns, 0, sizeof(phase_ns));
+  memset(phase_faults, 0, sizeof(phase_faults));
+  memset(phase_kfaults, 0, sizeof(phase_kfaults));
+}
+
+// end_phase adds everything since the current phase was entered to it. A
+// phase can be entered more than once a query, like marshal for the args and
+// then the result, and just adds up.
+void end_phase(void) {
+  if (phase < 0) {
+    return;
+  }
+
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  phase_ran[phase] = 1;
+  phase_ns[phase] += (now.tv_sec - phase_start.tv_sec) * 1000000000L +
+                     (now.tv_nsec - phase_start.tv_nsec);
+  phase_faults[phase] += heap_faults() - phase_start_faults;
+  phase_kfaults[phase] += kernel_faults() - phase_start_kfaults;
+  phase = -1;
+}
+
+void enter_phase(enum evaler_phase p) {
+  end_phase();
+
+  phase = p;
+  phase_start_faults = heap_faults();
+  phase_start_kfaults = kernel_faults();
+  clock_gettime(CLOCK_MONOTONIC, &phase_start);
+}
+
+json_t *phase_time(enum evaler_phase i) {
+  json_t *p = json_object();
+  json_object_set_new(p, "ns", json_integer(phase_ns[i]));
+  json_object_set_new(p, "faults", json_integer(phase_faults[i]));
+  json_object_set_new(p, "kernel_faults", json_integer(phase_kfaults[i]));
+
+  return p;
+}
+
+json_t *phase_times() {
+  json_t *t = json_object();
+
+  for (int i = 0; i < PHASE_COUNT; i++) {
+    if (phase_ran[i]) {
+      json_object_set_new(t, phase_names[i], phase_time(i));
+    }
+  }
+
+  return t;
 }
 
 int from_eval_arg(struct gengetopt_args_info args, struct heap_header *heap) {
@@ -43,19 +264,27 @@ int from_eval_arg(struct gengetopt_args_info args, struct heap_header *heap) {
     json_object_set_new(interp_args, key, val);
   }
 
-  int parent_gen = heap->committed->gen;
+  int parent_gen = snap_gen_id(heap, heap->committed);
 
   snap_begin_mut(heap);
 
   enum evaler_status status;
 
+  PROBE0(eval_start);
   json_t *result = do_eval(heap, args.eval_arg, interp_args, &status);
+  PROBE1(eval_done, status);
 
   if (!result) {
     fprintf(stdout, "internal error\n");
     return 0;
   }
 
+  if (!status && snap_out_of_room(heap)) {
+    json_decref(result);
+    result = json_string("not enough memory");
+    status = USER_ERROR;
+  }
+
   if (status) {
     fputs("error: ", stdout);
   }
@@ -80,10 +309,221 @@ int from_eval_arg(struct gengetopt_args_info args, struct heap_header *heap) {
   return 0;
 }
 
+// init_db gives a database that's never been used its initial interpreter
+// state.
+int init_db(struct heap_header *heap) {
+  if (heap->user_ptr) {
+    return 0;
+  }
+
+#ifdef DEBUG_LOGGING
+  fprintf(stderr, "CREATING INITIAL STATE\n");
+#endif
+
+  // setting up the interpreter isn't a query, only the file's quota applies
+  snap_set_quota(heap, 0, 0, db_quota);
+
+  if (create_init(heap)) {
+    fprintf(stderr, "fatal, unable to create evaler\n");
+    return 1;
+  }
+
+  assert(heap->user_ptr != NULL);
+
+  snap_commit(heap);
+
+  snap_set_quota(heap, txn_quota, txn_page_quota, db_quota);
+#ifdef DEBUG_LOGGING
+  fprintf(stderr, "CREATED INITIAL STATE\n");
+#endif
+
+  return 0;
+}
+
+// close_db closes the database in slot i of dbs, letting the driver drop
+// whatever it keeps about it first. The last slot takes its place.
+void close_db(int i) {
+  forget_db(dbs[i].heap);
+  snap_close(dbs[i].heap);
+  free(dbs[i].path);
+
+  dbs[i] = dbs[--open_dbs];
+}
+
+// load_db opens the database at path with the server's settings. Once the
+// table is full the least recently used database goes, though never the
+// first, which is the server's own and is held on to by server_loop.
+struct heap_header *load_db(const char *path) {
+  if (open_dbs == max_dbs) {
+    int lru = 1;
+    for (int i = 2; i < open_dbs; i++) {
+      if (dbs[i].used < dbs[lru].used) {
+        lru = i;
+      }
+    }
+
+    close_db(lru);
+  }
+
+  struct heap_header *heap = snap_init((char *)path);
+  if (heap == NULL) {
+    return NULL;
+  }
+
+  if (durability_given) {
+    snap_set_durability(heap, durability, group_commits, group_latency_us);
+  }
+
+  if (fault_around != -1) {
+    snap_set_fault_around(heap, fault_around);
+  }
+
+  if (precow != -1) {
+    snap_set_precow(heap, precow);
+  }
+
+  if (hugepages && snap_set_hugepages(heap, 1)) {
+    fprintf(stderr, "carrying on without huge pages\n");
+  }
+
+  if (cow_granule != -1) {
+    snap_set_cow_granule(heap, cow_granule);
+  }
+
+  snap_set_quota(heap, txn_quota, txn_page_quota, db_quota);
+  snap_set_verify(heap, verify_samples);
+
+  dbs[open_dbs++] = (struct open_db){
+      .path = strdup(path),
+      .heap = heap,
+      .used = ++db_clock,
+  };
+
+  return heap;
+}
+
+// use_db finds the database at path, opening and initializing it if it isn't
+// already.
+struct heap_header *use_db(const char *path) {
+  for (int i = 0; i < open_dbs; i++) {
+    if (!strcmp(dbs[i].path, path)) {
+      dbs[i].used = ++db_clock;
+      return dbs[i].heap;
+    }
+  }
+
+  struct heap_header *heap = load_db(path);
+  if (heap == NULL) {
+    return NULL;
+  }
+
+  if (init_db(heap)) {
+    close_db(open_dbs - 1);
+    return NULL;
+  }
+
+  return heap;
+}
+
+// next_sync_due returns the soonest any open database needs its group commits
+// flushed, or -1.
+long next_sync_due() {
+  long next = -1;
+
+  for (int i = 0; i < open_dbs; i++) {
+    long due = snap_sync_due(dbs[i].heap);
+    if (due >= 0 && (next < 0 || due < next)) {
+      next = due;
+    }
+  }
+
+  return next;
+}
+
+long elapsed_since(struct timespec since) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  return (now.tv_sec - since.tv_sec) * 1000000L +
+         (now.tv_nsec - since.tv_nsec) / 1000;
+}
+
+// respond writes out the response to a query along with how its time was
+// spent, and frees it.
+void respond(json_t *qr) {
+  // a response can't carry how long writing itself out took, so it carries
+  // how long the one before it took instead.
+  json_object_set_new(qr, "phases", phase_times());
+  if (last_serialize) {
+    json_object_set_new(qr, "last_serialize", last_serialize);
+    last_serialize = NULL;
+  }
+
+  enter_phase(PHASE_SERIALIZE);
+  char *r_str = json_dumps(qr, 0);
+  fputs(r_str, stdout);
+  fputs("\n", stdout);
+  fflush(stdout);
+  end_phase();
+
+  last_serialize = phase_time(PHASE_SERIALIZE);
+
+  json_decref(qr);
+  free(r_str);
+}
+
 void server_loop(struct heap_header *heap) {
+  struct heap_header *main_heap = heap;
+
+  struct timespec last_query;
+  clock_gettime(CLOCK_MONOTONIC, &last_query);
+  int hibernated = 0;
+
   for (;;) {
     char inbuff[4096];
 
+    // Use the time spent waiting on the next query to flush any group
+    // commits before their latency bound, and once we've sat idle for long
+    // enough to let go of the heaps until someone needs them again. A line
+    // already sitting in the stdin buffer just waits it out, the gateway
+    // never does this since it only sends a query once it has our last
+    // response.
+    for (;;) {
+      long wait = next_sync_due();
+      int hibernating = 0;
+
+      if (hibernate_after && !hibernated) {
+        long idle = hibernate_after * 1000000L - elapsed_since(last_query);
+        if (idle < 0) {
+          idle = 0;
+        }
+
+        if (wait < 0 || idle < wait) {
+          wait = idle;
+          hibernating = 1;
+        }
+      }
+
+      if (wait < 0) {
+        break;
+      }
+
+      struct pollfd in = {.fd = STDIN_FILENO, .events = POLLIN};
+      if (poll(&in, 1, (wait + 999) / 1000) != 0) {
+        break;
+      }
+
+      for (int i = 0; i < open_dbs; i++) {
+        if (hibernating) {
+          snap_hibernate(dbs[i].heap);
+        } else if (snap_sync_due(dbs[i].heap) >= 0) {
+          snap_sync(dbs[i].heap);
+        }
+      }
+
+      hibernated |= hibernating;
+    }
+
     if (!fgets(inbuff, 4096, stdin)) {
       return;
     }
@@ -93,7 +533,12 @@ void server_loop(struct heap_header *heap) {
       return;
     }
 
+    // the heap isn't known until the query's been parsed
+    reset_phases(NULL);
+    enter_phase(PHASE_PARSE);
+
     json_t *q = json_loads(inbuff, 0, NULL);
+    end_phase();
     if (!q) {
       fprintf(stderr, "unable to parse input\n");
       return;
@@ -105,6 +550,38 @@ void server_loop(struct heap_header *heap) {
       return;
     }
 
+    // queries can name any database, they all share this process
+    json_t *db = json_object_get(q, "db");
+    if (db) {
+      if (!json_is_string(db)) {
+        fprintf(stderr, "db should be a string\n");
+        json_decref(q);
+        return;
+      }
+
+      heap = use_db(json_string_value(db));
+      if (!heap) {
+        // every other database is still fine, only this query fails
+        char err[4096];
+        snprintf(
+            err, sizeof(err), "unable to open %s", json_string_value(db));
+        fprintf(stderr, "%s\n", err);
+        json_decref(q);
+
+        json_t *qr = json_object();
+        json_object_set_new(qr, "error", json_string(err));
+        respond(qr);
+        continue;
+      }
+    } else {
+      heap = main_heap;
+    }
+
+    phase_heap = heap;
+
+    struct snap_stats before, after;
+    snap_get_stats(heap, &before);
+
     json_t *gen = json_object_get(q, "gen");
     if (gen) {
       if (!json_is_integer(gen)) {
@@ -113,7 +590,9 @@ void server_loop(struct heap_header *heap) {
         return;
       }
 
+      enter_phase(PHASE_CHECKOUT);
       snap_checkout(heap, json_integer_value(gen));
+      end_phase();
     }
 
     json_t *args = json_object_get(q, "args");
@@ -138,23 +617,46 @@ void server_loop(struct heap_header *heap) {
     const char *code_str = json_string_value(code);
     enum evaler_status status;
 
-    int parent_gen = heap->committed->gen;
+    int parent_gen = snap_gen_id(heap, heap->committed);
 
+    enter_phase(PHASE_BEGIN);
     snap_begin_mut(heap);
 
+    // drivers that don't mark their own phases have it all put down as
+    // execute
+    enter_phase(PHASE_EXECUTE);
+    PROBE0(eval_start);
     json_t *result = do_eval(heap, code_str, args, &status);
+    PROBE1(eval_done, status);
 
+    // some of what it wrote had nowhere to go, there's nothing to keep
+    if (!status && snap_out_of_room(heap)) {
+      json_decref(result);
+      result = json_string("not enough memory");
+      status = USER_ERROR;
+    }
+
+    enter_phase(PHASE_COMMIT);
     int result_gen = snap_commit(heap);
+    end_phase();
 
     json_decref(q);
 
     json_t *qr = json_object();
 
+    // nothing can come of a rolled back generation, the pages it took go
+    // back to the heap for the next query.
     if (status) {
+      enter_phase(PHASE_ROLLBACK);
       snap_checkout(heap, parent_gen);
+      snap_discard(heap, result_gen);
+      end_phase();
       json_object_set_new(qr, "error", result);
     } else if (readonly) {
+      enter_phase(PHASE_ROLLBACK);
       snap_checkout(heap, parent_gen);
+      snap_discard(heap, result_gen);
+      end_phase();
       json_object_set_new(qr, "object", result);
     } else {
       json_object_set_new(qr, "object", result);
@@ -163,14 +665,18 @@ void server_loop(struct heap_header *heap) {
     json_object_set_new(qr, "gen", json_integer(result_gen));
     json_object_set_new(qr, "parent", json_integer(parent_gen));
 
-    char *r_str = json_dumps(qr, 0);
+    snap_get_stats(heap, &after);
+    json_object_set_new(qr, "alloc", alloc_delta(&before, &after));
+
+    int durable_gen = snap_durable_gen(heap);
+    if (durable_gen != -1) {
+      json_object_set_new(qr, "durable", json_integer(durable_gen));
+    }
 
-    fputs(r_str, stdout);
-    fputs("\n", stdout);
-    fflush(stdout);
+    respond(qr);
 
-    json_decref(qr);
-    free(r_str);
+    clock_gettime(CLOCK_MONOTONIC, &last_query);
+    hibernated = 0;
   }
 }
 
@@ -178,31 +684,147 @@ int main(int argc, char *argv[]) {
   struct gengetopt_args_info args;
   cmdline_parser(argc, argv, &args);
 
-  if (!args.noaslr_flag) {
-    int pers = personality(0xffffffff);
-    if (pers == -1) {
-      fprintf(stderr, "could not get personality %s\n", strerror(errno));
-      exit(1);
+  if (args.durability_given) {
+    if (!strcmp(args.durability_arg, "none")) {
+      durability = SNAP_DURABILITY_NONE;
+    } else if (!strcmp(args.durability_arg, "sync")) {
+      durability = SNAP_DURABILITY_SYNC;
+    } else if (!strcmp(args.durability_arg, "group")) {
+      durability = SNAP_DURABILITY_GROUP;
+    } else if (!strcmp(args.durability_arg, "wal")) {
+      durability = SNAP_DURABILITY_WAL;
+    } else {
+      fprintf(stderr, "unknown durability mode %s\n", args.durability_arg);
+      return 1;
     }
 
-    if (!(pers & ADDR_NO_RANDOMIZE)) {
-      if (personality(ADDR_NO_RANDOMIZE) == -1) {
-        fprintf(stderr, "could not set personality %s\n", strerror(errno));
-        exit(1);
-      }
+    durability_given = 1;
+    group_commits = args.group_commits_given ? args.group_commits_arg : 16;
+    group_latency_us =
+        (args.group_latency_given ? args.group_latency_arg : 5) * 1000L;
+  }
+
+  if (args.fault_around_given) {
+    if (args.fault_around_arg < 0 || args.fault_around_arg > FAULT_AROUND_MAX) {
+      fprintf(
+          stderr, "fault-around must be between 0 and %d\n", FAULT_AROUND_MAX);
+      return 1;
+    }
 
-      execve("/proc/self/exe", argv, NULL);
+    fault_around = args.fault_around_arg;
+  }
+
+  if (args.precow_given) {
+    if (args.precow_arg < 0 || args.precow_arg > HOT_PAGES) {
+      fprintf(stderr, "precow must be between 0 and %d\n", HOT_PAGES);
+      return 1;
+    }
+
+    precow = args.precow_arg;
+  }
+
+  hugepages = args.hugepages_flag;
+
+  if (args.hibernate_given) {
+    if (args.hibernate_arg < 1) {
+      fprintf(stderr, "hibernate must be at least a second\n");
+      return 1;
+    }
+
+    hibernate_after = args.hibernate_arg;
+  }
+
+  if (args.cow_granule_given) {
+    int g = args.cow_granule_arg;
+    if (g < 1 || g > COW_GRANULE_MAX || (g & (g - 1))) {
+      fprintf(
+          stderr,
+          "cow-granule must be a power of two between 1 and %d\n",
+          COW_GRANULE_MAX);
+      return 1;
+    }
+
+    cow_granule = g;
+  }
+
+  if ((args.txn_quota_given && args.txn_quota_arg < 0) ||
+      (args.txn_page_quota_given && args.txn_page_quota_arg < 0) ||
+      (args.db_quota_given && args.db_quota_arg < 0)) {
+    fprintf(stderr, "quotas can't be negative\n");
+    return 1;
+  }
+
+  // a query going over one just fails to allocate, which the interpreter
+  // reports as running out of memory and its generation gets rolled back
+  txn_quota = args.txn_quota_given ? (size_t)args.txn_quota_arg << 10 : 0;
+  txn_page_quota = args.txn_page_quota_given ? args.txn_page_quota_arg : 0;
+  db_quota = args.db_quota_given ? (size_t)args.db_quota_arg << 20 : 0;
+
+  if (args.verify_given) {
+    if (args.verify_arg < 0 || args.verify_arg > VERIFY_SAMPLES_MAX) {
+      fprintf(
+          stderr, "verify must be between 0 and %d\n", VERIFY_SAMPLES_MAX);
+      return 1;
+    }
+
+    verify_samples = args.verify_arg;
+  }
+
+  // the server's own database always stays open, so there has to be room
+  // for at least one more
+  if (args.max_dbs_given) {
+    if (args.max_dbs_arg < 2 || args.max_dbs_arg > MAX_OPEN_DBS) {
+      fprintf(stderr, "max-dbs must be between 2 and %d\n", MAX_OPEN_DBS);
+      return 1;
+    }
+
+    max_dbs = args.max_dbs_arg;
+  }
+
+  // started before anything's opened so the trace has the whole process
+  if (args.trace_given && snap_trace(args.trace_arg)) {
+    fprintf(stderr, "unable to start tracing to %s\n", args.trace_arg);
+    return 1;
+  }
+
+  if (args.compact_given && args.compact_arg < 0) {
+    fprintf(stderr, "compact age can't be negative\n");
+    return 1;
+  }
+
+  // these only look at the heap, so they're safe next to a running evaler
+  if (args.list_flag || args.usage_flag) {
+    struct heap_header *heap = snap_open_readonly(args.db_arg);
+    if (heap == NULL) {
+      fprintf(stderr, "unable to open %s\n", args.db_arg);
+      return 1;
     }
+
+    if (args.list_flag) {
+      list_generations(heap);
+    } else {
+      usage_db(heap);
+    }
+
+    snap_close(heap);
+    cmdline_parser_free(&args);
+
+    return 0;
   }
 
-  struct heap_header *heap = snap_init(args.db_arg);
+  struct heap_header *heap = load_db(args.db_arg);
   if (heap == NULL) {
     fprintf(stderr, "fatal, unable to create heap\n");
     return 1;
   }
 
-  if (args.list_flag) {
-    list_generations(heap);
+  if (args.compact_given) {
+    compact_db(heap, args.compact_arg);
+    goto cleanup;
+  }
+
+  if (args.relayout_flag) {
+    relayout_db(heap);
     goto cleanup;
   }
 
@@ -210,22 +832,8 @@ int main(int argc, char *argv[]) {
     snap_checkout(heap, args.checkout_arg);
   }
 
-  if (!heap->user_ptr) {
-#ifdef DEBUG_LOGGING
-    fprintf(stderr, "CREATING INITIAL STATE\n");
-#endif
-
-    if (create_init(heap)) {
-      fprintf(stderr, "fatal, unable to create evaler\n");
-      goto cleanup;
-    }
-
-    assert(heap->user_ptr != NULL);
-
-    snap_commit(heap);
-#ifdef DEBUG_LOGGING
-    fprintf(stderr, "CREATED INITIAL STATE\n");
-#endif
+  if (init_db(heap)) {
+    goto cleanup;
   }
 
   if (args.eval_given) {
@@ -239,6 +847,10 @@ int main(int argc, char *argv[]) {
 
 cleanup:
 
+  while (open_dbs) {
+    close_db(open_dbs - 1);
+  }
+
   cmdline_parser_free(&args);
 
   return 0;
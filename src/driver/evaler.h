@@ -16,3 +16,27 @@ json_t *do_eval(
     const char *code,
     json_t *args,
     enum evaler_status *status);
+
+// forget_db is called before a database is closed, the driver has to drop
+// anything it keeps about the heap outside of it since another database can
+// be opened at the same address.
+void forget_db(struct heap_header *heap);
+
+// the parts of a query a response breaks its time down into. The drivers
+// mark compile, execute, marshal and gc, the rest happen in server_loop.
+enum evaler_phase {
+  PHASE_PARSE,
+  PHASE_CHECKOUT,
+  PHASE_BEGIN,
+  PHASE_COMPILE,
+  PHASE_EXECUTE,
+  PHASE_MARSHAL,
+  PHASE_GC,
+  PHASE_COMMIT,
+  PHASE_ROLLBACK,
+  PHASE_SERIALIZE,
+  PHASE_COUNT,
+};
+
+void enter_phase(enum evaler_phase phase);
+void end_phase(void);
@@ -16,6 +16,8 @@ json_t *do_eval(
     json_t *args,
     enum evaler_status *status) {
 
+  enter_phase(PHASE_COMPILE);
+
   int argc = json_object_size(args);
 
   int premable_len = strlen(
@@ -79,6 +81,8 @@ json_t *do_eval(
     return jmsg;
   }
 
+  enter_phase(PHASE_MARSHAL);
+
   if (argc) {
     const char *key;
     json_t *value;
@@ -91,7 +95,9 @@ json_t *do_eval(
     }
   }
 
+  enter_phase(PHASE_EXECUTE);
   err = duk_pcall(ctx, argc);
+  enter_phase(PHASE_MARSHAL);
   if (err) {
     const char *msg = duk_safe_to_string(ctx, -1);
     json_t *jmsg = json_string(msg);
@@ -129,3 +135,6 @@ enum evaler_status create_init(struct heap_header *heap) {
 
   return OK;
 }
+
+// nothing about a heap is kept outside of it
+void forget_db(struct heap_header *heap) {}
@@ -1,6 +1,11 @@
+// MAP_ANONYMOUS and MAP_NORESERVE
+#define _GNU_SOURCE
+
+#include <errno.h>
 #include <jansson.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/mman.h>
 
 #include <assert.h>
 #include <stdlib.h>
@@ -30,6 +35,56 @@ void *lua_allocr(void *ud, void *ptr, size_t osize, size_t nsize) {
   return snap_malloc(heap, nsize);
 }
 
+// the collector's colors for each open heap. Lua keeps them in every object
+// it marks, so each collection would copy every live page of the heap just to
+// set and clear them. These live outside the heap instead, one byte for every
+// 8 bytes of it, and at is the working generation they were last left
+// describing.
+struct marks {
+  unsigned char *colors;
+  snap_off at;
+};
+
+static struct marks marks[HEAP_SLOTS];
+
+// use_marks points lua at heap's colors, rebuilding them if L has been checked
+// out, rolled back or reopened since they were last used.
+void use_marks(struct heap_header *heap, lua_State *L) {
+  struct marks *m =
+      &marks[((char *)heap - (char *)MAP_START_ADDR) / HEAP_SPAN];
+
+  if (!m->colors) {
+    void *colors = mmap(
+        NULL,
+        HEAP_SPAN / 8,
+        PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+        -1,
+        0);
+
+    // they stay in the objects, which only costs the copies
+    if (colors == MAP_FAILED) {
+      fprintf(stderr, "couldn't map gc marks: %s\n", strerror(errno));
+    } else {
+      m->colors = colors;
+      m->at = 0;
+    }
+  }
+
+  lua_setmarks(m->colors, heap);
+
+  if (L && m->at != heap->committed) {
+    lua_resetmarks(L);
+  }
+
+  m->at = heap->working;
+}
+
+// a database opened at the same address next can't go by these colors
+void forget_db(struct heap_header *heap) {
+  marks[((char *)heap - (char *)MAP_START_ADDR) / HEAP_SPAN].at = 0;
+}
+
 void unmarshal(lua_State *L, json_t *v) {
   lua_checkstack(L, 1);
   switch (json_typeof(v)) {
@@ -190,6 +245,8 @@ const char *lreader(lua_State *L, void *data, size_t *size) {
 }
 
 enum evaler_status create_init(struct heap_header *heap) {
+  use_marks(heap, NULL);
+
   lua_State *L = lua_newstate(lua_allocr, heap);
 
   if (!L) {
@@ -223,6 +280,10 @@ enum evaler_status create_init(struct heap_header *heap) {
   luaL_requiref(L, "utf8", luaopen_utf8, 1);
   lua_pop(L, 1);
 
+  // the gray lists are shared by every heap's state, so no cycle can be left
+  // half done
+  lua_gc(L, LUA_GCCOLLECT, 0);
+
   heap->user_ptr = L;
 
   return OK;
@@ -260,8 +321,12 @@ json_t *do_eval(
 
   lua_State *L = heap->user_ptr;
 
+  use_marks(heap, L);
+
   assert(lua_gettop(L) == 0);
 
+  enter_phase(PHASE_COMPILE);
+
   int error;
 
   int argc = json_object_size(args);
@@ -315,6 +380,8 @@ json_t *do_eval(
     goto abort;
   }
 
+  enter_phase(PHASE_MARSHAL);
+
   if (argc) {
     const char *key;
     json_t *value;
@@ -324,7 +391,9 @@ json_t *do_eval(
 
   assert(argc + 1 == lua_gettop(L));
 
+  enter_phase(PHASE_EXECUTE);
   error = lua_pcall(L, argc, 1, 0);
+  enter_phase(PHASE_MARSHAL);
   if (error) {
     result = marshal(L, 1, 0);
 
@@ -342,7 +411,9 @@ json_t *do_eval(
   *status = OK;
 
 abort:
+  enter_phase(PHASE_GC);
   lua_gc(L, LUA_GCCOLLECT, 0);
+  end_phase();
 
   if (ambled) {
     free(ambled);
@@ -0,0 +1,190 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "lz.h"
+
+uint32_t lz_hash(const unsigned char *at) {
+  uint32_t v;
+  memcpy(&v, at, sizeof(v));
+  return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+// lz_put_length writes whatever's left of a length that didn't fit in its
+// token.
+int lz_put_length(unsigned char *out, size_t *o, size_t max, size_t n) {
+  for (;; n -= 255) {
+    if (*o >= max) {
+      return -1;
+    }
+
+    out[(*o)++] = n < 255 ? n : 255;
+
+    if (n < 255) {
+      return 0;
+    }
+  }
+}
+
+// lz_get_length reads the rest of a length that topped out its token.
+int lz_get_length(
+    const unsigned char *in, size_t *i, size_t len, size_t *n) {
+  unsigned char b;
+
+  do {
+    if (*i >= len) {
+      return -1;
+    }
+
+    b = in[(*i)++];
+    *n += b;
+  } while (b == 255);
+
+  return 0;
+}
+
+// lz_put_sequence writes lit_len literals and then a match, or just the
+// literals when match is 0.
+int lz_put_sequence(
+    unsigned char *out,
+    size_t *o,
+    size_t max,
+    const unsigned char *lit,
+    size_t lit_len,
+    size_t offset,
+    size_t match) {
+  size_t match_len = match ? match - LZ_MIN_MATCH : 0;
+
+  if (*o >= max) {
+    return -1;
+  }
+
+  out[(*o)++] = (lit_len < 15 ? lit_len : 15) << 4 |
+                (match_len < 15 ? match_len : 15);
+
+  if (lit_len >= 15 && lz_put_length(out, o, max, lit_len - 15)) {
+    return -1;
+  }
+
+  if (lit_len > max - *o) {
+    return -1;
+  }
+
+  memcpy(out + *o, lit, lit_len);
+  *o += lit_len;
+
+  if (!match) {
+    return 0;
+  }
+
+  if (max - *o < 2) {
+    return -1;
+  }
+
+  out[(*o)++] = offset & 0xff;
+  out[(*o)++] = offset >> 8;
+
+  if (match_len >= 15 && lz_put_length(out, o, max, match_len - 15)) {
+    return -1;
+  }
+
+  return 0;
+}
+
+// lz_compress compresses len bytes of in into out. Returns how many bytes
+// that took, or -1 once it'd take more than max.
+long lz_compress(
+    const unsigned char *in, size_t len, unsigned char *out, size_t max) {
+  // positions are kept off by one so 0 can mean nothing's been seen yet
+  uint32_t table[1 << LZ_HASH_BITS];
+  memset(table, 0, sizeof(table));
+
+  size_t o = 0;
+  size_t anchor = 0;
+  size_t i = 0;
+
+  while (i + LZ_MIN_MATCH <= len) {
+    uint32_t h = lz_hash(in + i);
+    size_t seen = table[h];
+    table[h] = i + 1;
+
+    if (!seen || i - (seen - 1) > LZ_MAX_OFFSET ||
+        memcmp(in + seen - 1, in + i, LZ_MIN_MATCH)) {
+      i++;
+      continue;
+    }
+
+    size_t from = seen - 1;
+    size_t match = LZ_MIN_MATCH;
+    while (i + match < len && in[from + match] == in[i + match]) {
+      match++;
+    }
+
+    if (lz_put_sequence(
+            out, &o, max, in + anchor, i - anchor, i - from, match)) {
+      return -1;
+    }
+
+    i += match;
+    anchor = i;
+  }
+
+  if (lz_put_sequence(out, &o, max, in + anchor, len - anchor, 0, 0)) {
+    return -1;
+  }
+
+  return o;
+}
+
+// lz_decompress undoes lz_compress. Returns how many bytes were written to
+// out, or -1 if in is mangled or wouldn't fit in max.
+long lz_decompress(
+    const unsigned char *in, size_t len, unsigned char *out, size_t max) {
+  size_t i = 0;
+  size_t o = 0;
+
+  while (i < len) {
+    unsigned char token = in[i++];
+
+    size_t lit = token >> 4;
+    if (lit == 15 && lz_get_length(in, &i, len, &lit)) {
+      return -1;
+    }
+
+    if (lit > len - i || lit > max - o) {
+      return -1;
+    }
+
+    memcpy(out + o, in + i, lit);
+    i += lit;
+    o += lit;
+
+    if (i == len) {
+      break;
+    }
+
+    if (len - i < 2) {
+      return -1;
+    }
+
+    size_t offset = in[i] | (size_t)in[i + 1] << 8;
+    i += 2;
+
+    size_t match = token & 15;
+    if (match == 15 && lz_get_length(in, &i, len, &match)) {
+      return -1;
+    }
+    match += LZ_MIN_MATCH;
+
+    if (!offset || offset > o || match > max - o) {
+      return -1;
+    }
+
+    // a match can overlap what it's writing to repeat a short run, so this
+    // has to go a byte at a time
+    for (size_t j = 0; j < match; j++, o++) {
+      out[o] = out[o - offset];
+    }
+  }
+
+  return o;
+}
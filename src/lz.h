@@ -0,0 +1,26 @@
+#pragma once
+
+#include <stddef.h>
+
+// matches shorter than this aren't worth the bytes to point at them.
+#define LZ_MIN_MATCH 4
+
+// how far back a match can point, offsets are stored in 2 bytes.
+#define LZ_MAX_OFFSET 65535
+
+// LZ_HASH_BITS sizes the table of recently seen positions the compressor
+// looks matches up in.
+#define LZ_HASH_BITS 12
+
+// Compressed data is a list of sequences, each some literal bytes followed by
+// a match copying earlier output. A sequence starts with a token byte holding
+// the literal length in the top 4 bits and the match length (less
+// LZ_MIN_MATCH) in the bottom 4, either topping out at 15 and carrying on in
+// bytes of 255 until a smaller one. Then come the literals, the match's offset
+// as 2 little endian bytes, and the rest of the match length. The last
+// sequence is only literals.
+
+long lz_compress(
+    const unsigned char *in, size_t len, unsigned char *out, size_t max);
+long lz_decompress(
+    const unsigned char *in, size_t len, unsigned char *out, size_t max);
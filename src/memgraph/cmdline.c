@@ -40,6 +40,8 @@ const char *gengetopt_args_info_help[] = {
   "  -l, --labels     draw labels on nodes  (default=off)",
   "  -s, --segments   draw segments inside pages  (default=off)",
   "  -i, --history    draw links to ancestors  (default=off)",
+  "  -j, --json       print aggregate statistics as json instead of a graph\n                     (default=off)",
+  "  -u, --summary    draw one node per chain of generations with a sample of\n                     their pages  (default=off)",
     0
 };
 
@@ -72,6 +74,8 @@ void clear_given (struct gengetopt_args_info *args_info)
   args_info->labels_given = 0 ;
   args_info->segments_given = 0 ;
   args_info->history_given = 0 ;
+  args_info->json_given = 0 ;
+  args_info->summary_given = 0 ;
 }
 
 static
@@ -83,6 +87,8 @@ void clear_args (struct gengetopt_args_info *args_info)
   args_info->labels_flag = 0;
   args_info->segments_flag = 0;
   args_info->history_flag = 0;
+  args_info->json_flag = 0;
+  args_info->summary_flag = 0;
   
 }
 
@@ -97,6 +103,8 @@ void init_args_info(struct gengetopt_args_info *args_info)
   args_info->labels_help = gengetopt_args_info_help[3] ;
   args_info->segments_help = gengetopt_args_info_help[4] ;
   args_info->history_help = gengetopt_args_info_help[5] ;
+  args_info->json_help = gengetopt_args_info_help[6] ;
+  args_info->summary_help = gengetopt_args_info_help[7] ;
   
 }
 
@@ -230,6 +238,10 @@ cmdline_parser_dump(FILE *outfile, struct gengetopt_args_info *args_info)
     write_into_file(outfile, "segments", 0, 0 );
   if (args_info->history_given)
     write_into_file(outfile, "history", 0, 0 );
+  if (args_info->json_given)
+    write_into_file(outfile, "json", 0, 0 );
+  if (args_info->summary_given)
+    write_into_file(outfile, "summary", 0, 0 );
   
 
   i = EXIT_SUCCESS;
@@ -511,10 +523,12 @@ cmdline_parser_internal (
         { "labels",	0, NULL, 'l' },
         { "segments",	0, NULL, 's' },
         { "history",	0, NULL, 'i' },
+        { "json",	0, NULL, 'j' },
+        { "summary",	0, NULL, 'u' },
         { 0,  0, 0, 0 }
       };
 
-      c = getopt_long (argc, argv, "hVd:lsi", long_options, &option_index);
+      c = getopt_long (argc, argv, "hVd:lsiju", long_options, &option_index);
 
       if (c == -1) break;	/* Exit from `while (1)' loop.  */
 
@@ -572,6 +586,26 @@ cmdline_parser_internal (
             goto failure;
         
           break;
+        case 'j':	/* print aggregate statistics as json instead of a graph.  */
+        
+        
+          if (update_arg((void *)&(args_info->json_flag), 0, &(args_info->json_given),
+              &(local_args_info.json_given), optarg, 0, 0, ARG_FLAG,
+              check_ambiguity, override, 1, 0, "json", 'j',
+              additional_error))
+            goto failure;
+        
+          break;
+        case 'u':	/* draw one node per chain of generations with a sample of their pages.  */
+        
+        
+          if (update_arg((void *)&(args_info->summary_flag), 0, &(args_info->summary_given),
+              &(local_args_info.summary_given), optarg, 0, 0, ARG_FLAG,
+              check_ambiguity, override, 1, 0, "summary", 'u',
+              additional_error))
+            goto failure;
+        
+          break;
 
         case 0:	/* Long option with no short option */
         case '?':	/* Invalid option.  */
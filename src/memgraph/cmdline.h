@@ -48,6 +48,10 @@ struct gengetopt_args_info
   const char *segments_help; /**< @brief draw segments inside pages help description.  */
   int history_flag;	/**< @brief draw links to ancestors (default=off).  */
   const char *history_help; /**< @brief draw links to ancestors help description.  */
+  int json_flag;	/**< @brief print aggregate statistics as json instead of a graph (default=off).  */
+  const char *json_help; /**< @brief print aggregate statistics as json instead of a graph help description.  */
+  int summary_flag;	/**< @brief draw one node per chain of generations with a sample of their pages (default=off).  */
+  const char *summary_help; /**< @brief draw one node per chain of generations with a sample of their pages help description.  */
   
   unsigned int help_given ;	/**< @brief Whether help was given.  */
   unsigned int version_given ;	/**< @brief Whether version was given.  */
@@ -55,6 +59,8 @@ struct gengetopt_args_info
   unsigned int labels_given ;	/**< @brief Whether labels was given.  */
   unsigned int segments_given ;	/**< @brief Whether segments was given.  */
   unsigned int history_given ;	/**< @brief Whether history was given.  */
+  unsigned int json_given ;	/**< @brief Whether json was given.  */
+  unsigned int summary_given ;	/**< @brief Whether summary was given.  */
 
 } ;
 
@@ -13,7 +13,7 @@
 #include <sys/wait.h>
 #include <unistd.h>
 
-#include <sys/personality.h>
+#include <jansson.h>
 
 #include "../alloc.h"
 #include "./cmdline.h"
@@ -21,6 +21,7 @@
 int n = 0;
 
 static struct gengetopt_args_info args;
+static struct heap_header *heap;
 
 void print_node_connection(void *from, void *to);
 
@@ -60,22 +61,48 @@ void print_node(struct snap_node *n) {
     struct snap_page *p = (struct snap_page *)n;
     printf(
         " tooltip=\"%p\\nlen: %d\\npages: %d\"", (void *)n, p->len, p->pages);
-    if (p->real_addr == p) {
+    if (snap_at(heap, p->real_addr) == p) {
       printf(
           " label=\"%p\\nlen: %d\\npages: %d\"",
-          (void *)p->real_addr,
+          snap_at(heap, p->real_addr),
           p->len,
           p->pages);
       printf(" fillcolor=\"#88ff88\"");
     } else {
       printf(
           " label=\"%p\\nat %p\\nlen: %d\\npages: %d\"",
-          (void *)p->real_addr,
+          snap_at(heap, p->real_addr),
           (void *)p,
           p->len,
           p->pages);
       printf(" fillcolor=\"#ffff88\"");
     }
+  } else if (n->type == SNAP_NODE_DELTA) {
+    struct snap_delta *d = (struct snap_delta *)n;
+    printf(
+        " tooltip=\"%p\\ndelta: %u bytes\\nbase gen: %d\"",
+        (void *)n,
+        (unsigned)d->len,
+        d->base_gen);
+    printf(
+        " label=\"%p\\ndelta: %u bytes\\nbase gen: %d\"",
+        snap_at(heap, d->real_addr),
+        (unsigned)d->len,
+        d->base_gen);
+    printf(" fillcolor=\"#ffcc88\"");
+  } else if (n->type == SNAP_NODE_PACKED) {
+    struct snap_packed *p = (struct snap_packed *)n;
+    printf(
+        " tooltip=\"%p\\ncompressed: %u bytes\\npages: %d\"",
+        (void *)n,
+        (unsigned)p->len,
+        p->pages);
+    printf(
+        " label=\"%p\\ncompressed: %u bytes\\npages: %d\"",
+        snap_at(heap, p->real_addr),
+        (unsigned)p->len,
+        p->pages);
+    printf(" fillcolor=\"#88ccff\"");
   } else {
     printf(" label=\"%p\\nUNKNOWN\"", (void *)n);
     printf(" tooltip=\"%p\\nUNKNOWN\"", (void *)n);
@@ -113,31 +140,35 @@ void print_tree_nodes(struct snap_node *n) {
         continue;
       }
 
-      print_node_connection(g, g->c[i]);
-      print_tree_nodes(g->c[i]);
+      print_node_connection(g, snap_at(heap, g->c[i]));
+      print_tree_nodes(snap_at(heap, g->c[i]));
     }
   } else if (n->type == SNAP_NODE_PAGE) {
     if (args.segments_flag) {
       struct snap_page *p = (struct snap_page *)n;
       for (int i = 0; i < p->len; i++) {
-        print_node_connection(p, p->c[i]);
-        print_segment(p->c[i]);
+        print_node_connection(p, snap_segment_at(p, i));
+        print_segment(snap_segment_at(p, i));
       }
     }
+  } else if (n->type == SNAP_NODE_DELTA || n->type == SNAP_NODE_PACKED) {
+    // nothing hangs off an old version that isn't a page
   } else {
     printf("unknown node type %d at %p", n->type, (void *)n);
     exit(1);
   }
 }
 
-void *find_next_with_raddr(struct snap_generation *g, void *addr, int after) {
+void *
+find_next_with_raddr(struct snap_generation *g, snap_off addr, int after) {
   for (int i = 0; i < GENERATION_CHILDREN; i++) {
     if (!g->c[i]) {
       continue;
     }
 
-    struct snap_node *n2 = g->c[i];
-    if (n2->type == SNAP_NODE_PAGE) {
+    struct snap_node *n2 = snap_at(heap, g->c[i]);
+    if (n2->type == SNAP_NODE_PAGE || n2->type == SNAP_NODE_DELTA ||
+        n2->type == SNAP_NODE_PACKED) {
       struct snap_page *p = (struct snap_page *)n2;
 
       if (p->real_addr == addr && g->gen > after) {
@@ -163,12 +194,15 @@ void print_node_history(
       continue;
     }
 
-    struct snap_node *n = g->c[i];
+    struct snap_node *n = snap_at(heap, g->c[i]);
 
-    if (n->type == SNAP_NODE_PAGE) {
+    // deltas and compressed versions start out the same as a page so they can
+    // be followed the same way
+    if (n->type == SNAP_NODE_PAGE || n->type == SNAP_NODE_DELTA ||
+        n->type == SNAP_NODE_PACKED) {
       struct snap_page *p = (struct snap_page *)n;
 
-      if (p->real_addr != p) {
+      if (snap_at(heap, p->real_addr) != p) {
         printf(
             "\"%p\" -> \"%p\" ",
             (void *)p,
@@ -182,7 +216,7 @@ void print_node_history(
   }
 }
 
-void render_tree(struct heap_header *heap) {
+void render_tree() {
   printf("nodesep=0.0\n");
   printf("ranksep=0.1\n");
   /*printf("overlap=false\n");*/
@@ -191,45 +225,468 @@ void render_tree(struct heap_header *heap) {
   printf("\"working\" [shape=box fontsize=9 width=.1 height=.1]\n");
   printf("\"root\" [shape=box fontsize=9 width=.1 height=.1]\n");
 
-  printf("\"committed\" -> \"%p\" [arrowsize=.25]\n", (void *)heap->committed);
-  printf("\"working\" -> \"%p\" [arrowsize=.25]\n", (void *)heap->working);
-  printf("\"root\" -> \"%p\" [arrowsize=.25]\n", (void *)heap->root);
+  printf(
+      "\"committed\" -> \"%p\" [arrowsize=.25]\n",
+      snap_at(heap, heap->committed));
+  printf(
+      "\"working\" -> \"%p\" [arrowsize=.25]\n", snap_at(heap, heap->working));
+  printf("\"root\" -> \"%p\" [arrowsize=.25]\n", snap_at(heap, heap->root));
 
-  print_tree_nodes((struct snap_node *)heap->root);
+  print_tree_nodes(snap_at(heap, heap->root));
 
   if (args.history_flag) {
-    print_node_history(heap->root, heap->root);
+    print_node_history(snap_at(heap, heap->root), snap_at(heap, heap->root));
   }
 }
 
-int main(int argc, char *argv[]) {
-  int pers = personality(0xffffffff);
-  if (pers == -1) {
-    fprintf(stderr, "could not get personality %s\n", strerror(errno));
+// --json and --summary look at every node once without recursing, and only
+// keep a little per generation and per page address, so they keep up with
+// heaps far too big for dot to lay out.
+
+// pages drawn for each node of the summary
+#define SUMMARY_SAMPLE 4
+
+#define HIST_BUCKETS 64
+
+struct gen_info {
+  int present;
+  int parent;   // -1 for the root
+  int children; // generations branching off this one
+  long nodes;   // generation nodes it's split over
+  long pages;   // in page versions, counting each page they cover
+  long deltas;
+  long packed;
+
+  // the chain of generations with a single child it's collapsed into by
+  // --summary, and what that chain adds up to when this is its head.
+  int head;
+  int last;
+  int chain;
+  long chain_pages;
+  long chain_deltas;
+  long chain_packed;
+
+  int sampled;
+  struct snap_page *sample[SUMMARY_SAMPLE];
+};
+
+struct heap_stats {
+  struct gen_info *gens;
+  int ngens;
+
+  // versions of every page address, indexed by page
+  uint32_t *chains;
+  size_t nchains;
+
+  long gen_nodes;
+  long page_nodes;
+  long delta_nodes;
+  long packed_nodes;
+  long versions;
+  long home_pages;
+  long live_bytes;
+  long freed_bytes;
+  long unused_bytes;
+
+  long free_hist[11]; // home pages by the tenth of them that's free
+  long freed_hist[HIST_BUCKETS]; // freed segments by log2 size
+};
+
+int log2_bucket(unsigned long v) {
+  int b = 0;
+  while (v >>= 1) {
+    b++;
+  }
+
+  return b;
+}
+
+struct walk_entry {
+  snap_off off;
+  int owner; // generation the node belongs to, -1 above the root
+};
+
+void count_page(struct heap_stats *st, struct snap_page *p, int owner) {
+  struct gen_info *g = &st->gens[owner];
+
+  size_t i = p->real_addr / PAGE_SIZE;
+  if (i < st->nchains) {
+    st->chains[i]++;
+  }
+
+  st->versions += p->pages;
+
+  if (p->i.type == SNAP_NODE_DELTA) {
+    st->delta_nodes++;
+    g->deltas++;
+    return;
+  } else if (p->i.type == SNAP_NODE_PACKED) {
+    st->packed_nodes++;
+    g->packed++;
+    return;
+  }
+
+  st->page_nodes++;
+  g->pages += p->pages;
+
+  if (g->sampled < SUMMARY_SAMPLE) {
+    g->sample[g->sampled++] = p;
+  }
+
+  // only the version at home is part of what's checked out
+  if (snap_at(heap, p->real_addr) != p) {
+    return;
+  }
+
+  size_t size = p->pages * PAGE_SIZE;
+  long freed = 0;
+
+  for (int i = 0; i < p->len; i++) {
+    struct snap_segment *seg = snap_segment_at(p, i);
+
+    if (seg->used) {
+      st->live_bytes += seg->size;
+    } else {
+      freed += seg->size;
+      st->freed_hist[log2_bucket(seg->size)]++;
+    }
+  }
+
+  char *head_end =
+      (char *)p + sizeof(struct snap_page) + sizeof(size_t) * p->len;
+  char *data_start =
+      p->len ? (char *)snap_segment_at(p, p->len - 1) : (char *)p + size;
+  long unused = data_start > head_end ? data_start - head_end : 0;
+
+  st->home_pages += p->pages;
+  st->freed_bytes += freed;
+  st->unused_bytes += unused;
+  st->free_hist[(freed + unused) * 10 / size]++;
+}
+
+void collect_stats(struct heap_stats *st) {
+  *st = (struct heap_stats){0};
+
+  st->ngens = heap->last_gen_index + 1;
+  st->gens = calloc(st->ngens, sizeof(struct gen_info));
+  st->nchains = heap->size / PAGE_SIZE;
+  st->chains = calloc(st->nchains, sizeof(uint32_t));
+
+  size_t cap = 1024;
+  size_t len = 0;
+  struct walk_entry *stack = malloc(cap * sizeof(struct walk_entry));
+
+  if (!st->gens || !st->chains || !stack) {
+    fprintf(stderr, "out of memory\n");
     exit(1);
   }
 
-  if (!(pers & ADDR_NO_RANDOMIZE)) {
-    if (personality(ADDR_NO_RANDOMIZE) == -1) {
-      fprintf(stderr, "could not set personality %s\n", strerror(errno));
+  stack[len++] = (struct walk_entry){.off = heap->root, .owner = -1};
+
+  while (len) {
+    struct walk_entry e = stack[--len];
+    struct snap_node *n = snap_at(heap, e.off);
+
+    if (n->type != SNAP_NODE_GENERATION) {
+      if (e.owner < 0 || (n->type != SNAP_NODE_PAGE &&
+                          n->type != SNAP_NODE_DELTA &&
+                          n->type != SNAP_NODE_PACKED)) {
+        fprintf(stderr, "unknown node type %d at %p\n", n->type, (void *)n);
+        exit(1);
+      }
+
+      count_page(st, (struct snap_page *)n, e.owner);
+      continue;
+    }
+
+    struct snap_generation *g = (struct snap_generation *)n;
+    if (g->gen < 0 || g->gen >= st->ngens) {
+      fprintf(stderr, "generation %d at %p out of range\n", g->gen, (void *)g);
       exit(1);
     }
 
-    execve("/proc/self/exe", argv, NULL);
+    // a generation that's run out of children is split into more nodes with
+    // the same id
+    if (g->gen != e.owner) {
+      st->gens[g->gen].present = 1;
+      st->gens[g->gen].parent = e.owner;
+      if (e.owner >= 0) {
+        st->gens[e.owner].children++;
+      }
+    }
+
+    st->gen_nodes++;
+    st->gens[g->gen].nodes++;
+
+    if (len + GENERATION_CHILDREN > cap) {
+      cap *= 2;
+      stack = realloc(stack, cap * sizeof(struct walk_entry));
+      if (!stack) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+      }
+    }
+
+    for (int i = GENERATION_CHILDREN - 1; i >= 0; i--) {
+      if (g->c[i]) {
+        stack[len++] = (struct walk_entry){.off = g->c[i], .owner = g->gen};
+      }
+    }
+  }
+
+  free(stack);
+}
+
+// histogram turns counts by log2 bucket into an object keyed by each
+// bucket's smallest value, leaving out the empty ones.
+json_t *histogram(long *buckets, int n) {
+  json_t *h = json_object();
+
+  for (int i = 0; i < n; i++) {
+    if (buckets[i]) {
+      char key[24];
+      snprintf(key, sizeof(key), "%lu", 1UL << i);
+      json_object_set_new(h, key, json_integer(buckets[i]));
+    }
   }
 
+  return h;
+}
+
+json_t *distribution(long *buckets, long max, long total, long count) {
+  json_t *d = json_object();
+  json_object_set_new(d, "max", json_integer(max));
+  json_object_set_new(
+      d, "mean", json_real(count ? (double)total / count : 0));
+  json_object_set_new(d, "histogram", histogram(buckets, HIST_BUCKETS));
+
+  return d;
+}
+
+void print_json(struct heap_stats *st) {
+  json_t *out = json_object();
+
+  long generations = 0;
+  long gen_hist[HIST_BUCKETS] = {0};
+  long gen_max = 0;
+  long gen_total = 0;
+
+  for (int i = 0; i < st->ngens; i++) {
+    struct gen_info *g = &st->gens[i];
+    if (!g->present) {
+      continue;
+    }
+
+    generations++;
+    gen_total += g->pages;
+    if (g->pages > gen_max) {
+      gen_max = g->pages;
+    }
+    if (g->pages) {
+      gen_hist[log2_bucket(g->pages)]++;
+    }
+  }
+
+  long chain_hist[HIST_BUCKETS] = {0};
+  long chain_max = 0;
+  long chain_total = 0;
+  long addresses = 0;
+
+  for (size_t i = 0; i < st->nchains; i++) {
+    if (!st->chains[i]) {
+      continue;
+    }
+
+    addresses++;
+    chain_total += st->chains[i];
+    if (st->chains[i] > chain_max) {
+      chain_max = st->chains[i];
+    }
+    chain_hist[log2_bucket(st->chains[i])]++;
+  }
+
+  json_object_set_new(out, "size", json_integer(heap->size));
+  json_object_set_new(
+      out, "committed", json_integer(snap_gen_id(heap, heap->committed)));
+  json_object_set_new(
+      out, "working", json_integer(snap_gen_id(heap, heap->working)));
+  json_object_set_new(out, "generations", json_integer(generations));
+
+  json_t *nodes = json_object();
+  json_object_set_new(nodes, "generation", json_integer(st->gen_nodes));
+  json_object_set_new(nodes, "page", json_integer(st->page_nodes));
+  json_object_set_new(nodes, "delta", json_integer(st->delta_nodes));
+  json_object_set_new(nodes, "packed", json_integer(st->packed_nodes));
+  json_object_set_new(out, "nodes", nodes);
+
+  json_object_set_new(out, "versions", json_integer(st->versions));
+  json_object_set_new(out, "pages", json_integer(st->home_pages));
+
+  json_object_set_new(
+      out,
+      "pages_per_gen",
+      distribution(gen_hist, gen_max, gen_total, generations));
+  json_object_set_new(
+      out,
+      "chain_length",
+      distribution(chain_hist, chain_max, chain_total, addresses));
+
+  json_t *space = json_object();
+  json_object_set_new(space, "live_bytes", json_integer(st->live_bytes));
+  json_object_set_new(space, "freed_bytes", json_integer(st->freed_bytes));
+  json_object_set_new(space, "unused_bytes", json_integer(st->unused_bytes));
+
+  json_t *free_hist = json_object();
+  for (int i = 0; i <= 10; i++) {
+    if (st->free_hist[i]) {
+      char key[8];
+      snprintf(key, sizeof(key), "%d", i * 10);
+      json_object_set_new(free_hist, key, json_integer(st->free_hist[i]));
+    }
+  }
+  json_object_set_new(space, "percent_free", free_hist);
+  json_object_set_new(
+      space, "freed_segments", histogram(st->freed_hist, HIST_BUCKETS));
+  json_object_set_new(out, "free_space", space);
+
+  char *dump = json_dumps(out, JSON_INDENT(2));
+  puts(dump);
+  free(dump);
+  json_decref(out);
+}
+
+// render_summary draws each chain of generations that only ever had one child
+// as a single node, with a few of its pages hanging off it.
+void render_summary(struct heap_stats *st) {
+  // parents always get lower ids than their children
+  for (int i = 0; i < st->ngens; i++) {
+    struct gen_info *g = &st->gens[i];
+    if (!g->present) {
+      continue;
+    }
+
+    if (g->parent < 0 || st->gens[g->parent].children != 1) {
+      g->head = i;
+    } else {
+      g->head = st->gens[g->parent].head;
+    }
+
+    struct gen_info *h = &st->gens[g->head];
+    h->last = i;
+    h->chain++;
+    h->chain_pages += g->pages;
+    h->chain_deltas += g->deltas;
+    h->chain_packed += g->packed;
+
+    for (int j = 0; h != g && j < g->sampled && h->sampled < SUMMARY_SAMPLE;
+         j++) {
+      h->sample[h->sampled++] = g->sample[j];
+    }
+  }
+
+  printf("nodesep=0.1\n");
+  printf("ranksep=0.2\n");
+
+  int committed = snap_gen_id(heap, heap->committed);
+  int working = snap_gen_id(heap, heap->working);
+
+  for (int i = 0; i < st->ngens; i++) {
+    struct gen_info *g = &st->gens[i];
+    if (!g->present || g->head != i) {
+      continue;
+    }
+
+    printf("\"g%d\" [", i);
+    if (g->chain == 1) {
+      printf(" label=\"gen %d", i);
+    } else {
+      printf(" label=\"gens %d..%d (%d)", i, g->last, g->chain);
+    }
+    printf(
+        "\\n%ld pages\\n%ld deltas, %ld packed\"",
+        g->chain_pages,
+        g->chain_deltas,
+        g->chain_packed);
+    printf(" style=filled fontsize=9 shape=box penwidth=.5");
+    printf(" fillcolor=\"#aaaaff\"]\n");
+
+    if (g->parent >= 0) {
+      printf(
+          "\"g%d\" -> \"g%d\" [arrowsize=.25]\n",
+          st->gens[g->parent].head,
+          i);
+    }
+
+    for (int j = 0; j < g->sampled; j++) {
+      print_node((struct snap_node *)g->sample[j]);
+      printf(
+          "\"g%d\" -> \"%p\" [arrowsize=.25 style=dashed]\n",
+          i,
+          (void *)g->sample[j]);
+    }
+
+    long shown = 0;
+    for (int j = 0; j < g->sampled; j++) {
+      shown += g->sample[j]->pages;
+    }
+
+    if (g->chain_pages > shown) {
+      printf(
+          "\"g%d_more\" [label=\"+%ld pages\" shape=plaintext fontsize=9]\n",
+          i,
+          g->chain_pages - shown);
+      printf("\"g%d\" -> \"g%d_more\" [arrowsize=.25 style=dashed]\n", i, i);
+    }
+  }
+
+  printf("\"committed\" [shape=box fontsize=9 width=.1 height=.1]\n");
+  printf("\"working\" [shape=box fontsize=9 width=.1 height=.1]\n");
+
+  if (committed >= 0 && committed < st->ngens) {
+    printf(
+        "\"committed\" -> \"g%d\" [arrowsize=.25]\n",
+        st->gens[committed].head);
+  }
+  if (working >= 0 && working < st->ngens && st->gens[working].present) {
+    printf(
+        "\"working\" -> \"g%d\" [arrowsize=.25]\n", st->gens[working].head);
+  }
+}
+
+int main(int argc, char *argv[]) {
   cmdline_parser(argc, argv, &args);
 
-  struct heap_header *heap = snap_init(args.db_arg);
+  // only ever looks, so it can be pointed at a database an evaler has open
+  heap = snap_open_readonly(args.db_arg);
+  if (heap == NULL) {
+    exit(1);
+  }
 
-  if (heap->v != 0xffca) {
-    printf("got a bad heap! %d != %d (expected)", heap->v, 0xffca);
+  if (heap->v != HEAP_VERSION) {
+    printf("got a bad heap! %d != %d (expected)", heap->v, HEAP_VERSION);
     exit(1);
   }
 
+  if (args.json_flag || args.summary_flag) {
+    struct heap_stats st;
+    collect_stats(&st);
+
+    if (args.json_flag) {
+      print_json(&st);
+      return 0;
+    }
+
+    printf("digraph \"memory\" {\n");
+    printf("rankdir=LR\n");
+    render_summary(&st);
+    printf("}\n");
+
+    return 0;
+  }
+
   printf("digraph \"memory\" {\n");
   printf("rankdir=LR\n");
-  render_tree(heap);
+  render_tree();
 
   printf("}\n");
 
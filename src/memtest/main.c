@@ -1,7 +1,12 @@
+// getline and clock_gettime
+#define _XOPEN_SOURCE 700
+
 #include <assert.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #include "../alloc.h"
 
@@ -14,9 +19,290 @@ struct tracked_alloc {
   char used;
 };
 
+// latencies are counted in buckets of powers of two nanoseconds
+#define LATENCY_BUCKETS 48
+
+enum op_class {
+  OP_MALLOC,
+  OP_FREE,
+  OP_REALLOC,
+  OP_BEGIN_MUT,
+  OP_COMMIT,
+  OP_CLASSES,
+};
+
+const char *op_names[OP_CLASSES] = {
+    "malloc",
+    "free",
+    "realloc",
+    "begin_mut",
+    "commit",
+};
+
+struct op_timing {
+  long n;
+  long total_ns;
+  long max_ns;
+  long buckets[LATENCY_BUCKETS];
+};
+
+// addr_map maps the addresses a trace was recorded with to the ones the
+// replay got, which can differ once the heap it's replayed into does. Open
+// addressing, with to == NULL left behind by removals.
+struct addr_map {
+  uintptr_t *from;
+  void **to;
+  size_t cap;
+  size_t used; // slots with a from, removed ones included
+};
+
+size_t addr_slot(struct addr_map *m, uintptr_t from) {
+  size_t i = (from >> 4) * 11400714819323198485u & (m->cap - 1);
+
+  while (m->from[i] && m->from[i] != from) {
+    i = (i + 1) & (m->cap - 1);
+  }
+
+  return i;
+}
+
+void addr_put(struct addr_map *m, uintptr_t from, void *to) {
+  if ((m->used + 1) * 2 > m->cap) {
+    struct addr_map old = *m;
+
+    m->cap = old.cap ? old.cap * 2 : 1024;
+    m->from = calloc(m->cap, sizeof(uintptr_t));
+    m->to = calloc(m->cap, sizeof(void *));
+    m->used = 0;
+
+    for (size_t i = 0; i < old.cap; i++) {
+      if (old.from[i] && old.to[i]) {
+        size_t j = addr_slot(m, old.from[i]);
+        m->from[j] = old.from[i];
+        m->to[j] = old.to[i];
+        m->used++;
+      }
+    }
+
+    free(old.from);
+    free(old.to);
+  }
+
+  size_t i = addr_slot(m, from);
+  if (!m->from[i]) {
+    m->from[i] = from;
+    m->used++;
+  }
+  m->to[i] = to;
+}
+
+// addr_take removes from from the map, returning what it mapped to.
+void *addr_take(struct addr_map *m, uintptr_t from) {
+  if (!m->cap) {
+    return NULL;
+  }
+
+  size_t i = addr_slot(m, from);
+  void *to = m->from[i] ? m->to[i] : NULL;
+  m->to[i] = NULL;
+
+  return to;
+}
+
+long now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void record(struct op_timing *t, long ns) {
+  int b = 0;
+  while (b < LATENCY_BUCKETS - 1 && ns >> (b + 1)) {
+    b++;
+  }
+
+  t->n++;
+  t->total_ns += ns;
+  t->buckets[b]++;
+  if (ns > t->max_ns) {
+    t->max_ns = ns;
+  }
+}
+
+// bucket_percentile is the upper bound of the bucket the p'th percentile
+// latency landed in.
+long bucket_percentile(struct op_timing *t, int p) {
+  long want = (t->n * p + 99) / 100;
+  long seen = 0;
+
+  for (int b = 0; b < LATENCY_BUCKETS; b++) {
+    seen += t->buckets[b];
+    if (seen >= want) {
+      long upper = (2l << b) - 1;
+      return upper < t->max_ns ? upper : t->max_ns;
+    }
+  }
+
+  return t->max_ns;
+}
+
+void print_timing(const char *name, struct op_timing *t) {
+  printf(
+      "{\"op\": \"%s\", \"n\": %ld, \"total_ns\": %ld, "
+      "\"ops_per_sec\": %.1f, \"p50_ns\": %ld, \"p90_ns\": %ld, "
+      "\"p99_ns\": %ld, \"max_ns\": %ld, \"histogram\": [",
+      name,
+      t->n,
+      t->total_ns,
+      t->total_ns ? t->n / (t->total_ns / 1e9) : 0,
+      bucket_percentile(t, 50),
+      bucket_percentile(t, 90),
+      bucket_percentile(t, 99),
+      t->max_ns);
+
+  // each bucket as [lowest ns, count], leaving out empty ones
+  int first = 1;
+  for (int b = 0; b < LATENCY_BUCKETS; b++) {
+    if (t->buckets[b]) {
+      printf(
+          "%s[%ld, %ld]", first ? "" : ", ", b ? 1l << b : 0, t->buckets[b]);
+      first = 0;
+    }
+  }
+
+  printf("]}\n");
+}
+
+// replay_timed replays a log of any length as fast as it can, timing every
+// call instead of checking what it did.
+int replay_timed(char *db_path, const char *log_path) {
+  FILE *log = fopen(log_path, "r");
+  if (!log) {
+    fprintf(stderr, "could not open %s\n", log_path);
+    return 1;
+  }
+
+  struct heap_header *heap = snap_init(db_path);
+
+  struct op_timing timings[OP_CLASSES] = {{0}};
+  struct addr_map addrs = {0};
+  long events = 0;
+  long unmatched = 0;
+
+  char *line = NULL;
+  size_t line_cap = 0;
+
+  long start = now_ns();
+
+  while (getline(&line, &line_cap, log) > 0) {
+    // only the lines logged after a call returned say what it returned, the
+    // ones logged before it are left out
+    char *ret = strstr(line, "-> ");
+    char *args = strchr(line, ' ');
+    long before;
+
+    if (!strncmp(line, "snap_malloc ", 12)) {
+      if (!ret) {
+        continue;
+      }
+
+      long size = strtol(args + 1, NULL, 10);
+      uintptr_t traced = strtoull(ret + 3, NULL, 16);
+
+      before = now_ns();
+      void *ptr = snap_malloc(heap, size);
+      record(&timings[OP_MALLOC], now_ns() - before);
+
+      if (ptr) {
+        memset(ptr, used_ch, size);
+        addr_put(&addrs, traced, ptr);
+      }
+    } else if (!strncmp(line, "snap_free ", 10)) {
+      void *ptr = addr_take(&addrs, strtoull(args + 1, NULL, 16));
+      if (!ptr) {
+        unmatched++;
+        continue;
+      }
+
+      before = now_ns();
+      snap_free(heap, ptr);
+      record(&timings[OP_FREE], now_ns() - before);
+    } else if (!strncmp(line, "snap_realloc ", 13)) {
+      if (!ret) {
+        continue;
+      }
+
+      char *next;
+      uintptr_t traced = strtoull(args + 1, &next, 16);
+      long size = strtol(next, NULL, 10);
+      uintptr_t traced_result = strtoull(ret + 3, NULL, 16);
+
+      void *ptr = NULL;
+      if (traced) {
+        ptr = addr_take(&addrs, traced);
+        if (!ptr) {
+          unmatched++;
+          continue;
+        }
+      }
+
+      before = now_ns();
+      void *result = snap_realloc(heap, ptr, size);
+      record(&timings[OP_REALLOC], now_ns() - before);
+
+      if (result) {
+        memset(result, used_ch, size);
+        addr_put(&addrs, traced_result, result);
+      } else if (ptr && size) {
+        addr_put(&addrs, traced, ptr);
+      }
+    } else if (!strncmp(line, "snap_begin_mut", 14)) {
+      before = now_ns();
+      snap_begin_mut(heap);
+      record(&timings[OP_BEGIN_MUT], now_ns() - before);
+    } else if (!strncmp(line, "snap_commit", 11)) {
+      before = now_ns();
+      snap_commit(heap);
+      record(&timings[OP_COMMIT], now_ns() - before);
+    } else {
+      fprintf(stderr, "unknown command %s", line);
+      break;
+    }
+
+    events++;
+  }
+
+  long wall = now_ns() - start;
+
+  for (int i = 0; i < OP_CLASSES; i++) {
+    print_timing(op_names[i], &timings[i]);
+  }
+
+  printf(
+      "{\"events\": %ld, \"unmatched\": %ld, \"wall_ns\": %ld, "
+      "\"events_per_sec\": %.1f}\n",
+      events,
+      unmatched,
+      wall,
+      wall ? events / (wall / 1e9) : 0);
+
+  free(line);
+  free(addrs.from);
+  free(addrs.to);
+  fclose(log);
+  snap_close(heap);
+
+  return 0;
+}
+
 int main(int argc, char *argv[]) {
+  if (argc == 4 && !strcmp(argv[1], "-t")) {
+    return replay_timed(argv[2], argv[3]);
+  }
+
   if (argc < 3) {
-    fprintf(stderr, "usage: %s <db file> <log>\n", *argv);
+    fprintf(stderr, "usage: %s [-t] <db file> <log>\n", *argv);
+    fprintf(stderr, "  -t  time every call instead of checking them\n");
     exit(1);
   }
 
@@ -0,0 +1,56 @@
+#pragma once
+
+#include "config.h"
+
+// Static tracepoints perf and bpftrace can attach to as
+// usdt:<binary>:evaldb:<name>. Each one is a single nop plus an entry in the
+// .note.stapsdt section saying where it is and where its arguments live, the
+// same thing systemtap's sys/sdt.h emits, written out here rather than
+// depending on it. Arguments are all passed as 8 byte integers.
+//
+// Nothing happens at a probe until a tracer swaps its nop for a breakpoint, so
+// they're left in unless SNAP_PROBES is turned off in config.h.
+
+#if defined(SNAP_PROBES) && defined(__x86_64__)
+
+#define SNAP_PROBE_ASM(name, args)                                             \
+  "990: nop\n"                                                                 \
+  ".pushsection .note.stapsdt,\"?\",\"note\"\n"                                \
+  ".balign 4\n"                                                                \
+  ".4byte 992f-991f, 994f-993f, 3\n"                                           \
+  "991: .asciz \"stapsdt\"\n"                                                  \
+  "992: .balign 4\n"                                                           \
+  "993: .8byte 990b\n"                                                         \
+  ".8byte _.stapsdt.base\n"                                                    \
+  ".8byte 0\n"                                                                 \
+  ".asciz \"evaldb\"\n"                                                        \
+  ".asciz \"" #name "\"\n"                                                     \
+  ".asciz \"" args "\"\n"                                                      \
+  "994: .balign 4\n"                                                           \
+  ".popsection\n"                                                              \
+  ".ifndef _.stapsdt.base\n"                                                   \
+  ".pushsection .stapsdt.base,\"aG\",\"progbits\",.stapsdt.base,comdat\n"      \
+  ".weak _.stapsdt.base\n"                                                     \
+  ".hidden _.stapsdt.base\n"                                                   \
+  "_.stapsdt.base: .space 1\n"                                                 \
+  ".size _.stapsdt.base, 1\n"                                                  \
+  ".popsection\n"                                                              \
+  ".endif\n"
+
+#define PROBE0(name) __asm__ __volatile__(SNAP_PROBE_ASM(name, ""))
+
+#define PROBE1(name, a)                                                        \
+  __asm__ __volatile__(SNAP_PROBE_ASM(name, "-8@%0") : : "nor"((long)(a)))
+
+#define PROBE2(name, a, b)                                                     \
+  __asm__ __volatile__(                                                        \
+      SNAP_PROBE_ASM(name, "-8@%0 -8@%1") : : "nor"((long)(a)),               \
+      "nor"((long)(b)))
+
+#else
+
+#define PROBE0(name) ((void)0)
+#define PROBE1(name, a) ((void)0)
+#define PROBE2(name, a, b) ((void)0)
+
+#endif
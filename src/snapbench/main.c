@@ -0,0 +1,1534 @@
+// clock_gettime, fork and posix_fadvise, and syscall for perf_event_open
+#define _XOPEN_SOURCE 600
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/perf_event.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <time.h>
+
+#include "../alloc.h"
+#include "../wal.h"
+#include "../ws.h"
+
+int cmp_long(const void *a, const void *b) {
+  long l = *(const long *)a;
+  long r = *(const long *)b;
+  return (l > r) - (l < r);
+}
+
+long now_us() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+long now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+long percentile(long *sorted, int n, int p) {
+  int i = (n * p + 99) / 100 - 1;
+  if (i < 0) {
+    i = 0;
+  }
+
+  return sorted[i];
+}
+
+// run_durability commits txns transactions which each dirty a few fresh
+// allocations and prints one json line describing how the mode performed.
+// Every mode runs in its own process since the allocator only manages a
+// single heap at a time.
+void run_durability(
+    char *dir,
+    const char *name,
+    enum snap_durability mode,
+    int txns,
+    int writes) {
+  char db_path[4096];
+  snprintf(db_path, sizeof(db_path), "%s/durability-%s.db", dir, name);
+  unlink(db_path);
+  wal_discard(db_path);
+
+  struct heap_header *heap = snap_init(db_path);
+  snap_set_durability(heap, mode, 16, 5000);
+
+  // a fresh heap starts out inside the transaction for its first generation
+  heap->user_ptr = snap_malloc(heap, 1);
+  snap_commit(heap);
+
+  long *commit_us = calloc(txns, sizeof(long));
+  long start = now_us();
+
+  for (int i = 0; i < txns; i++) {
+    snap_begin_mut(heap);
+
+    for (int j = 0; j < writes; j++) {
+      char *p = snap_malloc(heap, 64);
+      memset(p, i, 64);
+    }
+
+    long before = now_us();
+    snap_commit(heap);
+    commit_us[i] = now_us() - before;
+  }
+
+  snap_sync(heap);
+
+  long total = now_us() - start;
+
+  qsort(commit_us, txns, sizeof(long), cmp_long);
+
+  printf(
+      "{\"mode\": \"%s\", \"txns\": %d, \"writes\": %d, \"tps\": %.1f, "
+      "\"commit_p50_us\": %ld, \"commit_p99_us\": %ld, "
+      "\"commit_max_us\": %ld}\n",
+      name,
+      txns,
+      writes,
+      txns / (total / 1e6),
+      percentile(commit_us, txns, 50),
+      percentile(commit_us, txns, 99),
+      commit_us[txns - 1]);
+
+  free(commit_us);
+}
+
+int durability(int argc, char *argv[]) {
+  if (argc < 1) {
+    fprintf(stderr, "usage: snapbench durability <dir> [txns] [writes]\n");
+    return 1;
+  }
+
+  char *dir = argv[0];
+  int txns = argc > 1 ? atoi(argv[1]) : 1000;
+  int writes = argc > 2 ? atoi(argv[2]) : 8;
+
+  if (txns < 1 || writes < 0) {
+    fprintf(stderr, "txns must be positive and writes not negative\n");
+    return 1;
+  }
+
+  if (mkdir(dir, 0755) && errno != EEXIST) {
+    fprintf(stderr, "could not create %s: %s\n", dir, strerror(errno));
+    return 1;
+  }
+
+  struct {
+    const char *name;
+    enum snap_durability mode;
+  } modes[] = {
+      {"none", SNAP_DURABILITY_NONE},
+      {"sync", SNAP_DURABILITY_SYNC},
+      {"group", SNAP_DURABILITY_GROUP},
+      {"wal", SNAP_DURABILITY_WAL},
+  };
+
+  for (size_t i = 0; i < sizeof(modes) / sizeof(*modes); i++) {
+    fflush(stdout);
+
+    pid_t pid = fork();
+    if (pid == 0) {
+      run_durability(dir, modes[i].name, modes[i].mode, txns, writes);
+      exit(0);
+    }
+
+    int status;
+    waitpid(pid, &status, 0);
+    if (!WIFEXITED(status) || WEXITSTATUS(status)) {
+      fprintf(stderr, "%s run failed\n", modes[i].name);
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+// roughly a page each so the working set is spread all over the heap
+#define COLDSTART_BLOCK 4000
+
+struct coldstart_data {
+  size_t count;
+  char *blocks[];
+};
+
+// touch_blocks reads every stride'th block the way a query reading part of
+// the heap would.
+unsigned long touch_blocks(struct heap_header *heap, int stride) {
+  struct coldstart_data *data = heap->user_ptr;
+  unsigned long sum = 0;
+
+  for (size_t i = 0; i < data->count; i += stride) {
+    for (int j = 0; j < COLDSTART_BLOCK; j += 512) {
+      sum += (unsigned char)data->blocks[i][j];
+    }
+  }
+
+  return sum;
+}
+
+// drop_cache pushes the db out of the page cache so the next open has to go
+// to the disk for it.
+int drop_cache(const char *db_path) {
+  int fd = open(db_path, O_RDONLY);
+  if (fd == -1) {
+    fprintf(stderr, "could not open %s: %s\n", db_path, strerror(errno));
+    return -1;
+  }
+
+  fdatasync(fd);
+  posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+  close(fd);
+
+  return 0;
+}
+
+void run_coldstart(char *db_path, const char *name, int stride) {
+  long start = now_us();
+  struct heap_header *heap = snap_init(db_path);
+  long opened = now_us();
+
+  unsigned long sum = touch_blocks(heap, stride);
+  long queried = now_us();
+
+  printf(
+      "{\"mode\": \"%s\", \"open_us\": %ld, \"first_query_us\": %ld, "
+      "\"total_us\": %ld, \"sum\": %lu}\n",
+      name,
+      opened - start,
+      queried - opened,
+      queried - start,
+      sum);
+}
+
+int coldstart(int argc, char *argv[]) {
+  if (argc < 1) {
+    fprintf(stderr, "usage: snapbench coldstart <dir> [mb] [stride]\n");
+    return 1;
+  }
+
+  char *dir = argv[0];
+  int mb = argc > 1 ? atoi(argv[1]) : 16;
+  int stride = argc > 2 ? atoi(argv[2]) : 4;
+
+  if (mb < 1 || stride < 1) {
+    fprintf(stderr, "mb and stride must be positive\n");
+    return 1;
+  }
+
+  if (mkdir(dir, 0755) && errno != EEXIST) {
+    fprintf(stderr, "could not create %s: %s\n", dir, strerror(errno));
+    return 1;
+  }
+
+  char db_path[4096];
+  snprintf(db_path, sizeof(db_path), "%s/coldstart.db", dir);
+  unlink(db_path);
+  wal_discard(db_path);
+  ws_discard(db_path);
+
+  char ws_path[4096 + 16];
+  char ws_aside[4096 + 16];
+  snprintf(ws_path, sizeof(ws_path), "%s.ws", db_path);
+  snprintf(ws_aside, sizeof(ws_aside), "%s.ws.aside", db_path);
+
+  size_t count = ((size_t)mb << 20) / 4096;
+
+  // build the heap, then open it once more and run a query over it so the
+  // working set gets recorded the way an evaler would.
+  pid_t pid = fork();
+  if (pid == 0) {
+    struct heap_header *heap = snap_init(db_path);
+
+    struct coldstart_data *data =
+        snap_malloc(heap, sizeof(*data) + count * sizeof(char *));
+    data->count = count;
+
+    for (size_t i = 0; i < count; i++) {
+      data->blocks[i] = snap_malloc(heap, COLDSTART_BLOCK);
+      memset(data->blocks[i], i, COLDSTART_BLOCK);
+    }
+
+    heap->user_ptr = data;
+    snap_commit(heap);
+    snap_close(heap);
+
+    heap = snap_init(db_path);
+    touch_blocks(heap, stride);
+    snap_begin_mut(heap);
+    snap_commit(heap);
+    snap_close(heap);
+
+    exit(0);
+  }
+
+  int status;
+  waitpid(pid, &status, 0);
+  if (!WIFEXITED(status) || WEXITSTATUS(status)) {
+    fprintf(stderr, "building the heap failed\n");
+    return 1;
+  }
+
+  struct {
+    const char *name;
+    int prefetch;
+  } modes[] = {
+      {"cold", 0},
+      {"prefetch", 1},
+  };
+
+  for (size_t i = 0; i < sizeof(modes) / sizeof(*modes); i++) {
+    if (!modes[i].prefetch && rename(ws_path, ws_aside)) {
+      fprintf(stderr, "no working set was recorded\n");
+      return 1;
+    } else if (modes[i].prefetch && rename(ws_aside, ws_path)) {
+      fprintf(stderr, "could not restore the working set\n");
+      return 1;
+    }
+
+    if (drop_cache(db_path)) {
+      return 1;
+    }
+
+    fflush(stdout);
+
+    // the run never commits so it leaves the working set alone
+    pid = fork();
+    if (pid == 0) {
+      run_coldstart(db_path, modes[i].name, stride);
+      exit(0);
+    }
+
+    waitpid(pid, &status, 0);
+    if (!WIFEXITED(status) || WEXITSTATUS(status)) {
+      fprintf(stderr, "%s run failed\n", modes[i].name);
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+// run_faultaround builds a heap of blocks, then has every transaction write
+// through a run of them in order the way a bulk update would.
+void run_faultaround(char *dir, int pages, size_t count, int txns, int run) {
+  char db_path[4096];
+  snprintf(db_path, sizeof(db_path), "%s/faultaround-%d.db", dir, pages);
+  unlink(db_path);
+  wal_discard(db_path);
+  ws_discard(db_path);
+
+  struct heap_header *heap = snap_init(db_path);
+  snap_set_fault_around(heap, pages);
+
+  struct coldstart_data *data =
+      snap_malloc(heap, sizeof(*data) + count * sizeof(char *));
+  data->count = count;
+
+  for (size_t i = 0; i < count; i++) {
+    data->blocks[i] = snap_malloc(heap, COLDSTART_BLOCK);
+    memset(data->blocks[i], 0, COLDSTART_BLOCK);
+  }
+
+  heap->user_ptr = data;
+  snap_commit(heap);
+
+  struct snap_stats before;
+  snap_get_stats(heap, &before);
+
+  long start = now_us();
+
+  for (int i = 0; i < txns; i++) {
+    snap_begin_mut(heap);
+
+    size_t first = (size_t)i * run % count;
+    for (int j = 0; j < run; j++) {
+      data->blocks[(first + j) % count][0] = i;
+    }
+
+    snap_commit(heap);
+  }
+
+  long total = now_us() - start;
+
+  struct snap_stats after;
+  snap_get_stats(heap, &after);
+
+  printf(
+      "{\"fault_around\": %d, \"txns\": %d, \"run\": %d, \"tps\": %.1f, "
+      "\"faults\": %ld, \"pages_copied\": %ld, "
+      "\"fault_around_pages\": %ld, \"faults_avoided\": %ld}\n",
+      pages,
+      txns,
+      run,
+      txns / (total / 1e6),
+      after.faults - before.faults,
+      after.pages_copied - before.pages_copied,
+      after.fault_around_pages - before.fault_around_pages,
+      after.faults_avoided - before.faults_avoided);
+
+  snap_close(heap);
+}
+
+int faultaround(int argc, char *argv[]) {
+  if (argc < 1) {
+    fprintf(stderr, "usage: snapbench faultaround <dir> [txns] [run]\n");
+    return 1;
+  }
+
+  char *dir = argv[0];
+  int txns = argc > 1 ? atoi(argv[1]) : 100;
+  int run = argc > 2 ? atoi(argv[2]) : 32;
+
+  if (txns < 1 || run < 1) {
+    fprintf(stderr, "txns and run must be positive\n");
+    return 1;
+  }
+
+  if (mkdir(dir, 0755) && errno != EEXIST) {
+    fprintf(stderr, "could not create %s: %s\n", dir, strerror(errno));
+    return 1;
+  }
+
+  int windows[] = {0, FAULT_AROUND_PAGES, FAULT_AROUND_MAX};
+
+  for (size_t i = 0; i < sizeof(windows) / sizeof(*windows); i++) {
+    fflush(stdout);
+
+    pid_t pid = fork();
+    if (pid == 0) {
+      run_faultaround(dir, windows[i], (size_t)run * 8, txns, run);
+      exit(0);
+    }
+
+    int status;
+    waitpid(pid, &status, 0);
+    if (!WIFEXITED(status) || WEXITSTATUS(status)) {
+      fprintf(stderr, "fault-around %d run failed\n", windows[i]);
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+// run_precow has every transaction write to the same few hot blocks plus one
+// other block, the way an interpreter keeps touching its globals.
+void run_precow(char *dir, int pages, int hot, int txns) {
+  char db_path[4096];
+  snprintf(db_path, sizeof(db_path), "%s/precow-%d.db", dir, pages);
+  unlink(db_path);
+  wal_discard(db_path);
+  ws_discard(db_path);
+
+  struct heap_header *heap = snap_init(db_path);
+  snap_set_precow(heap, pages);
+
+  // the hot blocks are spread out so fault-around can't pick them up
+  snap_set_fault_around(heap, 0);
+
+  size_t count = (size_t)hot * 16;
+  struct coldstart_data *data =
+      snap_malloc(heap, sizeof(*data) + count * sizeof(char *));
+  data->count = count;
+
+  for (size_t i = 0; i < count; i++) {
+    data->blocks[i] = snap_malloc(heap, COLDSTART_BLOCK);
+    memset(data->blocks[i], 0, COLDSTART_BLOCK);
+  }
+
+  heap->user_ptr = data;
+  snap_commit(heap);
+
+  struct snap_stats before;
+  snap_get_stats(heap, &before);
+
+  long start = now_us();
+
+  for (int i = 0; i < txns; i++) {
+    snap_begin_mut(heap);
+
+    for (int j = 0; j < hot; j++) {
+      data->blocks[j * 16][0] = i;
+    }
+    data->blocks[(size_t)i * 7 % count][1] = i;
+
+    snap_commit(heap);
+  }
+
+  long total = now_us() - start;
+
+  struct snap_stats after;
+  snap_get_stats(heap, &after);
+
+  printf(
+      "{\"precow\": %d, \"txns\": %d, \"hot\": %d, \"tps\": %.1f, "
+      "\"faults\": %ld, \"precow_pages\": %ld, \"precow_hits\": %ld, "
+      "\"precow_misses\": %ld}\n",
+      pages,
+      txns,
+      hot,
+      txns / (total / 1e6),
+      after.faults - before.faults,
+      after.precow_pages - before.precow_pages,
+      after.precow_hits - before.precow_hits,
+      after.precow_misses - before.precow_misses);
+
+  snap_close(heap);
+}
+
+int precow(int argc, char *argv[]) {
+  if (argc < 1) {
+    fprintf(stderr, "usage: snapbench precow <dir> [txns] [hot]\n");
+    return 1;
+  }
+
+  char *dir = argv[0];
+  int txns = argc > 1 ? atoi(argv[1]) : 200;
+  int hot = argc > 2 ? atoi(argv[2]) : 8;
+
+  if (txns < 1 || hot < 1) {
+    fprintf(stderr, "txns and hot must be positive\n");
+    return 1;
+  }
+
+  if (mkdir(dir, 0755) && errno != EEXIST) {
+    fprintf(stderr, "could not create %s: %s\n", dir, strerror(errno));
+    return 1;
+  }
+
+  int limits[] = {0, PRECOW_PAGES};
+
+  for (size_t i = 0; i < sizeof(limits) / sizeof(*limits); i++) {
+    fflush(stdout);
+
+    pid_t pid = fork();
+    if (pid == 0) {
+      run_precow(dir, limits[i], hot, txns);
+      exit(0);
+    }
+
+    int status;
+    waitpid(pid, &status, 0);
+    if (!WIFEXITED(status) || WEXITSTATUS(status)) {
+      fprintf(stderr, "precow %d run failed\n", limits[i]);
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+// heap_end is how far into the file the heap has actually put anything, the
+// file itself grows in big steps.
+size_t heap_end(struct heap_header *heap) {
+  struct snap_page *last = snap_at(heap, heap->last_page);
+  return heap->last_page + last->pages * (size_t)sysconf(_SC_PAGESIZE);
+}
+
+// run_history makes a long history of small edits to a few blocks and then
+// checks out older and older generations, so every checkout has to rebuild
+// pages from a longer chain of deltas.
+void run_history(char *dir, int deltas, int blocks, int txns) {
+  char db_path[4096];
+  snprintf(db_path, sizeof(db_path), "%s/history-%d.db", dir, deltas);
+  unlink(db_path);
+  wal_discard(db_path);
+  ws_discard(db_path);
+
+  struct heap_header *heap = snap_init(db_path);
+  snap_set_deltas(heap, deltas);
+
+  struct coldstart_data *data =
+      snap_malloc(heap, sizeof(*data) + blocks * sizeof(char *));
+  data->count = blocks;
+
+  for (int i = 0; i < blocks; i++) {
+    data->blocks[i] = snap_malloc(heap, COLDSTART_BLOCK);
+    memset(data->blocks[i], 0, COLDSTART_BLOCK);
+  }
+
+  heap->user_ptr = data;
+
+  int *gens = malloc(txns * sizeof(int));
+  gens[0] = snap_commit(heap);
+
+  long start = now_us();
+
+  for (int i = 1; i < txns; i++) {
+    snap_begin_mut(heap);
+    long *at = (long *)(data->blocks[i % blocks] + i * 64 % COLDSTART_BLOCK);
+    *at = i;
+    gens[i] = snap_commit(heap);
+  }
+
+  long total = now_us() - start;
+
+  struct snap_stats stats;
+  snap_get_stats(heap, &stats);
+
+  struct stat st;
+  stat(db_path, &st);
+
+  printf(
+      "{\"deltas\": %d, \"txns\": %d, \"tps\": %.1f, \"file_bytes\": %ld, "
+      "\"heap_bytes\": %lu, \"deltas_encoded\": %ld, \"delta_bytes\": %ld",
+      deltas,
+      txns,
+      (txns - 1) / (total / 1e6),
+      (long)st.st_size,
+      (unsigned long)heap_end(heap),
+      stats.deltas_encoded,
+      stats.delta_bytes);
+
+  // each checkout goes further back than the last, the way back to the head
+  // is cheap again since those versions were kept whole
+  int head = gens[txns - 1];
+  for (int depth = 1; depth < txns; depth *= 4) {
+    long t = now_us();
+    snap_checkout(heap, gens[txns - 1 - depth]);
+    snap_checkout(heap, head);
+    printf(", \"checkout_%d_us\": %ld", depth, now_us() - t);
+  }
+
+  snap_get_stats(heap, &stats);
+  printf(", \"pages_materialized\": %ld}\n", stats.pages_materialized);
+
+  free(gens);
+  snap_close(heap);
+}
+
+int history(int argc, char *argv[]) {
+  if (argc < 1) {
+    fprintf(stderr, "usage: snapbench history <dir> [txns] [blocks]\n");
+    return 1;
+  }
+
+  char *dir = argv[0];
+  int txns = argc > 1 ? atoi(argv[1]) : 2000;
+  int blocks = argc > 2 ? atoi(argv[2]) : 16;
+
+  if (txns < 2 || blocks < 1) {
+    fprintf(stderr, "txns must be at least 2 and blocks positive\n");
+    return 1;
+  }
+
+  if (mkdir(dir, 0755) && errno != EEXIST) {
+    fprintf(stderr, "could not create %s: %s\n", dir, strerror(errno));
+    return 1;
+  }
+
+  for (int deltas = 0; deltas <= 1; deltas++) {
+    fflush(stdout);
+
+    pid_t pid = fork();
+    if (pid == 0) {
+      run_history(dir, deltas, blocks, txns);
+      exit(0);
+    }
+
+    int status;
+    waitpid(pid, &status, 0);
+    if (!WIFEXITED(status) || WEXITSTATUS(status)) {
+      fprintf(stderr, "history run with deltas %d failed\n", deltas);
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+// put_record fills the 32 bytes at at with a short json record.
+void put_record(char *at, int key, int value) {
+  char rec[64] = {0};
+  snprintf(rec, sizeof(rec), "{\"key\": %d, \"value\": %d}", key, value);
+  memcpy(at, rec, 32);
+}
+
+// run_compact builds a history of full page versions (deltas are turned off
+// so there's something to compress) filled with the kind of repetitive records
+// an interpreter keeps, compresses everything at least age generations old
+// and then times checkouts further and further back. An age below 0 skips
+// compressing.
+void run_compact(char *dir, int age, int blocks, int txns) {
+  char db_path[4096];
+  snprintf(db_path, sizeof(db_path), "%s/compact-%d.db", dir, age);
+  unlink(db_path);
+  wal_discard(db_path);
+  ws_discard(db_path);
+
+  struct heap_header *heap = snap_init(db_path);
+  snap_set_deltas(heap, 0);
+
+  struct coldstart_data *data =
+      snap_malloc(heap, sizeof(*data) + blocks * sizeof(char *));
+  data->count = blocks;
+
+  for (int i = 0; i < blocks; i++) {
+    data->blocks[i] = snap_malloc(heap, COLDSTART_BLOCK);
+    for (int j = 0; j + 32 <= COLDSTART_BLOCK; j += 32) {
+      put_record(data->blocks[i] + j, j, i);
+    }
+  }
+
+  heap->user_ptr = data;
+
+  int *gens = malloc(txns * sizeof(int));
+  gens[0] = snap_commit(heap);
+
+  for (int i = 1; i < txns; i++) {
+    snap_begin_mut(heap);
+    char *at = data->blocks[i % blocks] + i * 32 % (COLDSTART_BLOCK - 32);
+    put_record(at, i, i * 7);
+    gens[i] = snap_commit(heap);
+  }
+
+  struct snap_stats stats;
+  snap_get_stats(heap, &stats);
+
+  long start = now_us();
+  if (age >= 0) {
+    snap_compact(heap, age);
+  }
+  long took = now_us() - start;
+
+  struct snap_stats after;
+  snap_get_stats(heap, &after);
+
+  long from = after.packed_from - stats.packed_from;
+  long to = after.packed_bytes - stats.packed_bytes;
+
+  printf(
+      "{\"age\": %d, \"txns\": %d, \"compact_us\": %ld, "
+      "\"pages_packed\": %ld, \"packed_from\": %ld, \"packed_bytes\": %ld, "
+      "\"ratio\": %.2f",
+      age,
+      txns,
+      took,
+      after.pages_packed - stats.pages_packed,
+      from,
+      to,
+      to ? (double)from / to : 0);
+
+  int head = gens[txns - 1];
+  for (int depth = 1; depth < txns; depth *= 4) {
+    long t = now_us();
+    snap_checkout(heap, gens[txns - 1 - depth]);
+    snap_checkout(heap, head);
+    printf(", \"checkout_%d_us\": %ld", depth, now_us() - t);
+  }
+
+  snap_get_stats(heap, &after);
+  printf(
+      ", \"pages_unpacked\": %ld}\n",
+      after.pages_unpacked - stats.pages_unpacked);
+
+  free(gens);
+  snap_close(heap);
+}
+
+int compact(int argc, char *argv[]) {
+  if (argc < 1) {
+    fprintf(stderr, "usage: snapbench compact <dir> [txns] [blocks]\n");
+    return 1;
+  }
+
+  char *dir = argv[0];
+  int txns = argc > 1 ? atoi(argv[1]) : 1000;
+  int blocks = argc > 2 ? atoi(argv[2]) : 16;
+
+  if (txns < 2 || blocks < 1) {
+    fprintf(stderr, "txns must be at least 2 and blocks positive\n");
+    return 1;
+  }
+
+  if (mkdir(dir, 0755) && errno != EEXIST) {
+    fprintf(stderr, "could not create %s: %s\n", dir, strerror(errno));
+    return 1;
+  }
+
+  int ages[] = {-1, txns / 2, txns / 8, 0};
+
+  for (size_t i = 0; i < sizeof(ages) / sizeof(*ages); i++) {
+    fflush(stdout);
+
+    pid_t pid = fork();
+    if (pid == 0) {
+      run_compact(dir, ages[i], blocks, txns);
+      exit(0);
+    }
+
+    int status;
+    waitpid(pid, &status, 0);
+    if (!WIFEXITED(status) || WEXITSTATUS(status)) {
+      fprintf(stderr, "compact run with age %d failed\n", ages[i]);
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+// open_tlb_misses starts counting this process's dTLB read misses, or
+// returns -1 when perf events aren't allowed.
+int open_tlb_misses() {
+  struct perf_event_attr attr = {
+      .type = PERF_TYPE_HW_CACHE,
+      .size = sizeof(struct perf_event_attr),
+      .config = PERF_COUNT_HW_CACHE_DTLB |
+                PERF_COUNT_HW_CACHE_OP_READ << 8 |
+                PERF_COUNT_HW_CACHE_RESULT_MISS << 16,
+      .exclude_kernel = 1,
+      .exclude_hv = 1,
+  };
+
+  return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+long read_counter(int fd) {
+  long long count;
+  if (fd == -1 || read(fd, &count, sizeof(count)) != sizeof(count)) {
+    return -1;
+  }
+
+  return count;
+}
+
+// thp_bytes adds up how much of this process is mapped with huge pages.
+long thp_bytes() {
+  FILE *f = fopen("/proc/self/smaps_rollup", "r");
+  if (!f) {
+    return -1;
+  }
+
+  long total = 0;
+  char line[256];
+  while (fgets(line, sizeof(line), f)) {
+    long kb;
+    if (sscanf(line, "AnonHugePages: %ld kB", &kb) == 1 ||
+        sscanf(line, "FilePmdMapped: %ld kB", &kb) == 1 ||
+        sscanf(line, "ShmemPmdMapped: %ld kB", &kb) == 1) {
+      total += kb * 1024;
+    }
+  }
+
+  fclose(f);
+
+  return total;
+}
+
+// run_hugepages reads lots of blocks spread all over a big heap every
+// transaction and writes to just one, so it's mostly paying for TLB misses
+// and a little for copying.
+void run_hugepages(char *dir, int huge, int granule, int mb, int txns) {
+  char db_path[4096];
+  snprintf(
+      db_path, sizeof(db_path), "%s/hugepages-%d-%d.db", dir, huge, granule);
+  unlink(db_path);
+  wal_discard(db_path);
+  ws_discard(db_path);
+
+  struct heap_header *heap = snap_init(db_path);
+  if (huge && snap_set_hugepages(heap, 1)) {
+    fprintf(stderr, "no huge pages, measuring without them\n");
+  }
+  snap_set_cow_granule(heap, granule);
+
+  // only the granule should decide what gets copied along with a fault
+  snap_set_fault_around(heap, 0);
+  snap_set_precow(heap, 0);
+
+  size_t count = (size_t)mb * 1024 * 1024 / COLDSTART_BLOCK;
+  struct coldstart_data *data =
+      snap_malloc(heap, sizeof(*data) + count * sizeof(char *));
+  data->count = count;
+
+  for (size_t i = 0; i < count; i++) {
+    data->blocks[i] = snap_malloc(heap, COLDSTART_BLOCK);
+    memset(data->blocks[i], i, COLDSTART_BLOCK);
+  }
+
+  heap->user_ptr = data;
+  snap_commit(heap);
+
+  struct snap_stats before;
+  snap_get_stats(heap, &before);
+
+  int tlb = open_tlb_misses();
+  long tlb_before = read_counter(tlb);
+
+  unsigned long sum = 0;
+  unsigned long seed = 1;
+  long start = now_us();
+
+  for (int i = 0; i < txns; i++) {
+    snap_begin_mut(heap);
+
+    for (int j = 0; j < 4096; j++) {
+      seed = seed * 6364136223846793005UL + 1442695040888963407UL;
+      sum += (unsigned char)data->blocks[(seed >> 33) % count][j % 4000];
+    }
+
+    seed = seed * 6364136223846793005UL + 1442695040888963407UL;
+    data->blocks[(seed >> 33) % count][0] = i;
+
+    snap_commit(heap);
+  }
+
+  long total = now_us() - start;
+  long tlb_after = read_counter(tlb);
+
+  struct snap_stats after;
+  snap_get_stats(heap, &after);
+
+  long faults = after.faults - before.faults;
+  long copied = after.pages_copied - before.pages_copied;
+
+  printf(
+      "{\"hugepages\": %d, \"cow_granule\": %d, \"mb\": %d, \"txns\": %d, "
+      "\"tps\": %.1f, \"thp_bytes\": %ld, \"dtlb_misses\": %ld, "
+      "\"faults\": %ld, \"pages_copied\": %ld, \"amplification\": %.1f, "
+      "\"sum\": %lu}\n",
+      huge,
+      granule,
+      mb,
+      txns,
+      txns / (total / 1e6),
+      thp_bytes(),
+      tlb_before < 0 || tlb_after < 0 ? -1 : tlb_after - tlb_before,
+      faults,
+      copied,
+      faults ? (double)copied / faults : 0,
+      sum);
+
+  snap_close(heap);
+}
+
+int hugepages(int argc, char *argv[]) {
+  if (argc < 1) {
+    fprintf(stderr, "usage: snapbench hugepages <dir> [mb] [txns]\n");
+    return 1;
+  }
+
+  char *dir = argv[0];
+  int mb = argc > 1 ? atoi(argv[1]) : 32;
+  int txns = argc > 2 ? atoi(argv[2]) : 100;
+
+  if (mb < 1 || txns < 1) {
+    fprintf(stderr, "mb and txns must be positive\n");
+    return 1;
+  }
+
+  if (mkdir(dir, 0755) && errno != EEXIST) {
+    fprintf(stderr, "could not create %s: %s\n", dir, strerror(errno));
+    return 1;
+  }
+
+  struct {
+    int huge;
+    int granule;
+  } configs[] = {{0, 1}, {1, 1}, {1, 16}, {1, COW_GRANULE_MAX}};
+
+  for (size_t i = 0; i < sizeof(configs) / sizeof(*configs); i++) {
+    fflush(stdout);
+
+    pid_t pid = fork();
+    if (pid == 0) {
+      run_hugepages(dir, configs[i].huge, configs[i].granule, mb, txns);
+      exit(0);
+    }
+
+    int status;
+    waitpid(pid, &status, 0);
+    if (!WIFEXITED(status) || WEXITSTATUS(status)) {
+      fprintf(stderr, "hugepages run %zu failed\n", i);
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+// build_relayout grows a heap a little every transaction while also
+// rewriting some of the blocks it already has, so the copies of their old
+// versions end up scattered between the blocks that come after.
+int build_relayout(char *db_path, size_t count, int txns, int rewrites) {
+  struct heap_header *heap = snap_init(db_path);
+  if (!heap) {
+    return 1;
+  }
+
+  // deltas would pack the old versions away and leave nothing to move
+  snap_set_deltas(heap, 0);
+
+  struct coldstart_data *data =
+      snap_malloc(heap, sizeof(*data) + count * sizeof(char *));
+  data->count = 0;
+  heap->user_ptr = data;
+  snap_commit(heap);
+
+  size_t per_txn = (count + txns - 1) / txns;
+
+  for (int t = 0; t < txns && data->count < count; t++) {
+    snap_begin_mut(heap);
+
+    for (size_t i = 0; i < per_txn && data->count < count; i++) {
+      data->blocks[data->count] = snap_malloc(heap, COLDSTART_BLOCK);
+      memset(data->blocks[data->count], data->count, COLDSTART_BLOCK);
+      data->count++;
+    }
+
+    for (int i = 0; i < rewrites; i++) {
+      size_t b = ((size_t)t * 7919 + i * 104729) % data->count;
+      data->blocks[b][(t + i) % COLDSTART_BLOCK]++;
+    }
+
+    snap_commit(heap);
+  }
+
+  snap_close(heap);
+  return 0;
+}
+
+// run_scan opens the heap cold and reads every block once in the order they
+// were allocated, which is the order they sit in the file.
+void run_scan(char *db_path, const char *name) {
+  long start = now_us();
+  struct heap_header *heap = snap_init(db_path);
+  unsigned long sum = touch_blocks(heap, 1);
+  long took = now_us() - start;
+
+  struct stat st;
+  stat(db_path, &st);
+
+  printf(
+      "{\"layout\": \"%s\", \"scan_us\": %ld, \"heap_bytes\": %lu, "
+      "\"disk_bytes\": %ld, \"sum\": %lu}\n",
+      name,
+      took,
+      (unsigned long)heap_end(heap),
+      (long)st.st_blocks * 512,
+      sum);
+
+  snap_close(heap);
+}
+
+int relayout(int argc, char *argv[]) {
+  if (argc < 1) {
+    fprintf(stderr, "usage: snapbench relayout <dir> [mb] [txns]\n");
+    return 1;
+  }
+
+  char *dir = argv[0];
+  int mb = argc > 1 ? atoi(argv[1]) : 16;
+  int txns = argc > 2 ? atoi(argv[2]) : 256;
+
+  if (mb < 1 || txns < 1) {
+    fprintf(stderr, "mb and txns must be positive\n");
+    return 1;
+  }
+
+  if (mkdir(dir, 0755) && errno != EEXIST) {
+    fprintf(stderr, "could not create %s: %s\n", dir, strerror(errno));
+    return 1;
+  }
+
+  char db_path[4096];
+  snprintf(db_path, sizeof(db_path), "%s/relayout.db", dir);
+  unlink(db_path);
+  wal_discard(db_path);
+  ws_discard(db_path);
+
+  size_t count = ((size_t)mb << 20) / 4096;
+
+  for (int after = 0; after <= 1; after++) {
+    fflush(stdout);
+
+    pid_t pid = fork();
+    if (pid == 0) {
+      if (!after) {
+        exit(build_relayout(db_path, count, txns, 8));
+      }
+
+      struct heap_header *heap = snap_init(db_path);
+      long start = now_us();
+      int moved = snap_relayout(heap);
+      long took = now_us() - start;
+
+      struct snap_stats stats;
+      snap_get_stats(heap, &stats);
+      printf(
+          "{\"relayout_us\": %ld, \"pages_relocated\": %d, "
+          "\"pages_punched\": %ld}\n",
+          took,
+          moved,
+          stats.pages_punched);
+
+      snap_close(heap);
+      exit(moved < 0);
+    }
+
+    int status;
+    waitpid(pid, &status, 0);
+    if (!WIFEXITED(status) || WEXITSTATUS(status)) {
+      fprintf(stderr, after ? "relayout failed\n" : "building failed\n");
+      return 1;
+    }
+
+    // nothing here commits, but opening would still prefetch whatever
+    // working set the build left behind
+    ws_discard(db_path);
+    if (drop_cache(db_path)) {
+      return 1;
+    }
+
+    fflush(stdout);
+
+    pid = fork();
+    if (pid == 0) {
+      run_scan(db_path, after ? "relaid" : "scattered");
+      exit(0);
+    }
+
+    waitpid(pid, &status, 0);
+    if (!WIFEXITED(status) || WEXITSTATUS(status)) {
+      fprintf(stderr, "scan failed\n");
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+// how many allocations the malloc benchmarks make per transaction before
+// freeing and growing some of them and committing.
+#define MICRO_BATCH 100
+
+// build_micro fills a heap with count blocks and then commits depth
+// transactions that each rewrite a few of them, so there's history behind
+// the generation the benchmarks start from.
+int build_micro(char *db_path, size_t count, int depth) {
+  struct heap_header *heap = snap_init(db_path);
+  if (!heap) {
+    return 1;
+  }
+
+  struct coldstart_data *data =
+      snap_malloc(heap, sizeof(*data) + count * sizeof(char *));
+  data->count = 0;
+  heap->user_ptr = data;
+  snap_commit(heap);
+
+  while (data->count < count) {
+    snap_begin_mut(heap);
+
+    for (int i = 0; i < 256 && data->count < count; i++) {
+      data->blocks[data->count] = snap_malloc(heap, COLDSTART_BLOCK);
+      memset(data->blocks[data->count], data->count, COLDSTART_BLOCK);
+      data->count++;
+    }
+
+    snap_commit(heap);
+  }
+
+  srand(1);
+
+  for (int t = 0; t < depth; t++) {
+    snap_begin_mut(heap);
+
+    for (int i = 0; i < 8; i++) {
+      data->blocks[rand() % count][rand() % COLDSTART_BLOCK]++;
+    }
+
+    snap_commit(heap);
+  }
+
+  snap_close(heap);
+  return 0;
+}
+
+// copy_db gives every benchmark its own copy of the built heap so none of
+// them start from what another left behind.
+int copy_db(const char *from, const char *to) {
+  int in = open(from, O_RDONLY);
+  if (in == -1) {
+    fprintf(stderr, "could not open %s: %s\n", from, strerror(errno));
+    return -1;
+  }
+
+  int out = open(to, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (out == -1) {
+    fprintf(stderr, "could not create %s: %s\n", to, strerror(errno));
+    close(in);
+    return -1;
+  }
+
+  static char buf[1 << 20];
+  ssize_t n;
+  while ((n = read(in, buf, sizeof(buf))) > 0) {
+    if (write(out, buf, n) != n) {
+      n = -1;
+      break;
+    }
+  }
+
+  close(in);
+  close(out);
+
+  if (n < 0) {
+    fprintf(stderr, "could not copy %s: %s\n", from, strerror(errno));
+    return -1;
+  }
+
+  wal_discard(to);
+  ws_discard(to);
+
+  return 0;
+}
+
+// print_latency prints one json line of percentiles for the n latencies in
+// ns, which it sorts.
+void print_latency(
+    const char *bench,
+    const char *variant,
+    int mb,
+    int depth,
+    long *ns,
+    int n) {
+  if (!n) {
+    return;
+  }
+
+  qsort(ns, n, sizeof(long), cmp_long);
+
+  printf(
+      "{\"bench\": \"%s\", \"variant\": \"%s\", \"mb\": %d, \"depth\": %d, "
+      "\"n\": %d, \"p50_ns\": %ld, \"p90_ns\": %ld, \"p99_ns\": %ld, "
+      "\"max_ns\": %ld}\n",
+      bench,
+      variant,
+      mb,
+      depth,
+      n,
+      percentile(ns, n, 50),
+      percentile(ns, n, 90),
+      percentile(ns, n, 99),
+      ns[n - 1]);
+}
+
+// run_micro_malloc allocates ops blocks with sizes between min and max in
+// batches, freeing every other one of each batch and doubling the rest.
+void run_micro_malloc(
+    struct heap_header *heap,
+    const char *mix,
+    size_t min,
+    size_t max,
+    int mb,
+    int depth,
+    int ops) {
+  long *malloc_ns = calloc(ops, sizeof(long));
+  long *free_ns = calloc(ops, sizeof(long));
+  long *realloc_ns = calloc(ops, sizeof(long));
+  int nmalloc = 0, nfree = 0, nrealloc = 0;
+
+  srand(2);
+
+  while (nmalloc < ops) {
+    snap_begin_mut(heap);
+
+    char *batch[MICRO_BATCH];
+    size_t sizes[MICRO_BATCH];
+    int n = 0;
+
+    for (; n < MICRO_BATCH && nmalloc < ops; n++) {
+      sizes[n] = min + (size_t)rand() % (max - min + 1);
+
+      long start = now_ns();
+      batch[n] = snap_malloc(heap, sizes[n]);
+      malloc_ns[nmalloc++] = now_ns() - start;
+
+      memset(batch[n], n, sizes[n]);
+    }
+
+    for (int i = 0; i < n; i += 2) {
+      long start = now_ns();
+      snap_free(heap, batch[i]);
+      free_ns[nfree++] = now_ns() - start;
+    }
+
+    for (int i = 1; i < n; i += 2) {
+      long start = now_ns();
+      batch[i] = snap_realloc(heap, batch[i], sizes[i] * 2);
+      realloc_ns[nrealloc++] = now_ns() - start;
+    }
+
+    snap_commit(heap);
+  }
+
+  print_latency("malloc", mix, mb, depth, malloc_ns, nmalloc);
+  print_latency("free", mix, mb, depth, free_ns, nfree);
+  print_latency("realloc", mix, mb, depth, realloc_ns, nrealloc);
+
+  free(malloc_ns);
+  free(free_ns);
+  free(realloc_ns);
+}
+
+// run_micro_fault times the first write to ops committed blocks, 64 to a
+// transaction, with nothing copied ahead of time.
+void run_micro_fault(struct heap_header *heap, int mb, int depth, int ops) {
+  struct coldstart_data *data = heap->user_ptr;
+  long *ns = calloc(ops, sizeof(long));
+  int n = 0;
+
+  snap_set_fault_around(heap, 0);
+  snap_set_precow(heap, 0);
+
+  srand(3);
+
+  while (n < ops) {
+    snap_begin_mut(heap);
+
+    // stepping by a prime keeps the blocks in a transaction distinct
+    size_t b = rand() % data->count;
+    for (int i = 0; i < 64 && n < ops; i++) {
+      b = (b + 7919) % data->count;
+
+      long start = now_ns();
+      data->blocks[b][0]++;
+      ns[n++] = now_ns() - start;
+    }
+
+    snap_commit(heap);
+  }
+
+  print_latency("fault", "cow", mb, depth, ns, n);
+  free(ns);
+}
+
+// run_micro_txn times snap_begin_mut and snap_commit around ops small
+// transactions.
+void run_micro_txn(struct heap_header *heap, int mb, int depth, int ops) {
+  struct coldstart_data *data = heap->user_ptr;
+  long *begin_ns = calloc(ops, sizeof(long));
+  long *commit_ns = calloc(ops, sizeof(long));
+
+  srand(4);
+
+  for (int t = 0; t < ops; t++) {
+    long start = now_ns();
+    snap_begin_mut(heap);
+    begin_ns[t] = now_ns() - start;
+
+    for (int i = 0; i < 8; i++) {
+      data->blocks[rand() % data->count][rand() % COLDSTART_BLOCK]++;
+    }
+
+    start = now_ns();
+    snap_commit(heap);
+    commit_ns[t] = now_ns() - start;
+  }
+
+  print_latency("begin_mut", "8_writes", mb, depth, begin_ns, ops);
+  print_latency("commit", "8_writes", mb, depth, commit_ns, ops);
+
+  free(begin_ns);
+  free(commit_ns);
+}
+
+// run_micro_checkout times checking out the generation just before the
+// newest one and the oldest one, going back to the newest after each.
+void run_micro_checkout(struct heap_header *heap, int mb, int depth, int ops) {
+  int newest = snap_gen_id(heap, heap->committed);
+
+  struct {
+    const char *name;
+    int gen;
+  } targets[] = {
+      {"near", newest - 1},
+      {"far", newest - depth},
+  };
+
+  long *ns = calloc(ops * 2, sizeof(long));
+
+  for (size_t i = 0; i < sizeof(targets) / sizeof(*targets); i++) {
+    if (targets[i].gen < 0 || targets[i].gen == newest) {
+      continue;
+    }
+
+    for (int j = 0; j < ops; j++) {
+      long start = now_ns();
+      snap_checkout(heap, targets[i].gen);
+      ns[2 * j] = now_ns() - start;
+
+      start = now_ns();
+      snap_checkout(heap, newest);
+      ns[2 * j + 1] = now_ns() - start;
+    }
+
+    print_latency("checkout", targets[i].name, mb, depth, ns, ops * 2);
+  }
+
+  free(ns);
+}
+
+int micro(int argc, char *argv[]) {
+  if (argc < 1) {
+    fprintf(stderr, "usage: snapbench micro <dir> [mb] [depth] [ops]\n");
+    return 1;
+  }
+
+  char *dir = argv[0];
+  int mb = argc > 1 ? atoi(argv[1]) : 4;
+  int depth = argc > 2 ? atoi(argv[2]) : 64;
+  int ops = argc > 3 ? atoi(argv[3]) : 2000;
+
+  if (mb < 1 || depth < 1 || ops < 10) {
+    fprintf(stderr, "mb and depth must be positive and ops at least 10\n");
+    return 1;
+  }
+
+  if (mkdir(dir, 0755) && errno != EEXIST) {
+    fprintf(stderr, "could not create %s: %s\n", dir, strerror(errno));
+    return 1;
+  }
+
+  char db_path[4096];
+  snprintf(db_path, sizeof(db_path), "%s/micro.db", dir);
+  unlink(db_path);
+  wal_discard(db_path);
+  ws_discard(db_path);
+
+  size_t count = ((size_t)mb << 20) / 4096;
+
+  fflush(stdout);
+
+  pid_t pid = fork();
+  if (pid == 0) {
+    exit(build_micro(db_path, count, depth));
+  }
+
+  int status;
+  waitpid(pid, &status, 0);
+  if (!WIFEXITED(status) || WEXITSTATUS(status)) {
+    fprintf(stderr, "building failed\n");
+    return 1;
+  }
+
+  char run_path[4096];
+  snprintf(run_path, sizeof(run_path), "%s/micro-run.db", dir);
+
+  for (int b = 0; b < 6; b++) {
+    if (copy_db(db_path, run_path)) {
+      return 1;
+    }
+
+    fflush(stdout);
+
+    pid = fork();
+    if (pid == 0) {
+      struct heap_header *heap = snap_init(run_path);
+
+      switch (b) {
+      case 0:
+        run_micro_malloc(heap, "small", 16, 256, mb, depth, ops);
+        break;
+      case 1:
+        run_micro_malloc(heap, "mixed", 16, 4096, mb, depth, ops);
+        break;
+      case 2:
+        run_micro_malloc(heap, "large", 4096, 65536, mb, depth, ops / 10);
+        break;
+      case 3:
+        run_micro_fault(heap, mb, depth, ops);
+        break;
+      case 4:
+        run_micro_txn(heap, mb, depth, ops / 10);
+        break;
+      case 5:
+        // a far checkout of a big heap can take seconds
+        run_micro_checkout(heap, mb, depth, ops / 400 + 1);
+        break;
+      }
+
+      snap_close(heap);
+      exit(0);
+    }
+
+    waitpid(pid, &status, 0);
+    if (!WIFEXITED(status) || WEXITSTATUS(status)) {
+      fprintf(stderr, "benchmark %d failed\n", b);
+      return 1;
+    }
+  }
+
+  unlink(run_path);
+  ws_discard(run_path);
+
+  return 0;
+}
+
+int main(int argc, char *argv[]) {
+  if (argc < 2) {
+    fprintf(stderr, "usage: %s <benchmark> [args...]\n", *argv);
+    fprintf(stderr, "benchmarks:\n");
+    fprintf(stderr, "  durability <dir> [txns] [writes]\n");
+    fprintf(stderr, "  coldstart <dir> [mb] [stride]\n");
+    fprintf(stderr, "  faultaround <dir> [txns] [run]\n");
+    fprintf(stderr, "  precow <dir> [txns] [hot]\n");
+    fprintf(stderr, "  history <dir> [txns] [blocks]\n");
+    fprintf(stderr, "  compact <dir> [txns] [blocks]\n");
+    fprintf(stderr, "  hugepages <dir> [mb] [txns]\n");
+    fprintf(stderr, "  relayout <dir> [mb] [txns]\n");
+    fprintf(stderr, "  micro <dir> [mb] [depth] [ops]\n");
+    exit(1);
+  }
+
+  if (!strcmp(argv[1], "durability")) {
+    return durability(argc - 2, argv + 2);
+  }
+
+  if (!strcmp(argv[1], "coldstart")) {
+    return coldstart(argc - 2, argv + 2);
+  }
+
+  if (!strcmp(argv[1], "faultaround")) {
+    return faultaround(argc - 2, argv + 2);
+  }
+
+  if (!strcmp(argv[1], "precow")) {
+    return precow(argc - 2, argv + 2);
+  }
+
+  if (!strcmp(argv[1], "history")) {
+    return history(argc - 2, argv + 2);
+  }
+
+  if (!strcmp(argv[1], "compact")) {
+    return compact(argc - 2, argv + 2);
+  }
+
+  if (!strcmp(argv[1], "hugepages")) {
+    return hugepages(argc - 2, argv + 2);
+  }
+
+  if (!strcmp(argv[1], "relayout")) {
+    return relayout(argc - 2, argv + 2);
+  }
+
+  if (!strcmp(argv[1], "micro")) {
+    return micro(argc - 2, argv + 2);
+  }
+
+  fprintf(stderr, "unknown benchmark %s\n", argv[1]);
+  return 1;
+}
@@ -0,0 +1,1073 @@
+// getopt, ftruncate and sysconf
+#define _XOPEN_SOURCE 600
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "../alloc.h"
+#include "../wal.h"
+
+// snapfsck checks a heap file without going through the allocator, so a heap
+// broken badly enough to crash it can still be looked at. The file is mapped
+// read-only wherever the kernel likes since every link inside it is an offset,
+// and every offset is checked before anything is read through it.
+//
+// The tree is walked once to find every node, then the nodes are split between
+// threads to check their contents, and finally every version of each page is
+// lined up by real_addr to check the chains.
+
+// the most problems kept before the rest are only counted.
+#define MAX_PROBLEMS 10000
+
+struct problem {
+  snap_off off;
+  int gen; // the generation the problem belongs to, -1 for the heap itself
+  int structural; // the tree or a link in it is broken, nothing can be trusted
+  char what[112];
+};
+
+struct problems {
+  struct problem *p;
+  size_t len;
+  size_t cap;
+  long dropped;
+};
+
+// a node found in the tree and the generation it belongs to.
+struct found {
+  snap_off off;
+  int gen;
+};
+
+struct gen_info {
+  char present;
+  char bad;
+  int parent;
+};
+
+struct version {
+  snap_off real_addr;
+  snap_off off;
+  int gen;
+  int pages;
+  char type;
+};
+
+struct worker {
+  pthread_t thread;
+  size_t from;
+  size_t to;
+  struct problems ps;
+};
+
+static const char *db_path;
+static struct heap_header *heap;
+static size_t mapped;
+static size_t page_size;
+
+static struct found *nodes;
+static size_t nodes_len;
+
+static struct gen_info *gens;
+static int gens_len;
+
+static unsigned char *seen; // one bit for every 8 bytes of the heap
+
+// what the last check found in the header.
+static int committed_gen;
+static size_t heap_size;
+static size_t file_size;
+
+void report(
+    struct problems *ps,
+    snap_off off,
+    int gen,
+    int structural,
+    const char *fmt,
+    ...) {
+  if (ps->len == MAX_PROBLEMS) {
+    ps->dropped++;
+    return;
+  }
+
+  if (ps->len == ps->cap) {
+    ps->cap = ps->cap ? ps->cap * 2 : 64;
+    ps->p = realloc(ps->p, ps->cap * sizeof(struct problem));
+    if (!ps->p) {
+      fprintf(stderr, "out of memory\n");
+      exit(2);
+    }
+  }
+
+  struct problem *p = &ps->p[ps->len++];
+  p->off = off;
+  p->gen = gen;
+  p->structural = structural;
+
+  va_list ap;
+  va_start(ap, fmt);
+  vsnprintf(p->what, sizeof(p->what), fmt, ap);
+  va_end(ap);
+}
+
+// in_heap is whether len bytes at off are all inside the mapped heap.
+int in_heap(snap_off off, size_t len) {
+  return off && off <= mapped && len <= mapped - off;
+}
+
+int gen_node_at(snap_off off) {
+  if (!in_heap(off, sizeof(struct snap_generation)) || off % 8) {
+    return 0;
+  }
+
+  struct snap_node *n = snap_at(heap, off);
+  return n->type == SNAP_NODE_GENERATION;
+}
+
+int check_header(struct problems *ps, size_t file_size) {
+  if (file_size < sizeof(struct heap_header)) {
+    fprintf(stderr, "%s is too small to be a heap\n", db_path);
+    return -1;
+  }
+
+  if (heap->v != HEAP_VERSION) {
+    fprintf(
+        stderr,
+        "%s has heap version %x, expected %x\n",
+        db_path,
+        heap->v,
+        HEAP_VERSION);
+    return -1;
+  }
+
+  if (heap->page_size != page_size) {
+    fprintf(
+        stderr,
+        "%s was made with %zu byte pages, these are %zu\n",
+        db_path,
+        heap->page_size,
+        page_size);
+    return -1;
+  }
+
+  if (heap->size < INITIAL_PAGES * page_size || heap->size % page_size) {
+    report(
+        ps,
+        0,
+        -1,
+        1,
+        "heap size %zu isn't a whole number of pages",
+        heap->size);
+  } else if (heap->size > file_size) {
+    report(
+        ps,
+        file_size,
+        -1,
+        1,
+        "file ends %zu bytes short of the heap's size %zu",
+        heap->size - file_size,
+        heap->size);
+  } else if (heap->size < file_size) {
+    report(
+        ps,
+        heap->size,
+        -1,
+        0,
+        "%zu bytes in the file past the end of the heap",
+        file_size - heap->size);
+  }
+
+  if (!gen_node_at(heap->root)) {
+    report(ps, heap->root, -1, 1, "root isn't a generation");
+  }
+
+  if (!gen_node_at(heap->working)) {
+    report(ps, heap->working, -1, 1, "working isn't a generation");
+  }
+
+  if (heap->committed && !gen_node_at(heap->committed)) {
+    report(ps, heap->committed, -1, 1, "committed isn't a generation");
+  }
+
+  if (!gen_node_at(heap->last_gen)) {
+    report(ps, heap->last_gen, -1, 1, "last_gen isn't a generation");
+  }
+
+  if (!in_heap(heap->last_page, page_size) || heap->last_page % page_size) {
+    report(ps, heap->last_page, -1, 1, "last_page is outside the heap");
+  }
+
+  if (heap->last_gen_index < 0) {
+    report(ps, 0, -1, 1, "last_gen_index is %d", heap->last_gen_index);
+  }
+
+  return 0;
+}
+
+// mark_seen marks the 8 bytes at off as the start of a node, returning
+// whether something already started there.
+int mark_seen(snap_off off) {
+  unsigned char bit = 1 << (off / 8 % 8);
+  int was = seen[off / 64] & bit;
+  seen[off / 64] |= bit;
+  return was;
+}
+
+void add_node(snap_off off, int gen) {
+  static size_t cap;
+
+  if (nodes_len == cap) {
+    cap = cap ? cap * 2 : 1024;
+    nodes = realloc(nodes, cap * sizeof(struct found));
+    if (!nodes) {
+      fprintf(stderr, "out of memory\n");
+      exit(2);
+    }
+  }
+
+  nodes[nodes_len++] = (struct found){.off = off, .gen = gen};
+}
+
+struct walk_entry {
+  snap_off off;
+  snap_off from; // where the link to it is kept
+  int owner;     // id of the generation holding the link, -1 above the root
+};
+
+// walk_tree finds every node reachable from the root without following
+// anything that doesn't check out, and checks the generations on the way.
+void walk_tree(struct problems *ps) {
+  size_t cap = 1024;
+  size_t len = 0;
+  struct walk_entry *stack = malloc(cap * sizeof(struct walk_entry));
+  if (!stack) {
+    fprintf(stderr, "out of memory\n");
+    exit(2);
+  }
+
+  int working_gen = snap_gen_id(heap, heap->working);
+  int in_txn = heap->committed && heap->committed != heap->working;
+
+  stack[len++] = (struct walk_entry){
+      .off = heap->root,
+      .from = offsetof(struct heap_header, root),
+      .owner = -1,
+  };
+
+  while (len) {
+    struct walk_entry e = stack[--len];
+
+    if (e.off % 8 || !in_heap(e.off, sizeof(struct snap_node))) {
+      report(
+          ps,
+          e.from,
+          e.owner,
+          1,
+          "link to 0x%lx outside the heap",
+          (unsigned long)e.off);
+      continue;
+    }
+
+    if (mark_seen(e.off)) {
+      report(
+          ps,
+          e.from,
+          e.owner,
+          1,
+          "link to 0x%lx, which is already linked to",
+          (unsigned long)e.off);
+      continue;
+    }
+
+    struct snap_node *n = snap_at(heap, e.off);
+
+    if (n->type == SNAP_NODE_PAGE || n->type == SNAP_NODE_DELTA ||
+        n->type == SNAP_NODE_PACKED) {
+      if (e.owner < 0) {
+        report(ps, e.off, e.owner, 1, "page above the root generation");
+        continue;
+      }
+
+      add_node(e.off, e.owner);
+
+      if (heap->committed &&
+          n->committed != !(in_txn && e.owner == working_gen)) {
+        report(ps, e.off, e.owner, 0, "committed flag is %d", n->committed);
+      }
+
+      continue;
+    }
+
+    if (n->type != SNAP_NODE_GENERATION) {
+      report(ps, e.off, e.owner, 1, "unknown node type %d", n->type);
+      continue;
+    }
+
+    if (!in_heap(e.off, sizeof(struct snap_generation))) {
+      report(ps, e.off, e.owner, 1, "generation past the end of the heap");
+      continue;
+    }
+
+    struct snap_generation *g = (struct snap_generation *)n;
+
+    if (g->gen < 0 || g->gen >= gens_len) {
+      report(
+          ps,
+          e.off,
+          e.owner,
+          1,
+          "generation id %d past last_gen_index %d",
+          g->gen,
+          heap->last_gen_index);
+      continue;
+    }
+
+    // a generation that ran out of room is split into nodes with the same id
+    if (g->gen != e.owner) {
+      struct gen_info *info = &gens[g->gen];
+
+      if (info->present) {
+        report(ps, e.off, g->gen, 1, "generation %d found twice", g->gen);
+        continue;
+      }
+
+      if (g->gen < e.owner) {
+        report(
+            ps,
+            e.off,
+            g->gen,
+            1,
+            "generation %d is a child of newer generation %d",
+            g->gen,
+            e.owner);
+      }
+
+      info->present = 1;
+      info->parent = e.owner;
+    }
+
+    if (heap->committed && n->committed != !(in_txn && g->gen == working_gen)) {
+      report(ps, e.off, g->gen, 0, "committed flag is %d", n->committed);
+    }
+
+    for (int i = GENERATION_CHILDREN - 1; i >= 0; i--) {
+      if (!g->c[i]) {
+        continue;
+      }
+
+      if (len == cap) {
+        cap *= 2;
+        stack = realloc(stack, cap * sizeof(struct walk_entry));
+        if (!stack) {
+          fprintf(stderr, "out of memory\n");
+          exit(2);
+        }
+      }
+
+      stack[len++] = (struct walk_entry){
+          .off = g->c[i],
+          .from = e.off + offsetof(struct snap_generation, c) +
+                  i * sizeof(snap_off),
+          .owner = g->gen,
+      };
+    }
+  }
+
+  free(stack);
+}
+
+// check_free_pages follows the free page chain, which isn't part of the tree.
+void check_free_pages(struct problems *ps) {
+  size_t limit = mapped / page_size;
+  size_t walked = 0;
+
+  for (snap_off off = heap->free_pages; off;) {
+    if (off % page_size || !in_heap(off, sizeof(struct snap_page))) {
+      report(ps, off, -1, 1, "free page link outside the heap");
+      return;
+    }
+
+    if (walked++ > limit || mark_seen(off)) {
+      report(ps, off, -1, 1, "free page is also in the tree or loops");
+      return;
+    }
+
+    struct snap_page *p = snap_at(heap, off);
+    if (p->i.type != 0 || p->pages < 1 ||
+        !in_heap(off, (size_t)p->pages * page_size)) {
+      report(ps, off, -1, 1, "bad free page");
+      return;
+    }
+
+    off = p->real_addr;
+  }
+}
+
+void check_page(struct problems *ps, struct found *f) {
+  struct snap_page *p = snap_at(heap, f->off);
+  char *end = (char *)p + (size_t)p->pages * page_size;
+
+  if (f->off % page_size) {
+    report(ps, f->off, f->gen, 1, "page isn't page aligned");
+    return;
+  }
+
+  if (!in_heap(f->off, (size_t)p->pages * page_size)) {
+    report(
+        ps,
+        f->off,
+        f->gen,
+        1,
+        "%d pages run past the end of the heap",
+        p->pages);
+    return;
+  }
+
+  if (p->len < 0 ||
+      sizeof(struct snap_page) + sizeof(size_t) * (size_t)p->len >
+          (size_t)p->pages * page_size) {
+    report(ps, f->off, f->gen, 1, "%d segments don't fit in the page", p->len);
+    return;
+  }
+
+  char *head_end = (char *)p->c + sizeof(size_t) * p->len;
+
+  // segments are handed out from the end of the page backwards
+  char *limit = end;
+  for (int i = 0; i < p->len; i++) {
+    struct snap_segment *s = (struct snap_segment *)((char *)p + p->c[i]);
+
+    if (p->c[i] < (size_t)(head_end - (char *)p) ||
+        p->c[i] > (size_t)(limit - (char *)p) ||
+        sizeof(struct snap_segment) > (size_t)(limit - (char *)s)) {
+      report(
+          ps,
+          f->off + p->c[i],
+          f->gen,
+          0,
+          "segment %d starts outside its page at %zu",
+          i,
+          p->c[i]);
+      return;
+    }
+
+    if (s->size > (size_t)(limit - (char *)s) - sizeof(struct snap_segment)) {
+      report(
+          ps,
+          f->off + p->c[i],
+          f->gen,
+          0,
+          "segment %d of %zu bytes overlaps the one after it",
+          i,
+          s->size);
+      return;
+    }
+
+    if (s->used != 0 && s->used != 1) {
+      report(
+          ps,
+          f->off + p->c[i],
+          f->gen,
+          0,
+          "segment %d used is %d",
+          i,
+          s->used);
+    }
+
+    limit = (char *)s;
+  }
+}
+
+void check_delta(struct problems *ps, struct found *f) {
+  struct snap_delta *d = snap_at(heap, f->off);
+
+  if (!in_heap(f->off, sizeof(struct snap_delta)) ||
+      !in_heap(f->off, sizeof(struct snap_delta) + d->len)) {
+    report(
+        ps,
+        f->off,
+        f->gen,
+        0,
+        "delta of %u bytes runs past the heap",
+        d->len);
+    return;
+  }
+
+  if (d->base_gen < 0 || d->base_gen >= gens_len ||
+      !gens[d->base_gen].present) {
+    report(
+        ps,
+        f->off,
+        f->gen,
+        0,
+        "delta against missing generation %d",
+        d->base_gen);
+  }
+
+  size_t at = 0;
+  size_t page_bytes = (size_t)d->pages * page_size;
+  for (uint32_t i = 0; i < d->len;) {
+    struct snap_delta_run r;
+    if (d->len - i < sizeof(r)) {
+      report(ps, f->off, f->gen, 0, "delta ends in the middle of a run");
+      return;
+    }
+
+    memcpy(&r, d->runs + i, sizeof(r));
+    i += sizeof(r);
+
+    if (r.len > d->len - i) {
+      report(
+          ps,
+          f->off,
+          f->gen,
+          0,
+          "delta run of %u bytes runs past the delta",
+          r.len);
+      return;
+    }
+
+    at += (size_t)r.skip + r.len;
+    if (at > page_bytes) {
+      report(ps, f->off, f->gen, 0, "delta runs past the end of its page");
+      return;
+    }
+
+    i += r.len;
+  }
+}
+
+void check_packed(struct problems *ps, struct found *f) {
+  struct snap_packed *k = snap_at(heap, f->off);
+
+  if (!in_heap(f->off, sizeof(struct snap_packed)) ||
+      !in_heap(f->off, sizeof(struct snap_packed) + k->len)) {
+    report(
+        ps,
+        f->off,
+        f->gen,
+        0,
+        "packed page of %u bytes runs past the heap",
+        k->len);
+  }
+}
+
+void check_node(struct problems *ps, struct found *f) {
+  struct snap_page *p = snap_at(heap, f->off);
+
+  if (!in_heap(f->off, sizeof(struct snap_delta))) {
+    report(ps, f->off, f->gen, 1, "node runs past the end of the heap");
+    return;
+  }
+
+  // deltas and packed versions start out the same as a page
+  if (p->pages < 1 || p->real_addr % page_size ||
+      !in_heap(p->real_addr, (size_t)p->pages * page_size)) {
+    report(
+        ps,
+        f->off,
+        f->gen,
+        1,
+        "%d pages at real_addr 0x%lx are outside the heap",
+        p->pages,
+        (unsigned long)p->real_addr);
+    return;
+  }
+
+  if (p->i.type == SNAP_NODE_PAGE) {
+    check_page(ps, f);
+  } else if (p->i.type == SNAP_NODE_DELTA) {
+    check_delta(ps, f);
+  } else {
+    check_packed(ps, f);
+  }
+}
+
+void *check_nodes(void *arg) {
+  struct worker *w = arg;
+
+  for (size_t i = w->from; i < w->to; i++) {
+    check_node(&w->ps, &nodes[i]);
+  }
+
+  return NULL;
+}
+
+int cmp_version(const void *a, const void *b) {
+  const struct version *l = a;
+  const struct version *r = b;
+
+  if (l->real_addr != r->real_addr) {
+    return (l->real_addr > r->real_addr) - (l->real_addr < r->real_addr);
+  }
+
+  return (l->gen > r->gen) - (l->gen < r->gen);
+}
+
+// check_chains lines every version of a page up by its real_addr. Each needs
+// exactly one version at home, all the same size, and at most one version
+// per generation.
+void check_chains(struct problems *ps) {
+  struct version *v = malloc((nodes_len + 1) * sizeof(struct version));
+  if (!v) {
+    fprintf(stderr, "out of memory\n");
+    exit(2);
+  }
+
+  size_t len = 0;
+  for (size_t i = 0; i < nodes_len; i++) {
+    struct snap_page *p = snap_at(heap, nodes[i].off);
+
+    // nodes that failed their own checks can't be trusted to point anywhere
+    if (p->pages < 1 || p->real_addr % page_size ||
+        !in_heap(p->real_addr, (size_t)p->pages * page_size)) {
+      continue;
+    }
+
+    v[len++] = (struct version){
+        .real_addr = p->real_addr,
+        .off = nodes[i].off,
+        .gen = nodes[i].gen,
+        .pages = p->pages,
+        .type = p->i.type,
+    };
+  }
+
+  qsort(v, len, sizeof(struct version), cmp_version);
+
+  for (size_t from = 0; from < len;) {
+    size_t to = from;
+    int homes = 0;
+
+    while (to < len && v[to].real_addr == v[from].real_addr) {
+      if (v[to].off == v[to].real_addr) {
+        homes += v[to].type == SNAP_NODE_PAGE;
+      }
+
+      if (v[to].pages != v[from].pages) {
+        report(
+            ps,
+            v[to].off,
+            v[to].gen,
+            0,
+            "version of 0x%lx covers %d pages, others %d",
+            (unsigned long)v[to].real_addr,
+            v[to].pages,
+            v[from].pages);
+      }
+
+      if (to > from && v[to].gen == v[to - 1].gen) {
+        report(
+            ps,
+            v[to].off,
+            v[to].gen,
+            0,
+            "second version of 0x%lx in the same generation",
+            (unsigned long)v[to].real_addr);
+      }
+
+      to++;
+    }
+
+    if (homes != 1) {
+      // the newest version is the one that's missing its home
+      report(
+          ps,
+          v[from].real_addr,
+          v[to - 1].gen,
+          0,
+          "page has %d versions at home",
+          homes);
+    }
+
+    from = to;
+  }
+
+  free(v);
+}
+
+// check_txn makes sure an unfinished transaction is a child of the generation
+// it was started from.
+void check_txn(struct problems *ps) {
+  if (!heap->committed || heap->committed == heap->working) {
+    return;
+  }
+
+  int working = snap_gen_id(heap, heap->working);
+  int committed = snap_gen_id(heap, heap->committed);
+
+  if (working < 0 || working >= gens_len || !gens[working].present ||
+      gens[working].parent != committed) {
+    report(
+        ps,
+        heap->working,
+        working,
+        0,
+        "working generation %d isn't a child of committed generation %d",
+        working,
+        committed);
+  }
+
+  report(
+      ps,
+      heap->working,
+      working,
+      0,
+      "uncommitted transaction in generation %d",
+      working);
+}
+
+void merge(struct problems *into, struct problems *from) {
+  for (size_t i = 0; i < from->len; i++) {
+    if (into->len == into->cap) {
+      into->cap = into->cap ? into->cap * 2 : 64;
+      into->p = realloc(into->p, into->cap * sizeof(struct problem));
+      if (!into->p) {
+        fprintf(stderr, "out of memory\n");
+        exit(2);
+      }
+    }
+
+    into->p[into->len++] = from->p[i];
+  }
+
+  into->dropped += from->dropped;
+  free(from->p);
+}
+
+int cmp_problem(const void *a, const void *b) {
+  const struct problem *l = a;
+  const struct problem *r = b;
+
+  if (l->off != r->off) {
+    return (l->off > r->off) - (l->off < r->off);
+  }
+
+  return strcmp(l->what, r->what);
+}
+
+// check maps the heap at db_path and checks all of it, filling in ps. Returns
+// -1 if it couldn't be checked at all.
+int check(struct problems *ps, int threads) {
+  free(ps->p);
+  memset(ps, 0, sizeof(*ps));
+
+  int fd = open(db_path, O_RDONLY);
+  if (fd == -1) {
+    fprintf(stderr, "couldn't open %s: %s\n", db_path, strerror(errno));
+    return -1;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st)) {
+    fprintf(stderr, "couldn't stat %s: %s\n", db_path, strerror(errno));
+    close(fd);
+    return -1;
+  }
+
+  file_size = st.st_size;
+  if (file_size < sizeof(struct heap_header)) {
+    fprintf(stderr, "%s is too small to be a heap\n", db_path);
+    close(fd);
+    return -1;
+  }
+
+  heap = mmap(NULL, file_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (heap == MAP_FAILED) {
+    fprintf(stderr, "couldn't map %s: %s\n", db_path, strerror(errno));
+    return -1;
+  }
+
+  mapped = heap->size < file_size ? heap->size : file_size;
+
+  if (check_header(ps, file_size)) {
+    munmap(heap, file_size);
+    return -1;
+  }
+
+  heap_size = heap->size;
+  committed_gen = -1;
+
+  // a broken header leaves nothing to start the walk from
+  for (size_t i = 0; i < ps->len; i++) {
+    if (ps->p[i].structural) {
+      munmap(heap, file_size);
+      return 0;
+    }
+  }
+
+  committed_gen = snap_gen_id(heap, heap->committed);
+
+  gens_len = heap->last_gen_index + 1;
+  if ((size_t)gens_len > mapped / sizeof(struct snap_generation)) {
+    gens_len = mapped / sizeof(struct snap_generation);
+  }
+
+  free(gens);
+  free(seen);
+  gens = calloc(gens_len, sizeof(struct gen_info));
+  seen = calloc(mapped / 64 + 1, 1);
+  if (!gens || !seen) {
+    fprintf(stderr, "out of memory\n");
+    exit(2);
+  }
+
+  nodes_len = 0;
+
+  walk_tree(ps);
+  check_free_pages(ps);
+  check_txn(ps);
+
+  if (threads > (int)(nodes_len / 256) + 1) {
+    threads = nodes_len / 256 + 1;
+  }
+
+  struct worker *w = calloc(threads, sizeof(struct worker));
+  if (!w) {
+    fprintf(stderr, "out of memory\n");
+    exit(2);
+  }
+
+  for (int i = 0; i < threads; i++) {
+    w[i].from = nodes_len * i / threads;
+    w[i].to = nodes_len * (i + 1) / threads;
+
+    if (pthread_create(&w[i].thread, NULL, check_nodes, &w[i])) {
+      // check it here instead
+      check_nodes(&w[i]);
+      w[i].thread = pthread_self();
+    }
+  }
+
+  for (int i = 0; i < threads; i++) {
+    if (!pthread_equal(w[i].thread, pthread_self())) {
+      pthread_join(w[i].thread, NULL);
+    }
+
+    merge(ps, &w[i].ps);
+  }
+
+  free(w);
+
+  check_chains(ps);
+
+  qsort(ps->p, ps->len, sizeof(struct problem), cmp_problem);
+
+  for (size_t i = 0; i < ps->len; i++) {
+    if (ps->p[i].gen >= 0 && ps->p[i].gen < gens_len) {
+      gens[ps->p[i].gen].bad = 1;
+    }
+  }
+
+  munmap(heap, file_size);
+  heap = NULL;
+
+  return 0;
+}
+
+// last_good finds the newest generation the committed one descends from whose
+// history has no problems, -1 if even the root has one.
+int last_good(void) {
+  int path[gens_len];
+  int len = 0;
+
+  for (int g = committed_gen; g >= 0 && len < gens_len; g = gens[g].parent) {
+    path[len++] = g;
+  }
+
+  int good = -1;
+  while (len && !gens[path[len - 1]].bad) {
+    good = path[--len];
+  }
+
+  return good;
+}
+
+// in_history is whether generation g is gen or one of its ancestors.
+int in_history(int g, int gen) {
+  for (int i = 0; gen >= 0 && i < gens_len; gen = gens[gen].parent, i++) {
+    if (gen == g) {
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+int print_problems(struct problems *ps) {
+  for (size_t i = 0; i < ps->len; i++) {
+    struct problem *p = &ps->p[i];
+
+    if (p->gen >= 0) {
+      printf("0x%08lx gen %d: %s\n", (unsigned long)p->off, p->gen, p->what);
+    } else {
+      printf("0x%08lx: %s\n", (unsigned long)p->off, p->what);
+    }
+  }
+
+  if (ps->dropped) {
+    printf("... and %ld more\n", ps->dropped);
+  }
+
+  int present = 0;
+  for (int i = 0; i < gens_len; i++) {
+    present += gens[i].present;
+  }
+
+  printf(
+      "%s: %zu page versions in %d generations, %zu problems\n",
+      db_path,
+      nodes_len,
+      present,
+      ps->len + ps->dropped);
+
+  return ps->len + ps->dropped ? 1 : 0;
+}
+
+// repair rolls the heap back to the newest generation nothing's wrong with.
+// Generations' pages are spread all over the file so it can't just be cut
+// short after one. Instead that generation is checked out, which is what
+// opening the heap would have done had it been the last one committed, and
+// anything newer is left behind as a branch. Returns the generation or -1.
+int repair(struct problems *ps, int threads) {
+  // whatever the log holds is newer than the heap, so it goes in first
+  int replayed = wal_replay(db_path);
+  if (replayed < 0) {
+    fprintf(stderr, "couldn't replay the log\n");
+    return -1;
+  }
+
+  if (replayed) {
+    printf("replayed %d commits from the log\n", replayed);
+    if (check(ps, threads)) {
+      return -1;
+    }
+  }
+
+  for (size_t i = 0; i < ps->len; i++) {
+    if (ps->p[i].structural) {
+      fprintf(stderr, "the heap's structure is broken, not repairing it\n");
+      return -1;
+    }
+  }
+
+  if (committed_gen < 0) {
+    fprintf(stderr, "the heap was never committed, nothing to roll back to\n");
+    return -1;
+  }
+
+  int good = last_good();
+  if (good < 0) {
+    fprintf(
+        stderr,
+        "the root generation has problems, nothing to roll back to\n");
+    return -1;
+  }
+
+  if (file_size > heap_size) {
+    if (truncate(db_path, heap_size)) {
+      fprintf(stderr, "couldn't truncate %s: %s\n", db_path, strerror(errno));
+      return -1;
+    }
+
+    printf(
+        "cut off %zu bytes past the end of the heap\n",
+        file_size - heap_size);
+  }
+
+  // opening rolls back an unfinished transaction
+  struct heap_header *h = snap_init((char *)db_path);
+  if (!h) {
+    return -1;
+  }
+
+  if (snap_gen_id(h, h->committed) != good) {
+    snap_checkout(h, good);
+  }
+
+  snap_close(h);
+
+  return good;
+}
+
+int main(int argc, char *argv[]) {
+  int fix = 0;
+  int threads = sysconf(_SC_NPROCESSORS_ONLN);
+
+  int opt;
+  while ((opt = getopt(argc, argv, "rj:")) != -1) {
+    switch (opt) {
+    case 'r':
+      fix = 1;
+      break;
+    case 'j':
+      threads = atoi(optarg);
+      break;
+    default:
+      fprintf(stderr, "usage: %s [-r] [-j threads] <db>\n", *argv);
+      return 2;
+    }
+  }
+
+  if (optind != argc - 1) {
+    fprintf(stderr, "usage: %s [-r] [-j threads] <db>\n", *argv);
+    return 2;
+  }
+
+  if (threads < 1) {
+    threads = 1;
+  }
+
+  db_path = argv[optind];
+  page_size = PAGE_SIZE;
+
+  struct problems ps = {0};
+  if (check(&ps, threads)) {
+    return 2;
+  }
+
+  char log[PATH_MAX];
+  struct stat st;
+  if (!wal_path(log, sizeof(log), db_path) && !stat(log, &st) && st.st_size) {
+    printf("%s has commits in its log that aren't in the heap yet\n", db_path);
+  }
+
+  if (!print_problems(&ps) || !fix) {
+    return ps.len + ps.dropped ? 1 : 0;
+  }
+
+  int was = committed_gen;
+  int good = repair(&ps, threads);
+  if (good < 0) {
+    return 1;
+  }
+
+  if (good != was) {
+    printf("rolled back from generation %d to %d\n", was, good);
+  }
+
+  if (check(&ps, threads)) {
+    return 2;
+  }
+
+  print_problems(&ps);
+
+  // anything newer was only left behind, nothing's going to read it again
+  for (size_t i = 0; i < ps.len; i++) {
+    if (ps.p[i].gen < 0 || in_history(ps.p[i].gen, good)) {
+      return 1;
+    }
+  }
+
+  return 0;
+}
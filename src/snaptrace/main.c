@@ -0,0 +1,41 @@
+// getopt
+#define _XOPEN_SOURCE 600
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "../trace.h"
+
+// snaptrace turns a binary trace written by an evaler started with --trace
+// into the text memtest replays. A trace holding calls to more than one heap
+// has to be told which one to pull out with -H.
+int main(int argc, char *argv[]) {
+  long heap = -1;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "H:")) != -1) {
+    switch (opt) {
+    case 'H':
+      heap = atol(optarg);
+      break;
+    default:
+      fprintf(stderr, "usage: %s [-H heap] <trace>\n", *argv);
+      exit(1);
+    }
+  }
+
+  if (optind != argc - 1) {
+    fprintf(stderr, "usage: %s [-H heap] <trace>\n", *argv);
+    exit(1);
+  }
+
+  long n = trace_decode(argv[optind], heap, stdout);
+  if (n < 0) {
+    return 1;
+  }
+
+  fprintf(stderr, "%ld records\n", n);
+
+  return 0;
+}
@@ -31,3 +31,6 @@ json_t *do_eval(
 
   return result;
 }
+
+// the counter lives in the heap, there's nothing else to drop
+void forget_db(struct heap_header *heap) {}
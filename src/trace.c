@@ -0,0 +1,243 @@
+// clock_gettime and ftruncate
+#define _XOPEN_SOURCE 600
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+struct trace {
+  struct trace_header *h;
+  size_t len;
+};
+
+size_t trace_len(uint64_t records) {
+  return sizeof(struct trace_header) + records * sizeof(struct trace_record);
+}
+
+// trace_open maps the trace at path, carrying on from where it left off if
+// it's already one of the same size and starting it over otherwise.
+struct trace *trace_open(const char *path, uint64_t records) {
+  int fd = open(path, O_RDWR | O_CREAT, 0600);
+  if (fd == -1) {
+    fprintf(stderr, "couldn't open trace %s: %s\n", path, strerror(errno));
+    return NULL;
+  }
+
+  size_t len = trace_len(records);
+
+  struct stat st;
+  if (fstat(fd, &st)) {
+    fprintf(stderr, "couldn't stat trace %s\n", strerror(errno));
+    close(fd);
+    return NULL;
+  }
+
+  int fresh = (size_t)st.st_size != len;
+  if (fresh && (ftruncate(fd, 0) || ftruncate(fd, len))) {
+    fprintf(stderr, "couldn't size trace %s\n", strerror(errno));
+    close(fd);
+    return NULL;
+  }
+
+  struct trace_header *h =
+      mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+
+  if (h == MAP_FAILED) {
+    fprintf(stderr, "couldn't map trace %s\n", strerror(errno));
+    return NULL;
+  }
+
+  if (fresh || h->magic != TRACE_MAGIC ||
+      h->record_size != sizeof(struct trace_record) || h->records != records) {
+    memset(h, 0, sizeof(*h));
+    h->records = records;
+    h->record_size = sizeof(struct trace_record);
+    h->magic = TRACE_MAGIC;
+  }
+
+  struct trace *t = malloc(sizeof(struct trace));
+  if (!t) {
+    munmap(h, len);
+    return NULL;
+  }
+
+  t->h = h;
+  t->len = len;
+
+  return t;
+}
+
+void trace_close(struct trace *t) {
+  munmap(t->h, t->len);
+  free(t);
+}
+
+// trace_event takes the next slot in the ring and fills it in. Taking the
+// slot is the only thing writers share, so nothing has to be locked.
+void trace_event(
+    struct trace *t,
+    enum trace_op op,
+    uint32_t heap,
+    uint64_t ptr,
+    size_t size,
+    uint64_t result) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  uint64_t i = __atomic_fetch_add(&t->h->next, 1, __ATOMIC_RELAXED);
+  struct trace_record *r = &t->h->r[i % t->h->records];
+
+  r->ns = (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+  r->ptr = ptr;
+  r->size = size;
+  r->result = result;
+  r->op = op;
+  r->heap = heap;
+
+  __atomic_store_n(&r->seq, i + 1, __ATOMIC_RELEASE);
+}
+
+// trace_heaps finds which heaps the records from first up to next were made
+// on, up to max of them. Returns how many there were.
+int trace_heaps(
+    struct trace_header *h,
+    uint64_t first,
+    uint64_t next,
+    uint32_t *heaps,
+    int max) {
+  int n = 0;
+
+  for (uint64_t i = first; i < next; i++) {
+    struct trace_record *r = &h->r[i % h->records];
+    if (r->seq != i + 1) {
+      continue;
+    }
+
+    int seen = 0;
+    for (int j = 0; j < n && j < max; j++) {
+      seen |= heaps[j] == r->heap;
+    }
+
+    if (!seen) {
+      if (n < max) {
+        heaps[n] = r->heap;
+      }
+      n++;
+    }
+  }
+
+  return n;
+}
+
+// trace_decode writes whatever records the trace still has of the calls made
+// on heap, oldest first, as the text memtest replays. A heap of -1 takes
+// every record as long as they're all from the same heap, a replay of
+// several interleaved wouldn't make sense. Returns how many records were
+// written, or -1.
+long trace_decode(const char *path, long heap, FILE *out) {
+  int fd = open(path, O_RDONLY);
+  if (fd == -1) {
+    fprintf(stderr, "couldn't open trace %s: %s\n", path, strerror(errno));
+    return -1;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) || (size_t)st.st_size < sizeof(struct trace_header)) {
+    fprintf(stderr, "%s isn't a trace\n", path);
+    close(fd);
+    return -1;
+  }
+
+  struct trace_header *h = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+
+  if (h == MAP_FAILED) {
+    fprintf(stderr, "couldn't map trace %s\n", strerror(errno));
+    return -1;
+  }
+
+  if (h->magic != TRACE_MAGIC ||
+      h->record_size != sizeof(struct trace_record) ||
+      trace_len(h->records) != (size_t)st.st_size) {
+    fprintf(stderr, "%s isn't a trace\n", path);
+    munmap(h, st.st_size);
+    return -1;
+  }
+
+  uint64_t next = __atomic_load_n(&h->next, __ATOMIC_ACQUIRE);
+  uint64_t first = next > h->records ? next - h->records : 0;
+  long written = 0;
+
+  if (heap < 0) {
+    uint32_t heaps[8];
+    int n = trace_heaps(h, first, next, heaps, 8);
+
+    if (n > 1) {
+      fprintf(stderr, "%s has calls from %d heaps, pick one of", path, n);
+      for (int j = 0; j < n && j < 8; j++) {
+        fprintf(stderr, " %u", heaps[j]);
+      }
+      fprintf(stderr, n > 8 ? " ...\n" : "\n");
+
+      munmap(h, st.st_size);
+      return -1;
+    }
+  }
+
+  for (uint64_t i = first; i < next; i++) {
+    struct trace_record r = h->r[i % h->records];
+
+    // still being written, or already written over by a later one
+    if (r.seq != i + 1) {
+      continue;
+    }
+
+    if (heap >= 0 && (long)r.heap != heap) {
+      continue;
+    }
+
+    unsigned long ptr = r.ptr;
+    unsigned long result = r.result;
+
+    switch (r.op) {
+    case TRACE_MALLOC:
+      fprintf(
+          out, "snap_malloc %lu -> 0x%lx\n", (unsigned long)r.size, result);
+      break;
+    case TRACE_FREE:
+      fprintf(out, "snap_free 0x%lx\n", ptr);
+      break;
+    case TRACE_REALLOC:
+      fprintf(
+          out,
+          "snap_realloc 0x%lx %lu -> 0x%lx\n",
+          ptr,
+          (unsigned long)r.size,
+          result);
+      break;
+    case TRACE_BEGIN_MUT:
+      fprintf(out, "snap_begin_mut\n");
+      break;
+    case TRACE_COMMIT:
+      fprintf(out, "snap_commit\n");
+      break;
+    default:
+      continue;
+    }
+
+    written++;
+  }
+
+  munmap(h, st.st_size);
+
+  return written;
+}
@@ -0,0 +1,59 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define TRACE_MAGIC 0x54524332
+
+// how many records a trace holds before it starts writing over the oldest.
+#define TRACE_RECORDS (1 << 20)
+
+enum trace_op {
+  TRACE_MALLOC = 1,
+  TRACE_FREE = 2,
+  TRACE_REALLOC = 3,
+  TRACE_BEGIN_MUT = 4,
+  TRACE_COMMIT = 5,
+};
+
+// every allocator call becomes one record. seq is one more than the record's
+// position in the trace and is written last, so a reader can tell a finished
+// record from one still being written or one that's been lapped. ptr and
+// result are offsets into the heap the call was made on, which heap is the
+// slot it was mapped at, so a trace of several heaps can be pulled apart and
+// replayed wherever they end up mapped.
+struct trace_record {
+  uint64_t seq;
+  uint64_t ns; // CLOCK_MONOTONIC
+  uint64_t ptr;
+  uint64_t size;
+  uint64_t result;
+  uint32_t op;
+  uint32_t heap;
+};
+
+// a trace file is this header followed by its records, used as a ring. next
+// counts every record ever taken so record i is at i % records.
+struct trace_header {
+  uint32_t magic;
+  uint32_t record_size;
+  uint64_t records;
+  uint64_t next;
+  struct trace_record r[];
+};
+
+struct trace;
+
+struct trace *trace_open(const char *path, uint64_t records);
+void trace_close(struct trace *t);
+
+void trace_event(
+    struct trace *t,
+    enum trace_op op,
+    uint32_t heap,
+    uint64_t ptr,
+    size_t size,
+    uint64_t result);
+
+long trace_decode(const char *path, long heap, FILE *out);
@@ -0,0 +1,718 @@
+// O_DIRECT and the raw io_uring syscalls need these
+#define _XOPEN_SOURCE 600
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "wal.h"
+
+#ifdef WAL_IO_URING
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#endif
+
+#define WAL_PAGE ((size_t)sysconf(_SC_PAGESIZE))
+
+// records are staged here before being written, grown as needed
+#define WAL_INITIAL_BUFFER (64 * 4096)
+
+#ifdef WAL_IO_URING
+// just enough of an io_uring to push a write and a datasync through it, we
+// talk to the kernel directly instead of pulling in liburing.
+struct uring {
+  int fd;
+
+  void *sq_ring;
+  size_t sq_len;
+  void *cq_ring;
+  size_t cq_len;
+  struct io_uring_sqe *sqes;
+  size_t sqes_len;
+
+  unsigned *sq_tail;
+  unsigned *sq_mask;
+  unsigned *sq_array;
+
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned *cq_mask;
+  struct io_uring_cqe *cqes;
+};
+#endif
+
+struct wal {
+  int fd;
+  uint64_t off;
+
+  char *buf; // page aligned
+  size_t buf_len;
+
+#ifdef WAL_IO_URING
+  int use_uring;
+  int registered; // buf is registered with the ring as fixed buffer 0
+  struct uring ring;
+#endif
+};
+
+size_t round_wal_page(size_t len) {
+  return (len + WAL_PAGE - 1) & ~(WAL_PAGE - 1);
+}
+
+// wal_sum is FNV-1a taken a word at a time, records are always a multiple of
+// the page size so there's never a tail to deal with.
+uint64_t wal_sum(const char *data, size_t len) {
+  uint64_t h = 0xcbf29ce484222325ULL;
+
+  for (size_t i = 0; i < len; i += sizeof(uint64_t)) {
+    uint64_t word;
+    memcpy(&word, data + i, sizeof(word));
+
+    h ^= word;
+    h *= 0x100000001b3ULL;
+  }
+
+  return h;
+}
+
+int wal_path(char *path, size_t len, const char *db_path) {
+  if ((size_t)snprintf(path, len, "%s.wal", db_path) >= len) {
+    fprintf(stderr, "db path too long for a log %s\n", db_path);
+    return -1;
+  }
+
+  return 0;
+}
+
+// sync_parent makes sure the log's directory entry survives a crash along
+// with its contents.
+void sync_parent(const char *path) {
+  char dir[PATH_MAX];
+  strncpy(dir, path, sizeof(dir) - 1);
+  dir[sizeof(dir) - 1] = '\0';
+
+  char *slash = strrchr(dir, '/');
+  if (slash == dir) {
+    slash[1] = '\0';
+  } else if (slash) {
+    *slash = '\0';
+  } else {
+    strcpy(dir, ".");
+  }
+
+  int fd = open(dir, O_RDONLY);
+  if (fd == -1) {
+    return;
+  }
+
+  fsync(fd);
+  close(fd);
+}
+
+#ifdef WAL_IO_URING
+void uring_teardown(struct uring *r) {
+  if (r->sqes) {
+    munmap(r->sqes, r->sqes_len);
+  }
+
+  if (r->cq_ring && r->cq_ring != r->sq_ring) {
+    munmap(r->cq_ring, r->cq_len);
+  }
+
+  if (r->sq_ring) {
+    munmap(r->sq_ring, r->sq_len);
+  }
+
+  close(r->fd);
+  memset(r, 0, sizeof(*r));
+}
+
+int uring_setup(struct uring *r) {
+  memset(r, 0, sizeof(*r));
+
+  struct io_uring_params p;
+  memset(&p, 0, sizeof(p));
+
+  int fd = syscall(__NR_io_uring_setup, 4, &p);
+  if (fd < 0) {
+    return -1;
+  }
+
+  r->fd = fd;
+  r->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  r->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  r->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+
+  int single = p.features & IORING_FEAT_SINGLE_MMAP;
+  if (single && r->cq_len > r->sq_len) {
+    r->sq_len = r->cq_len;
+  }
+
+  r->sq_ring = mmap(
+      NULL,
+      r->sq_len,
+      PROT_READ | PROT_WRITE,
+      MAP_SHARED,
+      fd,
+      IORING_OFF_SQ_RING);
+  if (r->sq_ring == MAP_FAILED) {
+    r->sq_ring = NULL;
+    uring_teardown(r);
+    return -1;
+  }
+
+  if (single) {
+    r->cq_ring = r->sq_ring;
+  } else {
+    r->cq_ring = mmap(
+        NULL,
+        r->cq_len,
+        PROT_READ | PROT_WRITE,
+        MAP_SHARED,
+        fd,
+        IORING_OFF_CQ_RING);
+    if (r->cq_ring == MAP_FAILED) {
+      r->cq_ring = NULL;
+      uring_teardown(r);
+      return -1;
+    }
+  }
+
+  r->sqes = mmap(
+      NULL,
+      r->sqes_len,
+      PROT_READ | PROT_WRITE,
+      MAP_SHARED,
+      fd,
+      IORING_OFF_SQES);
+  if (r->sqes == MAP_FAILED) {
+    r->sqes = NULL;
+    uring_teardown(r);
+    return -1;
+  }
+
+  char *sq = r->sq_ring;
+  char *cq = r->cq_ring;
+
+  r->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+  r->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+  r->sq_array = (unsigned *)(sq + p.sq_off.array);
+
+  r->cq_head = (unsigned *)(cq + p.cq_off.head);
+  r->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+  r->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+  r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+  return 0;
+}
+
+void uring_register(struct wal *w) {
+  struct iovec iov = {.iov_base = w->buf, .iov_len = w->buf_len};
+
+  // this can easily fail on RLIMIT_MEMLOCK, a plain write works just as well
+  w->registered = syscall(
+                      __NR_io_uring_register,
+                      w->ring.fd,
+                      IORING_REGISTER_BUFFERS,
+                      &iov,
+                      1) == 0;
+}
+
+void uring_unregister(struct wal *w) {
+  if (!w->registered) {
+    return;
+  }
+
+  syscall(
+      __NR_io_uring_register, w->ring.fd, IORING_UNREGISTER_BUFFERS, NULL, 0);
+  w->registered = 0;
+}
+
+struct io_uring_sqe *next_sqe(struct uring *r, unsigned *tail) {
+  unsigned index = *tail & *r->sq_mask;
+
+  struct io_uring_sqe *sqe = &r->sqes[index];
+  memset(sqe, 0, sizeof(*sqe));
+  r->sq_array[index] = index;
+
+  (*tail)++;
+
+  return sqe;
+}
+
+// uring_write_sync writes the first len bytes of the staging buffer at the end
+// of the log followed by a datasync linked to it, so the datasync only runs
+// once the write has fully completed. Returns 0 once both have succeeded.
+int uring_write_sync(struct wal *w, size_t len) {
+  struct uring *r = &w->ring;
+  unsigned tail = *r->sq_tail;
+
+  struct io_uring_sqe *sqe = next_sqe(r, &tail);
+  sqe->opcode = w->registered ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+  sqe->flags = IOSQE_IO_LINK;
+  sqe->fd = w->fd;
+  sqe->off = w->off;
+  sqe->addr = (uint64_t)(uintptr_t)w->buf;
+  sqe->len = len;
+  sqe->buf_index = 0;
+  sqe->user_data = 1;
+
+  sqe = next_sqe(r, &tail);
+  sqe->opcode = IORING_OP_FSYNC;
+  sqe->fd = w->fd;
+  sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+  sqe->user_data = 2;
+
+  __atomic_store_n(r->sq_tail, tail, __ATOMIC_RELEASE);
+
+  long submitted = syscall(
+      __NR_io_uring_enter, r->fd, 2, 2, IORING_ENTER_GETEVENTS, NULL, 0);
+  if (submitted != 2) {
+    return -1;
+  }
+
+  long written = -1;
+  long synced = -1;
+
+  for (int seen = 0; seen < 2;) {
+    unsigned head = *r->cq_head;
+
+    if (head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) {
+      long err = syscall(
+          __NR_io_uring_enter, r->fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+      if (err < 0 && errno != EINTR) {
+        return -1;
+      }
+      continue;
+    }
+
+    struct io_uring_cqe *cqe = &r->cqes[head & *r->cq_mask];
+    if (cqe->user_data == 1) {
+      written = cqe->res;
+    } else {
+      synced = cqe->res;
+    }
+
+    __atomic_store_n(r->cq_head, head + 1, __ATOMIC_RELEASE);
+    seen++;
+  }
+
+  if (written != (long)len || synced != 0) {
+    return -1;
+  }
+
+  return 0;
+}
+#endif
+
+// write_record appends the staged record to the log and waits for it to be on
+// disk.
+int write_record(struct wal *w, size_t len) {
+#ifdef WAL_IO_URING
+  if (w->use_uring && len <= UINT_MAX) {
+    if (!uring_write_sync(w, len)) {
+      return 0;
+    }
+
+    // Older kernels lack some of the opcodes and a failing device fails just
+    // the same through pwrite, so stop using the ring and write the whole
+    // record again the plain way.
+    uring_unregister(w);
+    uring_teardown(&w->ring);
+    w->use_uring = 0;
+  }
+#endif
+
+  size_t done = 0;
+  while (done < len) {
+    ssize_t n = pwrite(w->fd, w->buf + done, len - done, w->off + done);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+
+      fprintf(stderr, "failed to write log %s\n", strerror(errno));
+      return -1;
+    }
+
+    done += n;
+  }
+
+  if (fdatasync(w->fd)) {
+    fprintf(stderr, "failed to sync log %s\n", strerror(errno));
+    return -1;
+  }
+
+  return 0;
+}
+
+int grow_buffer(struct wal *w, size_t len) {
+  if (len <= w->buf_len) {
+    return 0;
+  }
+
+  size_t new_len = w->buf_len ? w->buf_len : WAL_INITIAL_BUFFER;
+  while (new_len < len) {
+    new_len *= 2;
+  }
+
+  void *buf = NULL;
+  int err = posix_memalign(&buf, WAL_PAGE, new_len);
+  if (err) {
+    fprintf(stderr, "couldn't allocate log buffer %s\n", strerror(err));
+    return -1;
+  }
+
+#ifdef WAL_IO_URING
+  uring_unregister(w);
+#endif
+
+  free(w->buf);
+  w->buf = buf;
+  w->buf_len = new_len;
+
+#ifdef WAL_IO_URING
+  if (w->use_uring) {
+    uring_register(w);
+  }
+#endif
+
+  return 0;
+}
+
+// wal_open starts a new, empty log next to the db. Anything left in an old
+// log is thrown away so make sure it's been replayed first. The log stays
+// locked for as long as it's open so nobody else replays it from under us.
+struct wal *wal_open(const char *db_path) {
+  char path[PATH_MAX];
+  if (wal_path(path, sizeof(path), db_path)) {
+    return NULL;
+  }
+
+  int fd = open(path, O_WRONLY | O_CREAT | O_DIRECT, 0660);
+  if (fd == -1 && errno == EINVAL) {
+    // not every filesystem supports O_DIRECT (tmpfs for one)
+    fd = open(path, O_WRONLY | O_CREAT, 0660);
+  }
+
+  if (fd == -1) {
+    fprintf(stderr, "couldn't open log %s\n", strerror(errno));
+    return NULL;
+  }
+
+  if (flock(fd, LOCK_EX | LOCK_NB)) {
+    fprintf(stderr, "log %s is already in use\n", path);
+    close(fd);
+    return NULL;
+  }
+
+  if (ftruncate(fd, 0)) {
+    fprintf(stderr, "failed to reset log %s\n", strerror(errno));
+    close(fd);
+    return NULL;
+  }
+
+  sync_parent(path);
+
+  struct wal *w = calloc(1, sizeof(struct wal));
+  w->fd = fd;
+
+#ifdef WAL_IO_URING
+  w->use_uring = !uring_setup(&w->ring);
+#endif
+
+  if (grow_buffer(w, WAL_INITIAL_BUFFER)) {
+    wal_close(w);
+    return NULL;
+  }
+
+  return w;
+}
+
+void wal_close(struct wal *w) {
+#ifdef WAL_IO_URING
+  if (w->use_uring) {
+    uring_unregister(w);
+    uring_teardown(&w->ring);
+  }
+#endif
+
+  close(w->fd);
+  free(w->buf);
+  free(w);
+}
+
+// wal_append logs the given ranges of the heap as a single record and returns
+// once the record is on disk. Ranges must be page aligned.
+int wal_append(
+    struct wal *w,
+    int gen,
+    uint64_t heap_size,
+    const void *heap_start,
+    const struct wal_range *ranges,
+    size_t nranges) {
+  size_t head_len = round_wal_page(
+      sizeof(struct wal_record) + nranges * sizeof(struct wal_range));
+
+  size_t len = head_len;
+  for (size_t i = 0; i < nranges; i++) {
+    len += ranges[i].len;
+  }
+
+  if (grow_buffer(w, len)) {
+    return -1;
+  }
+
+  memset(w->buf, 0, head_len);
+
+  struct wal_record *rec = (struct wal_record *)w->buf;
+  rec->magic = WAL_MAGIC;
+  rec->gen = gen;
+  rec->len = len;
+  rec->heap_size = heap_size;
+  rec->nranges = nranges;
+  memcpy(rec->ranges, ranges, nranges * sizeof(struct wal_range));
+
+  char *data = w->buf + head_len;
+  for (size_t i = 0; i < nranges; i++) {
+    memcpy(data, (const char *)heap_start + ranges[i].off, ranges[i].len);
+    data += ranges[i].len;
+  }
+
+  rec->sum = wal_sum(w->buf, len);
+
+  if (write_record(w, len)) {
+    return -1;
+  }
+
+  w->off += len;
+
+  return 0;
+}
+
+uint64_t wal_size(struct wal *w) { return w->off; }
+
+// wal_reset empties the log, only call this once everything it holds has been
+// written back to the heap file and synced.
+int wal_reset(struct wal *w) {
+  // The truncate has to be durable before anything new is appended, otherwise
+  // a crash could leave new records followed by stale ones which would then
+  // get replayed over them.
+  if (ftruncate(w->fd, 0) || fsync(w->fd)) {
+    fprintf(stderr, "failed to reset log %s\n", strerror(errno));
+    return -1;
+  }
+
+  w->off = 0;
+
+  return 0;
+}
+
+int read_full(int fd, char *buf, size_t len, uint64_t off) {
+  size_t done = 0;
+  while (done < len) {
+    ssize_t n = pread(fd, buf + done, len - done, off + done);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    } else if (n <= 0) {
+      return -1;
+    }
+
+    done += n;
+  }
+
+  return 0;
+}
+
+int write_full(int fd, const char *buf, size_t len, uint64_t off) {
+  size_t done = 0;
+  while (done < len) {
+    ssize_t n = pwrite(fd, buf + done, len - done, off + done);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    } else if (n < 0) {
+      return -1;
+    }
+
+    done += n;
+  }
+
+  return 0;
+}
+
+// record_ok checks a record read from the log is whole and was written by us.
+int record_ok(char *buf, uint64_t len) {
+  struct wal_record *rec = (struct wal_record *)buf;
+
+  if (rec->nranges > (len - sizeof(struct wal_record)) /
+                         sizeof(struct wal_range)) {
+    return 0;
+  }
+
+  uint64_t data_len =
+      round_wal_page(
+          sizeof(struct wal_record) + rec->nranges * sizeof(struct wal_range));
+  for (uint64_t i = 0; i < rec->nranges; i++) {
+    data_len += rec->ranges[i].len;
+  }
+
+  if (data_len != len) {
+    return 0;
+  }
+
+  uint64_t sum = rec->sum;
+  rec->sum = 0;
+
+  return wal_sum(buf, len) == sum;
+}
+
+// wal_replay writes every complete record in the db's log back into the heap
+// file and then empties the log. The log ends at the first record that is
+// torn or corrupt, that record was never acknowledged as committed. Returns
+// the number of records replayed.
+int wal_replay(const char *db_path) {
+  char path[PATH_MAX];
+  if (wal_path(path, sizeof(path), db_path)) {
+    return -1;
+  }
+
+  int fd = open(path, O_RDWR);
+  if (fd == -1) {
+    if (errno == ENOENT) {
+      return 0;
+    }
+
+    fprintf(stderr, "couldn't open log %s\n", strerror(errno));
+    return -1;
+  }
+
+  // someone is still writing to it, the heap file is only as new as their
+  // last checkpoint.
+  if (flock(fd, LOCK_EX | LOCK_NB)) {
+    close(fd);
+    return 0;
+  }
+
+  struct stat log_stat;
+  if (fstat(fd, &log_stat)) {
+    fprintf(stderr, "could not stat log: %s\n", strerror(errno));
+    close(fd);
+    return -1;
+  }
+
+  if (log_stat.st_size == 0) {
+    close(fd);
+    return 0;
+  }
+
+  int db_fd = open(db_path, O_RDWR);
+  if (db_fd == -1) {
+    fprintf(stderr, "couldn't open db %s\n", strerror(errno));
+    close(fd);
+    return -1;
+  }
+
+  uint64_t log_size = log_stat.st_size;
+  uint64_t off = 0;
+  int replayed = 0;
+  char *buf = NULL;
+  int err = 0;
+
+  while (off + WAL_PAGE <= log_size) {
+    struct wal_record head;
+    if (read_full(fd, (char *)&head, sizeof(head), off)) {
+      break;
+    }
+
+    if (head.magic != WAL_MAGIC || head.len < WAL_PAGE ||
+        head.len % WAL_PAGE || head.len > log_size - off) {
+      break;
+    }
+
+    char *next = realloc(buf, head.len);
+    if (!next) {
+      fprintf(stderr, "couldn't allocate log record\n");
+      err = 1;
+      break;
+    }
+    buf = next;
+
+    if (read_full(fd, buf, head.len, off) || !record_ok(buf, head.len)) {
+      break;
+    }
+
+    struct wal_record *rec = (struct wal_record *)buf;
+
+    struct stat db_stat;
+    if (fstat(db_fd, &db_stat)) {
+      fprintf(stderr, "could not stat db: %s\n", strerror(errno));
+      err = 1;
+      break;
+    }
+
+    if ((uint64_t)db_stat.st_size < rec->heap_size &&
+        ftruncate(db_fd, rec->heap_size)) {
+      fprintf(stderr, "could not grow db %s\n", strerror(errno));
+      err = 1;
+      break;
+    }
+
+    char *data =
+        buf + round_wal_page(
+                  sizeof(struct wal_record) +
+                  rec->nranges * sizeof(struct wal_range));
+
+    for (uint64_t i = 0; i < rec->nranges && !err; i++) {
+      if (write_full(db_fd, data, rec->ranges[i].len, rec->ranges[i].off)) {
+        fprintf(stderr, "failed to replay log %s\n", strerror(errno));
+        err = 1;
+      }
+
+      data += rec->ranges[i].len;
+    }
+
+    if (err) {
+      break;
+    }
+
+    replayed++;
+    off += head.len;
+  }
+
+  free(buf);
+
+  // only drop the log once what it held is safely in the heap file
+  if (!err && replayed && fdatasync(db_fd)) {
+    fprintf(stderr, "failed to sync db %s\n", strerror(errno));
+    err = 1;
+  }
+
+  if (!err && (ftruncate(fd, 0) || fsync(fd))) {
+    fprintf(stderr, "failed to reset log %s\n", strerror(errno));
+    err = 1;
+  }
+
+  close(db_fd);
+  close(fd);
+
+  return err ? -1 : replayed;
+}
+
+// wal_discard removes any log left behind by an older db at the same path.
+void wal_discard(const char *db_path) {
+  char path[PATH_MAX];
+  if (!wal_path(path, sizeof(path), db_path)) {
+    unlink(path);
+  }
+}
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define WAL_MAGIC 0x57414c31
+
+// once the log grows past this many bytes the heap file gets checkpointed and
+// the log starts over.
+#define WAL_CHECKPOINT_SIZE (64 * 1024 * 1024)
+
+// a run of bytes to copy from the heap into the log, offsets are relative to
+// the start of the heap file.
+struct wal_range {
+  uint64_t off;
+  uint64_t len;
+};
+
+// every commit is logged as one of these followed by the data for each range.
+// The header, range list and data are all padded out to the page size so the
+// log can be written with O_DIRECT.
+struct wal_record {
+  uint32_t magic;
+  int32_t gen;
+
+  uint64_t len;       // the entire record including this header
+  uint64_t heap_size; // the heap file is at least this big after replaying
+  uint64_t sum;       // checksum of the entire record with sum set to 0
+
+  uint64_t nranges;
+  struct wal_range ranges[];
+};
+
+struct wal;
+
+int wal_path(char *path, size_t len, const char *db_path);
+
+struct wal *wal_open(const char *db_path);
+void wal_close(struct wal *w);
+
+int wal_append(
+    struct wal *w,
+    int gen,
+    uint64_t heap_size,
+    const void *heap_start,
+    const struct wal_range *ranges,
+    size_t nranges);
+uint64_t wal_size(struct wal *w);
+int wal_reset(struct wal *w);
+
+int wal_replay(const char *db_path);
+void wal_discard(const char *db_path);
@@ -0,0 +1,251 @@
+// madvise and pread need these
+#define _XOPEN_SOURCE 600
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "ws.h"
+
+#define WS_PAGE ((size_t)sysconf(_SC_PAGESIZE))
+
+// pagemap entries read per pread
+#define PAGEMAP_BATCH 4096
+
+#define PAGEMAP_PRESENT (1ULL << 63)
+#define PAGEMAP_SWAPPED (1ULL << 62)
+
+struct ws {
+  char path[PATH_MAX];
+  int pagemap_fd;
+
+  // one bit for every page of the heap that's been seen in use
+  uint64_t *bits;
+  size_t pages;
+
+  char dirty;
+};
+
+int ws_path(char *path, size_t len, const char *db_path) {
+  if ((size_t)snprintf(path, len, "%s.ws", db_path) >= len) {
+    fprintf(stderr, "db path too long for a working set %s\n", db_path);
+    return -1;
+  }
+
+  return 0;
+}
+
+struct ws *ws_open(const char *db_path) {
+  struct ws *w = calloc(1, sizeof(struct ws));
+  if (!w) {
+    return NULL;
+  }
+
+  if (ws_path(w->path, sizeof(w->path), db_path)) {
+    free(w);
+    return NULL;
+  }
+
+  w->pagemap_fd = open("/proc/self/pagemap", O_RDONLY);
+  if (w->pagemap_fd == -1) {
+    fprintf(stderr, "couldn't open pagemap %s\n", strerror(errno));
+    free(w);
+    return NULL;
+  }
+
+  return w;
+}
+
+void ws_close(struct ws *w) {
+  close(w->pagemap_fd);
+  free(w->bits);
+  free(w);
+}
+
+int grow_bits(struct ws *w, size_t pages) {
+  if (pages <= w->pages) {
+    return 0;
+  }
+
+  size_t words = (pages + 63) / 64;
+  size_t old_words = (w->pages + 63) / 64;
+
+  uint64_t *bits = realloc(w->bits, words * sizeof(uint64_t));
+  if (!bits) {
+    return -1;
+  }
+
+  memset(bits + old_words, 0, (words - old_words) * sizeof(uint64_t));
+
+  w->bits = bits;
+  w->pages = pages;
+
+  return 0;
+}
+
+// ws_sample adds every page of the heap that's currently mapped into our page
+// tables to the working set. That covers anything read or written since the
+// heap was mapped, where the segv handler only ever sees writes.
+int ws_sample(struct ws *w, const void *heap_start, size_t heap_size) {
+  size_t pages = heap_size / WS_PAGE;
+
+  if (grow_bits(w, pages)) {
+    return -1;
+  }
+
+  uint64_t entries[PAGEMAP_BATCH];
+  off_t base = ((uintptr_t)heap_start / WS_PAGE) * sizeof(uint64_t);
+
+  for (size_t page = 0; page < pages; page += PAGEMAP_BATCH) {
+    size_t n = pages - page < PAGEMAP_BATCH ? pages - page : PAGEMAP_BATCH;
+
+    ssize_t got = pread(
+        w->pagemap_fd,
+        entries,
+        n * sizeof(uint64_t),
+        base + page * sizeof(uint64_t));
+    if (got < 0) {
+      fprintf(stderr, "couldn't read pagemap %s\n", strerror(errno));
+      return -1;
+    }
+
+    n = got / sizeof(uint64_t);
+
+    for (size_t i = 0; i < n; i++) {
+      if (!(entries[i] & (PAGEMAP_PRESENT | PAGEMAP_SWAPPED))) {
+        continue;
+      }
+
+      size_t p = page + i;
+      uint64_t bit = 1ULL << (p % 64);
+
+      if (!(w->bits[p / 64] & bit)) {
+        w->bits[p / 64] |= bit;
+        w->dirty = 1;
+      }
+    }
+  }
+
+  return 0;
+}
+
+// ws_save writes out the working set if anything was added since last time.
+// It goes to a temporary file first so a reader never sees half of one.
+int ws_save(struct ws *w) {
+  if (!w->dirty) {
+    return 0;
+  }
+
+  char tmp[PATH_MAX + 4];
+  snprintf(tmp, sizeof(tmp), "%s.tmp", w->path);
+
+  FILE *f = fopen(tmp, "w");
+  if (!f) {
+    fprintf(stderr, "couldn't write working set %s\n", strerror(errno));
+    return -1;
+  }
+
+  struct ws_header header = {
+      .magic = WS_MAGIC,
+      .page_size = WS_PAGE,
+      .nranges = 0,
+  };
+  fwrite(&header, sizeof(header), 1, f);
+
+  for (size_t p = 0; p < w->pages; p++) {
+    if (!(w->bits[p / 64] & (1ULL << (p % 64)))) {
+      continue;
+    }
+
+    struct ws_range r = {.page = p, .pages = 0};
+    while (p < w->pages && (w->bits[p / 64] & (1ULL << (p % 64)))) {
+      r.pages++;
+      p++;
+    }
+
+    fwrite(&r, sizeof(r), 1, f);
+    header.nranges++;
+  }
+
+  rewind(f);
+  fwrite(&header, sizeof(header), 1, f);
+
+  int err = ferror(f);
+  err |= fclose(f);
+
+  if (err || rename(tmp, w->path)) {
+    fprintf(stderr, "couldn't write working set %s\n", strerror(errno));
+    unlink(tmp);
+    return -1;
+  }
+
+  w->dirty = 0;
+
+  return 0;
+}
+
+// ws_prefetch starts reading in whatever the heap used last time it was open,
+// in file order so the readahead stays mostly sequential. Returns how many
+// pages were asked for.
+long ws_prefetch(const char *db_path, void *heap_start, size_t heap_size) {
+  char path[PATH_MAX];
+  if (ws_path(path, sizeof(path), db_path)) {
+    return -1;
+  }
+
+  FILE *f = fopen(path, "r");
+  if (!f) {
+    return 0;
+  }
+
+  long prefetched = 0;
+  size_t heap_pages = heap_size / WS_PAGE;
+
+  struct ws_header header;
+  if (fread(&header, sizeof(header), 1, f) != 1 || header.magic != WS_MAGIC ||
+      header.page_size != WS_PAGE) {
+    goto done;
+  }
+
+  for (uint64_t i = 0; i < header.nranges; i++) {
+    struct ws_range r;
+    if (fread(&r, sizeof(r), 1, f) != 1) {
+      break;
+    }
+
+    if (r.page >= heap_pages) {
+      break;
+    }
+
+    if (r.pages > heap_pages - r.page) {
+      r.pages = heap_pages - r.page;
+    }
+
+    madvise(
+        (char *)heap_start + r.page * WS_PAGE,
+        r.pages * WS_PAGE,
+        MADV_WILLNEED);
+
+    prefetched += r.pages;
+  }
+
+done:
+  fclose(f);
+
+  return prefetched;
+}
+
+// ws_discard removes any working set left behind by an older db at the same
+// path.
+void ws_discard(const char *db_path) {
+  char path[PATH_MAX];
+  if (!ws_path(path, sizeof(path), db_path)) {
+    unlink(path);
+  }
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define WS_MAGIC 0x57535331
+
+// the pages in use get sampled on the first commit after opening and then
+// again every this many commits.
+#define WS_SAMPLE_COMMITS 64
+
+// a run of pages, counted in pages from the start of the heap.
+struct ws_range {
+  uint64_t page;
+  uint64_t pages;
+};
+
+// the working set is kept next to the db (<db>.ws) as this header followed by
+// its ranges in file order. It's only ever a hint so a missing or mangled one
+// is ignored.
+struct ws_header {
+  uint32_t magic;
+  uint32_t page_size;
+  uint64_t nranges;
+  struct ws_range ranges[];
+};
+
+struct ws;
+
+struct ws *ws_open(const char *db_path);
+void ws_close(struct ws *w);
+
+int ws_sample(struct ws *w, const void *heap_start, size_t heap_size);
+int ws_save(struct ws *w);
+
+long ws_prefetch(const char *db_path, void *heap_start, size_t heap_size);
+void ws_discard(const char *db_path);
@@ -1,10 +1,19 @@
 package main
 
 import (
+	"bufio"
+	"debug/elf"
+	"encoding/binary"
+	"encoding/json"
 	"io/ioutil"
 	"os"
 	"os/exec"
+	"path/filepath"
+	"runtime"
+	"strconv"
+	"strings"
 	"testing"
+	"time"
 
 	"github.com/stretchr/testify/assert"
 )
@@ -169,3 +178,978 @@ func TestLuaTableCheckout(t *testing.T) {
 	assert.Contains(t, string(out), "\"second\": 2")
 	assert.NotContains(t, string(out), "\"third\": 3")
 }
+
+func TestLuavalSyncDurability(t *testing.T) {
+	db, err := ioutil.TempFile("", "luaval_sync_durability")
+	assert.NoError(t, err)
+	os.Remove(db.Name())
+
+	cmd := exec.Command("./luaval", "-d", db.Name(), "-s", "--durability=sync")
+	cmd.Dir = "../"
+	cmd.Stdin = strings.NewReader("{\"code\":\"v = 1\",\"args\":{}}\n")
+	out, err := cmd.Output()
+	assert.NoError(t, err)
+	assert.Contains(t, string(out), "\"gen\": 1")
+	assert.Contains(t, string(out), "\"durable\": 1")
+}
+
+func TestLuavalGroupDurabilityRollbacks(t *testing.T) {
+	db, err := ioutil.TempFile("", "luaval_group_durability")
+	assert.NoError(t, err)
+	os.Remove(db.Name())
+
+	// the rollbacks after each error don't count toward the group of three,
+	// so the flush comes with the third commit after the first one
+	cmd := exec.Command(
+		"./luaval",
+		"-d", db.Name(),
+		"-s",
+		"--durability=group",
+		"--group-commits=3",
+		"--group-latency=100000",
+	)
+	cmd.Dir = "../"
+	cmd.Stdin = strings.NewReader(
+		"{\"code\":\"v = 1\",\"args\":{}}\n" +
+			"{\"code\":\"error('no')\",\"args\":{}}\n" +
+			"{\"code\":\"error('no')\",\"args\":{}}\n" +
+			"{\"code\":\"v = 2\",\"args\":{}}\n" +
+			"{\"code\":\"v = 3\",\"args\":{}}\n")
+	out, err := cmd.Output()
+	assert.NoError(t, err)
+
+	lines := strings.Split(strings.TrimSpace(string(out)), "\n")
+	assert.Len(t, lines, 5)
+	assert.Contains(t, lines[3], "\"durable\": 2")
+	assert.Contains(t, lines[4], "\"gen\": 5")
+	assert.Contains(t, lines[4], "\"durable\": 5")
+}
+
+func TestLuavalDbQuotaRollback(t *testing.T) {
+	db, err := ioutil.TempFile("", "luaval_db_quota")
+	assert.NoError(t, err)
+	os.Remove(db.Name())
+	defer os.Remove(db.Name())
+
+	// each runaway query should get the room the one before it gave back
+	runaway := "{\"code\":\"local u = {} for i = 1, 1e7 do u[i] = {i} end\"," +
+		"\"args\":{}}\n"
+
+	cmd := exec.Command("./luaval", "-d", db.Name(), "-s", "--db-quota=2")
+	cmd.Dir = "../"
+	cmd.Stdin = strings.NewReader(
+		"{\"code\":\"t = {}\",\"args\":{}}\n" +
+			runaway +
+			runaway +
+			"{\"code\":\"for i = 1, 2000 do t[i] = {i} end return #t\"," +
+			"\"args\":{}}\n")
+	out, err := cmd.Output()
+	assert.NoError(t, err)
+
+	lines := strings.Split(strings.TrimSpace(string(out)), "\n")
+	assert.Len(t, lines, 4)
+	assert.Contains(t, lines[1], "\"error\": \"not enough memory\"")
+	assert.Contains(t, lines[2], "\"error\": \"not enough memory\"")
+	assert.NotContains(t, lines[2], "\"bytes_allocated\": 0,")
+	assert.Contains(t, lines[3], "\"object\": 2000")
+
+	// copies get QUOTA_RESERVE past the quota and nothing more
+	info, err := os.Stat(db.Name())
+	assert.NoError(t, err)
+	assert.LessOrEqual(t, info.Size(), int64(2<<20+64<<10))
+}
+
+func TestLuavalDbQuotaWriteRollback(t *testing.T) {
+	db, err := ioutil.TempFile("", "luaval_db_quota_write")
+	assert.NoError(t, err)
+	os.Remove(db.Name())
+	defer os.Remove(db.Name())
+
+	// the update allocates nothing but has to copy every page the tables are
+	// on, which there's no room left for
+	cmd := exec.Command("./luaval", "-d", db.Name(), "-s", "--db-quota=8")
+	cmd.Dir = "../"
+	cmd.Stdin = strings.NewReader(
+		"{\"code\":\"t = {} for j = 1, 200 do local a = {} " +
+			"for i = 1, 1000 do a[i] = i end t[j] = a end return 1\"," +
+			"\"args\":{}}\n" +
+			"{\"code\":\"for j = 1, #t do local a = t[j] " +
+			"for i = 1, #a do a[i] = a[i] + 1 end end return 2\"," +
+			"\"args\":{}}\n" +
+			"{\"code\":\"return t[1][1] + t[200][1000]\",\"args\":{}}\n")
+	out, err := cmd.Output()
+	assert.NoError(t, err)
+
+	lines := strings.Split(strings.TrimSpace(string(out)), "\n")
+	assert.Len(t, lines, 3)
+	assert.Contains(t, lines[0], "\"object\": 1,")
+	assert.Contains(t, lines[1], "\"error\": \"not enough memory\"")
+	assert.Contains(t, lines[2], "\"object\": 1001,")
+
+	info, err := os.Stat(db.Name())
+	assert.NoError(t, err)
+	assert.LessOrEqual(t, info.Size(), int64(8<<20+64<<10))
+
+	// and none of the update made it to the file
+	cmd = exec.Command("./luaval", "-d", db.Name(), "-e", "return t[1][1]")
+	cmd.Dir = "../"
+	res, err := cmd.Output()
+	assert.NoError(t, err)
+	assert.Equal(t, "1\n", string(res))
+}
+
+func TestLuavalAllocStats(t *testing.T) {
+	db, err := ioutil.TempFile("", "luaval_alloc_stats")
+	assert.NoError(t, err)
+	os.Remove(db.Name())
+
+	cmd := exec.Command("./luaval", "-d", db.Name(), "-s")
+	cmd.Dir = "../"
+	cmd.Stdin = strings.NewReader("{\"code\":\"t = {1, 2, 3}\",\"args\":{}}\n")
+	out, err := cmd.Output()
+	assert.NoError(t, err)
+	assert.Contains(t, string(out), "\"alloc\": {")
+	assert.Contains(t, string(out), "\"commit_ns\": ")
+	assert.NotContains(t, string(out), "\"bytes_allocated\": 0,")
+}
+
+func TestLuavalPhases(t *testing.T) {
+	db, err := ioutil.TempFile("", "luaval_phases")
+	assert.NoError(t, err)
+	os.Remove(db.Name())
+
+	cmd := exec.Command("./luaval", "-d", db.Name(), "-s")
+	cmd.Dir = "../"
+	cmd.Stdin = strings.NewReader(
+		"{\"code\":\"error('no')\",\"args\":{}}\n" +
+			"{\"code\":\"return 1\",\"args\":{}}\n")
+	out, err := cmd.Output()
+	assert.NoError(t, err)
+
+	lines := strings.Split(strings.TrimSpace(string(out)), "\n")
+	assert.Len(t, lines, 2)
+	assert.Contains(t, lines[0], "\"phases\": {")
+	assert.Contains(t, lines[0], "\"execute\": {\"ns\": ")
+	assert.Contains(t, lines[0], "\"rollback\": {")
+	assert.NotContains(t, lines[0], "\"checkout\": {")
+
+	// the phases are part of the response's object, and writing out each
+	// response is reported by the one after it
+	type phase struct {
+		Ns int64 `json:"ns"`
+	}
+	var res [2]struct {
+		Error         string           `json:"error"`
+		Phases        map[string]phase `json:"phases"`
+		LastSerialize *phase           `json:"last_serialize"`
+	}
+	for i, line := range lines {
+		assert.NoError(t, json.Unmarshal([]byte(line), &res[i]))
+		assert.NotContains(t, res[i].Phases, "serialize")
+	}
+
+	assert.Contains(t, res[0].Error, "no")
+	assert.Nil(t, res[0].LastSerialize)
+	assert.NotNil(t, res[1].LastSerialize)
+	assert.Greater(t, res[1].LastSerialize.Ns, int64(0))
+}
+
+func TestLuavalRecoverUncommitted(t *testing.T) {
+	db, err := ioutil.TempFile("", "luaval_recover_uncommitted")
+	assert.NoError(t, err)
+	os.Remove(db.Name())
+
+	cmd := exec.Command("./luaval", "-d", db.Name(), "-s")
+	cmd.Dir = "../"
+	stdin, err := cmd.StdinPipe()
+	assert.NoError(t, err)
+	stdout, err := cmd.StdoutPipe()
+	assert.NoError(t, err)
+	assert.NoError(t, cmd.Start())
+
+	_, err = stdin.Write([]byte("{\"code\":\"v = 5\",\"args\":{}}\n"))
+	assert.NoError(t, err)
+	_, err = bufio.NewReader(stdout).ReadString('\n')
+	assert.NoError(t, err)
+
+	// die in the middle of a transaction that has already overwritten v
+	_, err = stdin.Write([]byte("{\"code\":\"v = 99 while true do end\",\"args\":{}}\n"))
+	assert.NoError(t, err)
+	time.Sleep(100 * time.Millisecond)
+	assert.NoError(t, cmd.Process.Kill())
+	cmd.Wait()
+
+	cmd = exec.Command("./luaval", "-d", db.Name(), "-e", "return v")
+	cmd.Dir = "../"
+	out, err := cmd.Output()
+	assert.NoError(t, err)
+	assert.Equal(t, "5\n", string(out))
+}
+
+func TestLuavalWalReplay(t *testing.T) {
+	db, err := ioutil.TempFile("", "luaval_wal_replay")
+	assert.NoError(t, err)
+	os.Remove(db.Name())
+	defer os.Remove(db.Name() + ".wal")
+
+	cmd := exec.Command("./luaval", "-d", db.Name(), "-s", "--durability=wal")
+	cmd.Dir = "../"
+	stdin, err := cmd.StdinPipe()
+	assert.NoError(t, err)
+	stdout, err := cmd.StdoutPipe()
+	assert.NoError(t, err)
+	assert.NoError(t, cmd.Start())
+
+	out := bufio.NewReader(stdout)
+	for _, code := range []string{"v = 5", "w = v + 1"} {
+		_, err = stdin.Write([]byte("{\"code\":\"" + code + "\",\"args\":{}}\n"))
+		assert.NoError(t, err)
+		_, err = out.ReadString('\n')
+		assert.NoError(t, err)
+	}
+
+	// the commits only exist in the log at this point
+	assert.NoError(t, cmd.Process.Kill())
+	cmd.Wait()
+
+	cmd = exec.Command("./luaval", "-d", db.Name(), "-e", "return v + w")
+	cmd.Dir = "../"
+	res, err := cmd.Output()
+	assert.NoError(t, err)
+	assert.Equal(t, "11\n", string(res))
+}
+
+func TestLuavalManyDatabases(t *testing.T) {
+	first, err := ioutil.TempFile("", "luaval_many_first")
+	assert.NoError(t, err)
+	os.Remove(first.Name())
+
+	second, err := ioutil.TempFile("", "luaval_many_second")
+	assert.NoError(t, err)
+	os.Remove(second.Name())
+
+	cmd := exec.Command("./luaval", "-d", first.Name(), "-s")
+	cmd.Dir = "../"
+	cmd.Stdin = strings.NewReader(
+		"{\"code\":\"v = 1\",\"args\":{}}\n" +
+			"{\"code\":\"v = 2\",\"args\":{},\"db\":\"" + second.Name() + "\"}\n" +
+			"{\"code\":\"return v\",\"args\":{}}\n" +
+			"{\"code\":\"return v\",\"args\":{},\"db\":\"" + second.Name() + "\"}\n")
+	out, err := cmd.Output()
+	assert.NoError(t, err)
+
+	lines := strings.Split(strings.TrimSpace(string(out)), "\n")
+	assert.Len(t, lines, 4)
+	assert.Contains(t, lines[2], "\"object\": 1")
+	assert.Contains(t, lines[3], "\"object\": 2")
+}
+
+func TestLuavalManyDatabasesEvicted(t *testing.T) {
+	dir, err := ioutil.TempDir("", "luaval_many_evicted")
+	assert.NoError(t, err)
+	defer os.RemoveAll(dir)
+
+	// with room for the server's own and two more, every one of these gets
+	// closed and opened again, and one can't be opened at all
+	query := func(code, db string) string {
+		q := "{\"code\":\"" + code + "\",\"args\":{}"
+		if db != "" {
+			q += ",\"db\":\"" + dir + "/" + db + "\""
+		}
+		return q + "}\n"
+	}
+
+	in := query("v = 'own'", "")
+	for i := 0; i < 6; i++ {
+		n := strconv.Itoa(i)
+		in += query("v = "+n+" t = {} for i = 1, 500 do t[i] = {i} end", n+".db")
+	}
+	in += query("return 1", "missing/x.db")
+	for i := 5; i >= 0; i-- {
+		in += query("return v + #t", strconv.Itoa(i)+".db")
+	}
+	in += query("return v", "")
+
+	cmd := exec.Command("./luaval", "-d", dir+"/own.db", "-s", "--max-dbs=3")
+	cmd.Dir = "../"
+	cmd.Stdin = strings.NewReader(in)
+	out, err := cmd.Output()
+	assert.NoError(t, err)
+
+	lines := strings.Split(strings.TrimSpace(string(out)), "\n")
+	assert.Len(t, lines, 15)
+	assert.Contains(t, lines[7], "\"error\": \"unable to open "+dir+"/missing/x.db\"")
+	for i := 0; i < 6; i++ {
+		assert.Contains(t, lines[13-i], "\"object\": "+strconv.Itoa(500+i)+",")
+	}
+	assert.Contains(t, lines[14], "\"object\": \"own\"")
+
+	cmd = exec.Command("./luaval", "-d", dir+"/own.db", "--max-dbs=1")
+	cmd.Dir = "../"
+	res, err := cmd.CombinedOutput()
+	assert.Error(t, err)
+	assert.Contains(t, string(res), "max-dbs must be between 2 and 1024")
+}
+
+func TestLuavalRollbackAfterCheckout(t *testing.T) {
+	db, err := ioutil.TempFile("", "luaval_rollback_after_checkout")
+	assert.NoError(t, err)
+	os.Remove(db.Name())
+
+	// every other query fails after overwriting everything, and a few go back
+	// to an older generation first, so the tree of generations branches
+	queries := "{\"code\":\"t = {} for i = 1, 20 do t[i] = {} " +
+		"for j = 1, 200 do t[i][j] = j end end\",\"args\":{}}\n"
+	for r, gen := range []string{"", "", "1", "", "", "6", "", ""} {
+		code := "for i = " + strconv.Itoa((r+1)%3+1) + ", 20, 3 do " +
+			"for j = 1, 200 do t[i][j] = " + strconv.Itoa(r+1) + " end end"
+		if gen != "" {
+			queries += "{\"code\":\"" + code + "\",\"args\":{},\"gen\":" + gen + "}\n"
+		} else {
+			queries += "{\"code\":\"" + code + "\",\"args\":{}}\n"
+		}
+		queries += "{\"code\":\"for i = 1, 20 do for j = 1, 200 do " +
+			"t[i][j] = -1 end end error('no')\",\"args\":{}}\n"
+	}
+	queries += "{\"code\":\"local s = 0 for i = 1, 20 do " +
+		"for j = 1, 200 do s = s + t[i][j] end end return s\",\"args\":{}}\n"
+
+	cmd := exec.Command("./luaval", "-d", db.Name(), "-s")
+	cmd.Dir = "../"
+	cmd.Stdin = strings.NewReader(queries)
+	out, err := cmd.Output()
+	assert.NoError(t, err)
+
+	lines := strings.Split(strings.TrimSpace(string(out)), "\n")
+	assert.Len(t, lines, 18)
+	assert.Contains(t, lines[17], "\"object\": 27800")
+}
+
+func TestLuavalManyBranchesFromOneGeneration(t *testing.T) {
+	db, err := ioutil.TempFile("", "luaval_many_branches")
+	assert.NoError(t, err)
+	os.Remove(db.Name())
+
+	// every query branches off the first generation, more of them than a
+	// generation has room for children, then the last one is rolled back
+	queries := "{\"code\":\"t = {} for i = 1, 20 do t[i] = {} " +
+		"for j = 1, 200 do t[i][j] = j end end\",\"args\":{}}\n"
+	for k := 2; k < 20; k++ {
+		queries += "{\"code\":\"for j = 1, 200 do t[" + strconv.Itoa(k%20+1) +
+			"][j] = " + strconv.Itoa(k) + " end\",\"args\":{},\"gen\":1}\n"
+	}
+	queries += "{\"code\":\"x = 1\",\"args\":{},\"gen\":1}\n"
+	queries += "{\"code\":\"for i = 1, 20 do for j = 1, 200 do " +
+		"t[i][j] = -1 end end error('no')\",\"args\":{}}\n"
+	queries += "{\"code\":\"local s = 0 for i = 1, 20 do " +
+		"for j = 1, 200 do s = s + t[i][j] end end return s\",\"args\":{}}\n"
+
+	cmd := exec.Command("./luaval", "-d", db.Name(), "-s")
+	cmd.Dir = "../"
+	cmd.Stdin = strings.NewReader(queries)
+	out, err := cmd.Output()
+	assert.NoError(t, err)
+
+	lines := strings.Split(strings.TrimSpace(string(out)), "\n")
+	assert.Len(t, lines, 22)
+	assert.Contains(t, lines[21], "\"object\": 402000")
+}
+
+func TestLuavalCollectWithoutCopying(t *testing.T) {
+	db, err := ioutil.TempFile("", "luaval_collect_without_copying")
+	assert.NoError(t, err)
+	os.Remove(db.Name())
+
+	// nothing's garbage so a full collection shouldn't write to the pages
+	// holding the 10000 tables it marks
+	cmd := exec.Command("./luaval", "-d", db.Name(), "-s")
+	cmd.Dir = "../"
+	cmd.Stdin = strings.NewReader(
+		"{\"code\":\"t = {} for i = 1, 200 do t[i] = {} " +
+			"for j = 1, 50 do t[i][j] = {j} end end\",\"args\":{}}\n" +
+			"{\"code\":\"collectgarbage()\",\"args\":{}}\n")
+	out, err := cmd.Output()
+	assert.NoError(t, err)
+
+	lines := strings.Split(strings.TrimSpace(string(out)), "\n")
+	assert.Len(t, lines, 2)
+
+	var res struct {
+		Alloc struct {
+			PagesCopied int `json:"pages_copied"`
+		} `json:"alloc"`
+	}
+	assert.NoError(t, json.Unmarshal([]byte(lines[1]), &res))
+	assert.Less(t, res.Alloc.PagesCopied, 20)
+}
+
+func TestLuavalOlderHeapVersions(t *testing.T) {
+	db, err := ioutil.TempFile("", "luaval_older_heap_versions")
+	assert.NoError(t, err)
+	os.Remove(db.Name())
+
+	cmd := exec.Command("./luaval", "-d", db.Name(), "-e", "v = 1")
+	cmd.Dir = "../"
+	assert.NoError(t, cmd.Run())
+
+	// every version an older layout used has to be turned away before
+	// anything in the heap is looked at
+	for _, v := range []uint16{0xffca, 0xffcb, 0xffc9} {
+		f, err := os.OpenFile(db.Name(), os.O_WRONLY, 0)
+		assert.NoError(t, err)
+		_, err = f.WriteAt([]byte{byte(v), byte(v >> 8)}, 0)
+		assert.NoError(t, err)
+		f.Close()
+
+		cmd = exec.Command("./luaval", "-d", db.Name(), "-e", "return v")
+		cmd.Dir = "../"
+		out, err := cmd.CombinedOutput()
+
+		exit, ok := err.(*exec.ExitError)
+		assert.True(t, ok)
+		if ok {
+			assert.Equal(t, 1, exit.ExitCode())
+		}
+		assert.Contains(t, string(out), "invalid magic seq")
+	}
+}
+
+func TestLuavalHugepagesOnRegularFile(t *testing.T) {
+	// the test directory rather than the temp one, which might be tmpfs
+	db, err := ioutil.TempFile(".", "luaval_hugepages")
+	assert.NoError(t, err)
+	os.Remove(db.Name())
+	defer os.Remove(db.Name())
+	defer os.Remove(db.Name() + ".ws")
+
+	path, err := filepath.Abs(db.Name())
+	assert.NoError(t, err)
+
+	cmd := exec.Command("./luaval", "-d", path, "--hugepages", "-e", "return 1")
+	cmd.Dir = "../"
+	var stderr strings.Builder
+	cmd.Stderr = &stderr
+	out, err := cmd.Output()
+	assert.NoError(t, err)
+	assert.Equal(t, "1\n", string(out))
+	assert.Contains(t, stderr.String(), "carrying on without huge pages")
+}
+
+func TestLuavalWorkingSet(t *testing.T) {
+	db, err := ioutil.TempFile("", "luaval_working_set")
+	assert.NoError(t, err)
+	os.Remove(db.Name())
+	defer os.Remove(db.Name())
+	defer os.Remove(db.Name() + ".ws")
+
+	query := func() {
+		cmd := exec.Command("./luaval", "-d", db.Name(), "-s")
+		cmd.Dir = "../"
+		cmd.Stdin = strings.NewReader(
+			"{\"code\":\"t = t or {} for i = 1, 500 do t[i] = {i} end " +
+				"return #t\",\"args\":{}}\n")
+		out, err := cmd.Output()
+		assert.NoError(t, err)
+		assert.Contains(t, string(out), "\"object\": 500")
+	}
+
+	// the pages used get written next to the db, as ranges inside the heap
+	checkWorkingSet := func() {
+		ws, err := ioutil.ReadFile(db.Name() + ".ws")
+		assert.NoError(t, err)
+		if len(ws) < 16 {
+			t.Fatalf("working set is only %d bytes", len(ws))
+		}
+
+		info, err := os.Stat(db.Name())
+		assert.NoError(t, err)
+
+		assert.Equal(t, uint32(0x57535331), binary.LittleEndian.Uint32(ws))
+		pageSize := uint64(binary.LittleEndian.Uint32(ws[4:]))
+		ranges := binary.LittleEndian.Uint64(ws[8:])
+		assert.Greater(t, ranges, uint64(0))
+		assert.Equal(t, 16+16*int(ranges), len(ws))
+
+		for i := 0; i < int(ranges) && 16+16*i+16 <= len(ws); i++ {
+			page := binary.LittleEndian.Uint64(ws[16+16*i:])
+			pages := binary.LittleEndian.Uint64(ws[24+16*i:])
+			assert.LessOrEqual(t, (page+pages)*pageSize, uint64(info.Size()))
+		}
+	}
+
+	query()
+	checkWorkingSet()
+
+	// it's only a hint, a mangled one gets ignored and written over
+	assert.NoError(t, ioutil.WriteFile(db.Name()+".ws", []byte("mangled"), 0600))
+	query()
+	checkWorkingSet()
+}
+
+// allocStats is the part of a response's alloc object tests look at.
+type allocStats struct {
+	Faults         int `json:"faults"`
+	PagesCopied    int `json:"pages_copied"`
+	PagesCommitted int `json:"pages_committed"`
+	VerifyFailures int `json:"verify_failures"`
+}
+
+// runAllocStats runs queries through a luaval server on a fresh db and
+// returns what each of them did to the heap.
+func runAllocStats(t *testing.T, args []string, queries ...string) []allocStats {
+	db, err := ioutil.TempFile("", "luaval_alloc")
+	assert.NoError(t, err)
+	os.Remove(db.Name())
+	defer os.Remove(db.Name())
+	defer os.Remove(db.Name() + ".ws")
+
+	cmd := exec.Command("./luaval", append([]string{"-d", db.Name(), "-s"}, args...)...)
+	cmd.Dir = "../"
+	cmd.Stdin = strings.NewReader(
+		"{\"code\":\"" + strings.Join(queries, "\",\"args\":{}}\n{\"code\":\"") +
+			"\",\"args\":{}}\n")
+	out, err := cmd.Output()
+	assert.NoError(t, err)
+
+	lines := strings.Split(strings.TrimSpace(string(out)), "\n")
+	assert.Len(t, lines, len(queries))
+
+	stats := make([]allocStats, len(lines))
+	for i, line := range lines {
+		var res struct {
+			Error string     `json:"error"`
+			Alloc allocStats `json:"alloc"`
+		}
+		assert.NoError(t, json.Unmarshal([]byte(line), &res))
+		assert.Equal(t, "", res.Error)
+		stats[i] = res.Alloc
+	}
+
+	return stats
+}
+
+func TestLuavalFaultAround(t *testing.T) {
+	// writing to thousands of small tables in the order they were made moves
+	// forward through the pages they're on
+	queries := []string{
+		"t = {} for i = 1, 3000 do t[i] = {i} end",
+		"for i = 1, 3000 do t[i][1] = -i end",
+	}
+
+	off := runAllocStats(t, []string{"--fault-around=0", "--precow=0"}, queries...)
+	assert.Greater(t, off[1].PagesCopied, 50)
+	assert.Equal(t, off[1].PagesCopied, off[1].Faults)
+
+	on := runAllocStats(t, []string{"--fault-around=16", "--precow=0"}, queries...)
+	assert.GreaterOrEqual(t, on[1].PagesCopied, off[1].PagesCopied)
+	assert.Less(t, on[1].Faults, off[1].Faults/4)
+}
+
+func TestLuavalPrecow(t *testing.T) {
+	// the same four tables, a page apart, are written by every query
+	queries := []string{"t = {} for i = 1, 2000 do t[i] = {i} end"}
+	for i := 0; i < 6; i++ {
+		queries = append(queries,
+			"for _, i in ipairs({1, 500, 1000, 1500}) do "+
+				"t[i][1] = t[i][1] + 1 end")
+	}
+
+	off := runAllocStats(t, []string{"--fault-around=0", "--precow=0"}, queries...)
+	on := runAllocStats(t, []string{"--fault-around=0", "--precow=16"}, queries...)
+
+	// once they've been written often enough they're copied up front by
+	// begin instead of on a fault
+	last := len(queries) - 1
+	assert.Equal(t, off[last].PagesCopied, on[last].PagesCopied)
+	assert.Equal(t, off[last].PagesCopied, off[last].Faults)
+	assert.Less(t, on[last].Faults, off[last].Faults/2)
+}
+
+func TestLuavalElideUnchangedCopies(t *testing.T) {
+	db, err := ioutil.TempFile("", "luaval_elide")
+	assert.NoError(t, err)
+	os.Remove(db.Name())
+	defer os.Remove(db.Name())
+	defer os.Remove(db.Name() + ".ws")
+
+	// the second query writes every value back as it was, the third changes
+	// them, and the fourth goes back to what the second left
+	cmd := exec.Command("./luaval", "-d", db.Name(), "-s")
+	cmd.Dir = "../"
+	cmd.Stdin = strings.NewReader(
+		"{\"code\":\"t = {} for i = 1, 2000 do t[i] = {i} end\",\"args\":{}}\n" +
+			"{\"code\":\"for i = 1, 2000 do t[i][1] = t[i][1] end\",\"args\":{}}\n" +
+			"{\"code\":\"for i = 1, 2000 do t[i][1] = -i end\",\"args\":{}}\n" +
+			"{\"code\":\"local s = 0 for i = 1, 2000 do s = s + t[i][1] end " +
+			"return s\",\"args\":{},\"gen\":2}\n")
+	out, err := cmd.Output()
+	assert.NoError(t, err)
+
+	lines := strings.Split(strings.TrimSpace(string(out)), "\n")
+	assert.Len(t, lines, 4)
+
+	var res [4]struct {
+		Object int        `json:"object"`
+		Alloc  allocStats `json:"alloc"`
+	}
+	for i, line := range lines {
+		assert.NoError(t, json.Unmarshal([]byte(line), &res[i]))
+	}
+
+	// nearly all of the pages copied for the second query are dropped again
+	// at commit, the third keeps them
+	assert.Greater(t, res[1].Alloc.PagesCopied, 20)
+	assert.Less(t, res[1].Alloc.PagesCommitted, res[1].Alloc.PagesCopied/4)
+	assert.GreaterOrEqual(t, res[2].Alloc.PagesCommitted, res[2].Alloc.PagesCopied)
+
+	assert.Equal(t, 2001000, res[3].Object)
+}
+
+func TestLuavalDeltaHistory(t *testing.T) {
+	db, err := ioutil.TempFile("", "luaval_deltas")
+	assert.NoError(t, err)
+	os.Remove(db.Name())
+	defer os.Remove(db.Name())
+	defer os.Remove(db.Name() + ".ws")
+
+	// every query after the first changes a few bytes on each page, which the
+	// old versions are kept as deltas of. Checking out each generation again,
+	// newest first, undoes longer and longer chains of them.
+	sum := "local s = 0 for i = 1, 2000 do s = s + t[i][1] end return s"
+	queries := "{\"code\":\"t = {} for i = 1, 2000 do t[i] = {i} end\",\"args\":{}}\n"
+	for k := 0; k < 5; k++ {
+		queries += "{\"code\":\"for i = 1, 2000, 7 do t[i][1] = t[i][1] + 1 end\"," +
+			"\"args\":{}}\n"
+	}
+	for gen := 6; gen >= 1; gen-- {
+		queries += "{\"code\":\"" + sum + "\",\"args\":{},\"gen\":" +
+			strconv.Itoa(gen) + "}\n"
+	}
+
+	cmd := exec.Command("./luaval", "-d", db.Name(), "-s")
+	cmd.Dir = "../"
+	cmd.Stdin = strings.NewReader(queries)
+	out, err := cmd.Output()
+	assert.NoError(t, err)
+
+	lines := strings.Split(strings.TrimSpace(string(out)), "\n")
+	assert.Len(t, lines, 12)
+	for i, gen := 0, 6; gen >= 1; i, gen = i+1, gen-1 {
+		assert.Contains(t, lines[6+i],
+			"\"object\": "+strconv.Itoa(2001000+(gen-1)*286)+",")
+	}
+
+	cmd = exec.Command("./memgraph", "-d", db.Name(), "-j")
+	cmd.Dir = "../"
+	out, err = cmd.Output()
+	assert.NoError(t, err)
+
+	var graph struct {
+		Nodes struct {
+			Delta int `json:"delta"`
+		} `json:"nodes"`
+	}
+	assert.NoError(t, json.Unmarshal(out, &graph))
+	assert.Greater(t, graph.Nodes.Delta, 20)
+}
+
+func TestLuavalCheckoutCompacted(t *testing.T) {
+	db, err := ioutil.TempFile("", "luaval_compacted")
+	assert.NoError(t, err)
+	os.Remove(db.Name())
+	defer os.Remove(db.Name())
+	defer os.Remove(db.Name() + ".ws")
+
+	// each query rewrites all of an array, too much for its old versions to
+	// be deltas, so they're kept whole for compacting to compress
+	queries := "{\"code\":\"a = {} for i = 1, 2000 do a[i] = 0 end\",\"args\":{}}\n"
+	for k := 1; k <= 3; k++ {
+		queries += "{\"code\":\"for i = 1, 2000 do a[i] = i * " +
+			strconv.Itoa(k) + " end\",\"args\":{}}\n"
+	}
+
+	cmd := exec.Command("./luaval", "-d", db.Name(), "-s")
+	cmd.Dir = "../"
+	cmd.Stdin = strings.NewReader(queries)
+	_, err = cmd.Output()
+	assert.NoError(t, err)
+
+	cmd = exec.Command("./luaval", "-d", db.Name(), "--compact=1")
+	cmd.Dir = "../"
+	out, err := cmd.CombinedOutput()
+	assert.NoError(t, err, string(out))
+	assert.NotContains(t, string(out), "compressed 0 pages")
+
+	cmd = exec.Command("./memgraph", "-d", db.Name(), "-j")
+	cmd.Dir = "../"
+	out, err = cmd.Output()
+	assert.NoError(t, err)
+
+	var graph struct {
+		Nodes struct {
+			Packed int `json:"packed"`
+		} `json:"nodes"`
+	}
+	assert.NoError(t, json.Unmarshal(out, &graph))
+	assert.Greater(t, graph.Nodes.Packed, 0)
+
+	// the compressed versions come back as they were on checkout
+	sum := "local s = 0 for i = 1, 2000 do s = s + a[i] end return s"
+	queries = ""
+	for gen := 1; gen <= 4; gen++ {
+		queries += "{\"code\":\"" + sum + "\",\"args\":{},\"gen\":" +
+			strconv.Itoa(gen) + "}\n"
+	}
+
+	cmd = exec.Command("./luaval", "-d", db.Name(), "-s")
+	cmd.Dir = "../"
+	cmd.Stdin = strings.NewReader(queries)
+	out, err = cmd.Output()
+	assert.NoError(t, err)
+
+	lines := strings.Split(strings.TrimSpace(string(out)), "\n")
+	assert.Len(t, lines, 4)
+	for gen := 1; gen <= 4; gen++ {
+		assert.Contains(t, lines[gen-1],
+			"\"object\": "+strconv.Itoa((gen-1)*2001000)+",")
+	}
+}
+
+func TestLuavalCowGranule(t *testing.T) {
+	// writes to four tables far apart from each other, so only the granule
+	// brings other pages along
+	queries := []string{
+		"t = {} for i = 1, 3000 do t[i] = {i} end",
+		"for _, i in ipairs({1, 1000, 2000, 3000}) do t[i][1] = 0 end",
+	}
+	args := []string{"--fault-around=0", "--precow=0"}
+
+	one := runAllocStats(t, append(args, "--cow-granule=1"), queries...)
+	assert.Equal(t, one[1].Faults, one[1].PagesCopied)
+
+	eight := runAllocStats(t, append(args, "--cow-granule=8"), queries...)
+	assert.Greater(t, eight[1].PagesCopied, 2*eight[1].Faults)
+}
+
+// rssFile is how many kilobytes of files process pid has resident, which is
+// where the heap's mapping is counted.
+func rssFile(t *testing.T, pid int) int {
+	status, err := ioutil.ReadFile("/proc/" + strconv.Itoa(pid) + "/status")
+	assert.NoError(t, err)
+
+	for _, line := range strings.Split(string(status), "\n") {
+		if strings.HasPrefix(line, "RssFile:") {
+			kb, err := strconv.Atoi(strings.Fields(line)[1])
+			assert.NoError(t, err)
+			return kb
+		}
+	}
+
+	t.Fatal("no RssFile in status")
+	return 0
+}
+
+func TestLuavalHibernate(t *testing.T) {
+	db, err := ioutil.TempFile("", "luaval_hibernate")
+	assert.NoError(t, err)
+	os.Remove(db.Name())
+	defer os.Remove(db.Name())
+	defer os.Remove(db.Name() + ".ws")
+
+	cmd := exec.Command("./luaval", "-d", db.Name(), "-s", "--hibernate=1")
+	cmd.Dir = "../"
+	stdin, err := cmd.StdinPipe()
+	assert.NoError(t, err)
+	stdout, err := cmd.StdoutPipe()
+	assert.NoError(t, err)
+	assert.NoError(t, cmd.Start())
+	defer cmd.Wait()
+	defer stdin.Close()
+
+	responses := bufio.NewReader(stdout)
+
+	_, err = stdin.Write([]byte("{\"code\":\"s = {} local x = string.rep('x', 8000) " +
+		"for i = 1, 1000 do s[i] = x .. i end return #s\",\"args\":{}}\n"))
+	assert.NoError(t, err)
+	res, err := responses.ReadString('\n')
+	assert.NoError(t, err)
+	assert.Contains(t, res, "\"object\": 1000,")
+
+	busy := rssFile(t, cmd.Process.Pid)
+
+	// a second without a query lets go of the heap
+	time.Sleep(2 * time.Second)
+	idle := rssFile(t, cmd.Process.Pid)
+	assert.Less(t, idle, busy/2)
+
+	// and it all comes back as it's touched again
+	_, err = stdin.Write([]byte(
+		"{\"code\":\"return s[1000]:sub(8000)\",\"args\":{}}\n"))
+	assert.NoError(t, err)
+	res, err = responses.ReadString('\n')
+	assert.NoError(t, err)
+	assert.Contains(t, res, "\"object\": \"x1000\",")
+}
+
+func TestLuavalRelayout(t *testing.T) {
+	db, err := ioutil.TempFile("", "luaval_relayout")
+	assert.NoError(t, err)
+	os.Remove(db.Name())
+	defer os.Remove(db.Name())
+	defer os.Remove(db.Name() + ".ws")
+
+	// what t sums to in each of the three generations made below
+	var sums [3]int
+	for i := 1; i <= 2000; i++ {
+		v := i
+		sums[0] += v
+		if i%3 == 1 {
+			v = -i
+		}
+		sums[1] += v
+		if i%5 == 1 {
+			v = 2 * i
+		}
+		sums[2] += v
+	}
+
+	cmd := exec.Command("./luaval", "-d", db.Name(), "-s")
+	cmd.Dir = "../"
+	cmd.Stdin = strings.NewReader(
+		"{\"code\":\"t = {} for i = 1, 2000 do t[i] = {i} end\",\"args\":{}}\n" +
+			"{\"code\":\"for i = 1, 2000, 3 do t[i][1] = -i end\",\"args\":{}}\n" +
+			"{\"code\":\"for i = 1, 2000, 5 do t[i][1] = 2 * i end\",\"args\":{}}\n")
+	_, err = cmd.Output()
+	assert.NoError(t, err)
+
+	relayout := func() string {
+		cmd := exec.Command("./luaval", "-d", db.Name(), "--relayout")
+		cmd.Dir = "../"
+		out, err := cmd.CombinedOutput()
+		assert.NoError(t, err, string(out))
+		return string(out)
+	}
+
+	// the history in the way gets moved once, after which there's nothing
+	// left to move
+	assert.NotContains(t, relayout(), "moved 0 pages")
+	assert.Contains(t, relayout(), "moved 0 pages")
+
+	sum := "local s = 0 for i = 1, 2000 do s = s + t[i][1] end return s"
+	cmd = exec.Command("./luaval", "-d", db.Name(), "-s")
+	cmd.Dir = "../"
+	cmd.Stdin = strings.NewReader(
+		"{\"code\":\"" + sum + "\",\"args\":{}}\n" +
+			"{\"code\":\"" + sum + "\",\"args\":{},\"gen\":2}\n" +
+			"{\"code\":\"" + sum + "\",\"args\":{},\"gen\":1}\n")
+	out, err := cmd.Output()
+	assert.NoError(t, err)
+
+	lines := strings.Split(strings.TrimSpace(string(out)), "\n")
+	assert.Len(t, lines, 3)
+	for i, want := range []int{sums[2], sums[1], sums[0]} {
+		assert.Contains(t, lines[i], "\"object\": "+strconv.Itoa(want)+",")
+	}
+}
+
+// TestLuavalProbes reads the stapsdt notes out of the luaval binary and checks
+// every probe comes as a _start/_done pair and sits on a nop.
+func TestLuavalProbes(t *testing.T) {
+	if runtime.GOARCH != "amd64" {
+		t.Skip("probes are only emitted on x86-64")
+	}
+
+	bin, err := elf.Open("../luaval")
+	assert.NoError(t, err)
+	defer bin.Close()
+
+	notes := bin.Section(".note.stapsdt")
+	if notes == nil {
+		t.Skip("built without SNAP_PROBES")
+	}
+
+	data, err := notes.Data()
+	assert.NoError(t, err)
+
+	text := bin.Section(".text")
+	code, err := text.Data()
+	assert.NoError(t, err)
+
+	align := func(n uint32) uint32 { return (n + 3) &^ 3 }
+
+	probes := map[string]int{}
+	for len(data) >= 12 {
+		namesz := binary.LittleEndian.Uint32(data)
+		descsz := binary.LittleEndian.Uint32(data[4:])
+		owner := string(data[12 : 12+namesz-1])
+		desc := data[12+align(namesz) : 12+align(namesz)+descsz]
+		data = data[12+align(namesz)+align(descsz):]
+
+		assert.Equal(t, "stapsdt", owner)
+
+		// the location, base and semaphore, then provider, name and
+		// arguments as strings
+		pc := binary.LittleEndian.Uint64(desc)
+		strs := strings.Split(string(desc[24:]), "\x00")
+		assert.Equal(t, "evaldb", strs[0])
+		probes[strs[1]]++
+
+		assert.True(t, pc >= text.Addr && pc < text.Addr+text.Size, strs[1])
+		assert.Equal(t, byte(0x90), code[pc-text.Addr], strs[1])
+	}
+
+	for _, phase := range []string{
+		"eval", "begin", "commit", "checkout", "segv", "swap", "map",
+	} {
+		assert.Greater(t, probes[phase+"_start"], 0, phase)
+		assert.Greater(t, probes[phase+"_done"], 0, phase)
+		delete(probes, phase+"_start")
+		delete(probes, phase+"_done")
+	}
+	assert.Empty(t, probes)
+}
+
+func TestLuavalVerify(t *testing.T) {
+	db, err := ioutil.TempFile("", "luaval_verify")
+	assert.NoError(t, err)
+	os.Remove(db.Name())
+	defer os.Remove(db.Name())
+	defer os.Remove(db.Name() + ".ws")
+
+	// growing, copying, freeing and rolling back all leave a heap every
+	// sample of it should pass
+	var stderr strings.Builder
+	cmd := exec.Command("./luaval", "-d", db.Name(), "-s", "--verify=1024")
+	cmd.Dir = "../"
+	cmd.Stderr = &stderr
+	cmd.Stdin = strings.NewReader(
+		"{\"code\":\"t = {} for i = 1, 2000 do t[i] = {i} end\",\"args\":{}}\n" +
+			"{\"code\":\"for i = 1, 2000, 3 do t[i][1] = -i end\",\"args\":{}}\n" +
+			"{\"code\":\"s = string.rep('x', 50000)\",\"args\":{}}\n" +
+			"{\"code\":\"for i = 1, 2000, 2 do t[i] = nil end s = nil\"," +
+			"\"args\":{}}\n" +
+			"{\"code\":\"t[2][1] = 0 error('no')\",\"args\":{}}\n" +
+			"{\"code\":\"return #t\",\"args\":{}}\n")
+	out, err := cmd.Output()
+	assert.NoError(t, err, stderr.String())
+	assert.NotContains(t, stderr.String(), "heap verification failed")
+
+	lines := strings.Split(strings.TrimSpace(string(out)), "\n")
+	assert.Len(t, lines, 6)
+	for _, line := range lines {
+		var res struct {
+			Alloc allocStats `json:"alloc"`
+		}
+		assert.NoError(t, json.Unmarshal([]byte(line), &res), line)
+		assert.Equal(t, 0, res.Alloc.VerifyFailures, line)
+	}
+
+	// every commit samples a bounded amount, asking for more is refused
+	for _, n := range []string{"-1", "1025"} {
+		cmd = exec.Command("./luaval", "-d", db.Name(), "--verify="+n)
+		cmd.Dir = "../"
+		out, err = cmd.CombinedOutput()
+		assert.Error(t, err, n)
+		assert.Contains(t, string(out), "verify must be between 0 and 1024")
+	}
+}
@@ -0,0 +1,159 @@
+package main
+
+import (
+	"bufio"
+	"bytes"
+	"encoding/json"
+	"io/ioutil"
+	"os"
+	"os/exec"
+	"regexp"
+	"strconv"
+	"strings"
+	"testing"
+	"time"
+
+	"github.com/stretchr/testify/assert"
+)
+
+func memgraph(t *testing.T, args ...string) string {
+	cmd := exec.Command("./memgraph", args...)
+	cmd.Dir = "../"
+	out, err := cmd.Output()
+	assert.NoError(t, err)
+
+	return string(out)
+}
+
+func TestMemgraphLeavesTheDbAlone(t *testing.T) {
+	db, err := ioutil.TempFile("", "memgraph_readonly")
+	assert.NoError(t, err)
+	os.Remove(db.Name())
+	defer os.Remove(db.Name())
+	defer os.Remove(db.Name() + ".ws")
+
+	cmd := exec.Command("./luaval", "-d", db.Name(), "-s")
+	cmd.Dir = "../"
+	stdin, err := cmd.StdinPipe()
+	assert.NoError(t, err)
+	stdout, err := cmd.StdoutPipe()
+	assert.NoError(t, err)
+	assert.NoError(t, cmd.Start())
+
+	_, err = stdin.Write([]byte("{\"code\":\"v = 5 t = {} " +
+		"for i = 1, 300 do t[i] = {i} end\",\"args\":{}}\n"))
+	assert.NoError(t, err)
+	_, err = bufio.NewReader(stdout).ReadString('\n')
+	assert.NoError(t, err)
+
+	// a server in the middle of a transaction is no reason not to look
+	_, err = stdin.Write([]byte("{\"code\":\"v = 99 while true do end\",\"args\":{}}\n"))
+	assert.NoError(t, err)
+	time.Sleep(100 * time.Millisecond)
+
+	assert.Contains(t, memgraph(t, "-d", db.Name()), "digraph")
+
+	assert.NoError(t, cmd.Process.Kill())
+	cmd.Wait()
+
+	// the transaction it died in is left for the next evaler to roll back
+	before, err := ioutil.ReadFile(db.Name())
+	assert.NoError(t, err)
+
+	assert.Contains(t, memgraph(t, "-d", db.Name()), "digraph")
+
+	after, err := ioutil.ReadFile(db.Name())
+	assert.NoError(t, err)
+	assert.True(t, bytes.Equal(before, after))
+
+	cmd = exec.Command("./luaval", "-d", db.Name(), "-e", "return v")
+	cmd.Dir = "../"
+	out, err := cmd.Output()
+	assert.NoError(t, err)
+	assert.Equal(t, "5\n", string(out))
+
+	// nor is a db that isn't there made
+	missing := db.Name() + ".missing"
+	cmd = exec.Command("./memgraph", "-d", missing)
+	cmd.Dir = "../"
+	res, err := cmd.CombinedOutput()
+	assert.Error(t, err)
+	assert.Contains(t, string(res), "could not stat db")
+	_, err = os.Stat(missing)
+	assert.True(t, os.IsNotExist(err))
+}
+
+type memgraphStats struct {
+	Committed   int `json:"committed"`
+	Generations int `json:"generations"`
+	Pages       int `json:"pages"`
+	Nodes       struct {
+		Generation int `json:"generation"`
+		Page       int `json:"page"`
+		Delta      int `json:"delta"`
+	} `json:"nodes"`
+	PagesPerGen struct {
+		Max       int            `json:"max"`
+		Mean      float64        `json:"mean"`
+		Histogram map[string]int `json:"histogram"`
+	} `json:"pages_per_gen"`
+	FreeSpace struct {
+		LiveBytes int `json:"live_bytes"`
+	} `json:"free_space"`
+}
+
+func TestMemgraphStatsAndSummary(t *testing.T) {
+	db, err := ioutil.TempFile("", "memgraph_summary")
+	assert.NoError(t, err)
+	os.Remove(db.Name())
+	defer os.Remove(db.Name())
+	defer os.Remove(db.Name() + ".ws")
+
+	// two chains of generations branch off generation 1
+	cmd := exec.Command("./luaval", "-d", db.Name(), "-s")
+	cmd.Dir = "../"
+	cmd.Stdin = strings.NewReader(
+		"{\"code\":\"t = {} for i = 1, 300 do t[i] = {i} end\",\"args\":{}}\n" +
+			"{\"code\":\"t[1][1] = 5\",\"args\":{}}\n" +
+			"{\"code\":\"t[2] = nil\",\"args\":{}}\n" +
+			"{\"code\":\"t[3][1] = 7\",\"args\":{},\"gen\":1}\n")
+	_, err = cmd.Output()
+	assert.NoError(t, err)
+
+	var stats memgraphStats
+	assert.NoError(t, json.Unmarshal([]byte(memgraph(t, "-d", db.Name(), "-j")), &stats))
+	assert.Equal(t, 4, stats.Committed)
+	assert.Equal(t, 5, stats.Generations)
+	assert.Greater(t, stats.Nodes.Page, 0)
+	assert.Greater(t, stats.Nodes.Delta, 0)
+	assert.Greater(t, stats.FreeSpace.LiveBytes, 0)
+
+	gens := 0
+	for _, n := range stats.PagesPerGen.Histogram {
+		gens += n
+	}
+	assert.Equal(t, stats.Generations, gens)
+
+	// gens 0 and 1, then 2 and 3 on one branch and 4 on the other
+	summary := memgraph(t, "-d", db.Name(), "-u")
+	assert.Contains(t, summary, "digraph")
+	assert.Contains(t, summary, "\"g0\" [ label=\"gens 0..1 (2)\\n")
+	assert.Contains(t, summary, "\"g2\" [ label=\"gens 2..3 (2)\\n")
+	assert.Contains(t, summary, "\"g4\" [ label=\"gen 4\\n")
+	assert.Contains(t, summary, "\"g0\" -> \"g2\"")
+	assert.Contains(t, summary, "\"g0\" -> \"g4\"")
+	assert.Contains(t, summary, "\"committed\" -> \"g4\"")
+
+	// and the chains hold every page the generations do between them
+	pages := 0
+	for _, m := range regexp.MustCompile(`\\n(\d+) pages\\n`).FindAllStringSubmatch(summary, -1) {
+		n, err := strconv.Atoi(m[1])
+		assert.NoError(t, err)
+		pages += n
+	}
+	assert.InDelta(t, stats.PagesPerGen.Mean*float64(stats.Generations), pages, 0.01)
+
+	assert.Less(t,
+		strings.Count(summary, "\n"),
+		strings.Count(memgraph(t, "-d", db.Name()), "\n"))
+}
@@ -0,0 +1,198 @@
+package main
+
+import (
+	"encoding/json"
+	"fmt"
+	"io/ioutil"
+	"os"
+	"os/exec"
+	"strings"
+	"testing"
+
+	"github.com/stretchr/testify/assert"
+)
+
+func TestMemtestPrecowNextToCopies(t *testing.T) {
+	db, err := ioutil.TempFile("", "memtest_precow")
+	assert.NoError(t, err)
+	os.Remove(db.Name())
+
+	log, err := ioutil.TempFile("", "memtest_precow_log")
+	assert.NoError(t, err)
+	defer os.Remove(log.Name())
+
+	// sixteen blocks, a page each, are hot long enough to take every precow
+	// slot. Two pages allocated right after their copies get hot behind them,
+	// so once the sixteen cool down the first of the two is still read only
+	// and gets made writable along with the second, which already is.
+	var ops []string
+	write := func(addr int) {
+		ops = append(ops, fmt.Sprintf("snap_realloc %x 1 -> %x", addr, addr))
+	}
+
+	for i := 0; i < 16; i++ {
+		ops = append(ops, fmt.Sprintf("snap_malloc 4000 -> %x", 0x100+i*0x10))
+	}
+	ops = append(ops, "snap_commit")
+
+	for txn := 1; txn <= 7; txn++ {
+		ops = append(ops, "snap_begin_mut")
+		if txn <= 3 {
+			// backwards, so the faults don't set off fault-around
+			for i := 15; i >= 0; i-- {
+				write(0x100 + i*0x10)
+			}
+		}
+		if txn == 1 {
+			ops = append(ops, "snap_malloc 4000 -> 400", "snap_malloc 4000 -> 410")
+		}
+		if txn >= 2 && txn <= 4 {
+			write(0x400)
+		}
+		if txn >= 2 && txn <= 5 {
+			write(0x410)
+		}
+		ops = append(ops, "snap_commit")
+	}
+
+	_, err = log.WriteString(strings.Join(ops, "\n") + "\n")
+	assert.NoError(t, err)
+	log.Close()
+
+	cmd := exec.Command("./memtest", "-t", db.Name(), log.Name())
+	cmd.Dir = "../"
+	out, err := cmd.CombinedOutput()
+	assert.NoError(t, err, string(out))
+	assert.Contains(t, string(out), "\"unmatched\": 0")
+}
+
+func TestMemtestReplaysEachHeapOfATrace(t *testing.T) {
+	dir, err := ioutil.TempDir("", "memtest_trace")
+	assert.NoError(t, err)
+	defer os.RemoveAll(dir)
+
+	trace := dir + "/trace"
+
+	// one query runs on a second db, so the trace interleaves two heaps
+	cmd := exec.Command(
+		"./luaval", "-d", dir+"/first.db", "-s", "--trace="+trace)
+	cmd.Dir = "../"
+	cmd.Stdin = strings.NewReader(
+		"{\"code\":\"t = {} for i = 1, 300 do t[i] = {i} end\",\"args\":{}}\n" +
+			"{\"code\":\"u = {} for i = 1, 300 do u[i] = {i} end\"," +
+			"\"args\":{},\"db\":\"" + dir + "/second.db\"}\n" +
+			"{\"code\":\"t[1] = nil\",\"args\":{}}\n")
+	out, err := cmd.Output()
+	assert.NoError(t, err)
+
+	// which heap is which isn't up to us, snaptrace names them when it can't
+	// pick one
+	cmd = exec.Command("./snaptrace", trace)
+	cmd.Dir = "../"
+	out, err = cmd.CombinedOutput()
+	assert.Error(t, err)
+	assert.Contains(t, string(out), "calls from 2 heaps, pick one of")
+
+	heaps := strings.Fields(strings.SplitN(string(out), "pick one of", 2)[1])
+	assert.Len(t, heaps, 2)
+
+	for _, heap := range heaps {
+		cmd = exec.Command("./snaptrace", "-H", heap, trace)
+		cmd.Dir = "../"
+		text, err := cmd.Output()
+		assert.NoError(t, err)
+		assert.Contains(t, string(text), "snap_malloc ")
+
+		log := dir + "/log" + heap
+		assert.NoError(t, ioutil.WriteFile(log, text, 0644))
+
+		cmd = exec.Command("./memtest", "-t", dir+"/replay"+heap+".db", log)
+		cmd.Dir = "../"
+		out, err = cmd.CombinedOutput()
+		assert.NoError(t, err, string(out))
+		assert.Contains(t, string(out), "\"unmatched\": 0")
+	}
+}
+
+type replayOp struct {
+	Op        string     `json:"op"`
+	N         int        `json:"n"`
+	TotalNs   int64      `json:"total_ns"`
+	P50       int64      `json:"p50_ns"`
+	P99       int64      `json:"p99_ns"`
+	Max       int64      `json:"max_ns"`
+	Histogram [][2]int64 `json:"histogram"`
+	Events    int        `json:"events"`
+	Unmatched int        `json:"unmatched"`
+}
+
+func TestMemtestTimedReplay(t *testing.T) {
+	db, err := ioutil.TempFile("", "memtest_timed")
+	assert.NoError(t, err)
+	os.Remove(db.Name())
+	defer os.Remove(db.Name())
+
+	log, err := ioutil.TempFile("", "memtest_timed_log")
+	assert.NoError(t, err)
+	defer os.Remove(log.Name())
+
+	// the traced addresses are nothing like where a replay lands, and the
+	// last free is of an allocation the trace never saw
+	_, err = log.WriteString(
+		"snap_malloc 100 -> 10\n" +
+			"snap_malloc 5000 -> 20\n" +
+			"snap_commit\n" +
+			"snap_begin_mut\n" +
+			"snap_realloc 10 300 -> 30\n" +
+			"snap_free 20\n" +
+			"snap_free 999\n" +
+			"snap_commit\n")
+	assert.NoError(t, err)
+	log.Close()
+
+	cmd := exec.Command("./memtest", "-t", db.Name(), log.Name())
+	cmd.Dir = "../"
+	out, err := cmd.Output()
+	assert.NoError(t, err)
+
+	want := map[string]int{
+		"malloc":    2,
+		"free":      1,
+		"realloc":   1,
+		"begin_mut": 1,
+		"commit":    2,
+	}
+
+	lines := strings.Split(strings.TrimSpace(string(out)), "\n")
+	assert.Len(t, lines, len(want)+1)
+
+	events := 0
+	for _, line := range lines[:len(lines)-1] {
+		var op replayOp
+		assert.NoError(t, json.Unmarshal([]byte(line), &op), line)
+		assert.Equal(t, want[op.Op], op.N, line)
+		delete(want, op.Op)
+		events += op.N
+
+		// every call lands in one bucket, and the buckets go up in powers
+		// of two
+		in := int64(0)
+		for i, bucket := range op.Histogram {
+			in += bucket[1]
+			if i > 0 {
+				assert.Greater(t, bucket[0], op.Histogram[i-1][0], line)
+			}
+			assert.Equal(t, bucket[0]&(bucket[0]-1), int64(0), line)
+		}
+		assert.Equal(t, int64(op.N), in, line)
+
+		assert.LessOrEqual(t, op.Max, op.TotalNs, line)
+		assert.LessOrEqual(t, op.P50, op.P99, line)
+	}
+	assert.Empty(t, want)
+
+	var total replayOp
+	assert.NoError(t, json.Unmarshal([]byte(lines[len(lines)-1]), &total))
+	assert.Equal(t, events, total.Events)
+	assert.Equal(t, 1, total.Unmatched)
+}
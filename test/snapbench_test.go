@@ -0,0 +1,77 @@
+package main
+
+import (
+	"encoding/json"
+	"io/ioutil"
+	"os"
+	"os/exec"
+	"strings"
+	"testing"
+
+	"github.com/stretchr/testify/assert"
+)
+
+type microResult struct {
+	Bench   string `json:"bench"`
+	Variant string `json:"variant"`
+	MB      int    `json:"mb"`
+	Depth   int    `json:"depth"`
+	N       int    `json:"n"`
+	P50     int64  `json:"p50_ns"`
+	P90     int64  `json:"p90_ns"`
+	P99     int64  `json:"p99_ns"`
+	Max     int64  `json:"max_ns"`
+}
+
+func TestSnapbenchMicro(t *testing.T) {
+	dir, err := ioutil.TempDir("", "snapbench_micro")
+	assert.NoError(t, err)
+	defer os.RemoveAll(dir)
+
+	cmd := exec.Command("./snapbench", "micro", dir, "1", "4", "100")
+	cmd.Dir = "../"
+	out, err := cmd.Output()
+	assert.NoError(t, err)
+
+	// every benchmark gets a line of its own, with as many samples as the
+	// run was asked for and percentiles that only go up
+	want := map[string]int{
+		"malloc/small":       100,
+		"free/small":         50,
+		"realloc/small":      50,
+		"malloc/mixed":       100,
+		"free/mixed":         50,
+		"realloc/mixed":      50,
+		"malloc/large":       10,
+		"free/large":         5,
+		"realloc/large":      5,
+		"fault/cow":          100,
+		"begin_mut/8_writes": 10,
+		"commit/8_writes":    10,
+		"checkout/near":      2,
+		"checkout/far":       2,
+	}
+
+	lines := strings.Split(strings.TrimSpace(string(out)), "\n")
+	assert.Len(t, lines, len(want))
+
+	for _, line := range lines {
+		var r microResult
+		assert.NoError(t, json.Unmarshal([]byte(line), &r), line)
+
+		name := r.Bench + "/" + r.Variant
+		n, ok := want[name]
+		assert.True(t, ok, name)
+		delete(want, name)
+
+		assert.Equal(t, n, r.N, name)
+		assert.Equal(t, 1, r.MB, name)
+		assert.Equal(t, 4, r.Depth, name)
+		assert.Greater(t, r.P50, int64(0), name)
+		assert.LessOrEqual(t, r.P50, r.P90, name)
+		assert.LessOrEqual(t, r.P90, r.P99, name)
+		assert.LessOrEqual(t, r.P99, r.Max, name)
+	}
+
+	assert.Empty(t, want)
+}
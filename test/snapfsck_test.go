@@ -0,0 +1,166 @@
+package main
+
+import (
+	"encoding/binary"
+	"io/ioutil"
+	"os"
+	"os/exec"
+	"strings"
+	"testing"
+
+	"github.com/stretchr/testify/assert"
+)
+
+// fsckHeap makes a heap with a few generations of history behind it. The
+// third rewrites all of an array, which leaves a copy too different to be a
+// delta for compacting to compress, and the last adds pages of its own.
+func fsckHeap(t *testing.T, name string) string {
+	db, err := ioutil.TempFile("", name)
+	assert.NoError(t, err)
+	os.Remove(db.Name())
+
+	cmd := exec.Command("./luaval", "-d", db.Name(), "-s")
+	cmd.Dir = "../"
+	cmd.Stdin = strings.NewReader(
+		"{\"code\":\"x = 1\",\"args\":{}}\n" +
+			"{\"code\":\"t = {} for i = 1, 200 do t[i] = {i} end " +
+			"a = {} for i = 1, 2000 do a[i] = 0 end\",\"args\":{}}\n" +
+			"{\"code\":\"for i = 1, 200 do t[i][1] = -i end " +
+			"for i = 1, 2000 do a[i] = i * 7919 end\",\"args\":{}}\n" +
+			"{\"code\":\"s = string.rep('x', 20000) x = 2\",\"args\":{}}\n")
+	_, err = cmd.Output()
+	assert.NoError(t, err)
+
+	return db.Name()
+}
+
+func snapfsck(t *testing.T, args ...string) (string, int) {
+	cmd := exec.Command("./snapfsck", args...)
+	cmd.Dir = "../"
+	out, err := cmd.CombinedOutput()
+	if exit, ok := err.(*exec.ExitError); ok {
+		return string(out), exit.ExitCode()
+	}
+	assert.NoError(t, err)
+
+	return string(out), 0
+}
+
+func TestSnapfsckFreshHeap(t *testing.T) {
+	db := fsckHeap(t, "snapfsck_fresh")
+	defer os.Remove(db)
+
+	out, code := snapfsck(t, db)
+	assert.Equal(t, 0, code, out)
+	assert.Contains(t, out, "in 5 generations, 0 problems")
+}
+
+func TestSnapfsckCompactedHeap(t *testing.T) {
+	db := fsckHeap(t, "snapfsck_compacted")
+	defer os.Remove(db)
+
+	cmd := exec.Command("./luaval", "-d", db, "--compact=1")
+	cmd.Dir = "../"
+	out, err := cmd.CombinedOutput()
+	assert.NoError(t, err, string(out))
+	assert.Contains(t, string(out), "compressed ")
+	assert.NotContains(t, string(out), "compressed 0 pages")
+
+	fsck, code := snapfsck(t, db)
+	assert.Equal(t, 0, code, fsck)
+	assert.Contains(t, fsck, " 0 problems")
+}
+
+func TestSnapfsckRelaidOutHeap(t *testing.T) {
+	db := fsckHeap(t, "snapfsck_relaid_out")
+	defer os.Remove(db)
+
+	cmd := exec.Command("./luaval", "-d", db, "--relayout")
+	cmd.Dir = "../"
+	out, err := cmd.CombinedOutput()
+	assert.NoError(t, err, string(out))
+	assert.Contains(t, string(out), "moved ")
+	assert.NotContains(t, string(out), "moved 0 pages")
+
+	fsck, code := snapfsck(t, db)
+	assert.Equal(t, 0, code, fsck)
+	assert.Contains(t, fsck, " 0 problems")
+}
+
+// lastHomePage finds the page furthest into the heap that sits where it
+// belongs: a snap_page whose type is SNAP_NODE_PAGE and whose real_addr is
+// its own offset.
+func lastHomePage(t *testing.T, heap []byte) int {
+	last := 0
+	for off := 4096; off+32 <= len(heap); off += 4096 {
+		if heap[off] == 2 && binary.LittleEndian.Uint64(heap[off+8:]) == uint64(off) {
+			last = off
+		}
+	}
+	assert.Greater(t, last, 0)
+
+	return last
+}
+
+func TestSnapfsckBadSegmentOffset(t *testing.T) {
+	db := fsckHeap(t, "snapfsck_bad_segment")
+	defer os.Remove(db)
+
+	heap, err := ioutil.ReadFile(db)
+	assert.NoError(t, err)
+
+	// the first segment offset of the newest generation's page points far
+	// past the page
+	page := lastHomePage(t, heap)
+	binary.LittleEndian.PutUint64(heap[page+24:], 0x7fffffff)
+	assert.NoError(t, ioutil.WriteFile(db, heap, 0660))
+
+	out, code := snapfsck(t, db)
+	assert.Equal(t, 1, code, out)
+	assert.Contains(t, out, "gen 4: segment 0 starts outside its page")
+	assert.Contains(t, out, " 1 problems")
+
+	// only the generation the page belongs to is lost
+	out, code = snapfsck(t, "-r", db)
+	assert.Equal(t, 0, code, out)
+	assert.Contains(t, out, "rolled back from generation 4 to 3")
+
+	cmd := exec.Command("./luaval", "-d", db, "-s")
+	cmd.Dir = "../"
+	cmd.Stdin = strings.NewReader(
+		"{\"code\":\"return x + #t + t[200][1] + a[2000]\",\"args\":{}}\n")
+	res, err := cmd.Output()
+	assert.NoError(t, err)
+	assert.Contains(t, string(res), "\"object\": 15838001,")
+	assert.Contains(t, string(res), "\"parent\": 3")
+}
+
+func TestSnapfsckRelaidOutLoggedHeap(t *testing.T) {
+	db, err := ioutil.TempFile("", "snapfsck_relaid_out_wal")
+	assert.NoError(t, err)
+	os.Remove(db.Name())
+	defer os.Remove(db.Name())
+	defer os.Remove(db.Name() + ".wal")
+	defer os.Remove(db.Name() + ".ws")
+
+	// the free pages this leaves in the view are taken off the free list,
+	// and with a log only what was logged reaches the file
+	cmd := exec.Command("./luaval", "-d", db.Name(), "-s", "--durability=wal")
+	cmd.Dir = "../"
+	cmd.Stdin = strings.NewReader(
+		"{\"code\":\"t = {} for i = 1, 2000 do t[i] = {i} end\",\"args\":{}}\n" +
+			"{\"code\":\"for i = 1, 2000, 3 do t[i][1] = -i end\",\"args\":{}}\n")
+	_, err = cmd.Output()
+	assert.NoError(t, err)
+
+	cmd = exec.Command(
+		"./luaval", "-d", db.Name(), "--durability=wal", "--relayout")
+	cmd.Dir = "../"
+	out, err := cmd.CombinedOutput()
+	assert.NoError(t, err, string(out))
+	assert.NotContains(t, string(out), "punched 0 pages")
+
+	fsck, code := snapfsck(t, db.Name())
+	assert.Equal(t, 0, code, fsck)
+	assert.Contains(t, fsck, " 0 problems")
+}
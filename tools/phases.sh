@@ -0,0 +1,39 @@
+#!/usr/bin/env bash
+# Prints a latency histogram for every phase of a query in a running evaler
+# once it's stopped with ^C, using the static probes built into it.
+#
+#   ./tools/phases.sh ./luaval [pid]
+#
+# Without a pid every process running the binary is traced.
+
+set -e
+
+if [ $# -lt 1 ]; then
+  echo "usage: $0 <evaler binary> [pid]" >&2
+  exit 1
+fi
+
+bin=$(readlink -f "$1")
+pid=${2:+-p $2}
+
+prog=""
+for phase in eval begin commit checkout segv swap map; do
+  prog+="
+usdt:$bin:evaldb:${phase}_start { @${phase}_start[tid] = nsecs; }
+usdt:$bin:evaldb:${phase}_done /@${phase}_start[tid]/ {
+  @${phase}_us = hist((nsecs - @${phase}_start[tid]) / 1000);
+  delete(@${phase}_start[tid]);
+}"
+done
+
+prog+="
+END {"
+for phase in eval begin commit checkout segv swap map; do
+  prog+="
+  clear(@${phase}_start);"
+done
+prog+="
+}"
+
+# shellcheck disable=SC2086
+exec bpftrace $pid -e "$prog"